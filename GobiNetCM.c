@@ -237,6 +237,7 @@ const struct qmi_device_ops gobi_qmidev_ops = {
 	.deinit = GobiNetDeInit,
 	.send = GobiNetSendQMI,
 	.read = GobiNetThread,
+	.wakeup = QmiThreadWakeup,
 };
 #endif
 
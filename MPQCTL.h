@@ -95,6 +95,8 @@ typedef struct _QCQMICTL_TLV_HDR
 #define QMICTL_SYNC_RESP              0x0027
 #define QMICTL_SYNC_IND               0x0027
 #define QMI_MESSAGE_CTL_INTERNAL_PROXY_OPEN 0xFF00
+#define QMICTL_PROXY_IND_FILTER_REQ   0xFF10 // answered by quectel-qmi-proxy
+#define QMICTL_PROXY_IND_FILTER_RESP  0xFF10
 
 #define QMICTL_FLAG_REQUEST    0x00
 #define QMICTL_FLAG_RESPONSE   0x01
@@ -358,6 +360,24 @@ typedef struct _QMICTL_LIBQMI_PROXY_OPEN_MSG
    char device_path[0];       // result code
 } __attribute__ ((packed)) QMICTL_LIBQMI_PROXY_OPEN_MSG, *PQMICTL_LIBQMI_PROXY_OPEN_MSG;
 
+typedef struct _QMICTL_PROXY_IND_FILTER_TLV
+{
+   UCHAR  TLVType;         // QCTLV_TYPE_REQUIRED_PARAMETER
+   USHORT TLVLength;       // 2 + 2 * NumIds
+   UCHAR  QMIType;
+   UCHAR  NumIds;
+   USHORT MsgId[0];        // the broadcast indications of QMIType to forward, all until this is sent
+} __attribute__ ((packed)) QMICTL_PROXY_IND_FILTER_TLV, *PQMICTL_PROXY_IND_FILTER_TLV;
+
+typedef struct _QMICTL_PROXY_IND_FILTER_REQ_MSG
+{
+   UCHAR  CtlFlags;        // QMICTL_FLAG_REQUEST
+   UCHAR  TransactionId;
+   USHORT QMICTLType;      // QMICTL_PROXY_IND_FILTER_REQ
+   USHORT Length;
+   UCHAR  Filters[0];      // one QMICTL_PROXY_IND_FILTER_TLV per service
+} __attribute__ ((packed)) QMICTL_PROXY_IND_FILTER_REQ_MSG, *PQMICTL_PROXY_IND_FILTER_REQ_MSG;
+
 typedef struct _QMICTL_MSG
 {
    union
@@ -383,6 +403,7 @@ typedef struct _QMICTL_MSG
       QMICTL_SYNC_RESP_MSG                         SyncRsp;
       QMICTL_SYNC_IND_MSG                          SyncInd;
       QMICTL_LIBQMI_PROXY_OPEN_MSG          LibQmiProxyOpenReq;
+      QMICTL_PROXY_IND_FILTER_REQ_MSG              ProxyIndFilterReq;
    };
 } __attribute__ ((packed)) QMICTL_MSG, *PQMICTL_MSG;
 #pragma pack(pop)
@@ -20,7 +20,7 @@ static pthread_mutex_t dumpQMIMutex = PTHREAD_MUTEX_INITIALIZER;
 #undef dbg
 #define dbg( format, arg... ) do {if (strlen(line) < sizeof(line)) snprintf(&line[strlen(line)], sizeof(line) - strlen(line), format, ## arg);} while (0)
 
-PQMI_TLV_HDR GetTLV (PQCQMUX_MSG_HDR pQMUXMsgHdr, int TLVType);
+PQMI_TLV_HDR GetTLVLimit (PQCQMUX_MSG_HDR pQMUXMsgHdr, int Length, int TLVType);
 
 typedef struct {
     UINT type;
@@ -74,6 +74,7 @@ qmi_name_item(QMICTL_SET_DATA_FORMAT_RESP), //   0x0026
 qmi_name_item(QMICTL_SYNC_REQ), //               0x0027
 qmi_name_item(QMICTL_SYNC_RESP), //              0x0027
 qmi_name_item(QMICTL_SYNC_IND), //               0x0027
+qmi_name_item(QMICTL_PROXY_IND_FILTER_REQ), //   0xFF10
 };
 
 static const QMI_NAME_T qmux_CtlFlags[] = {
@@ -314,14 +315,40 @@ static const char * qmi_name_get(const QMI_NAME_T *table, size_t size, int type,
 #define QMI_NAME(table, type) qmi_name_get(table, sizeof(table) / sizeof(table[0]), type, 0)
 #define QMUX_NAME(table, type, tag) qmi_name_get(table, sizeof(table) / sizeof(table[0]), type, tag)
 
-void dump_tlv(PQCQMUX_MSG_HDR pQMUXMsgHdr) {
+/* name of a request, NULL if unknown. unlike qmi_name_get() it is safe to call from any thread */
+const char *qmi_req_name(int QMIType, int Type) {
+    const QMI_NAME_T *table;
+    size_t i, size;
+
+#define QMI_TABLE(t) do { table = t; size = sizeof(t) / sizeof(t[0]); } while (0)
+    switch (QMIType) {
+        case QMUX_TYPE_CTL: QMI_TABLE(qmux_ctl_QMICTLType); break;
+        case QMUX_TYPE_DMS: QMI_TABLE(qmux_dms_Type); break;
+        case QMUX_TYPE_NAS: QMI_TABLE(qmux_nas_Type); break;
+        case QMUX_TYPE_WDS:
+        case QMUX_TYPE_WDS_IPV6: QMI_TABLE(qmux_wds_Type); break;
+        case QMUX_TYPE_WMS: QMI_TABLE(qmux_wms_Type); break;
+        case QMUX_TYPE_WDS_ADMIN: QMI_TABLE(qmux_wds_admin_Type); break;
+        case QMUX_TYPE_UIM: QMI_TABLE(qmux_uim_Type); break;
+        default: return NULL;
+    }
+#undef QMI_TABLE
+
+    for (i = 0; i < size; i++) {
+        if (table[i].type == (UINT)Type && strstr(table[i].name, "_REQ"))
+            return table[i].name;
+    }
+    return NULL;
+}
+
+void dump_tlv(PQCQMUX_MSG_HDR pQMUXMsgHdr, int Length) {
     int TLVFind = 0;
     int i;
     //dbg("QCQMUX_TLV-----------------------------------\n");
     //dbg("{Type,\tLength,\tValue}\n");
 
     while (1) {
-        PQMI_TLV_HDR TLVHdr = GetTLV(pQMUXMsgHdr, 0x1000 + (++TLVFind));
+        PQMI_TLV_HDR TLVHdr = GetTLVLimit(pQMUXMsgHdr, Length, 0x1000 + (++TLVFind));
         if (TLVHdr == NULL)
             break;
 
@@ -336,7 +363,7 @@ void dump_tlv(PQCQMUX_MSG_HDR pQMUXMsgHdr) {
     }  // while
 }
 
-void dump_ctl(PQCQMICTL_MSG_HDR CTLHdr) {
+void dump_ctl(PQCQMICTL_MSG_HDR CTLHdr, int Length) {
     const char *tag;
     
     //dbg("QCQMICTL_MSG--------------------------------------------\n");
@@ -352,10 +379,10 @@ void dump_ctl(PQCQMICTL_MSG_HDR CTLHdr) {
         QMUX_NAME(qmux_ctl_QMICTLType, le16_to_cpu(CTLHdr->QMICTLType), tag));     
         dbg("Length:             %04x\n", le16_to_cpu(CTLHdr->Length));
 
-     dump_tlv((PQCQMUX_MSG_HDR)(&CTLHdr->QMICTLType));
+     dump_tlv((PQCQMUX_MSG_HDR)(&CTLHdr->QMICTLType), Length);
 }
 
-int dump_qmux(QMI_SERVICE_TYPE serviceType, PQCQMUX_HDR QMUXHdr) {
+int dump_qmux(QMI_SERVICE_TYPE serviceType, PQCQMUX_HDR QMUXHdr, int Length) {
     PQCQMUX_MSG_HDR QMUXMsgHdr = (PQCQMUX_MSG_HDR) (QMUXHdr + 1);
     CHAR *tag;
 
@@ -405,7 +432,7 @@ int dump_qmux(QMI_SERVICE_TYPE serviceType, PQCQMUX_HDR QMUXHdr) {
     }
     dbg("Length:             %04x\n", le16_to_cpu(QMUXMsgHdr->Length));
 
-    dump_tlv(QMUXMsgHdr);
+    dump_tlv(QMUXMsgHdr, Length);
     
     return 0;
 }
@@ -436,10 +463,11 @@ void dump_qmi(void *dataBuffer, int dataLen)
     //dbg("QMIType:            %02x\t\t%s", QMIHdr->QMIType, QMI_NAME(qmi_QMIType, QMIHdr->QMIType));
     //dbg("ClientId:           %02x", QMIHdr->ClientId);
 
+    //the TLVs are dumped from the bytes of dataBuffer, not from the Length fields of the message
     if (QMIHdr->QMIType == QMUX_TYPE_CTL) {
-        dump_ctl(CTLHdr);
+        dump_ctl(CTLHdr, dataLen - (int)(sizeof(QCQMI_HDR) + offsetof(QCQMICTL_MSG_HDR, QMICTLType) + sizeof(QCQMUX_MSG_HDR)));
     } else {
-        dump_qmux(QMIHdr->QMIType, QMUXHdr);
+        dump_qmux(QMIHdr->QMIType, QMUXHdr, dataLen - (int)(sizeof(QCQMI_HDR) + sizeof(QCQMUX_HDR) + sizeof(QCQMUX_MSG_HDR)));
     }
     dbg_time("%s", line);
     pthread_mutex_unlock(&dumpQMIMutex);
@@ -292,6 +292,7 @@ typedef struct _QMIWDS_GET_CURRENT_CHANNEL_RATE_RESP_MSG
 #ifdef QCUSB_MUX_PROTOCOL
 #error code not present
 #endif // QCUSB_MUX_PROTOCOL
+#endif
 
 typedef struct _QMIWDS_SET_EVENT_REPORT_REQ_MSG
 {
@@ -316,6 +317,8 @@ typedef struct _QMIWDS_SET_EVENT_REPORT_REQ_MSG
    UCHAR  DormancyStatus;    // 0-do not report; 1-report when changes
 } QMIWDS_SET_EVENT_REPORT_REQ_MSG, *PQMIWDS_SET_EVENT_REPORT_REQ_MSG;
 
+#if 0
+
 typedef struct _QMIWDS_SET_EVENT_REPORT_RESP_MSG
 {
    USHORT Type;             // QMUX type 0x0042
@@ -3330,9 +3333,9 @@ typedef struct _QMUX_MSG
       QMIWDS_GET_CURRENT_CHANNEL_RATE_RESP_MSG  GetCurrChannelRateRsp;
       QMIWDS_GET_PKT_STATISTICS_REQ_MSG         GetPktStatsReq;
       QMIWDS_GET_PKT_STATISTICS_RESP_MSG        GetPktStatsRsp;
-      QMIWDS_SET_EVENT_REPORT_REQ_MSG           EventReportReq;
       QMIWDS_SET_EVENT_REPORT_RESP_MSG          EventReportRsp;
 #endif
+      QMIWDS_SET_EVENT_REPORT_REQ_MSG           EventReportReq;
       //#ifdef QC_IP_MODE
       QMIWDS_GET_RUNTIME_SETTINGS_REQ_MSG       GetRuntimeSettingsReq;
       QMIWDS_GET_RUNTIME_SETTINGS_RESP_MSG      GetRuntimeSettingsRsp;
@@ -3465,6 +3468,7 @@ typedef struct _QMUX_MSG
       QMINAS_GET_SERVING_SYSTEM_RESP_MSG        GetServingSystemResp;
       QMINAS_GET_SYS_INFO_RESP_MSG              GetSysInfoResp;
       QMINAS_SYS_INFO_IND_MSG                   NasSysInfoInd;
+      QMINAS_SET_EVENT_REPORT_REQ_MSG           SetEventReportReq;
 #if 0
       QMINAS_SERVING_SYSTEM_IND_MSG             NasServingSystemInd;
       QMINAS_SET_PREFERRED_NETWORK_REQ_MSG      SetPreferredNetworkReq;
@@ -3479,7 +3483,6 @@ typedef struct _QMUX_MSG
       QMINAS_SET_TECHNOLOGY_PREF_RESP_MSG       SetTechnologyPrefResp;
       QMINAS_GET_SIGNAL_STRENGTH_REQ_MSG        GetSignalStrengthReq;
       QMINAS_GET_SIGNAL_STRENGTH_RESP_MSG       GetSignalStrengthResp;
-      QMINAS_SET_EVENT_REPORT_REQ_MSG           SetEventReportReq;
       QMINAS_SET_EVENT_REPORT_RESP_MSG          SetEventReportResp;
       QMINAS_EVENT_REPORT_IND_MSG               NasEventReportInd;
       QMINAS_GET_RF_BAND_INFO_REQ_MSG           GetRFBandInfoReq;
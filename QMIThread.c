@@ -14,6 +14,7 @@
   ---------------------------------------------------------------------------
 ******************************************************************************/
 #include "QMIThread.h"
+#include "trace.h"
 #include "contries_code.h"
 #ifndef MIN
 #define MIN(a, b)	((a) < (b)? (a): (b))
@@ -31,7 +32,7 @@ extern char *strndup (const char *__string, size_t __n);
             USHORT QMUXError = le16_to_cpu(pMUXMsg->QMUXMsgHdrResp.QMUXError); \
             dbg_time("%s QMUXResult = 0x%x, QMUXError = 0x%x", __func__, \
                 le16_to_cpu(pMUXMsg->QMUXMsgHdrResp.QMUXResult), QMUXError); \
-            free(pResponse); \
+            qmi_msg_free(pResponse); \
             return QMUXError; \
         } \
 } while(0)
@@ -49,8 +50,6 @@ extern char *strndup (const char *__string, size_t __n);
         } \
 } while(0)
 
-static uint32_t WdsConnectionIPv4Handle = 0;
-static uint32_t WdsConnectionIPv6Handle = 0;
 static int s_is_cdma = 0;
 static int s_5g_type = WWAN_DATA_CLASS_NONE;
 static int s_hdr_personality = 0; // 0x01-HRPD, 0x02-eHRPD
@@ -64,13 +63,88 @@ static int s_9x07 = 1;
 
 typedef USHORT (*CUSTOMQMUX)(PQMUX_MSG pMUXMsg, void *arg);
 
-// To retrieve the ith (Index) TLV
-PQMI_TLV_HDR GetTLV (PQCQMUX_MSG_HDR pQMUXMsgHdr, int TLVType) {
+/* One-pass TLV index of the response the current thread is parsing.
+ * QmiThreadSendQMITimeout() builds it when it hands a response to its caller,
+ * so the following GetTLV() calls of the request_* handler are a table lookup
+ * instead of a rescan of the TLV chain. It is per thread because every
+ * request_async worker parses its own response, and qmi_msg_free() drops it. */
+#define QMI_TLV_INDEX_ORDER_MAX 32
+
+typedef struct {
+    PQCQMUX_MSG_HDR pQMUXMsgHdr;
+    USHORT Length; //TLV bytes really received, see qmi_tlv_length()
+    USHORT TypeOffset[256]; //offset + 1 of the first TLV of each type, 0 if absent
+    USHORT OrderOffset[QMI_TLV_INDEX_ORDER_MAX]; //offset + 1 of the ith TLV, for GetTLV(0x1000 + i)
+} QMI_TLV_INDEX;
+
+static __thread QMI_TLV_INDEX s_tlv_index;
+
+/* TLV bytes of a QMUX message that can be trusted: QMUXMsgHdr.Length comes from
+ * the modem, QMIHdr.Length was checked against what the reader got.
+ * pQMUXMsgHdr must be the one of a QMUX QCQMIMSG, CTL messages are laid out differently */
+static USHORT qmi_tlv_length(PQCQMUX_MSG_HDR pQMUXMsgHdr) {
+    PQCQMIMSG pMsg = (PQCQMIMSG)((UCHAR *)pQMUXMsgHdr - offsetof(QCQMIMSG, MUXMsg.QMUXMsgHdr));
+    int Length = le16_to_cpu(pMsg->QMIHdr.Length) + 1
+        - (int)(sizeof(QCQMI_HDR) + sizeof(QCQMUX_HDR) + sizeof(QCQMUX_MSG_HDR));
+
+    if (Length < 0)
+        Length = 0;
+    if (Length > le16_to_cpu(pQMUXMsgHdr->Length))
+        Length = le16_to_cpu(pQMUXMsgHdr->Length);
+    return Length;
+}
+
+/* walk the TLV chain once, stop at the first TLV that does not fit in the received length */
+static void qmi_tlv_index_build(PQCQMUX_MSG_HDR pQMUXMsgHdr) {
+    UCHAR *pTLV = (UCHAR *)(pQMUXMsgHdr + 1);
+    USHORT Length = qmi_tlv_length(pQMUXMsgHdr);
+    USHORT Offset = 0;
+    unsigned TLVFind = 0;
+
+    memset(&s_tlv_index, 0x00, sizeof(s_tlv_index));
+    s_tlv_index.Length = Length;
+
+    while (Length - Offset >= sizeof(QMI_TLV_HDR)) {
+        PQMI_TLV_HDR pTLVHdr = (PQMI_TLV_HDR)(pTLV + Offset);
+        int TLVSize = le16_to_cpu(pTLVHdr->TLVLength) + sizeof(QMI_TLV_HDR); //not USHORT, 0xFFFF + 3 must not wrap
+
+        if (TLVSize > Length - Offset) {
+            dbg_time("%s TLV 0x%02x length %u beyond message length %u", __func__,
+                pTLVHdr->TLVType, le16_to_cpu(pTLVHdr->TLVLength), Length);
+            break;
+        }
+
+        if (s_tlv_index.TypeOffset[pTLVHdr->TLVType] == 0)
+            s_tlv_index.TypeOffset[pTLVHdr->TLVType] = Offset + 1;
+        if (TLVFind < QMI_TLV_INDEX_ORDER_MAX)
+            s_tlv_index.OrderOffset[TLVFind++] = Offset + 1;
+
+        Offset += TLVSize;
+    }
+
+    s_tlv_index.pQMUXMsgHdr = pQMUXMsgHdr;
+}
+
+static void qmi_tlv_index_drop(PQCQMIMSG pMsg) {
+    if (pMsg && s_tlv_index.pQMUXMsgHdr == &pMsg->MUXMsg.QMUXMsgHdr)
+        s_tlv_index.pQMUXMsgHdr = NULL;
+}
+
+/* To retrieve the ith (Index) TLV within the first Length bytes of TLVs,
+ * for messages whose received length is known to the caller, like CTL ones */
+PQMI_TLV_HDR GetTLVLimit (PQCQMUX_MSG_HDR pQMUXMsgHdr, int Length, int TLVType) {
     int TLVFind = 0;
-    USHORT Length = le16_to_cpu(pQMUXMsgHdr->Length);
     PQMI_TLV_HDR pTLVHdr = (PQMI_TLV_HDR)(pQMUXMsgHdr + 1);
 
-    while (Length >= sizeof(QMI_TLV_HDR)) {
+    if (Length > le16_to_cpu(pQMUXMsgHdr->Length))
+        Length = le16_to_cpu(pQMUXMsgHdr->Length);
+
+    while (Length >= (int)sizeof(QMI_TLV_HDR)) {
+        int TLVSize = le16_to_cpu(pTLVHdr->TLVLength) + sizeof(QMI_TLV_HDR); //not USHORT, 0xFFFF + 3 must not wrap
+
+        if (TLVSize > Length)
+            break; //malformed, the value would run past the message
+
         TLVFind++;
         //printf("GetTLV: TLVType=0x%X => TLVFind=%d, pTLVHdr->TLVType=0x%X, pTLVHdr->TLVLength=%d\n", TLVType, TLVFind, pTLVHdr->TLVType, pTLVHdr->TLVLength);
         if (TLVType > 0x1000) {
@@ -81,26 +155,135 @@ PQMI_TLV_HDR GetTLV (PQCQMUX_MSG_HDR pQMUXMsgHdr, int TLVType) {
             return pTLVHdr;
         }
 
-        Length -= (le16_to_cpu((pTLVHdr->TLVLength)) + sizeof(QMI_TLV_HDR));
-        pTLVHdr = (PQMI_TLV_HDR)(((UCHAR *)pTLVHdr) + le16_to_cpu(pTLVHdr->TLVLength) + sizeof(QMI_TLV_HDR));
+        Length -= TLVSize;
+        pTLVHdr = (PQMI_TLV_HDR)(((UCHAR *)pTLVHdr) + TLVSize);
     }
 
    return NULL;
 }
 
+// To retrieve the ith (Index) TLV of a QMUX message
+PQMI_TLV_HDR GetTLV (PQCQMUX_MSG_HDR pQMUXMsgHdr, int TLVType) {
+    if (s_tlv_index.pQMUXMsgHdr == pQMUXMsgHdr) {
+        USHORT Offset = 0;
+
+        if (TLVType > 0x1000) {
+            if (TLVType - 0x1000 > QMI_TLV_INDEX_ORDER_MAX)
+                return GetTLVLimit(pQMUXMsgHdr, s_tlv_index.Length, TLVType);
+            Offset = s_tlv_index.OrderOffset[TLVType - 0x1000 - 1];
+        } else if (TLVType >= 0 && TLVType < 256) {
+            Offset = s_tlv_index.TypeOffset[TLVType];
+        }
+
+        return Offset ? (PQMI_TLV_HDR)(((UCHAR *)(pQMUXMsgHdr + 1)) + Offset - 1) : NULL;
+    }
+
+    return GetTLVLimit(pQMUXMsgHdr, qmi_tlv_length(pQMUXMsgHdr), TLVType);
+}
+
+/* GetTLV() for a handler that reads the TLV through a struct of Size bytes
+ * (TLV header included), NULL if the modem sent a shorter value */
+static PQMI_TLV_HDR GetTLVSized (PQCQMUX_MSG_HDR pQMUXMsgHdr, int TLVType, size_t Size) {
+    PQMI_TLV_HDR pTLVHdr = GetTLV(pQMUXMsgHdr, TLVType);
+
+    if (pTLVHdr && le16_to_cpu(pTLVHdr->TLVLength) + sizeof(QMI_TLV_HDR) < Size) {
+        dbg_time("%s TLV 0x%02x length %u, expect %u", __func__, pTLVHdr->TLVType,
+            le16_to_cpu(pTLVHdr->TLVLength), (unsigned)(Size - sizeof(QMI_TLV_HDR)));
+        return NULL;
+    }
+    return pTLVHdr;
+}
+
+//the TLV as a PTYPE, only if the whole struct was received
+#define GetTLVTyped(pQMUXMsgHdr, TLVType, PTYPE) ((PTYPE)GetTLVSized(pQMUXMsgHdr, TLVType, sizeof(*(PTYPE)0)))
+
 static USHORT GetQMUXTransactionId(void) {
     static int TransactionId = 0;
+    USHORT tid;
+
+    pthread_mutex_lock(&cm_command_mutex);
     if (++TransactionId > 0xFFFF)
         TransactionId = 1;
-    return TransactionId;
+    tid = TransactionId;
+    pthread_mutex_unlock(&cm_command_mutex);
+    return tid;
+}
+
+/* Requests and responses are borrowed from two fixed pools instead of the heap:
+ * small slots fit every request ComposeQMUXMsg()/ComposeQCTLMsg() builds, large
+ * slots fit anything the read thread can put in cm_recv_buf. The signal/status
+ * polling runs forever, so avoid fragmenting small uClibc heaps with it.
+ * Only when a pool is used up (or the length is odd) we fall back to malloc(). */
+#define QMI_MSG_POOL_SLOTS 8
+
+static pthread_mutex_t s_qmi_msg_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static UCHAR s_qmi_msg_small[QMI_MSG_POOL_SLOTS][WDM_DEFAULT_BUFSIZE];
+static UCHAR s_qmi_msg_large[QMI_MSG_POOL_SLOTS][sizeof(cm_recv_buf)];
+static unsigned s_qmi_msg_small_used = 0;
+static unsigned s_qmi_msg_large_used = 0;
+
+static void *qmi_msg_pool_get(UCHAR *slots, size_t slot_size, unsigned *used) {
+    unsigned i;
+
+    for (i = 0; i < QMI_MSG_POOL_SLOTS; i++) {
+        if (!(*used & (1U << i))) {
+            *used |= (1U << i);
+            return slots + i * slot_size;
+        }
+    }
+    return NULL;
+}
+
+PQCQMIMSG qmi_msg_alloc(size_t len) {
+    void *pMsg = NULL;
+
+    pthread_mutex_lock(&s_qmi_msg_pool_mutex);
+    if (len <= sizeof(s_qmi_msg_small[0]))
+        pMsg = qmi_msg_pool_get(s_qmi_msg_small[0], sizeof(s_qmi_msg_small[0]), &s_qmi_msg_small_used);
+    if (!pMsg && len <= sizeof(s_qmi_msg_large[0]))
+        pMsg = qmi_msg_pool_get(s_qmi_msg_large[0], sizeof(s_qmi_msg_large[0]), &s_qmi_msg_large_used);
+    pthread_mutex_unlock(&s_qmi_msg_pool_mutex);
+
+    if (!pMsg) {
+        if (debug_qmi)
+            dbg_time("%s pool exhausted for %zd bytes", __func__, len);
+        pMsg = malloc(len);
+    }
+
+    return (PQCQMIMSG)pMsg;
+}
+
+void qmi_msg_free(PQCQMIMSG pMsg) {
+    UCHAR *p = (UCHAR *)pMsg;
+
+    if (!p)
+        return;
+
+    qmi_tlv_index_drop(pMsg);
+
+    pthread_mutex_lock(&s_qmi_msg_pool_mutex);
+    if (p >= s_qmi_msg_small[0] && p < s_qmi_msg_small[QMI_MSG_POOL_SLOTS]) {
+        s_qmi_msg_small_used &= ~(1U << ((p - s_qmi_msg_small[0]) / sizeof(s_qmi_msg_small[0])));
+        p = NULL;
+    } else if (p >= s_qmi_msg_large[0] && p < s_qmi_msg_large[QMI_MSG_POOL_SLOTS]) {
+        s_qmi_msg_large_used &= ~(1U << ((p - s_qmi_msg_large[0]) / sizeof(s_qmi_msg_large[0])));
+        p = NULL;
+    }
+    pthread_mutex_unlock(&s_qmi_msg_pool_mutex);
+
+    if (p)
+        free(p);
 }
 
 static PQCQMIMSG ComposeQMUXMsg(UCHAR QMIType, USHORT Type, CUSTOMQMUX customQmuxMsgFunction, void *arg) {
-    UCHAR QMIBuf[WDM_DEFAULT_BUFSIZE];
-    PQCQMIMSG pRequest = (PQCQMIMSG)QMIBuf;
-    int Length;
+    PQCQMIMSG pRequest = qmi_msg_alloc(WDM_DEFAULT_BUFSIZE);
 
-    memset(QMIBuf, 0x00, sizeof(QMIBuf));
+    if (pRequest == NULL) {
+        dbg_time("%s fail to malloc", __func__);
+        return NULL;
+    }
+
+    memset(pRequest, 0x00, WDM_DEFAULT_BUFSIZE);
     pRequest->QMIHdr.IFType = USB_CTL_MSG_TYPE_QMI;
     pRequest->QMIHdr.CtlFlags = 0x00;
     pRequest->QMIHdr.QMIType = QMIType;
@@ -115,26 +298,28 @@ static PQCQMIMSG ComposeQMUXMsg(UCHAR QMIType, USHORT Type, CUSTOMQMUX customQmu
 
     pRequest->QMIHdr.Length = cpu_to_le16(le16_to_cpu(pRequest->MUXMsg.QMUXMsgHdr.Length) + sizeof(QCQMUX_MSG_HDR) + sizeof(QCQMUX_HDR)
         + sizeof(QCQMI_HDR) - 1);
-    Length = le16_to_cpu(pRequest->QMIHdr.Length) + 1;
 
-    pRequest = (PQCQMIMSG)malloc(Length);
-    if (pRequest == NULL) {
-        dbg_time("%s fail to malloc", __func__);
-    } else {
-        memcpy(pRequest, QMIBuf, Length);
-    }
+    return pRequest;
+}
+
+/* WDS request on the client of this PDN for curIpFamily,
+ * ClientId 0 lets qmidev_send() use the default WDS/WDS_IPV6 client */
+static PQCQMIMSG ComposeWdsMsg(PROFILE_T *profile, int curIpFamily, USHORT Type, CUSTOMQMUX customQmuxMsgFunction, void *arg) {
+    UCHAR QMIType = (curIpFamily == IpFamilyV4) ? QMUX_TYPE_WDS : QMUX_TYPE_WDS_IPV6;
+    PQCQMIMSG pRequest = ComposeQMUXMsg(QMIType, Type, customQmuxMsgFunction, arg);
 
+    if (pRequest)
+        pRequest->QMIHdr.ClientId = profile->wds_client[curIpFamily == IpFamilyV6];
     return pRequest;
 }
 
-#if 0
 static USHORT NasSetEventReportReq(PQMUX_MSG pMUXMsg, void *arg) {
     pMUXMsg->SetEventReportReq.TLVType = 0x10;
     pMUXMsg->SetEventReportReq.TLVLength = 0x04;
-    pMUXMsg->SetEventReportReq.ReportSigStrength = 0x00;
+    pMUXMsg->SetEventReportReq.ReportSigStrength = 0x01; //report when crossing a threshold
     pMUXMsg->SetEventReportReq.NumTresholds = 2;
-    pMUXMsg->SetEventReportReq.TresholdList[0] = -113;
-    pMUXMsg->SetEventReportReq.TresholdList[1] = -50;
+    pMUXMsg->SetEventReportReq.TresholdList[0] = -100;
+    pMUXMsg->SetEventReportReq.TresholdList[1] = -85;
     return sizeof(QMINAS_SET_EVENT_REPORT_REQ_MSG);
 }
 
@@ -158,6 +343,7 @@ static USHORT WdsSetEventReportReq(PQMUX_MSG pMUXMsg, void *arg) {
     return sizeof(QMIWDS_SET_EVENT_REPORT_REQ_MSG);
 }
 
+#if 0
 static USHORT DmsSetEventReportReq(PQMUX_MSG pMUXMsg) {
     PPIN_STATUS pPinState = (PPIN_STATUS)(&pMUXMsg->DmsSetEventReportReq + 1);
     PUIM_STATE pUimState = (PUIM_STATE)(pPinState + 1);
@@ -173,6 +359,13 @@ static USHORT DmsSetEventReportReq(PQMUX_MSG pMUXMsg) {
 }
 #endif
 
+//IPv4 and IPv6 may be started at the same time, so the family and auth do not go through PROFILE_T
+typedef struct {
+    PROFILE_T *profile;
+    int curIpFamily;
+    int auth;
+} WDS_START_NW_ARG;
+
 static USHORT WdsStartNwInterfaceReq(PQMUX_MSG pMUXMsg, void *arg) {
     PQMIWDS_TECHNOLOGY_PREFERECE pTechPref;
     PQMIWDS_AUTH_PREFERENCE pAuthPref;
@@ -182,10 +375,11 @@ static USHORT WdsStartNwInterfaceReq(PQMUX_MSG pMUXMsg, void *arg) {
     PQMIWDS_IP_FAMILY_TLV pIpFamily;
     USHORT TLVLength = 0;
     UCHAR *pTLV;
-    PROFILE_T *profile = (PROFILE_T *)arg;
+    WDS_START_NW_ARG *start = (WDS_START_NW_ARG *)arg;
+    PROFILE_T *profile = start->profile;
     const char *profile_user = profile->user;
     const char *profile_password = profile->password;
-    int profile_auth = profile->auth;
+    int profile_auth = start->auth;
 
     if (s_is_cdma && (profile_user == NULL || profile_user[0] == '\0') && (profile_password == NULL || profile_password[0] == '\0')) {
         profile_user = "ctnet@mycdma.cn";
@@ -246,7 +440,7 @@ static USHORT WdsStartNwInterfaceReq(PQMUX_MSG pMUXMsg, void *arg) {
     pIpFamily = (PQMIWDS_IP_FAMILY_TLV)(pTLV + TLVLength);
     pIpFamily->TLVType = 0x19;
     pIpFamily->TLVLength = cpu_to_le16(0x01);
-    pIpFamily->IpFamily = profile->curIpFamily;
+    pIpFamily->IpFamily = start->curIpFamily;
     TLVLength += (le16_to_cpu(pIpFamily->TLVLength) + sizeof(QCQMICTL_TLV_HDR));
 
     //Set Profile Index
@@ -268,10 +462,7 @@ static USHORT WdsStartNwInterfaceReq(PQMUX_MSG pMUXMsg, void *arg) {
 static USHORT WdsStopNwInterfaceReq(PQMUX_MSG pMUXMsg, void *arg) {
     pMUXMsg->StopNwInterfaceReq.TLVType = 0x01;
     pMUXMsg->StopNwInterfaceReq.TLVLength = cpu_to_le16(0x04);
-    if (*((int *)arg) == IpFamilyV4)
-        pMUXMsg->StopNwInterfaceReq.Handle =  cpu_to_le32(WdsConnectionIPv4Handle);
-    else
-        pMUXMsg->StopNwInterfaceReq.Handle =  cpu_to_le32(WdsConnectionIPv6Handle);
+    pMUXMsg->StopNwInterfaceReq.Handle =  cpu_to_le32(*((uint32_t *)arg));
     return sizeof(QMIWDS_STOP_NETWORK_INTERFACE_REQ_MSG);
 }
 
@@ -568,87 +759,306 @@ static USHORT WdsGetRuntimeSettingReq(PQMUX_MSG pMUXMsg, void *arg)
     return sizeof(QMIWDS_GET_RUNTIME_SETTINGS_REQ_MSG);
 }
 
-static PQCQMIMSG s_pRequest;
-static PQCQMIMSG s_pResponse;
+/* Outstanding QMI transactions, hashed by (QMIType, ClientId, TransactionId).
+ * Every caller of QmiThreadSendQMITimeout() owns its completion object on its
+ * own stack, so requests to independent services (or to the IPv4 and IPv6 WDS
+ * clients) can be in flight at the same time and QmiThreadRecvQMI() only has
+ * to look at a single hash bucket to find the waiter of a response.
+ * The table is protected by cm_command_mutex. */
+#define QMI_TXN_HASH_SIZE 32
+
+typedef struct __QMI_TXN {
+    struct __QMI_TXN *next;
+    UCHAR QMIType;
+    UCHAR ClientId;
+    USHORT TransactionId;
+    int done;
+    PQCQMIMSG pResponse;
+    pthread_cond_t cond;
+} QMI_TXN;
+
+static QMI_TXN *s_qmi_txn_table[QMI_TXN_HASH_SIZE];
+
+static USHORT qmi_txn_tid(const PQCQMIMSG pQMI) {
+    if (pQMI->QMIHdr.QMIType == QMUX_TYPE_CTL)
+        return pQMI->CTLMsg.QMICTLMsgHdr.TransactionId;
+    return le16_to_cpu(pQMI->MUXMsg.QMUXHdr.TransactionId);
+}
+
+static QMI_TXN **qmi_txn_bucket(UCHAR QMIType, UCHAR ClientId, USHORT TransactionId) {
+    return &s_qmi_txn_table[(TransactionId ^ ClientId ^ QMIType) & (QMI_TXN_HASH_SIZE - 1)];
+}
+
+static QMI_TXN *qmi_txn_find(const PQCQMIMSG pResponse) {
+    UCHAR QMIType = pResponse->QMIHdr.QMIType;
+    UCHAR ClientId = pResponse->QMIHdr.ClientId;
+    USHORT TransactionId = qmi_txn_tid(pResponse);
+    QMI_TXN *pTxn = *qmi_txn_bucket(QMIType, ClientId, TransactionId);
+
+    for (; pTxn; pTxn = pTxn->next) {
+        if (pTxn->QMIType == QMIType && pTxn->ClientId == ClientId && pTxn->TransactionId == TransactionId)
+            return pTxn;
+    }
+    return NULL;
+}
+
+static void qmi_txn_add(QMI_TXN *pTxn) {
+    QMI_TXN **ppHead = qmi_txn_bucket(pTxn->QMIType, pTxn->ClientId, pTxn->TransactionId);
 
-static int is_response(const PQCQMIMSG pRequest, const PQCQMIMSG pResponse) {
-    if ((pRequest->QMIHdr.QMIType == pResponse->QMIHdr.QMIType)
-        && (pRequest->QMIHdr.ClientId == pResponse->QMIHdr.ClientId)) {
-            USHORT requestTID, responseTID;
-        if (pRequest->QMIHdr.QMIType == QMUX_TYPE_CTL) {
-            requestTID = pRequest->CTLMsg.QMICTLMsgHdr.TransactionId;
-            responseTID = pResponse->CTLMsg.QMICTLMsgHdr.TransactionId;
+    pTxn->next = *ppHead;
+    *ppHead = pTxn;
+}
+
+static void qmi_txn_del(QMI_TXN *pTxn) {
+    QMI_TXN **ppTxn = qmi_txn_bucket(pTxn->QMIType, pTxn->ClientId, pTxn->TransactionId);
+
+    for (; *ppTxn; ppTxn = &(*ppTxn)->next) {
+        if (*ppTxn == pTxn) {
+            *ppTxn = pTxn->next;
+            break;
+        }
+    }
+}
+
+/* Send to response latency of every (QMIType, message Type) seen, in fixed
+ * buckets, so a slow firmware call shows up without debug logs.
+ * Dumped to the log on SIGUSR1. */
+#define QMI_STATS_SIZE 128
+
+static const unsigned s_qmi_stats_bucket_msec[] = {5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 30000, 60000, 120000};
+#define QMI_STATS_NUM_BUCKETS (sizeof(s_qmi_stats_bucket_msec)/sizeof(s_qmi_stats_bucket_msec[0]))
+
+typedef struct {
+    USHORT MsgType;
+    UCHAR QMIType;
+    unsigned count;
+    unsigned timeouts;
+    unsigned long sum_msec;
+    unsigned long max_msec;
+    unsigned buckets[QMI_STATS_NUM_BUCKETS + 1]; //the last one is +Inf
+} QMI_STATS;
+
+static pthread_mutex_t s_qmi_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static QMI_STATS s_qmi_stats[QMI_STATS_SIZE];
+static unsigned s_qmi_stats_used = 0;
+static unsigned s_qmi_stats_dropped = 0; //requests of types that found the table full
+
+/* callers hold s_qmi_stats_mutex, NULL when the table is full */
+static QMI_STATS *qmi_stats_get(UCHAR QMIType, USHORT MsgType) {
+    unsigned i;
+
+    for (i = 0; i < s_qmi_stats_used; i++) {
+        if (s_qmi_stats[i].QMIType == QMIType && s_qmi_stats[i].MsgType == MsgType)
+            return &s_qmi_stats[i];
+    }
+    if (s_qmi_stats_used == QMI_STATS_SIZE) {
+        if (!s_qmi_stats_dropped++)
+            dbg_time("%s too many message types, %02x/%04x not recorded", __func__, QMIType, MsgType);
+        return NULL;
+    }
+
+    s_qmi_stats[s_qmi_stats_used].QMIType = QMIType;
+    s_qmi_stats[s_qmi_stats_used].MsgType = MsgType;
+    return &s_qmi_stats[s_qmi_stats_used++];
+}
+
+static void qmi_stats_record(UCHAR QMIType, USHORT MsgType, int timeout, unsigned long msec) {
+    const char *name = qmi_req_name(QMIType, MsgType);
+    QMI_STATS *st;
+    unsigned b;
+
+    pthread_mutex_lock(&s_qmi_stats_mutex);
+    st = qmi_stats_get(QMIType, MsgType);
+    if (st) {
+        if (timeout) {
+            st->timeouts++;
         } else {
-            requestTID = le16_to_cpu(pRequest->MUXMsg.QMUXHdr.TransactionId);
-            responseTID = le16_to_cpu(pResponse->MUXMsg.QMUXHdr.TransactionId);
+            st->count++;
+            st->sum_msec += msec;
+            if (msec > st->max_msec)
+                st->max_msec = msec;
+            for (b = 0; b < QMI_STATS_NUM_BUCKETS && msec > s_qmi_stats_bucket_msec[b]; b++);
+            st->buckets[b]++;
         }
-        return (requestTID == responseTID);
     }
-    return 0;
+    pthread_mutex_unlock(&s_qmi_stats_mutex);
+
+    if (!name)
+        name = "unknown";
+    if (timeout)
+        metric_inc(METRIC_QMI_TIMEOUTS, "service=\"%u\",msg=\"0x%04x\",name=\"%s\"", QMIType, MsgType, name);
+    else
+        metric_observe(METRIC_QMI_REQUEST_SECONDS, msec / 1000.0, "service=\"%u\",msg=\"0x%04x\",name=\"%s\"", QMIType, MsgType, name);
+}
+
+/* upper bound of the bucket holding the given percentile */
+static const char *qmi_stats_percentile(const QMI_STATS *st, unsigned percent, char *buf, size_t size) {
+    unsigned long want = ((unsigned long)st->count * percent + 99) / 100;
+    unsigned long seen = 0;
+    unsigned b;
+
+    if (!st->count)
+        return "-";
+    for (b = 0; b < QMI_STATS_NUM_BUCKETS; b++) {
+        seen += st->buckets[b];
+        if (seen >= want) {
+            snprintf(buf, size, "%u", s_qmi_stats_bucket_msec[b]);
+            return buf;
+        }
+    }
+    return "inf";
+}
+
+void qmi_stats_dump(void) {
+    unsigned i;
+
+    pthread_mutex_lock(&s_qmi_stats_mutex);
+    dbg_time("QMI request latency, %u message types:", s_qmi_stats_used);
+    if (s_qmi_stats_dropped)
+        dbg_time("  table full, %u requests of other types not recorded", s_qmi_stats_dropped);
+    for (i = 0; i < s_qmi_stats_used; i++) {
+        const QMI_STATS *st = &s_qmi_stats[i];
+        const char *name = qmi_req_name(st->QMIType, st->MsgType);
+        char p50[16], p90[16], p99[16];
+
+        dbg_time("  %02x/%04x %-40s n=%u avg=%lu max=%lu p50<=%s p90<=%s p99<=%s ms, timeout=%u",
+            st->QMIType, st->MsgType, name ? name : "unknown", st->count,
+            st->count ? st->sum_msec / st->count : 0, st->max_msec,
+            qmi_stats_percentile(st, 50, p50, sizeof(p50)),
+            qmi_stats_percentile(st, 90, p90, sizeof(p90)),
+            qmi_stats_percentile(st, 99, p99, sizeof(p99)),
+            st->timeouts);
+    }
+    pthread_mutex_unlock(&s_qmi_stats_mutex);
 }
 
 int (*qmidev_send)(PQCQMIMSG pRequest);
 
 int QmiThreadSendQMITimeout(PQCQMIMSG pRequest, PQCQMIMSG *ppResponse, unsigned msecs, const char *funcname) {
     int ret;
-    
+    QMI_TXN txn;
+    unsigned QMIType, MsgType;
+    unsigned long start_msec;
+
+    if (ppResponse)
+        *ppResponse = NULL;
+
     if (!pRequest)
         return -EINVAL;
 
-    pthread_mutex_lock(&cm_command_mutex);
+    memset(&txn, 0x00, sizeof(txn));
+    pthread_cond_init(&txn.cond, NULL);
 
-    if (ppResponse)
-        *ppResponse = NULL;
+    QMIType = pRequest->QMIHdr.QMIType;
+    if (QMIType == QMUX_TYPE_CTL)
+        MsgType = le16_to_cpu(pRequest->CTLMsg.QMICTLMsgHdr.QMICTLType);
+    else
+        MsgType = le16_to_cpu(pRequest->MUXMsg.QMUXMsgHdr.Type);
+    start_msec = clock_msec();
 
-    dump_qmi(pRequest, le16_to_cpu(pRequest->QMIHdr.Length) + 1);
+    pthread_mutex_lock(&cm_command_mutex);
 
-    s_pRequest = pRequest;
-    s_pResponse = NULL;
+    dump_qmi(pRequest, le16_to_cpu(pRequest->QMIHdr.Length) + 1);
 
+    //qmidev_send() fills in the ClientId, so the key is only known after it
     ret = qmidev_send(pRequest);
+    ql_trace(QL_TRACE_QMI, QL_TRACE_TX, pRequest, le16_to_cpu(pRequest->QMIHdr.Length) + 1);
 
     if (ret == 0) {
-        ret = pthread_cond_timeout_np(&cm_command_cond, &cm_command_mutex, msecs);
+        txn.QMIType = pRequest->QMIHdr.QMIType;
+        txn.ClientId = pRequest->QMIHdr.ClientId;
+        txn.TransactionId = qmi_txn_tid(pRequest);
+        qmi_txn_add(&txn);
+
+        do {
+            ret = pthread_cond_timeout_np(&txn.cond, &cm_command_mutex, msecs);
+        } while (!ret && !txn.done);
+        qmi_txn_del(&txn);
+
         if (!ret) {
-            if (s_pResponse && ppResponse) {
-                *ppResponse = s_pResponse;
-            } else {
-                if (s_pResponse) {
-                    free(s_pResponse);
-                    s_pResponse = NULL;
-                }
+            if (txn.pResponse && ppResponse) {
+                *ppResponse = txn.pResponse;
+                txn.pResponse = NULL;
             }
         } else {
             dbg_time("%s message timeout", funcname);
         }
+
+        if (txn.pResponse)
+            qmi_msg_free(txn.pResponse);
     }
 
     pthread_mutex_unlock(&cm_command_mutex);
 
+    pthread_cond_destroy(&txn.cond);
+    qmi_msg_free(pRequest);
+
+    if (ret == ETIMEDOUT)
+        qmi_stats_record(QMIType, MsgType, 1, 0);
+    else if (ret == 0 && ppResponse && *ppResponse)
+        qmi_stats_record(QMIType, MsgType, 0, clock_msec() - start_msec);
+
+    if (ppResponse && *ppResponse && (*ppResponse)->QMIHdr.QMIType != QMUX_TYPE_CTL)
+        qmi_tlv_index_build(&(*ppResponse)->MUXMsg.QMUXMsgHdr);
+
     return ret;
 }
 
+/* the indications QmiThreadRecvQMI() acts on, keep them in step */
+static const struct {
+    UCHAR QMIType;
+    USHORT MsgId;
+} s_qmi_indications[] = {
+    {QMUX_TYPE_NAS, QMINAS_SERVING_SYSTEM_IND},
+    {QMUX_TYPE_WDS, QMIWDS_GET_PKT_SRVC_STATUS_IND},
+    {QMUX_TYPE_NAS, QMINAS_SYS_INFO_IND},
+    {QMUX_TYPE_NAS, QMINAS_EVENT_REPORT_IND},
+    {QMUX_TYPE_WDS, QMIWDS_EVENT_REPORT_IND},
+    {QMUX_TYPE_WDS_ADMIN, QMI_WDA_SET_LOOPBACK_CONFIG_IND},
+};
+
+/* fills MsgId with the indications of QMIType we want, for quectel-qmi-proxy to drop the others */
+int QmiThreadIndications(UCHAR QMIType, USHORT *MsgId, int max) {
+    unsigned i;
+    int n = 0;
+
+    for (i = 0; i < sizeof(s_qmi_indications)/sizeof(s_qmi_indications[0]); i++) {
+        if (s_qmi_indications[i].QMIType == QMIType && n < max)
+            MsgId[n++] = s_qmi_indications[i].MsgId;
+    }
+
+    return n;
+}
+
 void QmiThreadRecvQMI(PQCQMIMSG pResponse) {
+    QMI_TXN *pTxn;
+
     pthread_mutex_lock(&cm_command_mutex);
     if (pResponse == NULL) {
-        if (s_pRequest) {
-            free(s_pRequest);
-            s_pRequest = NULL;
-            s_pResponse = NULL;
-            pthread_cond_signal(&cm_command_cond);
+        unsigned i;
+
+        //device is gone, wake up every pending QmiThreadSendQMI()
+        for (i = 0; i < QMI_TXN_HASH_SIZE; i++) {
+            for (pTxn = s_qmi_txn_table[i]; pTxn; pTxn = pTxn->next) {
+                if (!pTxn->done) {
+                    pTxn->done = 1;
+                    pthread_cond_signal(&pTxn->cond);
+                }
+            }
         }
         pthread_mutex_unlock(&cm_command_mutex);
         return;
     }
+    ql_trace(QL_TRACE_QMI, QL_TRACE_RX, pResponse, le16_to_cpu(pResponse->QMIHdr.Length) + 1);
     dump_qmi(pResponse, le16_to_cpu(pResponse->QMIHdr.Length) + 1);
-    if (s_pRequest && is_response(s_pRequest, pResponse)) {
-        free(s_pRequest);
-        s_pRequest = NULL;
-        s_pResponse = malloc(le16_to_cpu(pResponse->QMIHdr.Length) + 1);
-        if (s_pResponse != NULL) {
-            memcpy(s_pResponse, pResponse, le16_to_cpu(pResponse->QMIHdr.Length) + 1);
+    pTxn = qmi_txn_find(pResponse);
+    if (pTxn && !pTxn->done) {
+        pTxn->done = 1;
+        pTxn->pResponse = qmi_msg_alloc(le16_to_cpu(pResponse->QMIHdr.Length) + 1);
+        if (pTxn->pResponse != NULL) {
+            memcpy(pTxn->pResponse, pResponse, le16_to_cpu(pResponse->QMIHdr.Length) + 1);
         }
-        pthread_cond_signal(&cm_command_cond);
+        pthread_cond_signal(&pTxn->cond);
     } else if ((pResponse->QMIHdr.QMIType == QMUX_TYPE_CTL)
                     && (le16_to_cpu(pResponse->CTLMsg.QMICTLMsgHdrRsp.QMICTLType == QMICTL_REVOKE_CLIENT_ID_IND))) {
         qmidevice_send_event_to_main(MODEM_REPORT_RESET_EVENT);
@@ -661,6 +1071,12 @@ void QmiThreadRecvQMI(PQCQMIMSG pResponse) {
     } else if ((pResponse->QMIHdr.QMIType == QMUX_TYPE_NAS)
                     && (le16_to_cpu(pResponse->MUXMsg.QMUXMsgHdrResp.Type) == QMINAS_SYS_INFO_IND)) {
         qmidevice_send_event_to_main(RIL_UNSOL_RESPONSE_VOICE_NETWORK_STATE_CHANGED);
+    } else if ((pResponse->QMIHdr.QMIType == QMUX_TYPE_NAS)
+                    && (le16_to_cpu(pResponse->MUXMsg.QMUXMsgHdrResp.Type) == QMINAS_EVENT_REPORT_IND)) {
+        qmidevice_send_event_to_main(RIL_UNSOL_SIGNAL_STRENGTH);
+    } else if ((pResponse->QMIHdr.QMIType == QMUX_TYPE_WDS)
+                    && (le16_to_cpu(pResponse->MUXMsg.QMUXMsgHdrResp.Type) == QMIWDS_EVENT_REPORT_IND)) {
+        qmidevice_send_event_to_main(RIL_UNSOL_DATA_CALL_LIST_CHANGED);
     } else if ((pResponse->QMIHdr.QMIType == QMUX_TYPE_WDS_ADMIN)
                     && (le16_to_cpu(pResponse->MUXMsg.QMUXMsgHdrResp.Type) == QMI_WDA_SET_LOOPBACK_CONFIG_IND)) {
     	qmidevice_send_event_to_main_ext(RIL_UNSOL_LOOPBACK_CONFIG_IND,
@@ -672,6 +1088,11 @@ void QmiThreadRecvQMI(PQCQMIMSG pResponse) {
     pthread_mutex_unlock(&cm_command_mutex);
 }
 
+//qmi_ops->wakeup of the QMI drivers, request_async_deinit() must not wait out a 120s request
+void QmiThreadWakeup(void) {
+    QmiThreadRecvQMI(NULL);
+}
+
 static int requestSetEthMode(PROFILE_T *profile) {
     PQCQMIMSG pRequest;
     PQCQMIMSG pResponse = NULL;
@@ -681,6 +1102,7 @@ static int requestSetEthMode(PROFILE_T *profile) {
     UCHAR IpPreference;
     UCHAR autoconnect_setting = 0;
     QMAP_SETTING qmap_settings = {0};
+    PROFILE_T *pdn;
 
     qmap_settings.size = sizeof(qmap_settings);
     
@@ -732,13 +1154,13 @@ static int requestSetEthMode(PROFILE_T *profile) {
     err = QmiThreadSendQMI(pRequest, &pResponse);
     qmi_rsp_check_and_return();
 
-    linkProto = (PQMIWDS_ADMIN_SET_DATA_FORMAT_TLV)GetTLV(&pResponse->MUXMsg.QMUXMsgHdr, 0x11);
+    linkProto = GetTLVTyped(&pResponse->MUXMsg.QMUXMsgHdr, 0x11, PQMIWDS_ADMIN_SET_DATA_FORMAT_TLV);
     if (linkProto != NULL) {
         profile->rawIP = (le32_to_cpu(linkProto->Value) == 2);
         s_9x07 = profile->rawIP; //MDM90x7 only support RAW IP, do not support Eth
     }
 
-    linkProto = (PQMIWDS_ADMIN_SET_DATA_FORMAT_TLV)GetTLV(&pResponse->MUXMsg.QMUXMsgHdr, 0x16);
+    linkProto = GetTLVTyped(&pResponse->MUXMsg.QMUXMsgHdr, 0x16, PQMIWDS_ADMIN_SET_DATA_FORMAT_TLV);
     if (linkProto != NULL && profile->qmap_mode) {
         qmap_settings.rx_urb_size = le32_to_cpu(linkProto->Value);
         dbg_time("qmap_settings.rx_urb_size = %u", qmap_settings.rx_urb_size); //must same as rx_urb_size defined in GobiNet&qmi_wwan driver
@@ -747,19 +1169,19 @@ static int requestSetEthMode(PROFILE_T *profile) {
 #ifdef QUECTEL_UL_DATA_AGG
     if (qmap_settings.ul_data_aggregation_max_datagrams)
     {
-        linkProto = (PQMIWDS_ADMIN_SET_DATA_FORMAT_TLV)GetTLV(&pResponse->MUXMsg.QMUXMsgHdr, 0x17);
+        linkProto = GetTLVTyped(&pResponse->MUXMsg.QMUXMsgHdr, 0x17, PQMIWDS_ADMIN_SET_DATA_FORMAT_TLV);
         if (linkProto != NULL) {
             qmap_settings.ul_data_aggregation_max_datagrams = MIN(qmap_settings.ul_data_aggregation_max_datagrams, le32_to_cpu(linkProto->Value));
             dbg_time("qmap_settings.ul_data_aggregation_max_datagrams  = %u", qmap_settings.ul_data_aggregation_max_datagrams);
         }
 
-        linkProto = (PQMIWDS_ADMIN_SET_DATA_FORMAT_TLV)GetTLV(&pResponse->MUXMsg.QMUXMsgHdr, 0x18);
+        linkProto = GetTLVTyped(&pResponse->MUXMsg.QMUXMsgHdr, 0x18, PQMIWDS_ADMIN_SET_DATA_FORMAT_TLV);
         if (linkProto != NULL) {
             qmap_settings.ul_data_aggregation_max_size = MIN(qmap_settings.ul_data_aggregation_max_size, le32_to_cpu(linkProto->Value));
             dbg_time("qmap_settings.ul_data_aggregation_max_size       = %u", qmap_settings.ul_data_aggregation_max_size);
         }
 
-        linkProto = (PQMIWDS_ADMIN_SET_DATA_FORMAT_TLV)GetTLV(&pResponse->MUXMsg.QMUXMsgHdr, 0x1A);
+        linkProto = GetTLVTyped(&pResponse->MUXMsg.QMUXMsgHdr, 0x1A, PQMIWDS_ADMIN_SET_DATA_FORMAT_TLV);
         if (linkProto != NULL) {
             qmap_settings.dl_minimum_padding = le32_to_cpu(linkProto->Value);
             dbg_time("qmap_settings.dl_minimum_padding                 = %u", qmap_settings.dl_minimum_padding);
@@ -771,45 +1193,50 @@ static int requestSetEthMode(PROFILE_T *profile) {
     }
 #endif
 
-    free(pResponse);
+    qmi_msg_free(pResponse);
 
 skip_WdaSetDataFormat:
-    if (profile->enable_ipv4) {
-    	if (profile->qmapnet_adapter[0]) {
-            // bind wds mux data port
-        	pRequest = ComposeQMUXMsg(QMUX_TYPE_WDS, QMIWDS_BIND_MUX_DATA_PORT_REQ , WdsSetQMUXBindMuxDataPort, (void *)&qmap_settings);
-        	err = QmiThreadSendQMI(pRequest, &pResponse);
-        	qmi_rsp_check_and_return();
-        	if (pResponse) free(pResponse);
+    //every PDN of this process binds its own WDS clients to its own mux id
+    for (pdn = profile; pdn; pdn = pdn->next_pdn) {
+        qmap_settings.MuxId = pdn->muxid;
+
+        if (pdn->enable_ipv4) {
+            if (pdn->qmapnet_adapter[0]) {
+                // bind wds mux data port
+                pRequest = ComposeWdsMsg(pdn, IpFamilyV4, QMIWDS_BIND_MUX_DATA_PORT_REQ , WdsSetQMUXBindMuxDataPort, (void *)&qmap_settings);
+                err = QmiThreadSendQMI(pRequest, &pResponse);
+                qmi_rsp_check_and_return();
+                if (pResponse) qmi_msg_free(pResponse);
+            }
+
+            // set ipv4
+            IpPreference = IpFamilyV4;
+            pRequest = ComposeWdsMsg(pdn, IpFamilyV4, QMIWDS_SET_CLIENT_IP_FAMILY_PREF_REQ, WdsSetClientIPFamilyPref, (void *)&IpPreference);
+            err = QmiThreadSendQMI(pRequest, &pResponse);
+            if (pResponse) qmi_msg_free(pResponse);
         }
 
-        // set ipv4
-    	IpPreference = IpFamilyV4;
-    	pRequest = ComposeQMUXMsg(QMUX_TYPE_WDS, QMIWDS_SET_CLIENT_IP_FAMILY_PREF_REQ, WdsSetClientIPFamilyPref, (void *)&IpPreference);
-    	err = QmiThreadSendQMI(pRequest, &pResponse);
-    	if (pResponse) free(pResponse);
-    }
+        if (pdn->enable_ipv6) {
+            if (pdn->qmapnet_adapter[0]) {
+                // bind wds ipv6 mux data port
+                pRequest = ComposeWdsMsg(pdn, IpFamilyV6, QMIWDS_BIND_MUX_DATA_PORT_REQ , WdsSetQMUXBindMuxDataPort, (void *)&qmap_settings);
+                err = QmiThreadSendQMI(pRequest, &pResponse);
+                qmi_rsp_check_and_return();
+                if (pResponse) qmi_msg_free(pResponse);
+            }
 
-    if (profile->enable_ipv6) {
-        if (profile->qmapnet_adapter[0]) {
-            // bind wds ipv6 mux data port
-            pRequest = ComposeQMUXMsg(QMUX_TYPE_WDS_IPV6, QMIWDS_BIND_MUX_DATA_PORT_REQ , WdsSetQMUXBindMuxDataPort, (void *)&qmap_settings);
+            // set ipv6
+            IpPreference = IpFamilyV6;
+            pRequest = ComposeWdsMsg(pdn, IpFamilyV6, QMIWDS_SET_CLIENT_IP_FAMILY_PREF_REQ, WdsSetClientIPFamilyPref, (void *)&IpPreference);
             err = QmiThreadSendQMI(pRequest, &pResponse);
             qmi_rsp_check_and_return();
-            if (pResponse) free(pResponse);
+            if (pResponse) qmi_msg_free(pResponse);
         }
-
-        // set ipv6
-        IpPreference = IpFamilyV6;
-        pRequest = ComposeQMUXMsg(QMUX_TYPE_WDS_IPV6, QMIWDS_SET_CLIENT_IP_FAMILY_PREF_REQ, WdsSetClientIPFamilyPref, (void *)&IpPreference);
-        err = QmiThreadSendQMI(pRequest, &pResponse);
-        qmi_rsp_check_and_return();
-        if (pResponse) free(pResponse);
     }
 
     pRequest = ComposeQMUXMsg(QMUX_TYPE_WDS, QMIWDS_SET_AUTO_CONNECT_REQ , WdsSetAutoConnect, (void *)&autoconnect_setting);
     QmiThreadSendQMI(pRequest, &pResponse);
-    if (pResponse) free(pResponse);
+    if (pResponse) qmi_msg_free(pResponse);
 
     return 0;
 }
@@ -830,8 +1257,8 @@ static int requestGetPINStatus(SIM_Status *pSIMStatus) {
     err = QmiThreadSendQMI(pRequest, &pResponse);
     qmi_rsp_check_and_return();
 
-    pPin1Status = (PQMIDMS_UIM_PIN_STATUS)GetTLV(&pResponse->MUXMsg.QMUXMsgHdr, 0x11);
-    //pPin2Status = (PQMIDMS_UIM_PIN_STATUS)GetTLV(&pResponse->MUXMsg.QMUXMsgHdr, 0x12);
+    pPin1Status = GetTLVTyped(&pResponse->MUXMsg.QMUXMsgHdr, 0x11, PQMIDMS_UIM_PIN_STATUS);
+    //pPin2Status = GetTLVTyped(&pResponse->MUXMsg.QMUXMsgHdr, 0x12, PQMIDMS_UIM_PIN_STATUS);
 
     if (pPin1Status != NULL) {
         if (pPin1Status->PINStatus == QMI_PIN_STATUS_NOT_VERIF) {
@@ -843,7 +1270,7 @@ static int requestGetPINStatus(SIM_Status *pSIMStatus) {
         }
     }
 
-    free(pResponse);
+    qmi_msg_free(pResponse);
     return 0;
 }
 
@@ -852,7 +1279,6 @@ static int requestGetSIMStatus(SIM_Status *pSIMStatus) { //RIL_REQUEST_GET_SIM_S
     PQCQMIMSG pResponse;
     PQMUX_MSG pMUXMsg;
     int err;
-    char shell_cmd[128];
     const char * SIM_Status_String[] = {
         "SIM_ABSENT",
         "SIM_NOT_READY",
@@ -883,7 +1309,10 @@ static int requestGetSIMStatus(SIM_Status *pSIMStatus) { //RIL_REQUEST_GET_SIM_S
         //UCHAR PIN2Retries;
         //UCHAR PUK2Retries;
 
-        pCardStatus = (PQMIUIM_CARD_STATUS)GetTLV(&pResponse->MUXMsg.QMUXMsgHdr, 0x10);
+        pCardStatus = GetTLVTyped(&pResponse->MUXMsg.QMUXMsgHdr, 0x10, PQMIUIM_CARD_STATUS);
+        if (pCardStatus && le16_to_cpu(pCardStatus->TLVLength) + sizeof(QMI_TLV_HDR)
+            < sizeof(QMIUIM_CARD_STATUS) + pCardStatus->AIDLength + sizeof(QMIUIM_PIN_STATE))
+            pCardStatus = NULL;
         if (pCardStatus != NULL)
         {
             pPINState = (PQMIUIM_PIN_STATE)((PUCHAR)pCardStatus + sizeof(QMIUIM_CARD_STATUS) + pCardStatus->AIDLength);
@@ -959,9 +1388,8 @@ static int requestGetSIMStatus(SIM_Status *pSIMStatus) { //RIL_REQUEST_GET_SIM_S
         }
     }
     dbg_time("%s SIMStatus.1.: %s", __func__, SIM_Status_String[*pSIMStatus]);
-    snprintf(shell_cmd, sizeof(shell_cmd), "echo %s > /tmp/lteSim", SIM_Status_String[*pSIMStatus]);
-            system(shell_cmd);
-    free(pResponse);
+    ql_status_set(QL_STATUS_SIM, "%s", SIM_Status_String[*pSIMStatus]);
+    qmi_msg_free(pResponse);
 
     return 0;
 }
@@ -979,7 +1407,7 @@ static int requestEnterSimPin(const CHAR *pPinCode) {
     err = QmiThreadSendQMI(pRequest, &pResponse);
     qmi_rsp_check_and_return();
 
-    free(pResponse);
+    qmi_msg_free(pResponse);
     return 0;
 }
 #endif
@@ -1000,12 +1428,12 @@ static int requestGetICCID(void) { //RIL_REQUEST_GET_IMSI
     }
     qmi_rsp_check_and_return();
 
-    pUimContent = (PQMIUIM_CONTENT)GetTLV(&pResponse->MUXMsg.QMUXMsgHdr, 0x11);
+    pUimContent = GetTLVTyped(&pResponse->MUXMsg.QMUXMsgHdr, 0x11, PQMIUIM_CONTENT);
     if (pUimContent != NULL) {
         static char DeviceICCID[32] = {'\0'};
         int i = 0, j = 0;
 
-        for (i = 0, j = 0; i < le16_to_cpu(pUimContent->content_len); ++i) {
+        for (i = 0, j = 0; i < le16_to_cpu(pUimContent->content_len) && i < le16_to_cpu(pUimContent->TLVLength) - 2 && j < 30; ++i) {
             char charmaps[] = "0123456789ABCDEF";
 
             DeviceICCID[j++] = charmaps[(pUimContent->content[i] & 0x0F)];
@@ -1016,7 +1444,7 @@ static int requestGetICCID(void) { //RIL_REQUEST_GET_IMSI
         dbg_time("%s DeviceICCID: %s", __func__, DeviceICCID);
     }
 
-    free(pResponse);
+    qmi_msg_free(pResponse);
     return 0;
 }
 
@@ -1036,12 +1464,12 @@ static int requestGetIMSI(const char **pp_imsi) { //RIL_REQUEST_GET_IMSI
     }
     qmi_rsp_check_and_return();
 
-    pUimContent = (PQMIUIM_CONTENT)GetTLV(&pResponse->MUXMsg.QMUXMsgHdr, 0x11);
+    pUimContent = GetTLVTyped(&pResponse->MUXMsg.QMUXMsgHdr, 0x11, PQMIUIM_CONTENT);
     if (pUimContent != NULL) {
         static char DeviceIMSI[32] = {'\0'};
         int i = 0, j = 0;
 
-        for (i = 0, j = 0; i < le16_to_cpu(pUimContent->content[0]); ++i) {
+        for (i = 0, j = 0; i < pUimContent->content[0] && i + 1 < le16_to_cpu(pUimContent->TLVLength) - 2 && j < 30; ++i) {
             if (i != 0)
                 DeviceIMSI[j++] = (pUimContent->content[i+1] & 0x0F) + '0';
             DeviceIMSI[j++] = ((pUimContent->content[i+1] & 0xF0) >> 0x04) + '0';
@@ -1051,7 +1479,7 @@ static int requestGetIMSI(const char **pp_imsi) { //RIL_REQUEST_GET_IMSI
         dbg_time("%s DeviceIMSI: %s", __func__, DeviceIMSI);
     }
 
-    free(pResponse);
+    qmi_msg_free(pResponse);
     return 0;
 }
 #endif
@@ -1132,21 +1560,21 @@ static int requestGetHomeNetwork(USHORT *p_mcc, USHORT *p_mnc, USHORT *p_sid, US
     err = QmiThreadSendQMI(pRequest, &pResponse);
     qmi_rsp_check_and_return();
 
-    pHomeNetwork = (PHOME_NETWORK)GetTLV(&pResponse->MUXMsg.QMUXMsgHdr, 0x01);
+    pHomeNetwork = (PHOME_NETWORK)GetTLVSized(&pResponse->MUXMsg.QMUXMsgHdr, 0x01, offsetof(HOME_NETWORK, NetworkDesclen));
     if (pHomeNetwork && p_mcc && p_mnc ) {
         *p_mcc = le16_to_cpu(pHomeNetwork->MobileCountryCode);
         *p_mnc = le16_to_cpu(pHomeNetwork->MobileNetworkCode);
         //dbg_time("%s MobileCountryCode: %d, MobileNetworkCode: %d", __func__, *pMobileCountryCode, *pMobileNetworkCode);
     }
 
-    pHomeNetworkSystemID = (PHOME_NETWORK_SYSTEMID)GetTLV(&pResponse->MUXMsg.QMUXMsgHdr, 0x10);
+    pHomeNetworkSystemID = GetTLVTyped(&pResponse->MUXMsg.QMUXMsgHdr, 0x10, PHOME_NETWORK_SYSTEMID);
     if (pHomeNetworkSystemID && p_sid && p_nid) {
         *p_sid = le16_to_cpu(pHomeNetworkSystemID->SystemID); //china-hefei: sid 14451
         *p_nid = le16_to_cpu(pHomeNetworkSystemID->NetworkID);
         //dbg_time("%s SystemID: %d, NetworkID: %d", __func__, *pSystemID, *pNetworkID);
     }
 
-    free(pResponse);
+    qmi_msg_free(pResponse);
 
     return 0;
 }
@@ -1245,7 +1673,7 @@ int requestGetIMSI(const char **pp_imsi, USHORT *pMobileCountryCode, USHORT *pMo
         if (pMobileNetworkCode) *pMobileNetworkCode = atoi(tmp);
     }
 
-    free(pResponse);
+    qmi_msg_free(pResponse);
 
     return 0;
 }
@@ -1300,6 +1728,13 @@ static USHORT char2ushort(UCHAR str[3]) {
     return ret;
 }
 
+static void metric_set_registration(int registered, UCHAR PSAttachedState, const char *pDataCapStr) {
+    metric_set(METRIC_REGISTERED, !!registered, NULL);
+    metric_set(METRIC_PS_ATTACHED, PSAttachedState == 1, NULL);
+    metric_clear(METRIC_DATA_CLASS);
+    metric_set(METRIC_DATA_CLASS, 1, "class=\"%s\"", pDataCapStr);
+}
+
 static int requestRegistrationState2(UCHAR *pPSAttachedState) {
     PQCQMIMSG pRequest;
     PQCQMIMSG pResponse;
@@ -1627,6 +2062,7 @@ static int requestRegistrationState2(UCHAR *pPSAttachedState) {
 
     dbg_time("%s MCC: %d, MNC: %d, PS: %s, DataCap: %s", __func__,
         MobileCountryCode, MobileNetworkCode, (*pPSAttachedState == 1) ? "Attached" : "Detached" , pDataCapStr);
+    metric_set_registration(DataCapList != 0, *pPSAttachedState, pDataCapStr);
     for(int i = 0; i < sizeof(PVN_ISPNAME); i++){
       if((MobileCountryCode * 100 + MobileNetworkCode) == PVN_ISPNAME[i].code){
         dbg_time("%s: SIM-Card MobileCountryName[%s], MobileISPName[%s]",__func__, PVN_ISPNAME[i].country, PVN_ISPNAME[i].isp_name);
@@ -1634,7 +2070,7 @@ static int requestRegistrationState2(UCHAR *pPSAttachedState) {
       }
     }
 
-    free(pResponse);
+    qmi_msg_free(pResponse);
 
     return 0;
 }
@@ -1659,14 +2095,17 @@ static int requestRegistrationState(UCHAR *pPSAttachedState) {
     err = QmiThreadSendQMI(pRequest, &pResponse);
     qmi_rsp_check_and_return();
 
-    pCurrentPlmn = (PQMINAS_CURRENT_PLMN_MSG)GetTLV(&pResponse->MUXMsg.QMUXMsgHdr, 0x12);
+    pCurrentPlmn = (PQMINAS_CURRENT_PLMN_MSG)GetTLVSized(&pResponse->MUXMsg.QMUXMsgHdr, 0x12, offsetof(QMINAS_CURRENT_PLMN_MSG, NetworkDesclen));
     if (pCurrentPlmn) {
         MobileCountryCode = le16_to_cpu(pCurrentPlmn->MobileCountryCode);
         MobileNetworkCode = le16_to_cpu(pCurrentPlmn->MobileNetworkCode);
     }
 
     *pPSAttachedState = 0;
-    pServingSystem = (PSERVING_SYSTEM)GetTLV(&pResponse->MUXMsg.QMUXMsgHdr, 0x01);
+    pServingSystem = (PSERVING_SYSTEM)GetTLVSized(&pResponse->MUXMsg.QMUXMsgHdr, 0x01, offsetof(SERVING_SYSTEM, RadioIF));
+    if (pServingSystem && pServingSystem->InUseRadioIF
+        && le16_to_cpu(pServingSystem->TLVLength) + sizeof(QMI_TLV_HDR) < offsetof(SERVING_SYSTEM, RadioIF) + pServingSystem->InUseRadioIF)
+        pServingSystem = NULL;
     if (pServingSystem) {
     //Packet-switched domain attach state of the mobile.
     //0x00    PS_UNKNOWN ?Unknown or not applicable
@@ -1681,7 +2120,10 @@ static int requestRegistrationState(UCHAR *pPSAttachedState) {
         }
     }
 
-    pDataCap = (PQMINAS_DATA_CAP)GetTLV(&pResponse->MUXMsg.QMUXMsgHdr, 0x11);
+    pDataCap = (PQMINAS_DATA_CAP)GetTLVSized(&pResponse->MUXMsg.QMUXMsgHdr, 0x11, offsetof(QMINAS_DATA_CAP, DataCap));
+    if (pDataCap
+        && le16_to_cpu(pDataCap->TLVLength) + sizeof(QMI_TLV_HDR) < offsetof(QMINAS_DATA_CAP, DataCap) + pDataCap->DataCapListLen)
+        pDataCap = NULL;
     if (pDataCap && pDataCap->DataCapListLen) {
         UCHAR *DataCap = &pDataCap->DataCap;
         if (pDataCap->DataCapListLen == 2) {
@@ -1719,7 +2161,7 @@ static int requestRegistrationState(UCHAR *pPSAttachedState) {
             quectel_convert_cdma_mnc_2_ascii_mnc(&MobileNetworkCode, cdma_mnc);
         }
         if (1) {
-            PQCQMUX_TLV pTLV = (PQCQMUX_TLV)GetTLV(&pResponse->MUXMsg.QMUXMsgHdr, 0x23);
+            PQCQMUX_TLV pTLV = GetTLVTyped(&pResponse->MUXMsg.QMUXMsgHdr, 0x23, PQCQMUX_TLV);
             if (pTLV)
                 s_hdr_personality = pTLV->Value;
             else
@@ -1731,27 +2173,59 @@ static int requestRegistrationState(UCHAR *pPSAttachedState) {
 
     dbg_time("%s MCC: %d, MNC: %d, PS: %s, DataCap: %s", __func__,
         MobileCountryCode, MobileNetworkCode, (*pPSAttachedState == 1) ? "Attached" : "Detached" , pDataCapStr);
+    metric_set_registration(pServingSystem && pServingSystem->RegistrationState == 0x01, *pPSAttachedState, pDataCapStr);
 
-    free(pResponse);
+    qmi_msg_free(pResponse);
 
     return 0;
 }
 
-static int requestQueryDataCall(UCHAR  *pConnectionStatus, int curIpFamily) {
+/* Ask the modem to report what SIG_EVENT_CHECK otherwise has to poll for:
+ * signal strength crossing a threshold (NAS) and data bearer changes (WDS).
+ * Packet service status and sys-info indications are sent without asking. */
+static int requestRegisterIndications(PROFILE_T *profile) {
+    PQCQMIMSG pRequest;
+    PQCQMIMSG pResponse;
+    PQMUX_MSG pMUXMsg;
+    PROFILE_T *pdn;
+    int err;
+
+    pRequest = ComposeQMUXMsg(QMUX_TYPE_NAS, QMINAS_SET_EVENT_REPORT_REQ, NasSetEventReportReq, NULL);
+    err = QmiThreadSendQMI(pRequest, &pResponse);
+    qmi_rsp_check_and_return();
+    qmi_msg_free(pResponse);
+
+    for (pdn = profile; pdn; pdn = pdn->next_pdn) {
+        pRequest = ComposeWdsMsg(pdn, IpFamilyV4, QMIWDS_SET_EVENT_REPORT_REQ, WdsSetEventReportReq, NULL);
+        err = QmiThreadSendQMI(pRequest, &pResponse);
+        qmi_rsp_check_and_return();
+        qmi_msg_free(pResponse);
+
+        if (pdn->enable_ipv6) {
+            pRequest = ComposeWdsMsg(pdn, IpFamilyV6, QMIWDS_SET_EVENT_REPORT_REQ, WdsSetEventReportReq, NULL);
+            err = QmiThreadSendQMI(pRequest, &pResponse);
+            qmi_rsp_check_and_return();
+            qmi_msg_free(pResponse);
+        }
+    }
+
+    return 0;
+}
+
+static int requestQueryDataCall(PROFILE_T *profile, UCHAR  *pConnectionStatus, int curIpFamily) {
     PQCQMIMSG pRequest;
     PQCQMIMSG pResponse;
     PQMUX_MSG pMUXMsg;
     int err;
     PQMIWDS_PKT_SRVC_TLV pPktSrvc;
     UCHAR oldConnectionStatus = *pConnectionStatus;
-    UCHAR QMIType = (curIpFamily == IpFamilyV4) ? QMUX_TYPE_WDS : QMUX_TYPE_WDS_IPV6;
 
-    pRequest = ComposeQMUXMsg(QMIType, QMIWDS_GET_PKT_SRVC_STATUS_REQ, NULL, NULL);
+    pRequest = ComposeWdsMsg(profile, curIpFamily, QMIWDS_GET_PKT_SRVC_STATUS_REQ, NULL, NULL);
     err = QmiThreadSendQMI(pRequest, &pResponse);
     qmi_rsp_check_and_return();
 
     *pConnectionStatus = QWDS_PKT_DATA_DISCONNECTED;
-    pPktSrvc = (PQMIWDS_PKT_SRVC_TLV)GetTLV(&pResponse->MUXMsg.QMUXMsgHdr, 0x01);
+    pPktSrvc = GetTLVTyped(&pResponse->MUXMsg.QMUXMsgHdr, 0x01, PQMIWDS_PKT_SRVC_TLV);
     if (pPktSrvc) {
         *pConnectionStatus = pPktSrvc->ConnectionStatus;
         if ((le16_to_cpu(pPktSrvc->TLVLength) == 2) && (pPktSrvc->ReconfigReqd == 0x01))
@@ -1760,44 +2234,45 @@ static int requestQueryDataCall(UCHAR  *pConnectionStatus, int curIpFamily) {
 
     if (*pConnectionStatus == QWDS_PKT_DATA_DISCONNECTED) {
         if (curIpFamily == IpFamilyV4)
-            WdsConnectionIPv4Handle = 0;
+            profile->WdsConnectionIPv4Handle = 0;
         else
-            WdsConnectionIPv6Handle = 0;
+            profile->WdsConnectionIPv6Handle = 0;
     }
 
     if (oldConnectionStatus != *pConnectionStatus || debug_qmi) {
-        dbg_time("%s %sConnectionStatus: %s", __func__, (curIpFamily == IpFamilyV4) ? "IPv4" : "IPv6",
+        dbg_time("%s pdn-%d %sConnectionStatus: %s", __func__, profile->pdp, (curIpFamily == IpFamilyV4) ? "IPv4" : "IPv6",
             (*pConnectionStatus == QWDS_PKT_DATA_CONNECTED) ? "CONNECTED" : "DISCONNECTED");
     }
 
-    free(pResponse);
+    qmi_msg_free(pResponse);
     return 0;
 }
 
-static int requestSetupDataCall(PROFILE_T *profile, int curIpFamily) {
+static int requestSetupDataCall(PROFILE_T *profile, int curIpFamily, int auth) {
     PQCQMIMSG pRequest;
     PQCQMIMSG pResponse;
     PQMUX_MSG pMUXMsg;
     int err = 0;
-    UCHAR QMIType = (curIpFamily == IpFamilyV4) ? QMUX_TYPE_WDS : QMUX_TYPE_WDS_IPV6;
+    WDS_START_NW_ARG start = {profile, curIpFamily, auth};
 
 //DualIPSupported means can get ipv4 & ipv6 address at the same time, one wds for ipv4, the other wds for ipv6
-    profile->curIpFamily = curIpFamily;
-    pRequest = ComposeQMUXMsg(QMIType, QMIWDS_START_NETWORK_INTERFACE_REQ, WdsStartNwInterfaceReq, profile);
+    pRequest = ComposeWdsMsg(profile, curIpFamily, QMIWDS_START_NETWORK_INTERFACE_REQ, WdsStartNwInterfaceReq, &start);
     err = QmiThreadSendQMITimeout(pRequest, &pResponse, 120 * 1000, __func__);
     qmi_rsp_check();
 
     if (le16_to_cpu(pMUXMsg->QMUXMsgHdrResp.QMUXResult) || le16_to_cpu(pMUXMsg->QMUXMsgHdrResp.QMUXError)) {
         PQMI_TLV_HDR pTLVHdr;
+        const char *family = curIpFamily == IpFamilyV4 ? "ipv4" : "ipv6";
 
-        pTLVHdr = GetTLV(&pResponse->MUXMsg.QMUXMsgHdr, 0x10);
+        pTLVHdr = GetTLVSized(&pResponse->MUXMsg.QMUXMsgHdr, 0x10, sizeof(QMI_TLV_HDR) + 2);
         if (pTLVHdr) {
             uint16_t *data16 = (uint16_t *)(pTLVHdr+1);
             uint16_t call_end_reason = le16_to_cpu(data16[0]);
             dbg_time("call_end_reason is %d", call_end_reason);
+            metric_inc(METRIC_CALL_END, "reason=\"%u\"", call_end_reason);
         }
 
-        pTLVHdr = GetTLV(&pResponse->MUXMsg.QMUXMsgHdr, 0x11);
+        pTLVHdr = GetTLVSized(&pResponse->MUXMsg.QMUXMsgHdr, 0x11, sizeof(QMI_TLV_HDR) + 4);
         if (pTLVHdr) {
             uint16_t *data16 = (uint16_t *)(pTLVHdr+1);
             uint16_t call_end_reason_type = le16_to_cpu(data16[0]);
@@ -1805,21 +2280,24 @@ static int requestSetupDataCall(PROFILE_T *profile, int curIpFamily) {
 
             dbg_time("call_end_reason_type is %d", call_end_reason_type);
             dbg_time("call_end_reason_verbose is %d", verbose_call_end_reason);
+            metric_set(METRIC_CALL_END_REASON, verbose_call_end_reason, "pdn=\"%d\",family=\"%s\",type=\"%u\"",
+                profile->pdp, family, call_end_reason_type);
         }
 
-        free(pResponse);
-        return le16_to_cpu(pMUXMsg->QMUXMsgHdrResp.QMUXError);
+        err = le16_to_cpu(pMUXMsg->QMUXMsgHdrResp.QMUXError);
+        qmi_msg_free(pResponse);
+        return err;
     }
 
     if (curIpFamily == IpFamilyV4) {
-        WdsConnectionIPv4Handle = le32_to_cpu(pResponse->MUXMsg.StartNwInterfaceResp.Handle);
-        dbg_time("%s WdsConnectionIPv4Handle: 0x%08x", __func__, WdsConnectionIPv4Handle);
+        profile->WdsConnectionIPv4Handle = le32_to_cpu(pResponse->MUXMsg.StartNwInterfaceResp.Handle);
+        dbg_time("%s WdsConnectionIPv4Handle: 0x%08x", __func__, profile->WdsConnectionIPv4Handle);
     } else {
-        WdsConnectionIPv6Handle = le32_to_cpu(pResponse->MUXMsg.StartNwInterfaceResp.Handle);
-        dbg_time("%s WdsConnectionIPv6Handle: 0x%08x", __func__, WdsConnectionIPv6Handle);
+        profile->WdsConnectionIPv6Handle = le32_to_cpu(pResponse->MUXMsg.StartNwInterfaceResp.Handle);
+        dbg_time("%s WdsConnectionIPv6Handle: 0x%08x", __func__, profile->WdsConnectionIPv6Handle);
     }
 
-    free(pResponse);
+    qmi_msg_free(pResponse);
 
     return 0;
 }
@@ -1829,25 +2307,19 @@ static int requestDeactivateDefaultPDP(PROFILE_T *profile, int curIpFamily) {
     PQCQMIMSG pResponse;
     PQMUX_MSG pMUXMsg;
     int err;
-    UCHAR QMIType = (curIpFamily == 0x04) ? QMUX_TYPE_WDS : QMUX_TYPE_WDS_IPV6;
+    uint32_t *pHandle = (curIpFamily == IpFamilyV4) ? &profile->WdsConnectionIPv4Handle : &profile->WdsConnectionIPv6Handle;
 
-    (void)profile;
-    if (curIpFamily == IpFamilyV4 && WdsConnectionIPv4Handle == 0)
-        return 0;
-    if (curIpFamily == IpFamilyV6 && WdsConnectionIPv6Handle == 0)
+    if (*pHandle == 0)
         return 0;
 
     dbg_time("%s WdsConnectionIPv%dHandle", __func__, curIpFamily == IpFamilyV4 ? 4 : 6);
 
-    pRequest = ComposeQMUXMsg(QMIType, QMIWDS_STOP_NETWORK_INTERFACE_REQ , WdsStopNwInterfaceReq, &curIpFamily);
+    pRequest = ComposeWdsMsg(profile, curIpFamily, QMIWDS_STOP_NETWORK_INTERFACE_REQ , WdsStopNwInterfaceReq, pHandle);
     err = QmiThreadSendQMI(pRequest, &pResponse);
     qmi_rsp_check_and_return();
 
-    if (curIpFamily == IpFamilyV4)
-        WdsConnectionIPv4Handle = 0;
-    else
-         WdsConnectionIPv6Handle = 0;
-    free(pResponse);
+    *pHandle = 0;
+    qmi_msg_free(pResponse);
     return 0;
 }
 
@@ -1861,25 +2333,27 @@ static int requestGetIPAddress(PROFILE_T *profile, int curIpFamily) {
     PQMIWDS_GET_RUNTIME_SETTINGS_TLV_MTU pMtu;
     IPV4_T *pIpv4 = &profile->ipv4;
     IPV6_T *pIpv6 = &profile->ipv6;
-    UCHAR QMIType = (curIpFamily == 0x04) ? QMUX_TYPE_WDS : QMUX_TYPE_WDS_IPV6;
     PQMIWDS_GET_RUNNING_SETTINGS_PCSCF_IPV6_ADDR pPCSCFIpv6Addr;
 	PQMIWDS_GET_RUNNING_SETTINGS_PCSCF_IPV4_ADDR pPCSCFIpv4Addr;
 
     if (curIpFamily == IpFamilyV4) {
         memset(pIpv4, 0x00, sizeof(IPV4_T));
-        if (WdsConnectionIPv4Handle == 0)
+        if (profile->WdsConnectionIPv4Handle == 0)
             return 0;
     } else if (curIpFamily == IpFamilyV6) {
         memset(pIpv6, 0x00, sizeof(IPV6_T));
-        if (WdsConnectionIPv6Handle == 0)
+        if (profile->WdsConnectionIPv6Handle == 0)
             return 0;
     }
 
-    pRequest = ComposeQMUXMsg(QMIType, QMIWDS_GET_RUNTIME_SETTINGS_REQ, WdsGetRuntimeSettingReq, NULL);
+    pRequest = ComposeWdsMsg(profile, curIpFamily, QMIWDS_GET_RUNTIME_SETTINGS_REQ, WdsGetRuntimeSettingReq, NULL);
     err = QmiThreadSendQMI(pRequest, &pResponse);
     qmi_rsp_check_and_return();
 
-	pPCSCFIpv6Addr = (PQMIWDS_GET_RUNNING_SETTINGS_PCSCF_IPV6_ADDR)GetTLV(&pResponse->MUXMsg.QMUXMsgHdr, 0x2e);    // 0x2e - pcscf ipv6 address 
+	pPCSCFIpv6Addr = GetTLVTyped(&pResponse->MUXMsg.QMUXMsgHdr, 0x2e, PQMIWDS_GET_RUNNING_SETTINGS_PCSCF_IPV6_ADDR);    // 0x2e - pcscf ipv6 address 
+	if (pPCSCFIpv6Addr && le16_to_cpu(pPCSCFIpv6Addr->TLVLength) + sizeof(QMI_TLV_HDR)
+        < sizeof(*pPCSCFIpv6Addr) + pPCSCFIpv6Addr->PCSCFNumber * 16)
+        pPCSCFIpv6Addr = NULL;
 	if (pPCSCFIpv6Addr) {
     	if (pPCSCFIpv6Addr->PCSCFNumber == 1) {
         	UCHAR *PCSCFIpv6Addr1 = (UCHAR *)(pPCSCFIpv6Addr + 1);
@@ -1892,7 +2366,10 @@ static int requestGetIPAddress(PROFILE_T *profile, int curIpFamily) {
         }
     }
     
-	pPCSCFIpv4Addr = (PQMIWDS_GET_RUNNING_SETTINGS_PCSCF_IPV4_ADDR)GetTLV(&pResponse->MUXMsg.QMUXMsgHdr, 0x23);    // 0x23 - pcscf ipv4 address 
+	pPCSCFIpv4Addr = GetTLVTyped(&pResponse->MUXMsg.QMUXMsgHdr, 0x23, PQMIWDS_GET_RUNNING_SETTINGS_PCSCF_IPV4_ADDR);    // 0x23 - pcscf ipv4 address 
+	if (pPCSCFIpv4Addr && le16_to_cpu(pPCSCFIpv4Addr->TLVLength) + sizeof(QMI_TLV_HDR)
+        < sizeof(*pPCSCFIpv4Addr) + pPCSCFIpv4Addr->PCSCFNumber * 4)
+        pPCSCFIpv4Addr = NULL;
 	if (pPCSCFIpv4Addr) {
     	if (pPCSCFIpv4Addr->PCSCFNumber == 1) {
         	UCHAR *PCSCFIpv4Addr1 = (UCHAR *)(pPCSCFIpv4Addr + 1);
@@ -1905,54 +2382,56 @@ static int requestGetIPAddress(PROFILE_T *profile, int curIpFamily) {
         }
     }
 
-    pIpv4Addr = (PQMIWDS_GET_RUNTIME_SETTINGS_TLV_IPV4_ADDR)GetTLV(&pResponse->MUXMsg.QMUXMsgHdr, QMIWDS_GET_RUNTIME_SETTINGS_TLV_TYPE_IPV4PRIMARYDNS);
+    pIpv4Addr = GetTLVTyped(&pResponse->MUXMsg.QMUXMsgHdr, QMIWDS_GET_RUNTIME_SETTINGS_TLV_TYPE_IPV4PRIMARYDNS, PQMIWDS_GET_RUNTIME_SETTINGS_TLV_IPV4_ADDR);
     if (pIpv4Addr) {
         pIpv4->DnsPrimary = pIpv4Addr->IPV4Address;
     }
 
-    pIpv4Addr = (PQMIWDS_GET_RUNTIME_SETTINGS_TLV_IPV4_ADDR)GetTLV(&pResponse->MUXMsg.QMUXMsgHdr, QMIWDS_GET_RUNTIME_SETTINGS_TLV_TYPE_IPV4SECONDARYDNS);
+    pIpv4Addr = GetTLVTyped(&pResponse->MUXMsg.QMUXMsgHdr, QMIWDS_GET_RUNTIME_SETTINGS_TLV_TYPE_IPV4SECONDARYDNS, PQMIWDS_GET_RUNTIME_SETTINGS_TLV_IPV4_ADDR);
     if (pIpv4Addr) {
         pIpv4->DnsSecondary = pIpv4Addr->IPV4Address;
     }
 
-    pIpv4Addr = (PQMIWDS_GET_RUNTIME_SETTINGS_TLV_IPV4_ADDR)GetTLV(&pResponse->MUXMsg.QMUXMsgHdr, QMIWDS_GET_RUNTIME_SETTINGS_TLV_TYPE_IPV4GATEWAY);
+    pIpv4Addr = GetTLVTyped(&pResponse->MUXMsg.QMUXMsgHdr, QMIWDS_GET_RUNTIME_SETTINGS_TLV_TYPE_IPV4GATEWAY, PQMIWDS_GET_RUNTIME_SETTINGS_TLV_IPV4_ADDR);
     if (pIpv4Addr) {
         pIpv4->Gateway = pIpv4Addr->IPV4Address;
     }
 
-    pIpv4Addr = (PQMIWDS_GET_RUNTIME_SETTINGS_TLV_IPV4_ADDR)GetTLV(&pResponse->MUXMsg.QMUXMsgHdr, QMIWDS_GET_RUNTIME_SETTINGS_TLV_TYPE_IPV4SUBNET);
+    pIpv4Addr = GetTLVTyped(&pResponse->MUXMsg.QMUXMsgHdr, QMIWDS_GET_RUNTIME_SETTINGS_TLV_TYPE_IPV4SUBNET, PQMIWDS_GET_RUNTIME_SETTINGS_TLV_IPV4_ADDR);
     if (pIpv4Addr) {
         pIpv4->SubnetMask = pIpv4Addr->IPV4Address;
     }
 
-    pIpv4Addr = (PQMIWDS_GET_RUNTIME_SETTINGS_TLV_IPV4_ADDR)GetTLV(&pResponse->MUXMsg.QMUXMsgHdr, QMIWDS_GET_RUNTIME_SETTINGS_TLV_TYPE_IPV4);
+    pIpv4Addr = GetTLVTyped(&pResponse->MUXMsg.QMUXMsgHdr, QMIWDS_GET_RUNTIME_SETTINGS_TLV_TYPE_IPV4, PQMIWDS_GET_RUNTIME_SETTINGS_TLV_IPV4_ADDR);
     if (pIpv4Addr) {
         pIpv4->Address = pIpv4Addr->IPV4Address;
     }
 
-    pIpv6Addr = (PQMIWDS_GET_RUNTIME_SETTINGS_TLV_IPV6_ADDR)GetTLV(&pResponse->MUXMsg.QMUXMsgHdr, QMIWDS_GET_RUNTIME_SETTINGS_TLV_TYPE_IPV6PRIMARYDNS);
+    pIpv6Addr = (PQMIWDS_GET_RUNTIME_SETTINGS_TLV_IPV6_ADDR)GetTLVSized(&pResponse->MUXMsg.QMUXMsgHdr, QMIWDS_GET_RUNTIME_SETTINGS_TLV_TYPE_IPV6PRIMARYDNS,
+        offsetof(QMIWDS_GET_RUNTIME_SETTINGS_TLV_IPV6_ADDR, PrefixLength)); //no prefix length for dns
     if (pIpv6Addr) {
         memcpy(pIpv6->DnsPrimary, pIpv6Addr->IPV6Address, 16);
     }
 
-    pIpv6Addr = (PQMIWDS_GET_RUNTIME_SETTINGS_TLV_IPV6_ADDR)GetTLV(&pResponse->MUXMsg.QMUXMsgHdr, QMIWDS_GET_RUNTIME_SETTINGS_TLV_TYPE_IPV6SECONDARYDNS);
+    pIpv6Addr = (PQMIWDS_GET_RUNTIME_SETTINGS_TLV_IPV6_ADDR)GetTLVSized(&pResponse->MUXMsg.QMUXMsgHdr, QMIWDS_GET_RUNTIME_SETTINGS_TLV_TYPE_IPV6SECONDARYDNS,
+        offsetof(QMIWDS_GET_RUNTIME_SETTINGS_TLV_IPV6_ADDR, PrefixLength)); //no prefix length for dns
     if (pIpv6Addr) {
         memcpy(pIpv6->DnsSecondary, pIpv6Addr->IPV6Address, 16);
     }
 
-    pIpv6Addr = (PQMIWDS_GET_RUNTIME_SETTINGS_TLV_IPV6_ADDR)GetTLV(&pResponse->MUXMsg.QMUXMsgHdr, QMIWDS_GET_RUNTIME_SETTINGS_TLV_TYPE_IPV6GATEWAY);
+    pIpv6Addr = GetTLVTyped(&pResponse->MUXMsg.QMUXMsgHdr, QMIWDS_GET_RUNTIME_SETTINGS_TLV_TYPE_IPV6GATEWAY, PQMIWDS_GET_RUNTIME_SETTINGS_TLV_IPV6_ADDR);
     if (pIpv6Addr) {
         memcpy(pIpv6->Gateway, pIpv6Addr->IPV6Address, 16);
         pIpv6->PrefixLengthGateway = pIpv6Addr->PrefixLength;
     }
 
-    pIpv6Addr = (PQMIWDS_GET_RUNTIME_SETTINGS_TLV_IPV6_ADDR)GetTLV(&pResponse->MUXMsg.QMUXMsgHdr, QMIWDS_GET_RUNTIME_SETTINGS_TLV_TYPE_IPV6);
+    pIpv6Addr = GetTLVTyped(&pResponse->MUXMsg.QMUXMsgHdr, QMIWDS_GET_RUNTIME_SETTINGS_TLV_TYPE_IPV6, PQMIWDS_GET_RUNTIME_SETTINGS_TLV_IPV6_ADDR);
     if (pIpv6Addr) {
         memcpy(pIpv6->Address, pIpv6Addr->IPV6Address, 16);
         pIpv6->PrefixLengthIPAddr = pIpv6Addr->PrefixLength;
     }
 
-    pMtu = (PQMIWDS_GET_RUNTIME_SETTINGS_TLV_MTU)GetTLV(&pResponse->MUXMsg.QMUXMsgHdr, QMIWDS_GET_RUNTIME_SETTINGS_TLV_TYPE_MTU);
+    pMtu = GetTLVTyped(&pResponse->MUXMsg.QMUXMsgHdr, QMIWDS_GET_RUNTIME_SETTINGS_TLV_TYPE_MTU, PQMIWDS_GET_RUNTIME_SETTINGS_TLV_MTU);
     if (pMtu) {
         if (curIpFamily == IpFamilyV4)
             pIpv4->Mtu =  le32_to_cpu(pMtu->Mtu);
@@ -1960,7 +2439,7 @@ static int requestGetIPAddress(PROFILE_T *profile, int curIpFamily) {
             pIpv6->Mtu =  le32_to_cpu(pMtu->Mtu);
     }
 
-    free(pResponse);
+    qmi_msg_free(pResponse);
     return 0;
 }
 
@@ -1979,7 +2458,7 @@ static int requestSetProfile(PROFILE_T *profile) {
     err = QmiThreadSendQMI(pRequest, &pResponse);
     qmi_rsp_check_and_return();
 
-    free(pResponse);
+    qmi_msg_free(pResponse);
     return 0;
 }
 
@@ -2007,7 +2486,7 @@ static int requestGetProfile(PROFILE_T *profile) {
     pApnName = (PQMIWDS_APNNAME)GetTLV(&pResponse->MUXMsg.QMUXMsgHdr, 0x14);
     pUserName = (PQMIWDS_USERNAME)GetTLV(&pResponse->MUXMsg.QMUXMsgHdr, 0x1B);
     pPassWd = (PQMIWDS_PASSWD)GetTLV(&pResponse->MUXMsg.QMUXMsgHdr, 0x1C);
-    pAuthPref = (PQMIWDS_AUTH_PREFERENCE)GetTLV(&pResponse->MUXMsg.QMUXMsgHdr, 0x1D);
+    pAuthPref = GetTLVTyped(&pResponse->MUXMsg.QMUXMsgHdr, 0x1D, PQMIWDS_AUTH_PREFERENCE);
 
     if (pApnName/* && le16_to_cpu(pApnName->TLVLength)*/)
         apn = strndup((const char *)(&pApnName->ApnName), le16_to_cpu(pApnName->TLVLength));
@@ -2030,7 +2509,7 @@ static int requestGetProfile(PROFILE_T *profile) {
 
     dbg_time("%s[%d] %s/%s/%s/%d", __func__, profile->pdp, apn, user, password, auth);
 
-    free(pResponse);
+    qmi_msg_free(pResponse);
     return 0;
 }
 #endif
@@ -2038,10 +2517,8 @@ static int requestGetProfile(PROFILE_T *profile) {
 
 static void map_active_band (USHORT activeBand)
 {
-    char shell_cmd[128];
     if (activeBand <= 19) {
-        snprintf(shell_cmd, sizeof(shell_cmd), "echo CDMA:%d > /tmp/lteMode", activeBand);
-        system(shell_cmd);
+        ql_status_set(QL_STATUS_MODE, "CDMA:%d", activeBand);
         return;
     }
     if ((activeBand <= 39) || ((activeBand > 48) && (activeBand <= 79))) {
@@ -2072,8 +2549,7 @@ static void map_active_band (USHORT activeBand)
     // 90 => 'WCDMA 1500 (Japan)',
     // 91 => 'WCDMA 850 (Japan)',
     //if (activeBand == 47) {
-        //nprintf(shell_cmd, sizeof(shell_cmd), "echo GSM1800:%d > /tmp/lteMode", activeBand);
-        //system(shell_cmd);
+        //ql_status_set(QL_STATUS_MODE, "GSM1800:%d", activeBand);
         //return;
     //}
     
@@ -2085,13 +2561,12 @@ static void map_active_band (USHORT activeBand)
         if (activeBand > 146) band += 2; // and have a whole for band  22 and 23
         if (activeBand > 148) band += 15; // and up to 41 again after 25..
         if (band >= 34 && band <= 53) {
-            snprintf(shell_cmd, sizeof(shell_cmd), "echo 'Mode: TDD LTE; Band: LTE BAND %d' > /tmp/lteMode", band);
+            ql_status_set(QL_STATUS_MODE, "Mode: TDD LTE; Band: LTE BAND %d", band);
         } else if (band == 29 || band == 32 || band == 67 || band == 69 || band == 75 || band == 76){
-            snprintf(shell_cmd, sizeof(shell_cmd), "echo 'Mode: SDL LTE; Band: LTE BAND %d' > /tmp/lteMode", band);
+            ql_status_set(QL_STATUS_MODE, "Mode: SDL LTE; Band: LTE BAND %d", band);
         } else {
-            snprintf(shell_cmd, sizeof(shell_cmd), "echo 'Mode: FDD LTE; Band: LTE BAND %d' > /tmp/lteMode", band);
+            ql_status_set(QL_STATUS_MODE, "Mode: FDD LTE; Band: LTE BAND %d", band);
         }
-        system(shell_cmd);
         dbg_time("%s band is %d", __func__, band);
         return;
     }
@@ -2109,9 +2584,10 @@ static int requestGetBandCap(void)
     pRequest = ComposeQMUXMsg(QMUX_TYPE_DMS, QMIDMS_GET_BAND_CAP_REQ, NULL, NULL);
     err = QmiThreadSendQMI(pRequest, &pResponse);
     qmi_rsp_check_and_return();
-    PQMIDMS_GET_BAND_CAP ptlv1 = (PQMIDMS_GET_BAND_CAP)GetTLV(&pResponse->MUXMsg.QMUXMsgHdr, 0x01);
-    free(pResponse);
-    dbg_time("%s BandCap: [0x%X]\n", __func__, ptlv1->BandCap);
+    PQMIDMS_GET_BAND_CAP ptlv1 = GetTLVTyped(&pResponse->MUXMsg.QMUXMsgHdr, 0x01, PQMIDMS_GET_BAND_CAP);
+    if (ptlv1)
+        dbg_time("%s BandCap: [0x%X]\n", __func__, ptlv1->BandCap);
+    qmi_msg_free(pResponse);
     return 0;
 }
 
@@ -2126,12 +2602,15 @@ static int requestGetRfBandInfo(void)
     pRequest = ComposeQMUXMsg(QMUX_TYPE_NAS, QMINAS_GET_RF_BAND_INFO_REQ, NULL, NULL);
     err = QmiThreadSendQMI(pRequest, &pResponse);
     qmi_rsp_check_and_return();
-    PQMINASRF_BAND_INFO ptlv = (PQMINASRF_BAND_INFO)GetTLV(&pResponse->MUXMsg.QMUXMsgHdr, 0x01);
+    PQMINASRF_BAND_INFO ptlv = GetTLVTyped(&pResponse->MUXMsg.QMUXMsgHdr, 0x01, PQMINASRF_BAND_INFO);
 
-    dbg_time("%s: NumInstances=%d, RadioIf=%d (%s), ActiveBand=%d, ActiveChannel=%d, TLVType=0x%02X, TLVLength=%d\n", 
-              __func__, ptlv->NumInstances, ptlv->RadioIf, Radio_If[ptlv->RadioIf], ptlv->ActiveBand, ptlv->ActiveChannel, ptlv->TLVType, ptlv->TLVLength);
-    map_active_band(ptlv->ActiveBand);
-    free(pResponse);
+    if (ptlv) {
+        dbg_time("%s: NumInstances=%d, RadioIf=%d (%s), ActiveBand=%d, ActiveChannel=%d, TLVType=0x%02X, TLVLength=%d\n", 
+              __func__, ptlv->NumInstances, ptlv->RadioIf, ptlv->RadioIf < sizeof(Radio_If)/sizeof(Radio_If[0]) ? Radio_If[ptlv->RadioIf] : "UNKNOW",
+              ptlv->ActiveBand, ptlv->ActiveChannel, ptlv->TLVType, ptlv->TLVLength);
+        map_active_band(ptlv->ActiveBand);
+    }
+    qmi_msg_free(pResponse);
     
     requestGetBandCap();
     return 0;
@@ -2151,7 +2630,7 @@ static int requestGetSignalStrength(void)
 
     dbg_time("%s: SigStrength =%d, RadioIf=%d (%s)\n", 
               __func__, ptlv->SigStrength, ptlv->RadioIf, Radio_If[ptlv->RadioIf]);
-    free(pResponse);
+    qmi_msg_free(pResponse);
     return 0;
 }
 
@@ -2160,7 +2639,6 @@ static int requestGetSignalInfo(void)
     PQCQMIMSG pRequest;
     PQCQMIMSG pResponse;
     PQMUX_MSG pMUXMsg;
-    char shell_cmd[128];
     int err;
     
 
@@ -2168,61 +2646,77 @@ static int requestGetSignalInfo(void)
     err = QmiThreadSendQMI(pRequest, &pResponse);
     qmi_rsp_check_and_return();
 
-    
+    //only the rats reported this time are exported
+    metric_clear(METRIC_SIGNAL_RSSI);
+    metric_clear(METRIC_SIGNAL_RSRQ);
+    metric_clear(METRIC_SIGNAL_RSRP);
+    metric_clear(METRIC_SIGNAL_SNR);
+    metric_clear(METRIC_SIGNAL_ECIO);
+
     // CDMA
     {
-        PQMINAS_SIG_INFO_CDMA_TLV_MSG ptlv = (PQMINAS_SIG_INFO_CDMA_TLV_MSG)GetTLV(&pResponse->MUXMsg.QMUXMsgHdr, 0x10);
+        PQMINAS_SIG_INFO_CDMA_TLV_MSG ptlv = GetTLVTyped(&pResponse->MUXMsg.QMUXMsgHdr, 0x10, PQMINAS_SIG_INFO_CDMA_TLV_MSG);
         if (ptlv && ptlv->TLVLength)
         {
             dbg_time("%s CDMA: RSSI %d dBm, ECIO %.1lf dBm", __func__,
                 ptlv->rssi, (-0.5) * (double)ptlv->ecio);
+            metric_set(METRIC_SIGNAL_RSSI, ptlv->rssi, "rat=\"cdma\"");
+            metric_set(METRIC_SIGNAL_ECIO, (-0.5) * (double)ptlv->ecio, "rat=\"cdma\"");
         }
     }
 
     // HDR
     {
-        PQMINAS_SIG_INFO_HDR_TLV_MSG ptlv = (PQMINAS_SIG_INFO_HDR_TLV_MSG)GetTLV(&pResponse->MUXMsg.QMUXMsgHdr, 0x11);
+        PQMINAS_SIG_INFO_HDR_TLV_MSG ptlv = GetTLVTyped(&pResponse->MUXMsg.QMUXMsgHdr, 0x11, PQMINAS_SIG_INFO_HDR_TLV_MSG);
         if (ptlv && ptlv->TLVLength)
         {
             dbg_time("%s HDR: RSSI %d dBm, ECIO %.1lf dBm, IO %d dBm", __func__,
                 ptlv->rssi, (-0.5) * (double)ptlv->ecio, ptlv->io);
+            metric_set(METRIC_SIGNAL_RSSI, ptlv->rssi, "rat=\"hdr\"");
+            metric_set(METRIC_SIGNAL_ECIO, (-0.5) * (double)ptlv->ecio, "rat=\"hdr\"");
         }
     }
 
     // GSM
     {
-        PQMINAS_SIG_INFO_GSM_TLV_MSG ptlv = (PQMINAS_SIG_INFO_GSM_TLV_MSG)GetTLV(&pResponse->MUXMsg.QMUXMsgHdr, 0x12);
+        PQMINAS_SIG_INFO_GSM_TLV_MSG ptlv = GetTLVTyped(&pResponse->MUXMsg.QMUXMsgHdr, 0x12, PQMINAS_SIG_INFO_GSM_TLV_MSG);
         if (ptlv && ptlv->TLVLength)
         {
             dbg_time("%s GSM: RSSI %d dBm", __func__, ptlv->rssi);
+            metric_set(METRIC_SIGNAL_RSSI, ptlv->rssi, "rat=\"gsm\"");
         }
     }
 
     // WCDMA
     {
-        PQMINAS_SIG_INFO_WCDMA_TLV_MSG ptlv = (PQMINAS_SIG_INFO_WCDMA_TLV_MSG)GetTLV(&pResponse->MUXMsg.QMUXMsgHdr, 0x13);
+        PQMINAS_SIG_INFO_WCDMA_TLV_MSG ptlv = GetTLVTyped(&pResponse->MUXMsg.QMUXMsgHdr, 0x13, PQMINAS_SIG_INFO_WCDMA_TLV_MSG);
         if (ptlv && ptlv->TLVLength)
         {
             dbg_time("%s WCDMA: RSSI %d dBm, ECIO %.1lf dBm", __func__,
                 ptlv->rssi, (-0.5) * (double)ptlv->ecio);
+            metric_set(METRIC_SIGNAL_RSSI, ptlv->rssi, "rat=\"wcdma\"");
+            metric_set(METRIC_SIGNAL_ECIO, (-0.5) * (double)ptlv->ecio, "rat=\"wcdma\"");
         }
     }
 
     // LTE
     {
-        PQMINAS_SIG_INFO_LTE_TLV_MSG ptlv = (PQMINAS_SIG_INFO_LTE_TLV_MSG)GetTLV(&pResponse->MUXMsg.QMUXMsgHdr, 0x14);
+        PQMINAS_SIG_INFO_LTE_TLV_MSG ptlv = GetTLVTyped(&pResponse->MUXMsg.QMUXMsgHdr, 0x14, PQMINAS_SIG_INFO_LTE_TLV_MSG);
         if (ptlv && ptlv->TLVLength)
         {
             dbg_time("%s LTE: RSSI %d dBm, RSRQ %d dB, RSRP %d dBm, SNR %.1lf dB", __func__,
                 ptlv->rssi, ptlv->rsrq, ptlv->rsrp, (0.1) * (double)ptlv->snr);
-            snprintf(shell_cmd, sizeof(shell_cmd), "echo %d > /tmp/lteRssi", ptlv->rssi);
-            system(shell_cmd);
+            ql_status_set_rssi(ptlv->rssi);
+            metric_set(METRIC_SIGNAL_RSSI, ptlv->rssi, "rat=\"lte\"");
+            metric_set(METRIC_SIGNAL_RSRQ, ptlv->rsrq, "rat=\"lte\"");
+            metric_set(METRIC_SIGNAL_RSRP, ptlv->rsrp, "rat=\"lte\"");
+            metric_set(METRIC_SIGNAL_SNR, (0.1) * (double)ptlv->snr, "rat=\"lte\"");
         }
     }
 
     // TDSCDMA
     {
-        PQMINAS_SIG_INFO_TDSCDMA_TLV_MSG ptlv = (PQMINAS_SIG_INFO_TDSCDMA_TLV_MSG)GetTLV(&pResponse->MUXMsg.QMUXMsgHdr, 0x15);
+        PQMINAS_SIG_INFO_TDSCDMA_TLV_MSG ptlv = GetTLVTyped(&pResponse->MUXMsg.QMUXMsgHdr, 0x15, PQMINAS_SIG_INFO_TDSCDMA_TLV_MSG);
         if (ptlv && ptlv->TLVLength)
         {
             dbg_time("%s LTE: RSCP %d dBm", __func__, ptlv->rscp);
@@ -2232,23 +2726,26 @@ static int requestGetSignalInfo(void)
     // 5G_NSA
     if (s_5g_type == WWAN_DATA_CLASS_5G_NSA)
     {
-        PQMINAS_SIG_INFO_5G_NSA_TLV_MSG ptlv = (PQMINAS_SIG_INFO_5G_NSA_TLV_MSG)GetTLV(&pResponse->MUXMsg.QMUXMsgHdr, 0x17);
+        PQMINAS_SIG_INFO_5G_NSA_TLV_MSG ptlv = GetTLVTyped(&pResponse->MUXMsg.QMUXMsgHdr, 0x17, PQMINAS_SIG_INFO_5G_NSA_TLV_MSG);
         if (ptlv && ptlv->TLVLength)
         {
             dbg_time("%s 5G_NSA: RSRP %d dBm, SNR %.1lf dB", __func__, ptlv->rsrp, (0.1) * (double)ptlv->snr);
+            metric_set(METRIC_SIGNAL_RSRP, ptlv->rsrp, "rat=\"nr5g_nsa\"");
+            metric_set(METRIC_SIGNAL_SNR, (0.1) * (double)ptlv->snr, "rat=\"nr5g_nsa\"");
         }
     }
 
     // 5G_SA
     if (s_5g_type == WWAN_DATA_CLASS_5G_SA)
     {
-        PQMINAS_SIG_INFO_5G_SA_TLV_MSG ptlv = (PQMINAS_SIG_INFO_5G_SA_TLV_MSG)GetTLV(&pResponse->MUXMsg.QMUXMsgHdr, 0x18);
+        PQMINAS_SIG_INFO_5G_SA_TLV_MSG ptlv = GetTLVTyped(&pResponse->MUXMsg.QMUXMsgHdr, 0x18, PQMINAS_SIG_INFO_5G_SA_TLV_MSG);
         if (ptlv && ptlv->TLVLength)
         {
             dbg_time("%s 5G_SA: NR5G_RSRQ %d dB", __func__, ptlv->nr5g_rsrq);
+            metric_set(METRIC_SIGNAL_RSRQ, ptlv->nr5g_rsrq, "rat=\"nr5g_sa\"");
         }
     }
-    free(pResponse);
+    qmi_msg_free(pResponse);
     
     //requestGetSignalStrength();
     
@@ -2264,7 +2761,6 @@ static int requestDeviceSerialNumber(void) { // GET IMEI
     PQMUX_MSG pMUXMsg;
     PQCTLV_DEVICE_SERIAL_NUMBER serialNumber;
     int err;
-    char shell_cmd[128];
     
     pRequest = ComposeQMUXMsg(QMUX_TYPE_DMS, QMIDMS_GET_DEVICE_SERIAL_NUMBERS_REQ, NULL, NULL);
     err = QmiThreadSendQMI(pRequest, &pResponse);
@@ -2274,11 +2770,10 @@ static int requestDeviceSerialNumber(void) { // GET IMEI
     {
         char *DeviceSerialNumber = strndup((const char *)(&serialNumber->SerialNumberString), le16_to_cpu(serialNumber->TLVLength));
         dbg_time("%s %s", __func__, DeviceSerialNumber);
-        snprintf(shell_cmd, sizeof(shell_cmd), "echo %s > /tmp/lteIMEI", DeviceSerialNumber);
-        system(shell_cmd);
+        ql_status_set(QL_STATUS_IMEI, "%s", DeviceSerialNumber);
         free(DeviceSerialNumber);
     }
-    free(pResponse);
+    qmi_msg_free(pResponse);
     return 0;
 }
 static int requestDeviceModelID(void) { // GET Device Model ID
@@ -2287,7 +2782,6 @@ static int requestDeviceModelID(void) { // GET Device Model ID
     PQMUX_MSG pMUXMsg;
     PDEVICE_MODEL_ID modelID;
     int err;
-    char shell_cmd[128];
     
     pRequest = ComposeQMUXMsg(QMUX_TYPE_DMS, QMIDMS_GET_DEVICE_MODEL_ID_REQ, NULL, NULL);
     err = QmiThreadSendQMI(pRequest, &pResponse);
@@ -2297,11 +2791,10 @@ static int requestDeviceModelID(void) { // GET Device Model ID
     {
         char *model_ = strndup((const char *)(&modelID->DeviceModelID), le16_to_cpu(modelID->TLVLength));
         dbg_time("%s %s", __func__, model_);
-        snprintf(shell_cmd, sizeof(shell_cmd), "echo %s > /tmp/lteDevModel", model_);
-        system(shell_cmd);
+        ql_status_set(QL_STATUS_MODEL, "%s", model_);
         free(model_);
     }
-    free(pResponse);
+    qmi_msg_free(pResponse);
     return 0;
 }
 
@@ -2314,7 +2807,6 @@ static int requestBaseBandVersion(PROFILE_T *profile) {
     PQMUX_MSG pMUXMsg;
     PDEVICE_REV_ID revId;
     int err;
-    char shell_cmd[128];
     
     pRequest = ComposeQMUXMsg(QMUX_TYPE_DMS, QMIDMS_GET_DEVICE_REV_ID_REQ, NULL, NULL);
     err = QmiThreadSendQMI(pRequest, &pResponse);
@@ -2326,13 +2818,12 @@ static int requestBaseBandVersion(PROFILE_T *profile) {
     {
         char *DeviceRevisionID = strndup((const char *)(&revId->RevisionID), le16_to_cpu(revId->TLVLength));
         dbg_time("%s %s", __func__, DeviceRevisionID);
-        snprintf(shell_cmd, sizeof(shell_cmd), "echo %s > /tmp/lteVersion", DeviceRevisionID);
-            system(shell_cmd);
+        ql_status_set(QL_STATUS_REVISION, "%s", DeviceRevisionID);
         strncpy(profile->BaseBandVersion, DeviceRevisionID, sizeof(profile->BaseBandVersion));
         free(DeviceRevisionID);
     }
     
-    free(pResponse);
+    qmi_msg_free(pResponse);
     
     requestDeviceModelID();
     
@@ -2361,7 +2852,7 @@ static int requestSetOperatingMode(UCHAR OperatingMode) {
     err = QmiThreadSendQMI(pRequest, &pResponse);
     qmi_rsp_check_and_return();
 
-    free(pResponse);
+    qmi_msg_free(pResponse);
     return 0;
 }
 #endif
@@ -2392,7 +2883,7 @@ static int requestSetLoopBackState(UCHAR loopback_state, ULONG replication_facto
     err = QmiThreadSendQMI(pRequest, &pResponse);
     qmi_rsp_check_and_return();
 
-    free(pResponse);
+    qmi_msg_free(pResponse);
     return 0;
 }
 
@@ -2423,4 +2914,6 @@ const struct request_ops qmi_request_ops = {
 #endif
     .requestSetLoopBackState = requestSetLoopBackState,
     .requestGetIMEI = requestDeviceSerialNumber,
+    .requestRegisterIndications = requestRegisterIndications,
+    .async_workers = 4,
 };
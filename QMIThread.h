@@ -140,6 +140,7 @@ struct qmi_device_ops {
 	int (*deinit)(void);
 	int (*send)(PQCQMIMSG pRequest);
 	void* (*read)(void *pData);
+	void (*wakeup)(void); //fail every request still waiting for the modem
 };
 extern const struct qmi_device_ops gobi_qmidev_ops;
 extern const struct qmi_device_ops qmiwwan_qmidev_ops;
@@ -191,6 +192,7 @@ typedef struct __PROFILE {
     int rawIP;
     int muxid;
     int enable_bridge;
+    int static_ip; //apply WDS runtime settings directly, skip DHCP
     int wda_client;
     IPV4_T ipv4;
     IPV6_T ipv6;
@@ -215,6 +217,25 @@ typedef struct __PROFILE {
 
     char BaseBandVersion[64];
 
+    unsigned long redial_min_msec;
+    unsigned long redial_max_msec;
+    unsigned long outage_msec; //how long the last data call outage lasted, lost -> connected again
+
+    /* data call state of this PDN, the first PROFILE_T also owns the device */
+    UCHAR IPv4ConnectionStatus;
+    UCHAR IPv6ConnectionStatus;
+    unsigned SetupCallFail;
+    unsigned long SetupCallAllowTime;
+    unsigned long OutageStartTime;
+    int redial_timerfd;
+    struct pdn_setup *setup_call; //SIG_EVENT_START in flight on the request_async workers, see main.c
+    int usbnet_link;
+    UCHAR wds_client[2]; //WDS client IDs for IPv4/IPv6, 0 means the default ones of qmi_ops
+    uint32_t WdsConnectionIPv4Handle;
+    uint32_t WdsConnectionIPv6Handle;
+    struct __PROFILE *next_pdn; //more PDNs served by this process, see -N
+    struct dhcp_client *dhcpc; //in-process DHCPv4 of the netlink backend
+
     const struct qmi_device_ops *qmi_ops;
     const struct request_ops *request_ops;
     RMNET_INFO rmnet_info;
@@ -258,6 +279,7 @@ typedef enum {
 #define RIL_UNSOL_DATA_CALL_LIST_CHANGED    0x1005
 #define MODEM_REPORT_RESET_EVENT 0x1006
 #define RIL_UNSOL_LOOPBACK_CONFIG_IND 0x1007
+#define RIL_UNSOL_SIGNAL_STRENGTH 0x1008
 
 extern pthread_mutex_t cm_command_mutex;
 extern pthread_cond_t cm_command_cond;
@@ -268,12 +290,23 @@ extern int pthread_cond_timeout_np(pthread_cond_t *cond, pthread_mutex_t * mutex
 extern int QmiThreadSendQMITimeout(PQCQMIMSG pRequest, PQCQMIMSG *ppResponse, unsigned msecs, const char *funcname);
 #define QmiThreadSendQMI(pRequest, ppResponse) QmiThreadSendQMITimeout(pRequest, ppResponse, 30 * 1000, __func__)
 extern void QmiThreadRecvQMI(PQCQMIMSG pResponse);
+extern void QmiThreadWakeup(void);
+extern int QmiThreadIndications(UCHAR QMIType, USHORT *MsgId, int max);
+extern PQCQMIMSG qmi_msg_alloc(size_t len);
+extern void qmi_msg_free(PQCQMIMSG pMsg);
 extern void udhcpc_start(PROFILE_T *profile);
 extern void udhcpc_stop(PROFILE_T *profile);
 extern void ql_set_driver_link_state(PROFILE_T *profile, int link_state);
 extern void ql_set_driver_qmap_setting(PROFILE_T *profile, QMAP_SETTING *qmap_settings);
 extern void ql_get_driver_rmnet_info(PROFILE_T *profile, RMNET_INFO *rmnet_info);
 extern void dump_qmi(void *dataBuffer, int dataLen);
+extern const char *qmi_req_name(int QMIType, int Type);
+extern void qmi_stats_dump(void);
+
+/* trace.c, see trace.h for the proto/dir values */
+extern void ql_trace(int proto, int dir, const void *data, unsigned len);
+extern void ql_trace_init(int pdp);
+extern int ql_trace_dump(void);
 extern void qmidevice_send_event_to_main(int triger_event);
 extern void qmidevice_send_event_to_main_ext(int triger_event, void *data, unsigned len);
 
@@ -286,19 +319,97 @@ struct request_ops {
     int (*requestSetProfile)(PROFILE_T *profile) ;
     int (*requestGetProfile)(PROFILE_T *profile);
     int (*requestRegistrationState)(UCHAR *pPSAttachedState);
-    int (*requestSetupDataCall)(PROFILE_T *profile, int curIpFamily);
-    int (*requestQueryDataCall)(UCHAR  *pConnectionStatus, int curIpFamily);
+    int (*requestSetupDataCall)(PROFILE_T *profile, int curIpFamily, int auth); //auth of this attempt, not profile->auth
+    int (*requestQueryDataCall)(PROFILE_T *profile, UCHAR  *pConnectionStatus, int curIpFamily);
     int (*requestDeactivateDefaultPDP)(PROFILE_T *profile, int curIpFamily);
     int (*requestGetIPAddress)(PROFILE_T *profile, int curIpFamily);
     int (*requestGetSignalInfo)(void);
     int (*requestGetICCID)(void);
     int (*requestGetIMSI)(const char **pp_imsi);
     int (*requestGetIMEI)(void);
+    int (*requestRegisterIndications)(PROFILE_T *profile); //0 if the modem will report state changes by itself
+    unsigned async_workers; //how many requests can be outstanding at the same time
 };
 extern const struct request_ops qmi_request_ops;
 extern const struct request_ops mbim_request_ops;
 extern const struct request_ops atc_request_ops;
 
+typedef struct __REQUEST_FUTURE REQUEST_FUTURE;
+typedef int (*REQUEST_ASYNC_FUNC)(PROFILE_T *profile, void *arg);
+typedef void (*REQUEST_ASYNC_CB)(REQUEST_FUTURE *future);
+
+struct __REQUEST_FUTURE {
+    struct listnode node;
+    const char *name;
+    REQUEST_ASYNC_FUNC func;
+    void *arg;
+    REQUEST_ASYNC_CB cb; //called on the worker thread when func returns
+    int err;
+    int done;
+    int queued; //not picked up by a worker yet
+    int running; //func is running on a worker
+    int detached; //timed out while running, only cb sees it again
+    unsigned long submit_msec;
+    unsigned long start_msec;
+    unsigned long done_msec;
+};
+
+#define REQUEST_FUTURE_INIT(_name, _func, _arg, _cb) {.name = _name, .func = _func, .arg = _arg, .cb = _cb}
+
+extern int request_async_init(PROFILE_T *profile);
+extern void request_async_deinit(void);
+extern int request_async_submit(REQUEST_FUTURE *future);
+extern int request_async_cancel(REQUEST_FUTURE *future);
+extern int request_async_wait(REQUEST_FUTURE *future, unsigned msecs);
+extern int request_async_wait_any(REQUEST_FUTURE **futures, int count, unsigned msecs);
+
+/* status.c, the page layout is in status.h */
+enum ql_status_field {
+    QL_STATUS_SIM,
+    QL_STATUS_MODE,
+    QL_STATUS_IMEI,
+    QL_STATUS_MODEL,
+    QL_STATUS_REVISION,
+    QL_STATUS_FIELD_MAX
+};
+extern int ql_status_open(int pdp);
+extern void ql_status_close(void);
+extern void ql_status_set(enum ql_status_field field, const char *fmt, ...);
+extern void ql_status_set_rssi(int rssi);
+extern void ql_status_set_link(const PROFILE_T *profile);
+extern void ql_status_set_connected(void);
+extern void ql_status_reset(void);
+extern void ql_status_count_spawn(void);
+extern unsigned ql_status_spawn_count(void);
+
+/* metrics.c */
+enum metric_id {
+    METRIC_SIGNAL_RSSI,
+    METRIC_SIGNAL_RSRQ,
+    METRIC_SIGNAL_RSRP,
+    METRIC_SIGNAL_SNR,
+    METRIC_SIGNAL_ECIO,
+    METRIC_REGISTERED,
+    METRIC_PS_ATTACHED,
+    METRIC_DATA_CLASS,
+    METRIC_PDN_CONNECTED,
+    METRIC_SETUP_CALL,
+    METRIC_CALL_END,
+    METRIC_CALL_END_REASON,
+    METRIC_OUTAGE_SECONDS,
+    METRIC_QMI_REQUEST_SECONDS,
+    METRIC_QMI_TIMEOUTS,
+    METRIC_ID_MAX
+};
+//labels is a printf format giving 'name="value",...', or NULL
+extern void metric_set(enum metric_id id, double value, const char *labels, ...);
+extern void metric_inc(enum metric_id id, const char *labels, ...);
+extern void metric_observe(enum metric_id id, double value, const char *labels, ...);
+extern void metric_clear(enum metric_id id);
+extern int metrics_render(FILE *fp, int json);
+extern int metrics_start(int pdp);
+extern void metrics_stop(void);
+
 extern int get_driver_type(PROFILE_T *profile);
 extern BOOL qmidevice_detect(char *qmichannel, char *usbnet_adapter, unsigned bufsize, PROFILE_T *profile);
 int mhidevice_detect(char *qmichannel, char *usbnet_adapter, PROFILE_T *profile);
@@ -316,12 +427,20 @@ extern int ql_qmap_mode_detect(PROFILE_T *profile);
 extern FILE *logfilefp;
 extern int debug_qmi;
 extern int qmidevice_control_fd[2];
+typedef void (*main_fd_handler)(int fd, void *arg);
+extern int main_watch_fd(int fd, main_fd_handler handler, void *arg);
+extern int main_watch_fd_events(int fd, unsigned int events);
+extern void main_unwatch_fd(int fd);
 extern USHORT le16_to_cpu(USHORT v16);
 extern UINT  le32_to_cpu (UINT v32);
 extern UINT  ql_swap32(UINT v32);
 extern USHORT cpu_to_le16(USHORT v16);
 extern UINT cpu_to_le32(UINT v32);
-extern void update_resolv_conf(int iptype, const char *ifname, const char *dns1, const char *dns2);
+extern void update_resolv_conf(int iptype, const char *ifname, int prio, const char *dns1, const char *dns2);
+extern int ql_system(const char *shell_cmd);
+extern int ql_exec(char *const argv[]);
+extern FILE *ql_popen(const char *shell_cmd, pid_t *ppid);
+extern int ql_pclose(FILE *fp, pid_t pid);
 void update_ipv4_address(const char *ifname, const char *ip, const char *gw, unsigned prefix);
 void update_ipv6_address(const char *ifname, const char *ip, const char *gw, unsigned prefix);
 int reattach_driver(PROFILE_T *profile);
@@ -24,6 +24,7 @@
 #ifdef CONFIG_QMIWWAN
 static int cdc_wdm_fd = -1;
 static UCHAR qmiclientId[QMUX_TYPE_WDS_ADMIN + 1];
+static PROFILE_T *s_pdn_list; //PDNs whose own WDS clients QmiWwanDeInit() releases
 
 static UCHAR GetQCTLTransactionId(void) {
     static int TransactionId = 0;
@@ -35,10 +36,14 @@ static UCHAR GetQCTLTransactionId(void) {
 typedef USHORT (*CUSTOMQCTL)(PQMICTL_MSG pCTLMsg, void *arg);
 
 static PQCQMIMSG ComposeQCTLMsg(USHORT QMICTLType, CUSTOMQCTL customQctlMsgFunction, void *arg) {
-    UCHAR QMIBuf[WDM_DEFAULT_BUFSIZE];
-    PQCQMIMSG pRequest = (PQCQMIMSG)QMIBuf;
-    int Length;
+    PQCQMIMSG pRequest = qmi_msg_alloc(WDM_DEFAULT_BUFSIZE);
 
+    if (pRequest == NULL) {
+        dbg_time("%s fail to malloc", __func__);
+        return NULL;
+    }
+
+    memset(pRequest, 0x00, WDM_DEFAULT_BUFSIZE); //pool slots come back with the previous message
     pRequest->QMIHdr.IFType   = USB_CTL_MSG_TYPE_QMI;
     pRequest->QMIHdr.CtlFlags = 0x00;
     pRequest->QMIHdr.QMIType  = QMUX_TYPE_CTL;
@@ -53,14 +58,6 @@ static PQCQMIMSG ComposeQCTLMsg(USHORT QMICTLType, CUSTOMQCTL customQctlMsgFunct
         pRequest->CTLMsg.QMICTLMsgHdr.Length = cpu_to_le16(0x0000);
 
     pRequest->QMIHdr.Length = cpu_to_le16(le16_to_cpu(pRequest->CTLMsg.QMICTLMsgHdr.Length) + sizeof(QCQMICTL_MSG_HDR) + sizeof(QCQMI_HDR) - 1);
-    Length = le16_to_cpu(pRequest->QMIHdr.Length) + 1;
-
-    pRequest = (PQCQMIMSG)malloc(Length);
-    if (pRequest == NULL) {
-        dbg_time("%s fail to malloc", __func__);
-    } else {
-        memcpy(pRequest, QMIBuf, Length);
-    }
 
     return pRequest;
 }
@@ -101,6 +98,49 @@ static USHORT CtlLibQmiProxyOpenReq(PQMICTL_MSG QCTLMsg, void *arg)
     return sizeof(QMICTL_LIBQMI_PROXY_OPEN_MSG) + (strlen(device_path));
 }
 
+//arg is the list of services, ended by 0 (QMUX_TYPE_CTL never has a filter)
+static USHORT CtlProxyIndFilterReq(PQMICTL_MSG QCTLMsg, void *arg) {
+    const UCHAR *services = (const UCHAR *)arg;
+    USHORT Length = sizeof(QMICTL_PROXY_IND_FILTER_REQ_MSG);
+
+    for (; *services; services++) {
+        PQMICTL_PROXY_IND_FILTER_TLV pTLV = (PQMICTL_PROXY_IND_FILTER_TLV)((UCHAR *)QCTLMsg + Length);
+        USHORT MsgId[16];
+        int i, n = QmiThreadIndications(*services, MsgId, 16);
+
+        pTLV->TLVType = QCTLV_TYPE_REQUIRED_PARAMETER;
+        pTLV->TLVLength = cpu_to_le16(2 + 2 * n);
+        pTLV->QMIType = *services;
+        pTLV->NumIds = n;
+        for (i = 0; i < n; i++)
+            pTLV->MsgId[i] = cpu_to_le16(MsgId[i]);
+        Length += sizeof(QMICTL_PROXY_IND_FILTER_TLV) + 2 * n;
+    }
+    return Length;
+}
+
+/* quectel-qmi-proxy sends every connection all broadcasts of its services unless told which ones it wants.
+ * One request for all services, so a proxy that does not know it costs a single timeout */
+static void quectel_qmi_proxy_set_ind_filter(void) {
+    static const UCHAR services[] = {QMUX_TYPE_WDS, QMUX_TYPE_DMS, QMUX_TYPE_NAS, QMUX_TYPE_UIM, QMUX_TYPE_WDS_ADMIN};
+    UCHAR wanted[sizeof(services) + 1];
+    PQCQMIMSG pResponse = NULL;
+    unsigned i, n = 0;
+
+    for (i = 0; i < sizeof(services)/sizeof(services[0]); i++) {
+        if (qmiclientId[services[i]])
+            wanted[n++] = services[i];
+    }
+    if (!n)
+        return;
+    wanted[n] = 0;
+
+    //an older proxy passes it to the modem, which may never answer
+    QmiThreadSendQMITimeout(ComposeQCTLMsg(QMICTL_PROXY_IND_FILTER_REQ, CtlProxyIndFilterReq, wanted), &pResponse, 1000, __func__);
+    if (pResponse)
+        qmi_msg_free(pResponse);
+}
+
 static int libqmi_proxy_open(const char *cdc_wdm) {
     int ret;
     PQCQMIMSG pResponse;
@@ -117,7 +157,7 @@ static int libqmi_proxy_open(const char *cdc_wdm) {
     }
 
     if (pResponse)
-            free(pResponse);
+            qmi_msg_free(pResponse);
 
     return ret;
 }
@@ -132,7 +172,9 @@ static int QmiWwanSendQMI(PQCQMIMSG pRequest) {
     }
 
     if (pRequest->QMIHdr.QMIType != QMUX_TYPE_CTL) {
-        pRequest->QMIHdr.ClientId = qmiclientId[pRequest->QMIHdr.QMIType];
+        //WDS requests of other PDNs come with their own ClientId
+        if (pRequest->QMIHdr.ClientId == 0)
+            pRequest->QMIHdr.ClientId = qmiclientId[pRequest->QMIHdr.QMIType];
         if (pRequest->QMIHdr.ClientId == 0) {
             dbg_time("QMIType %d has no clientID", pRequest->QMIHdr.QMIType);
             return -ENODEV;
@@ -201,6 +243,7 @@ static int QmiWwanInit(PROFILE_T *profile) {
     unsigned i;
     int ret;
     PQCQMIMSG pResponse;
+    PROFILE_T *pdn;
 
     if (profile->proxy[0] && !strcmp(profile->proxy, LIBQMI_PROXY)) {
         ret = libqmi_proxy_open(profile->qmichannel);
@@ -238,7 +281,7 @@ static int QmiWwanInit(PROFILE_T *profile) {
             }
         }
     }
-    if (pResponse) free(pResponse);
+    if (pResponse) qmi_msg_free(pResponse);
     qmiclientId[QMUX_TYPE_WDS] = QmiWwanGetClientID(QMUX_TYPE_WDS);
     if (profile->enable_ipv6)
         qmiclientId[QMUX_TYPE_WDS_IPV6] = QmiWwanGetClientID(QMUX_TYPE_WDS);
@@ -248,11 +291,35 @@ static int QmiWwanInit(PROFILE_T *profile) {
     qmiclientId[QMUX_TYPE_WDS_ADMIN] = QmiWwanGetClientID(QMUX_TYPE_WDS_ADMIN);
     profile->wda_client = qmiclientId[QMUX_TYPE_WDS_ADMIN];
 
+    if (!strncmp(profile->proxy, QUECTEL_QMI_PROXY, strlen(QUECTEL_QMI_PROXY)))
+        quectel_qmi_proxy_set_ind_filter();
+
+    //one pair of WDS clients for each PDN, they share DMS/NAS/UIM/WDA of the first one
+    s_pdn_list = profile->next_pdn;
+    for (pdn = s_pdn_list; pdn; pdn = pdn->next_pdn) {
+        if (pdn->enable_ipv4)
+            pdn->wds_client[0] = QmiWwanGetClientID(QMUX_TYPE_WDS);
+        if (pdn->enable_ipv6)
+            pdn->wds_client[1] = QmiWwanGetClientID(QMUX_TYPE_WDS);
+    }
+
     return 0;
 }
 
 static int QmiWwanDeInit(void) {
     unsigned int i;
+    PROFILE_T *pdn;
+
+    for (pdn = s_pdn_list; pdn; pdn = pdn->next_pdn) {
+        for (i = 0; i < sizeof(pdn->wds_client)/sizeof(pdn->wds_client[0]); i++) {
+            if (pdn->wds_client[i] != 0) {
+                QmiWwanReleaseClientID(QMUX_TYPE_WDS, pdn->wds_client[i]);
+                pdn->wds_client[i] = 0;
+            }
+        }
+    }
+    s_pdn_list = NULL;
+
     for (i = 0; i < sizeof(qmiclientId)/sizeof(qmiclientId[0]); i++)
     {
         if (qmiclientId[i] != 0)
@@ -265,16 +332,44 @@ static int QmiWwanDeInit(void) {
     return 0;
 }
 
+/*
+ * The proxy socket is a stream: a read() may end inside a message or carry several.
+ * The bytes wait in cm_recv_buf until they make a message, which is always at the front.
+ */
+static size_t s_proxy_len = 0;
+
 static ssize_t qmi_proxy_read (int fd, void *buf, size_t size) {
     ssize_t nreads;
+
+    nreads = read(fd, (UCHAR *)buf + s_proxy_len, size - s_proxy_len);
+    if (nreads > 0)
+        s_proxy_len += nreads;
+
+    return nreads;
+}
+
+/* size of the message at the front of buf, 0 until it is complete */
+static size_t qmi_proxy_next (void *buf, size_t size) {
     PQCQMI_HDR pHdr = (PQCQMI_HDR)buf;
+    size_t len;
+
+    if (s_proxy_len < sizeof(QCQMI_HDR))
+        return 0;
 
-    nreads = read(fd, pHdr, sizeof(QCQMI_HDR));
-    if (nreads == sizeof(QCQMI_HDR) && le16_to_cpu(pHdr->Length) < size) {
-        nreads += read(fd, pHdr+1, le16_to_cpu(pHdr->Length) + 1 - sizeof(QCQMI_HDR));
+    len = le16_to_cpu(pHdr->Length) + 1;
+    if (len < sizeof(QCQMI_HDR) || len > size) {
+        //lost the framing, nothing to resync on
+        dbg_time("%s bad QMIHdr.Length %u, drop %u bytes", __func__, (unsigned)len, (unsigned)s_proxy_len);
+        s_proxy_len = 0;
+        return 0;
     }
 
-    return nreads;
+    return s_proxy_len >= len ? len : 0;
+}
+
+static void qmi_proxy_consume (void *buf, size_t len) {
+    s_proxy_len -= len;
+    memmove(buf, (UCHAR *)buf + len, s_proxy_len);
 }
 
 #ifdef QUECTEL_QMI_MERGE
@@ -340,6 +435,7 @@ static void * QmiWwanThread(void *pData) {
 
     dbg_time("cdc_wdm_fd = %d", cdc_wdm_fd);
 
+    s_proxy_len = 0;
     qmidevice_send_event_to_main(RIL_INDICATE_DEVICE_CONNECTED);
     while (1) {
         struct pollfd pollfds[] = {{qmidevice_control_fd[1], POLLIN, 0}, {cdc_wdm_fd, POLLIN, 0}};
@@ -395,14 +491,26 @@ static void * QmiWwanThread(void *pData) {
                 }
             }
 
-            if (fd == cdc_wdm_fd) {
+            if (fd == cdc_wdm_fd && profile->proxy[0]) {
+                PQCQMIMSG pResponse = (PQCQMIMSG)cm_recv_buf;
+                ssize_t nreads = qmi_proxy_read(fd, cm_recv_buf, sizeof(cm_recv_buf));
+                size_t len;
+
+                if (nreads <= 0) {
+                    dbg_time("%s read=%d errno: %d (%s)",  __func__, (int)nreads, errno, strerror(errno));
+                    break;
+                }
+
+                while ((len = qmi_proxy_next(cm_recv_buf, sizeof(cm_recv_buf))) > 0) {
+                    QmiThreadRecvQMI(pResponse);
+                    qmi_proxy_consume(cm_recv_buf, len);
+                }
+            }
+            else if (fd == cdc_wdm_fd) {
                 ssize_t nreads;
                 PQCQMIMSG pResponse = (PQCQMIMSG)cm_recv_buf;
                 
-                if (!profile->proxy[0])
-                    nreads = read(fd, cm_recv_buf, sizeof(cm_recv_buf));
-                else
-                    nreads = qmi_proxy_read(fd, cm_recv_buf, sizeof(cm_recv_buf));
+                nreads = read(fd, cm_recv_buf, sizeof(cm_recv_buf));
                 //dbg_time("%s read=%d errno: %d (%s)",  __func__, (int)nreads, errno, strerror(errno));
                 if (nreads <= 0) {
                     dbg_time("%s read=%d errno: %d (%s)",  __func__, (int)nreads, errno, strerror(errno));
@@ -427,8 +535,7 @@ __QmiWwanThread_quit:
     qmidevice_send_event_to_main(RIL_INDICATE_DEVICE_DISCONNECTED);
     QmiThreadRecvQMI(NULL); //main thread may pending on QmiThreadSendQMI()
     dbg_time("%s exit", __func__);
-    system("rm -rf /tmp/lte*");
-    system("touch /tmp/lteDisconnected");
+    ql_status_reset();
     pthread_exit(NULL);
     return NULL;
 }
@@ -438,6 +545,7 @@ const struct qmi_device_ops qmiwwan_qmidev_ops = {
     .deinit = QmiWwanDeInit,
     .send = QmiWwanSendQMI,
     .read = QmiWwanThread,
+    .wakeup = QmiThreadWakeup,
 };
 #endif
 
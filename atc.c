@@ -118,7 +118,7 @@ static void * atc_read_thread(void *param) {
 
     while (atc_fd > 0) {
         struct pollfd pollfds[] = {{atc_fd, POLLIN, 0}, {qmidevice_control_fd[1], POLLIN, 0}};
-        int ne, ret, nevents = 2;
+        int ne, ret, nevents = sizeof(pollfds)/sizeof(pollfds[0]);
 
         ret = poll(pollfds, nevents, wait_for_request_quit ? 1000 : -1);
 
@@ -325,7 +325,7 @@ error:
     return err;
 }
 
-static int requestSetupDataCall(PROFILE_T *profile, int curIpFamily) {
+static int requestSetupDataCall(PROFILE_T *profile, int curIpFamily, int auth) {
     int err;
     ATResponse *p_response = NULL;
     char *cmd = NULL;
@@ -335,6 +335,7 @@ static int requestSetupDataCall(PROFILE_T *profile, int curIpFamily) {
     int state = 0;
 
     (void)curIpFamily;
+    (void)auth;
 
     if (asr_style_atc) {
         err = at_send_command_multiline("AT+CGACT?", "+CGACT:", &p_response);
@@ -439,7 +440,7 @@ _error:
     return err;
 }
 
-static int requestQueryDataCall(UCHAR  *pConnectionStatus, int curIpFamily) {
+static int requestQueryDataCall(PROFILE_T *profile, UCHAR  *pConnectionStatus, int curIpFamily) {
     int err;
     ATResponse *p_response = NULL;
     ATLine *p_cur = NULL;
@@ -450,6 +451,7 @@ static int requestQueryDataCall(UCHAR  *pConnectionStatus, int curIpFamily) {
     int pdp = 1;
     unsigned int v4Addr = 0;
 
+    (void)profile;
     (void)curIpFamily;
 
     *pConnectionStatus = QWDS_PKT_DATA_DISCONNECTED;
@@ -683,5 +685,6 @@ const struct request_ops atc_request_ops = {
     .requestGetIPAddress = requestGetIPAddress,
     .requestGetICCID = requestGetICCID,
     .requestGetIMSI = requestGetIMSI,
+    .async_workers = 1,
 };
 
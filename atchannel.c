@@ -32,6 +32,7 @@
 #include <stdarg.h>
 
 #include "QMIThread.h"
+#include "trace.h"
 #define LOGE dbg_time
 #define LOGD dbg_time
 
@@ -42,6 +43,7 @@
 #define HANDSHAKE_TIMEOUT_MSEC 1000
 
 static pthread_t s_tid_reader;
+static pthread_mutex_t s_commandmutex = PTHREAD_MUTEX_INITIALIZER; //one command in flight
 static int s_fd = -1;    /* fd of the AT channel */
 static ATUnsolHandler s_unsolHandler;
 
@@ -390,6 +392,7 @@ static const char *readline()
 
         if (count > 0) {
             AT_DUMP( "<< ", p_read, count );
+            ql_trace(QL_TRACE_AT, QL_TRACE_RX, p_read, count);
             s_readCount += count;
 
             p_read[count] = '\0';
@@ -503,6 +506,7 @@ static int writeline (const char *s)
     LOGD("AT> %s", s);
 
     AT_DUMP( ">> ", s, strlen(s) );
+    ql_trace(QL_TRACE_AT, QL_TRACE_TX, s, len);
 
 #if 1 //send '\r' maybe fail via USB controller: Intel Corporation 7 Series/C210 Series Chipset Family USB xHCI Host Controller (rev 04)
     if (len < (sizeof(at_command) - 1)) {
@@ -556,6 +560,7 @@ static int writeCtrlZ (const char *s)
     LOGD("AT> %s^Z", s);
 
     AT_DUMP( ">* ", s, strlen(s) );
+    ql_trace(QL_TRACE_AT, QL_TRACE_TX, s, len);
 
     /* the main string */
     while (cur < len) {
@@ -807,6 +812,7 @@ static int at_send_command_full (const char *command, ATCommandType type,
         return AT_ERROR_INVALID_THREAD;
     }
 
+    pthread_mutex_lock(&s_commandmutex);
     pthread_mutex_lock(&cm_command_mutex);
 
     err = at_send_command_full_nolock(command, type,
@@ -814,6 +820,7 @@ static int at_send_command_full (const char *command, ATCommandType type,
                     timeoutMsec, pp_outResponse);
 
     pthread_mutex_unlock(&cm_command_mutex);
+    pthread_mutex_unlock(&s_commandmutex);
 
     if (err == AT_ERROR_TIMEOUT && s_onTimeout != NULL) {
         s_onTimeout();
@@ -953,6 +960,7 @@ int at_handshake()
         return AT_ERROR_INVALID_THREAD;
     }
 
+    pthread_mutex_lock(&s_commandmutex);
     pthread_mutex_lock(&cm_command_mutex);
 
     for (i = 0 ; i < HANDSHAKE_RETRY_COUNT ; i++) {
@@ -966,6 +974,7 @@ int at_handshake()
     }
 
     pthread_mutex_unlock(&cm_command_mutex);
+    pthread_mutex_unlock(&s_commandmutex);
 
     if (err == 0) {
         /* pause for a bit to let the input buffer drain any unmatched OK's
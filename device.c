@@ -599,9 +599,6 @@ int ql_capture_usbmon_log(PROFILE_T *profile, const char *log_path)
         return -1;
     }
 
-    snprintf(usbmon_path, sizeof(usbmon_path), "cat /sys/kernel/debug/usb/devices >> %s", log_path);
-    if (system(usbmon_path) == -1) {};
-
     profile->usbmon_logfile_fp = fopen(log_path, "wb");
     if (!profile->usbmon_logfile_fp) {
       dbg_time("open %s error(%d) (%s)", log_path, errno, strerror(errno));
@@ -610,6 +607,18 @@ int ql_capture_usbmon_log(PROFILE_T *profile, const char *log_path)
       return -1;
     }
 
+    //log starts with the usb devices list, was 'cat /sys/kernel/debug/usb/devices >> log_path'
+    {
+        int fd = open("/sys/kernel/debug/usb/devices", O_RDONLY);
+        ssize_t nreads;
+
+        if (fd >= 0) {
+            while ((nreads = read(fd, usbmon_path, sizeof(usbmon_path))) > 0)
+                fwrite(usbmon_path, 1, nreads, profile->usbmon_logfile_fp);
+            close(fd);
+        }
+    }
+
     pthread_attr_init(&attr);
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
 
@@ -1,5 +1,40 @@
 #ifndef __DHCP_H__
 #define __DHCP_H__
 
+#include <stdint.h>
+
+typedef struct dhcp_info dhcp_info;
+
+/* addresses in network byte order */
+struct dhcp_info {
+    uint32_t type;
+
+    uint32_t ipaddr;
+    uint32_t gateway;
+    uint32_t prefixLength;
+
+    uint32_t dns1;
+    uint32_t dns2;
+
+    uint32_t serveraddr;
+    uint32_t lease;
+};
+
+#define DHCP_EVENT_BOUND   1 /* new lease, or renewed with different parameters */
+#define DHCP_EVENT_RENEWED 2 /* same lease extended, nothing to reconfigure */
+#define DHCP_EVENT_EXPIRED 3 /* lease lost (NAK or expiry), client restarts discovery */
+#define DHCP_EVENT_FAILED  4 /* no server answered, client stays idle until restarted */
+
+struct dhcp_client;
+typedef void (*dhcp_client_cb)(struct dhcp_client *c, int event, const dhcp_info *info, void *arg);
+
+struct dhcp_client *dhcp_client_start(const char *ifname, dhcp_client_cb cb, void *arg);
+void dhcp_client_restart(struct dhcp_client *c);
+void dhcp_client_stop(struct dhcp_client *c);
+int dhcp_client_sock(const struct dhcp_client *c);
+int dhcp_client_timerfd(const struct dhcp_client *c);
+const char *dhcp_client_ifname(const struct dhcp_client *c);
+void dhcp_client_handle(struct dhcp_client *c, int fd);
+
 int do_dhcp(char *iname);
-#endif //__DHCP_H__
\ No newline at end of file
+#endif //__DHCP_H__
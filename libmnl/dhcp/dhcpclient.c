@@ -24,6 +24,7 @@
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <net/if.h>
 #include <time.h>
@@ -33,6 +34,7 @@
 #include "../ifutils.h"
 #include "dhcpmsg.h"
 #include "packet.h"
+#include "dhcp.h"
 
 #define VERBOSE 2
 
@@ -79,22 +81,6 @@ int fatal(const char *reason)
 //    exit(1);
 }
 
-typedef struct dhcp_info dhcp_info;
-
-struct dhcp_info {
-    uint32_t type;
-
-    uint32_t ipaddr;
-    uint32_t gateway;
-    uint32_t prefixLength;
-
-    uint32_t dns1;
-    uint32_t dns2;
-
-    uint32_t serveraddr;
-    uint32_t lease;
-};
-
 dhcp_info last_good_info;
 
 void get_dhcp_info(uint32_t *ipaddr, uint32_t *gateway, uint32_t *prefixLength,
@@ -304,6 +290,8 @@ void dump_dhcp_msg(dhcp_msg *msg, int len)
             name = dhcp_type_to_name(x[2]);
         else
             name = NULL;
+        if (verbose > 1)
+            printf("  opt %d %s %s\n", x[0], name ? name : "", buf);
         len -= optsz;
         x = x + optsz + 2;
     }
@@ -311,12 +299,13 @@ void dump_dhcp_msg(dhcp_msg *msg, int len)
 
 #endif
 
-static int send_message(int sock, int if_index, dhcp_msg  *msg, int size)
+static int send_message(int sock, int if_index, dhcp_msg  *msg, int size,
+                        uint32_t saddr, uint32_t daddr)
 {
 #if VERBOSE > 1
     dump_dhcp_msg(msg, size);
 #endif
-    return send_packet(sock, if_index, msg, size, INADDR_ANY, INADDR_BROADCAST,
+    return send_packet(sock, if_index, msg, size, saddr, daddr,
                        PORT_BOOTP_CLIENT, PORT_BOOTP_SERVER);
 }
 
@@ -350,153 +339,399 @@ static int is_valid_reply(dhcp_msg *msg, dhcp_msg *reply, int sz)
     return 1;
 }
 
+/*
+ * Non-blocking DHCPv4 client. The owner polls dhcp_client_sock() and
+ * dhcp_client_timerfd() from its own event loop and hands readiness to
+ * dhcp_client_handle(); results come back through the callback.
+ *
+ *   INIT -> SELECTING -> REQUESTING -> BOUND -(T1)-> RENEWING -(T2)-> REBINDING
+ *                ^                        ^             |               |
+ *                |                        +----- ACK ---+---------------+
+ *                +--------------- NAK / lease expired ------------------+
+ */
+#define STATE_INIT       0
 #define STATE_SELECTING  1
 #define STATE_REQUESTING 2
+#define STATE_BOUND      3
+#define STATE_RENEWING   4
+#define STATE_REBINDING  5
 
-#define TIMEOUT_INITIAL   4000
-#define TIMEOUT_MAX      32000
+/* same budget as 'busybox udhcpc -t 5 -T 3' used before */
+#define TIMEOUT_INITIAL   3000
+#define DISCOVER_TRIES    5
+#define TIMEOUT_RENEW_MIN 60000
 
-int dhcp_init_ifc(const char *ifname)
-{
-    dhcp_msg discover_msg;
-    dhcp_msg request_msg;
-    dhcp_msg reply;
-    dhcp_msg *msg;
-    dhcp_info info;
-    int s, r, size;
-    int valid_reply;
-    uint32_t xid;
-    unsigned char hwaddr[6];
-    struct pollfd pfd;
-    unsigned int state;
-    unsigned int timeout;
+struct dhcp_client {
+    char ifname[IFNAMSIZ];
     int if_index;
+    unsigned char hwaddr[6];
+    int sock;
+    int timerfd;
+    int state;
+    int tries;
+    uint32_t xid;
+    msecs_t bound_at;       /* when the current lease was acked */
+    dhcp_msg msg;           /* last request sent, replies are matched against it */
+    int msg_size;
+    dhcp_info offer;
+    dhcp_info lease;
+    dhcp_client_cb cb;
+    void *arg;
+};
 
-    xid = (uint32_t) get_msecs();
+static void dhcp_timer_set(struct dhcp_client *c, msecs_t msecs)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = msecs / 1000;
+    its.it_value.tv_nsec = (msecs % 1000) * 1000000;
+    if (msecs == 0)
+        its.it_value.tv_nsec = 1; /* fire at once, 0 would disarm */
+    timerfd_settime(c->timerfd, 0, &its, NULL);
+}
 
-    if (if_get_hwaddr(ifname, hwaddr)) {
-        return fatal("cannot obtain interface address");
-    }
-    if ((if_index = if_nametoindex(ifname)) == 0) {
-        return fatal("cannot obtain interface index");
+static void dhcp_timer_stop(struct dhcp_client *c)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    timerfd_settime(c->timerfd, 0, &its, NULL);
+}
+
+static int lease_infinite(const dhcp_info *lease)
+{
+    return lease->lease == 0 || lease->lease == 0xffffffff;
+}
+
+/* T1, T2 and expiry, in msecs after bound_at */
+static msecs_t lease_t1(const dhcp_info *lease) { return (msecs_t)lease->lease * 500; }
+static msecs_t lease_t2(const dhcp_info *lease) { return (msecs_t)lease->lease * 875; }
+static msecs_t lease_end(const dhcp_info *lease) { return (msecs_t)lease->lease * 1000; }
+
+static void dhcp_transmit(struct dhcp_client *c)
+{
+    uint32_t saddr = INADDR_ANY, daddr = INADDR_BROADCAST;
+
+    switch (c->state) {
+    case STATE_SELECTING:
+        c->msg_size = init_dhcp_discover_msg(&c->msg, c->hwaddr, c->xid);
+        break;
+    case STATE_REQUESTING:
+        c->msg_size = init_dhcp_request_msg(&c->msg, c->hwaddr, c->xid,
+                                            c->offer.ipaddr, c->offer.serveraddr);
+        break;
+    case STATE_RENEWING:
+        daddr = c->lease.serveraddr ? c->lease.serveraddr : INADDR_BROADCAST;
+        /* fall through */
+    case STATE_REBINDING:
+        saddr = c->lease.ipaddr;
+        c->msg_size = init_dhcp_renew_msg(&c->msg, c->hwaddr, c->xid, c->lease.ipaddr);
+        break;
+    default:
+        return;
     }
 
-    s = open_raw_socket(ifname, hwaddr, if_index);
+    if (send_message(c->sock, c->if_index, &c->msg, c->msg_size, saddr, daddr) < 0)
+        printerr("error sending dhcp msg: %s\n", strerror(errno));
+}
 
-    timeout = TIMEOUT_INITIAL;
-    state = STATE_SELECTING;
-    info.type = 0;
-    goto transmit;
+static void dhcp_discover(struct dhcp_client *c)
+{
+    c->state = STATE_SELECTING;
+    c->tries = 0;
+    c->xid++;
+    memset(&c->offer, 0, sizeof(c->offer));
+    dhcp_transmit(c);
+    dhcp_timer_set(c, TIMEOUT_INITIAL);
+}
 
-    for (;;) {
-        pfd.fd = s;
-        pfd.events = POLLIN;
-        pfd.revents = 0;
-        r = poll(&pfd, 1, timeout);
+/* next retransmit while renewing/rebinding: half the time left, at least 60s (RFC 2131 4.4.5) */
+static void dhcp_renew_timer(struct dhcp_client *c, msecs_t until)
+{
+    msecs_t now = get_msecs() - c->bound_at;
+    msecs_t wait = until > now ? (until - now) / 2 : 0;
 
-        if (r == 0) {
-#if VERBOSE
-            printerr("TIMEOUT\n");
-#endif
-            if (timeout >= TIMEOUT_MAX) {
-                printerr("timed out\n");
-                if ( info.type == DHCPOFFER ) {
-                    printerr("no acknowledgement from DHCP server\nconfiguring %s with offered parameters\n", ifname);
-                    return dhcp_configure(ifname, &info);
-                }
-                errno = ETIME;
-                close(s);
-                return -1;
-            }
-            timeout = timeout * 2;
-
-        transmit:
-            size = 0;
-            msg = NULL;
-            switch(state) {
-            case STATE_SELECTING:
-                msg = &discover_msg;
-                size = init_dhcp_discover_msg(msg, hwaddr, xid);
-                break;
-            case STATE_REQUESTING:
-                msg = &request_msg;
-                size = init_dhcp_request_msg(msg, hwaddr, xid, info.ipaddr, info.serveraddr);
-                break;
-            default:
-                r = 0;
-            }
-            if (size != 0) {
-                r = send_message(s, if_index, msg, size);
-                if (r < 0) {
-                    printerr("error sending dhcp msg: %s\n", strerror(errno));
-                }
-            }
-            continue;
-        }
+    if (wait < TIMEOUT_RENEW_MIN)
+        wait = until > now ? until - now : 0;
+    dhcp_timer_set(c, wait);
+}
 
-        if (r < 0) {
-            if ((errno == EAGAIN) || (errno == EINTR)) {
-                continue;
-            }
-            return fatal("poll failed");
+static void dhcp_bound(struct dhcp_client *c, const dhcp_info *info)
+{
+    int changed = c->state == STATE_REQUESTING
+        || info->ipaddr != c->lease.ipaddr || info->gateway != c->lease.gateway
+        || info->prefixLength != c->lease.prefixLength
+        || info->dns1 != c->lease.dns1 || info->dns2 != c->lease.dns2;
+
+    c->lease = *info;
+    c->bound_at = get_msecs();
+    c->state = STATE_BOUND;
+
+    if (lease_infinite(&c->lease))
+        dhcp_timer_stop(c);
+    else
+        dhcp_timer_set(c, lease_t1(&c->lease));
+
+    c->cb(c, changed ? DHCP_EVENT_BOUND : DHCP_EVENT_RENEWED, &c->lease, c->arg);
+}
+
+static void dhcp_lost(struct dhcp_client *c)
+{
+    c->cb(c, DHCP_EVENT_EXPIRED, &c->lease, c->arg);
+    memset(&c->lease, 0, sizeof(c->lease));
+    dhcp_discover(c);
+}
+
+static void dhcp_timeout(struct dhcp_client *c)
+{
+    msecs_t elapsed;
+    int state;
+
+    switch (c->state) {
+    case STATE_SELECTING:
+    case STATE_REQUESTING:
+        if (++c->tries < DISCOVER_TRIES) {
+            dhcp_transmit(c);
+            dhcp_timer_set(c, TIMEOUT_INITIAL);
+            break;
+        }
+        if (c->state == STATE_REQUESTING) {
+            printerr("no acknowledgement from DHCP server\nconfiguring %s with offered parameters\n", c->ifname);
+            dhcp_bound(c, &c->offer);
+            break;
         }
+        printerr("%s: no DHCP server answered\n", c->ifname);
+        c->state = STATE_INIT;
+        c->cb(c, DHCP_EVENT_FAILED, NULL, c->arg);
+        break;
+
+    case STATE_BOUND:
+    case STATE_RENEWING:
+    case STATE_REBINDING:
+        state = c->state;
+        elapsed = get_msecs() - c->bound_at;
+        if (elapsed >= lease_end(&c->lease)) {
+            printerr("%s: lease expired\n", c->ifname);
+            dhcp_lost(c);
+            break;
+        }
+        if (elapsed >= lease_t2(&c->lease)) {
+            c->state = STATE_REBINDING;
+            dhcp_renew_timer(c, lease_end(&c->lease));
+        } else {
+            c->state = STATE_RENEWING;
+            dhcp_renew_timer(c, lease_t2(&c->lease));
+        }
+        if (c->state != state)
+            c->xid++;
+        dhcp_transmit(c);
+        break;
 
+    default:
+        break;
+    }
+}
+
+static void dhcp_input(struct dhcp_client *c)
+{
+    dhcp_msg reply;
+    dhcp_info info;
+    int r;
+
+    for (;;) {
         errno = 0;
-        r = receive_packet(s, &reply);
+        r = receive_packet(c->sock, &reply);
         if (r < 0) {
-            if (errno != 0) {
-                printf("receive_packet failed (%d): %s", r, strerror(errno));
-                if (errno == ENETDOWN || errno == ENXIO) {
-                    return -1;
-                }
-            }
-            continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            if (errno != 0)
+                printf("receive_packet failed (%d): %s\n", r, strerror(errno));
+            if (errno == 0 || errno == EINTR || errno == ENETDOWN)
+                continue; /* filtered packet, or error of a link bounce */
+            break;
         }
 
 #if VERBOSE > 1
         dump_dhcp_msg(&reply, r);
 #endif
-        decode_dhcp_msg(&reply, r, &info);
-
-        if (state == STATE_SELECTING) {
-            valid_reply = is_valid_reply(&discover_msg, &reply, r);
-        } else {
-            valid_reply = is_valid_reply(&request_msg, &reply, r);
-        }
-        if (!valid_reply) {
-            printerr("invalid reply\n");
+        if (c->state == STATE_INIT || c->state == STATE_BOUND)
+            continue;
+        if (!is_valid_reply(&c->msg, &reply, r))
+            continue;
+        if (decode_dhcp_msg(&reply, r, &info))
             continue;
-        }
 
         if (verbose) dump_dhcp_info(&info);
 
-        switch(state) {
+        switch (c->state) {
         case STATE_SELECTING:
             if (info.type == DHCPOFFER) {
-                state = STATE_REQUESTING;
-                timeout = TIMEOUT_INITIAL;
-                xid++;
-                goto transmit;
+                c->offer = info;
+                c->state = STATE_REQUESTING;
+                c->tries = 0;
+                c->xid++;
+                dhcp_transmit(c);
+                dhcp_timer_set(c, TIMEOUT_INITIAL);
             }
             break;
         case STATE_REQUESTING:
+        case STATE_RENEWING:
+        case STATE_REBINDING:
             if (info.type == DHCPACK) {
-                printerr("configuring %s\n", ifname);
-                close(s);
-                return dhcp_configure(ifname, &info);
+                if (c->state == STATE_REQUESTING)
+                    printerr("configuring %s\n", c->ifname);
+                dhcp_bound(c, &info);
             } else if (info.type == DHCPNAK) {
                 printerr("configuration request denied\n");
-                close(s);
-                return -1;
+                if (c->state == STATE_REQUESTING)
+                    dhcp_discover(c);
+                else
+                    dhcp_lost(c);
             } else {
                 printerr("ignoring %s message in state %d\n",
-                         dhcp_type_to_name(info.type), state);
+                         dhcp_type_to_name(info.type), c->state);
             }
             break;
         }
     }
-    close(s);
-    return 0;
+}
+
+struct dhcp_client *dhcp_client_start(const char *ifname, dhcp_client_cb cb, void *arg)
+{
+    struct dhcp_client *c;
+
+    c = calloc(1, sizeof(*c));
+    if (c == NULL)
+        return NULL;
+
+    strncpy(c->ifname, ifname, sizeof(c->ifname) - 1);
+    c->cb = cb;
+    c->arg = arg;
+    c->sock = c->timerfd = -1;
+
+    if (if_get_hwaddr(ifname, c->hwaddr)) {
+        fatal("cannot obtain interface address");
+        goto error;
+    }
+    if ((c->if_index = if_nametoindex(ifname)) == 0) {
+        fatal("cannot obtain interface index");
+        goto error;
+    }
+
+    c->sock = open_raw_socket(ifname, c->hwaddr, c->if_index);
+    if (c->sock < 0)
+        goto error;
+
+    c->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (c->timerfd < 0) {
+        fatal("timerfd_create");
+        goto error;
+    }
+
+    c->xid = (uint32_t) get_msecs() ^ c->if_index;
+    dhcp_discover(c);
+    return c;
+
+error:
+    dhcp_client_stop(c);
+    return NULL;
+}
+
+void dhcp_client_restart(struct dhcp_client *c)
+{
+    memset(&c->lease, 0, sizeof(c->lease));
+    dhcp_discover(c);
+}
+
+void dhcp_client_stop(struct dhcp_client *c)
+{
+    if (c == NULL)
+        return;
+    if (c->sock >= 0)
+        close(c->sock);
+    if (c->timerfd >= 0)
+        close(c->timerfd);
+    free(c);
+}
+
+int dhcp_client_sock(const struct dhcp_client *c)
+{
+    return c->sock;
+}
+
+int dhcp_client_timerfd(const struct dhcp_client *c)
+{
+    return c->timerfd;
+}
+
+const char *dhcp_client_ifname(const struct dhcp_client *c)
+{
+    return c->ifname;
+}
+
+void dhcp_client_handle(struct dhcp_client *c, int fd)
+{
+    if (fd == c->timerfd) {
+        uint64_t expirations;
+
+        if (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+            dhcp_timeout(c);
+    } else if (fd == c->sock) {
+        dhcp_input(c);
+    }
+}
+
+struct dhcp_wait {
+    const char *ifname;
+    int done;
+    int ret;
+};
+
+static void dhcp_wait_cb(struct dhcp_client *c, int event, const dhcp_info *info, void *arg)
+{
+    struct dhcp_wait *w = (struct dhcp_wait *)arg;
+
+    (void)c;
+    w->done = 1;
+    if (event == DHCP_EVENT_BOUND || event == DHCP_EVENT_RENEWED)
+        w->ret = dhcp_configure(w->ifname, (dhcp_info *)info);
+    else
+        w->ret = -1;
+}
+
+/* blocking one-shot, kept for callers without an event loop */
+int dhcp_init_ifc(const char *ifname)
+{
+    struct dhcp_client *c;
+    struct dhcp_wait w = {ifname, 0, -1};
+    struct pollfd pfd[2];
+
+    c = dhcp_client_start(ifname, dhcp_wait_cb, &w);
+    if (c == NULL)
+        return -1;
+
+    pfd[0].fd = c->sock;
+    pfd[1].fd = c->timerfd;
+    while (!w.done) {
+        int i;
+
+        pfd[0].events = pfd[1].events = POLLIN;
+        pfd[0].revents = pfd[1].revents = 0;
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            fatal("poll failed");
+            break;
+        }
+        for (i = 0; i < 2 && !w.done; i++) {
+            if (pfd[i].revents)
+                dhcp_client_handle(c, pfd[i].fd);
+        }
+    }
+
+    dhcp_client_stop(c);
+    return w.ret;
 }
 
 int do_dhcp(char *iname)
@@ -24,6 +24,7 @@
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <netinet/udp.h>
+#include <linux/filter.h>
 #include <unistd.h>
 #include <stdio.h>
 
@@ -36,10 +37,29 @@ int open_raw_socket(const char *ifname __attribute__((unused)), uint8_t *hwaddr,
     int s;
     struct sockaddr_ll bindaddr;
 
-    if((s = socket(PF_PACKET, SOCK_DGRAM, htons(ETH_P_IP))) < 0) {
+    /* only unfragmented UDP to the DHCP client port gets past the kernel,
+     * the socket stays open for renewals without seeing the data traffic */
+    static struct sock_filter filter[] = {
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 9),                      /* ip protocol */
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 6),
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 6),                      /* fragment offset */
+        BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x1fff, 4, 0),
+        BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),                     /* X = ip header length */
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, 2),                      /* udp dest port */
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PORT_BOOTP_CLIENT, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, 0xffff),
+        BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+    struct sock_fprog fprog = {sizeof(filter) / sizeof(filter[0]), filter};
+
+    if((s = socket(PF_PACKET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, htons(ETH_P_IP))) < 0) {
         return fatal("socket(PF_PACKET)");
     }
 
+    if (setsockopt(s, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) < 0) {
+        fatal("SO_ATTACH_FILTER"); /* not fatal, receive_packet() filters too */
+    }
+
     memset(&bindaddr, 0, sizeof(bindaddr));
     bindaddr.sll_family = AF_PACKET;
     bindaddr.sll_protocol = htons(ETH_P_IP);
@@ -48,7 +68,9 @@ int open_raw_socket(const char *ifname __attribute__((unused)), uint8_t *hwaddr,
     bindaddr.sll_ifindex = if_index;
 
     if (bind(s, (struct sockaddr *)&bindaddr, sizeof(bindaddr)) < 0) {
-        return fatal("Cannot bind raw socket to interface");
+        fatal("Cannot bind raw socket to interface");
+        close(s);
+        return -1;
     }
 
     return s;
@@ -238,7 +260,7 @@ int receive_packet(int s, struct dhcp_msg *msg)
     packet.udp.check = temp;
     if (!sum)
         sum = finish_sum(sum);
-    if (temp != sum) {
+    if (temp != 0 && temp != sum) { /* 0: sender did not compute one (RFC 768) */
         printf("UDP header checksum failure (0x%x should be 0x%x)\n", sum, temp);
         return -1;
     }
@@ -12,6 +12,7 @@
 #include <sys/stat.h>
 #include <sys/fcntl.h>
 #include <sys/ioctl.h>
+#include <pthread.h>
 
 #include <linux/if_link.h>
 #include <linux/if_ether.h>
@@ -68,6 +69,7 @@ int if_get_hwaddr(const char *name, void *ptr)
         return -1;
     }
     r = ioctl(ifc_ctl_sock, SIOCGIFHWADDR, &ifr);
+    close(ifc_ctl_sock);
     if (r < 0)
         return -1;
 
@@ -75,210 +77,215 @@ int if_get_hwaddr(const char *name, void *ptr)
     return 0;
 }
 
-static int if_act_on_link(const char *ifname, int state)
-{
-    struct mnl_socket *nl;
-    char buf[MNL_SOCKET_BUFFER_SIZE];
-    struct nlmsghdr *nlh;
-    struct ifinfomsg *ifm;
-    int ret;
-    unsigned int seq, portid, change = 0, flags = 0;
-    static int oldstate = -1;
+/*
+ * One NETLINK_ROUTE socket is kept open for the life of the process and
+ * shared by every request below. It is dropped and reopened lazily after
+ * any socket level error, so a stale reply can never be matched later.
+ */
+static pthread_mutex_t if_nl_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mnl_socket *if_nl;
+static unsigned int if_nl_portid;
+static unsigned int if_nl_seq;
 
-    if (state == oldstate)
-        return 0;
-    oldstate = state;
+static struct mnl_socket *if_nl_get(void)
+{
+    if (if_nl)
+        return if_nl;
 
-    if (state)
+    if_nl = mnl_socket_open(NETLINK_ROUTE);
+    if (if_nl == NULL)
     {
-        change |= IFF_UP;
-        flags |= IFF_UP;
+        ERRMSG(" mnl_socket_open");
+        return NULL;
     }
-    else
+
+    if (mnl_socket_bind(if_nl, 0, MNL_SOCKET_AUTOPID) < 0)
     {
-        change |= IFF_UP;
-        flags &= ~IFF_UP;
+        ERRMSG(" mnl_socket_bind");
+        mnl_socket_close(if_nl);
+        if_nl = NULL;
+        return NULL;
     }
+    fcntl(mnl_socket_get_fd(if_nl), F_SETFD, FD_CLOEXEC);
+    if_nl_portid = mnl_socket_get_portid(if_nl);
+    if (if_nl_seq == 0)
+        if_nl_seq = time(NULL);
 
-    nlh = mnl_nlmsg_put_header(buf);
-    nlh->nlmsg_type = RTM_NEWLINK;
-    nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
-    nlh->nlmsg_seq = seq = time(NULL);
-    ifm = mnl_nlmsg_put_extra_header(nlh, sizeof(*ifm));
-    ifm->ifi_family = AF_UNSPEC;
-    ifm->ifi_change = change;
-    ifm->ifi_flags = flags;
+    return if_nl;
+}
 
-    mnl_attr_put_str(nlh, IFLA_IFNAME, ifname);
+static void if_nl_drop(void)
+{
+    if (if_nl)
+        mnl_socket_close(if_nl);
+    if_nl = NULL;
+}
 
-    nl = mnl_socket_open(NETLINK_ROUTE);
-    if (nl == NULL)
-    {
-        ERRMSG("mnl_socket_open");
-        return -1;
-    }
+/*
+ * Send len bytes of requests starting at nlh and keep reading until the
+ * reply set is complete: NLMSG_DONE when cb_ctl is NULL, otherwise until
+ * cb_ctl (called for every NLMSG_ERROR) returns MNL_CB_STOP.
+ * Caller holds if_nl_lock.
+ */
+static int if_nl_xfer(struct nlmsghdr *nlh, size_t len, unsigned int seq,
+                      mnl_cb_t cb, mnl_cb_t cb_ctl, void *data)
+{
+    struct mnl_socket *nl;
+    char buf[MNL_SOCKET_BUFFER_SIZE];
+    mnl_cb_t ctl[NLMSG_MIN_TYPE] = {NULL};
+    int ret;
 
-    if (mnl_socket_bind(nl, 0, MNL_SOCKET_AUTOPID) < 0)
-    {
-        ERRMSG(" mnl_socket_bind");
+    nl = if_nl_get();
+    if (nl == NULL)
         return -1;
-    }
-    portid = mnl_socket_get_portid(nl);
 
-    if (mnl_socket_sendto(nl, nlh, nlh->nlmsg_len) < 0)
+    if (mnl_socket_sendto(nl, nlh, len) < 0)
     {
         ERRMSG(" mnl_socket_sendto");
+        if_nl_drop();
         return -1;
     }
 
+    ctl[NLMSG_ERROR] = cb_ctl;
     ret = mnl_socket_recvfrom(nl, buf, sizeof(buf));
-    if (ret == -1)
+    while (ret > 0)
     {
-        ERRMSG(" mnl_socket_recvfrom");
-        return -1;
+        if (cb_ctl)
+            ret = mnl_cb_run2(buf, ret, seq, if_nl_portid, cb, data, ctl, NLMSG_MIN_TYPE);
+        else
+            ret = mnl_cb_run(buf, ret, seq, if_nl_portid, cb, data);
+        if (ret <= MNL_CB_STOP)
+            break;
+        ret = mnl_socket_recvfrom(nl, buf, sizeof(buf));
     }
 
-    ret = mnl_cb_run(buf, ret, seq, portid, NULL, NULL);
     if (ret == -1)
     {
         ERRMSG(" mnl_cb_run");
+        if_nl_drop();
         return -1;
     }
 
-    mnl_socket_close(nl);
-
     return 0;
 }
 
-int if_link_up(const char *ifname)
+/* dump request, replies run through cb until NLMSG_DONE */
+static int if_nl_talk(struct nlmsghdr *nlh, mnl_cb_t cb, void *data)
 {
-    return if_act_on_link(ifname, 1);
+    int ret;
+
+    pthread_mutex_lock(&if_nl_lock);
+    nlh->nlmsg_seq = ++if_nl_seq;
+    ret = if_nl_xfer(nlh, nlh->nlmsg_len, nlh->nlmsg_seq, cb, NULL, data);
+    pthread_mutex_unlock(&if_nl_lock);
+
+    return ret;
 }
 
-int if_link_down(const char *ifname)
+int if_batch_init(struct if_batch *b, const char *ifname)
 {
-    return if_act_on_link(ifname, 0);
+    memset(b, 0, sizeof(*b));
+    b->ifname = ifname;
+    b->failed = -1;
+    b->iface = if_nametoindex(ifname);
+    if (b->iface == 0)
+    {
+        ERRMSG(" if_nametoindex");
+        return -1;
+    }
+    return 0;
 }
 
-int if_set_mtu(const char *ifname, uint32_t mtu)
+static struct nlmsghdr *if_batch_put(struct if_batch *b, uint16_t type, uint16_t flags)
 {
-    char buf[MNL_SOCKET_BUFFER_SIZE];
-    unsigned int seq, portid;
-    struct mnl_socket *nl;
     struct nlmsghdr *nlh;
-    struct ifinfomsg *ifm;
-    int ret;
-    int iface;
-    static uint32_t oldmtu = 1500;
 
-    if (mtu == oldmtu)
-        return 0;
-    oldmtu = mtu;
-
-    iface = if_nametoindex(ifname);
-    if (iface == 0)
+    /* header + ancillary header + a few addresses always fit in 256 bytes */
+    if (b->len + 256 > sizeof(b->buf))
     {
-        ERRMSG(" if_nametoindex");
-        return -1;
+        b->overflow = 1;
+        return NULL;
     }
 
-    nlh = mnl_nlmsg_put_header(buf);
-    nlh->nlmsg_type = RTM_NEWLINK;
-    nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
-    nlh->nlmsg_seq = seq = time(NULL);
-    ifm = mnl_nlmsg_put_extra_header(nlh, sizeof(struct ifinfomsg));
-    ifm->ifi_family = AF_UNSPEC;
-    ifm->ifi_index = iface;
-    ifm->ifi_change = 0xFFFFFFFF;
-    ifm->ifi_type = ifm->ifi_flags = 0;
+    nlh = mnl_nlmsg_put_header(b->buf + b->len);
+    nlh->nlmsg_type = type;
+    nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+    return nlh;
+}
 
-    mnl_attr_put_u32(nlh, IFLA_MTU, mtu);
+static int if_batch_next(struct if_batch *b, struct nlmsghdr *nlh)
+{
+    b->len += nlh->nlmsg_len;
+    b->num++;
+    return 0;
+}
 
-    nl = mnl_socket_open(NETLINK_ROUTE);
-    if (nl == NULL)
-    {
-        ERRMSG(" mnl_socket_open");
-        return -1;
-    }
+int if_batch_link(struct if_batch *b, int up)
+{
+    struct nlmsghdr *nlh;
+    struct ifinfomsg *ifm;
 
-    if (mnl_socket_bind(nl, 0, MNL_SOCKET_AUTOPID) < 0)
-    {
-        ERRMSG(" mnl_socket_bind");
+    nlh = if_batch_put(b, RTM_NEWLINK, 0);
+    if (nlh == NULL)
         return -1;
-    }
-    portid = mnl_socket_get_portid(nl);
 
-    if (mnl_socket_sendto(nl, nlh, nlh->nlmsg_len) < 0)
-    {
-        ERRMSG(" mnl_socket_sendto");
-        return -1;
-    }
+    ifm = mnl_nlmsg_put_extra_header(nlh, sizeof(*ifm));
+    ifm->ifi_family = AF_UNSPEC;
+    ifm->ifi_index = b->iface;
+    ifm->ifi_change = IFF_UP;
+    ifm->ifi_flags = up ? IFF_UP : 0;
 
-    ret = mnl_socket_recvfrom(nl, buf, sizeof(buf));
-    if (ret == -1)
-    {
-        ERRMSG(" mnl_socket_recvfrom");
-        return -1;
-    }
+    return if_batch_next(b, nlh);
+}
 
-    ret = mnl_cb_run(buf, ret, seq, portid, NULL, NULL);
-    if (ret == -1)
-    {
-        ERRMSG(" mnl_cb_run");
+int if_batch_mtu(struct if_batch *b, uint32_t mtu)
+{
+    struct nlmsghdr *nlh;
+    struct ifinfomsg *ifm;
+
+    nlh = if_batch_put(b, RTM_NEWLINK, 0);
+    if (nlh == NULL)
         return -1;
-    }
 
-    mnl_socket_close(nl);
+    ifm = mnl_nlmsg_put_extra_header(nlh, sizeof(*ifm));
+    ifm->ifi_family = AF_UNSPEC;
+    ifm->ifi_index = b->iface;
+    /* MTU only, do not touch IFF_UP and friends */
+    ifm->ifi_change = 0;
+    ifm->ifi_type = ifm->ifi_flags = 0;
 
-    return 0;
+    mnl_attr_put_u32(nlh, IFLA_MTU, mtu);
+
+    return if_batch_next(b, nlh);
 }
 
 /**
- * @brief Set the ip addr object
+ * @brief queue an address add/delete
  * 
  * @param operate 
- *  0 -> add address on interface
- *  1 -> delete address on interface
- * @param ifname 
- * @param ipaddr 
- * @param prefix 
- * @return int 
+ *  1 -> add address on interface
+ *  0 -> delete address on interface
+ * @param proto
+ *  AF_INET or AF_INET6
  */
-static int if_act_on_addr(bool operate, int proto, const char *ifname, addr_t *ipaddr, uint32_t prefix)
+int if_batch_addr(struct if_batch *b, bool operate, int proto, addr_t *ipaddr, uint32_t prefix)
 {
-    struct mnl_socket *nl;
-    char buf[MNL_SOCKET_BUFFER_SIZE];
     struct nlmsghdr *nlh;
     struct ifaddrmsg *ifm;
-    uint32_t seq, portid;
-    int ret, family = proto;
+    int family = proto;
 
-    int iface;
-
-    iface = if_nametoindex(ifname);
-    if (iface == 0)
-    {
-        ERRMSG(" if_nametoindex");
+    nlh = if_batch_put(b, operate ? RTM_NEWADDR : RTM_DELADDR, NLM_F_CREATE | NLM_F_REPLACE);
+    if (nlh == NULL)
         return -1;
-    }
-
-    nlh = mnl_nlmsg_put_header(buf);
-    if (operate)
-        nlh->nlmsg_type = RTM_NEWADDR;
-    else
-        nlh->nlmsg_type = RTM_DELADDR;
-
-    nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_CREATE | NLM_F_REPLACE | NLM_F_ACK;
-    nlh->nlmsg_seq = seq = time(NULL);
 
     ifm = mnl_nlmsg_put_extra_header(nlh, sizeof(struct ifaddrmsg));
 
     ifm->ifa_family = family;
     ifm->ifa_prefixlen = prefix;
-    ifm->ifa_flags = IFA_F_PERMANENT;
+    ifm->ifa_flags = IFA_F_PERMANENT | (operate ? b->addr_flags : 0);
 
     ifm->ifa_scope = RT_SCOPE_UNIVERSE;
-    ifm->ifa_index = iface;
+    ifm->ifa_index = b->iface;
 
     /*
 	 * The exact meaning of IFA_LOCAL and IFA_ADDRESS depend
@@ -297,43 +304,163 @@ static int if_act_on_addr(bool operate, int proto, const char *ifname, addr_t *i
         mnl_attr_put(nlh, IFA_ADDRESS, sizeof(struct in6_addr), ipaddr);
     }
 
-    nl = mnl_socket_open(NETLINK_ROUTE);
-    if (nl == NULL)
-    {
-        ERRMSG(" mnl_socket_open");
+    return if_batch_next(b, nlh);
+}
+
+/**
+ * @brief queue a route add/delete
+ *   Usage: 
+ *      iface destination cidr [gateway]
+ *   Example:
+ *      eth0 10.0.1.12 32 10.0.1.11
+ *      eth0 ffff::10.0.1.12 128 fdff::1
+ * @param operate
+ *  add or del
+ * @param dstaddr 
+ * @param prefix 
+ * @param gwaddr 
+ *  NULL for an on-link route
+ */
+int if_batch_route(struct if_batch *b, bool operate, int proto, addr_t *dstaddr, uint32_t prefix, addr_t *gwaddr)
+{
+    struct nlmsghdr *nlh;
+    struct rtmsg *rtm;
+    int family = proto;
+
+    nlh = if_batch_put(b, operate ? RTM_NEWROUTE : RTM_DELROUTE, NLM_F_CREATE);
+    if (nlh == NULL)
         return -1;
+
+    rtm = mnl_nlmsg_put_extra_header(nlh, sizeof(struct rtmsg));
+    rtm->rtm_family = family;
+    rtm->rtm_dst_len = prefix;
+    rtm->rtm_src_len = 0;
+    rtm->rtm_tos = 0;
+    rtm->rtm_protocol = RTPROT_STATIC;
+    rtm->rtm_table = RT_TABLE_MAIN;
+    rtm->rtm_type = RTN_UNICAST;
+    /* is there any gateway? */
+    rtm->rtm_scope = gwaddr ? RT_SCOPE_UNIVERSE : RT_SCOPE_LINK;
+    rtm->rtm_flags = 0;
+
+    if (family == AF_INET)
+        mnl_attr_put_u32(nlh, RTA_DST, dstaddr->ip);
+    else
+        mnl_attr_put(nlh, RTA_DST, sizeof(struct in6_addr), dstaddr);
+
+    mnl_attr_put_u32(nlh, RTA_OIF, b->iface);
+    if (gwaddr)
+    {
+        if (family == AF_INET)
+            mnl_attr_put_u32(nlh, RTA_GATEWAY, gwaddr->ip);
+        else
+        {
+            mnl_attr_put(nlh, RTA_GATEWAY, sizeof(struct in6_addr), gwaddr);
+        }
     }
 
-    if (mnl_socket_bind(nl, 0, MNL_SOCKET_AUTOPID) < 0)
+    return if_batch_next(b, nlh);
+}
+
+static int if_batch_ack_cb(const struct nlmsghdr *nlh, void *data)
+{
+    struct if_batch *b = (struct if_batch *)data;
+    const struct nlmsgerr *err = mnl_nlmsg_get_payload(nlh);
+    int idx = nlh->nlmsg_seq - b->seq;
+
+    if (nlh->nlmsg_len < mnl_nlmsg_size(sizeof(struct nlmsgerr)) || idx < 0 || idx >= b->num)
     {
-        ERRMSG(" mnl_socket_bind");
-        return -1;
+        errno = EBADMSG;
+        return MNL_CB_ERROR;
     }
-    portid = mnl_socket_get_portid(nl);
 
-    if (mnl_socket_sendto(nl, nlh, nlh->nlmsg_len) < 0)
+    if (err->error && b->failed < 0)
     {
-        ERRMSG(" mnl_socket_sendto");
-        return -1;
+        b->failed = idx;
+        b->error = -err->error;
     }
 
-    ret = mnl_socket_recvfrom(nl, buf, sizeof(buf));
-    if (ret < 0)
+    return ++b->acked < b->num ? MNL_CB_OK : MNL_CB_STOP;
+}
+
+/*
+ * Send every queued message in one sendto() and collect one ACK per message.
+ * The kernel applies them in order and keeps going after a NACK, so the
+ * caller should queue them in a safe order (flush, address, link, route).
+ * Returns 0 when all succeeded, else -1 with b->failed/b->error set.
+ */
+int if_batch_commit(struct if_batch *b)
+{
+    struct nlmsghdr *nlh;
+    size_t off;
+    int i, ret;
+
+    if (b->overflow)
     {
-        ERRMSG(" mnl_socket_recvfrom");
+        errno = ENOSPC;
         return -1;
     }
+    if (b->num == 0)
+        return 0;
 
-    ret = mnl_cb_run(buf, ret, seq, portid, NULL, NULL);
-    if (ret < 0)
+    pthread_mutex_lock(&if_nl_lock);
+    b->seq = if_nl_seq + 1;
+    for (i = 0, off = 0; i < b->num; i++, off += nlh->nlmsg_len)
     {
-        ERRMSG(" mnl_cb_run");
-        return -1;
+        nlh = (struct nlmsghdr *)(b->buf + off);
+        nlh->nlmsg_seq = ++if_nl_seq;
     }
+    b->acked = 0;
+    ret = if_nl_xfer((struct nlmsghdr *)b->buf, b->len, 0, NULL, if_batch_ack_cb, b);
+    pthread_mutex_unlock(&if_nl_lock);
 
-    mnl_socket_close(nl);
+    if (ret == 0 && b->failed >= 0)
+    {
+        errno = b->error;
+        ret = -1;
+    }
 
-    return 0;
+    return ret;
+}
+
+static int if_act_on_link(const char *ifname, int state)
+{
+    struct if_batch b;
+
+    if (if_batch_init(&b, ifname))
+        return -1;
+    if_batch_link(&b, state);
+    return if_batch_commit(&b);
+}
+
+int if_link_up(const char *ifname)
+{
+    return if_act_on_link(ifname, 1);
+}
+
+int if_link_down(const char *ifname)
+{
+    return if_act_on_link(ifname, 0);
+}
+
+int if_set_mtu(const char *ifname, uint32_t mtu)
+{
+    struct if_batch b;
+
+    if (if_batch_init(&b, ifname))
+        return -1;
+    if_batch_mtu(&b, mtu);
+    return if_batch_commit(&b);
+}
+
+static int if_act_on_addr(bool operate, int proto, const char *ifname, addr_t *ipaddr, uint32_t prefix)
+{
+    struct if_batch b;
+
+    if (if_batch_init(&b, ifname))
+        return -1;
+    if_batch_addr(&b, operate, proto, ipaddr, prefix);
+    return if_batch_commit(&b);
 }
 
 int if_set_addr_v4(const char *ifname, in_addr_t ipaddr, uint32_t prefix)
@@ -405,6 +532,8 @@ static int data_cb(const struct nlmsghdr *nlh, void *data)
             ERRMSG("inet_ntop");
         // printf("%d %d-> %d %s\n", addrinfo->iface, ifa->ifa_index, ifa->ifa_scope, out);
 
+        if (addrinfo->num >= MAX_IP_NUM)
+            return MNL_CB_OK;
         addrinfo->addrs[addrinfo->num].prefix = ifa->ifa_prefixlen;
         if (ifa->ifa_index == (unsigned int)addrinfo->iface)
         {
@@ -438,11 +567,8 @@ static int data_cb(const struct nlmsghdr *nlh, void *data)
 static int if_get_addr(const char *ifname, int proto, struct addrinfo_t *addrinfo)
 {
     char buf[MNL_SOCKET_BUFFER_SIZE];
-    unsigned int seq, portid;
-    struct mnl_socket *nl;
     struct nlmsghdr *nlh;
     struct rtgenmsg *rt;
-    int ret;
 
     addrinfo->iface = if_nametoindex(ifname);
     if (addrinfo->iface == 0)
@@ -454,186 +580,81 @@ static int if_get_addr(const char *ifname, int proto, struct addrinfo_t *addrinf
     nlh = mnl_nlmsg_put_header(buf);
     nlh->nlmsg_type = RTM_GETADDR;
     nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
-    nlh->nlmsg_seq = seq = time(NULL);
     rt = mnl_nlmsg_put_extra_header(nlh, sizeof(struct rtgenmsg));
     if (proto == AF_INET)
         rt->rtgen_family = AF_INET;
     else if (proto == AF_INET6)
         rt->rtgen_family = AF_INET6;
 
-    nl = mnl_socket_open(NETLINK_ROUTE);
-    if (nl == NULL)
-    {
-        ERRMSG(" mnl_socket_open");
-        return -1;
-    }
-
-    if (mnl_socket_bind(nl, 0, MNL_SOCKET_AUTOPID) < 0)
-    {
-        ERRMSG(" mnl_socket_bind");
-        return -1;
-    }
-    portid = mnl_socket_get_portid(nl);
-
-    if (mnl_socket_sendto(nl, nlh, nlh->nlmsg_len) < 0)
-    {
-        ERRMSG(" mnl_socket_sendto");
-        return -1;
-    }
-
-    ret = mnl_socket_recvfrom(nl, buf, sizeof(buf));
-    while (ret > 0)
-    {
-        ret = mnl_cb_run(buf, ret, seq, portid, data_cb, addrinfo);
-        if (ret <= MNL_CB_STOP)
-            break;
-        ret = mnl_socket_recvfrom(nl, buf, sizeof(buf));
-    }
-    if (ret == -1)
-    {
-        ERRMSG(" error");
-        return -1;
-    }
-    mnl_socket_close(nl);
-
-    return 0;
+    return if_nl_talk(nlh, data_cb, addrinfo);
 }
 
-int if_flush_v4_addr(const char *ifname)
+/* queue RTM_DELADDR for every proto address currently on the interface */
+int if_batch_flush_addr(struct if_batch *b, int proto)
 {
     struct addrinfo_t addrinfo;
-    int i = 0;
-    
+    int i;
+
     memset(&addrinfo, 0, sizeof(struct addrinfo_t));
-    if_get_addr(ifname, AF_INET, &addrinfo);
-    for (; i < addrinfo.num; i++)
+    if (if_get_addr(b->ifname, proto, &addrinfo))
+        return -1;
+
+    for (i = 0; i < addrinfo.num; i++)
     {
-        // printf("remove address: %s\n", ipaddr_to_string_v4(addrinfo.addrs[i].address.ip));
-        if_del_addr_v4(ifname, addrinfo.addrs[i].address.ip, addrinfo.addrs[i].prefix);
+        if (if_batch_addr(b, 0, proto, &addrinfo.addrs[i].address, addrinfo.addrs[i].prefix))
+            return -1;
     }
     return 0;
 }
 
-int if_flush_v6_addr(const char *ifname)
+/* 1 if the kernel reports ipaddr on the interface, read back without touching the link */
+int if_has_addr(const char *ifname, int proto, addr_t *ipaddr)
 {
     struct addrinfo_t addrinfo;
-    int i = 0;
-    
+    size_t len = (proto == AF_INET) ? sizeof(in_addr_t) : sizeof(struct in6_addr);
+    int i;
+
     memset(&addrinfo, 0, sizeof(struct addrinfo_t));
-    if_get_addr(ifname, AF_INET6, &addrinfo);
-    for (; i < addrinfo.num; i++)
+    if (if_get_addr(ifname, proto, &addrinfo))
+        return 0;
+
+    for (i = 0; i < addrinfo.num; i++)
     {
-        // printf("remove address: %s\n", ipaddr_to_string_v6(addrinfo.addrs[i].address.ip6.s6_addr));
-        if_del_addr_v6(ifname, addrinfo.addrs[i].address.ip6.s6_addr, addrinfo.addrs[i].prefix);
+        if (!memcmp(&addrinfo.addrs[i].address, ipaddr, len))
+            return 1;
     }
     return 0;
 }
 
-/**
- * @brief Set the route addr object
- *   Usage: 
- *      iface destination cidr [gateway]
- *   Example:
- *      eth0 10.0.1.12 32 10.0.1.11
- *      eth0 ffff::10.0.1.12 128 fdff::1
- * @param operate
- *  add or del
- * @param ifname 
- * @param dstaddr 
- * @param prefix 
- * @param gwaddr 
- * @return int 
- */
-int if_act_on_route(bool operate, int proto, const char *ifname, addr_t *dstaddr, uint32_t prefix, addr_t *gwaddr)
+static int if_flush_addr(const char *ifname, int proto)
 {
-    struct mnl_socket *nl;
-    char buf[MNL_SOCKET_BUFFER_SIZE];
-    struct nlmsghdr *nlh;
-    struct rtmsg *rtm;
-    uint32_t seq, portid;
-    int iface, ret, family = proto;
+    struct if_batch b;
 
-    iface = if_nametoindex(ifname);
-    if (iface == 0)
-    {
-        ERRMSG(" if_nametoindex");
+    if (if_batch_init(&b, ifname))
         return -1;
-    }
-
-    nlh = mnl_nlmsg_put_header(buf);
-    if (operate)
-        nlh->nlmsg_type = RTM_NEWROUTE;
-    else
-        nlh->nlmsg_type = RTM_DELROUTE;
-
-    nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_CREATE | NLM_F_ACK;
-    nlh->nlmsg_seq = seq = time(NULL);
-
-    rtm = mnl_nlmsg_put_extra_header(nlh, sizeof(struct rtmsg));
-    rtm->rtm_family = family;
-    rtm->rtm_dst_len = prefix;
-    rtm->rtm_src_len = 0;
-    rtm->rtm_tos = 0;
-    rtm->rtm_protocol = RTPROT_STATIC;
-    rtm->rtm_table = RT_TABLE_MAIN;
-    rtm->rtm_type = RTN_UNICAST;
-    /* is there any gateway? */
-    rtm->rtm_scope = gwaddr ? RT_SCOPE_UNIVERSE : RT_SCOPE_LINK;
-    rtm->rtm_flags = 0;
-
-    if (family == AF_INET)
-        mnl_attr_put_u32(nlh, RTA_DST, dstaddr->ip);
-    else
-        mnl_attr_put(nlh, RTA_DST, sizeof(struct in6_addr), dstaddr);
-
-    mnl_attr_put_u32(nlh, RTA_OIF, iface);
-    if (gwaddr)
-    {
-        if (family == AF_INET)
-            mnl_attr_put_u32(nlh, RTA_GATEWAY, gwaddr->ip);
-        else
-        {
-            mnl_attr_put(nlh, RTA_GATEWAY, sizeof(struct in6_addr), gwaddr);
-        }
-    }
-
-    nl = mnl_socket_open(NETLINK_ROUTE);
-    if (nl == NULL)
-    {
-        ERRMSG(" mnl_socket_open");
+    if (if_batch_flush_addr(&b, proto))
         return -1;
-    }
+    return if_batch_commit(&b);
+}
 
-    if (mnl_socket_bind(nl, 0, MNL_SOCKET_AUTOPID) < 0)
-    {
-        ERRMSG(" mnl_socket_bind");
-        return -1;
-    }
-    portid = mnl_socket_get_portid(nl);
+int if_flush_v4_addr(const char *ifname)
+{
+    return if_flush_addr(ifname, AF_INET);
+}
 
-    if (mnl_socket_sendto(nl, nlh, nlh->nlmsg_len) < 0)
-    {
-        ERRMSG(" mnl_socket_sendto");
-        return -1;
-    }
+int if_flush_v6_addr(const char *ifname)
+{
+    return if_flush_addr(ifname, AF_INET6);
+}
 
-    ret = mnl_socket_recvfrom(nl, buf, sizeof(buf));
-    if (ret < 0)
-    {
-        ERRMSG(" mnl_socket_recvfrom");
-        return -1;
-    }
+int if_act_on_route(bool operate, int proto, const char *ifname, addr_t *dstaddr, uint32_t prefix, addr_t *gwaddr)
+{
+    struct if_batch b;
 
-    ret = mnl_cb_run(buf, ret, seq, portid, NULL, NULL);
-    if (ret < 0)
-    {
-        ERRMSG(" mnl_cb_run");
+    if (if_batch_init(&b, ifname))
         return -1;
-    }
-
-    mnl_socket_close(nl);
-
-    return 0;
+    if_batch_route(&b, operate, proto, dstaddr, prefix, gwaddr);
+    return if_batch_commit(&b);
 }
 
 int if_set_default_route_v4(const char *ifname)
@@ -711,7 +732,7 @@ int if_set_dns(const char *dns1, const char *dns2)
     if (dns1)
         snprintf(buf, sizeof(buf), "nameserver %s\n", dns1);
     if (dns2)
-        snprintf(buf, sizeof(buf), "nameserver %s\n", dns2);
+        snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), "nameserver %s\n", dns2);
     ret = write(fd, buf, strlen(buf));
     if (ret < 0)
     {
@@ -724,10 +745,17 @@ int if_set_dns(const char *dns1, const char *dns2)
 int if_set_network_v4(const char *ifname, in_addr_t ipaddr, uint32_t prefix,
                       in_addr_t gwaddr, in_addr_t dns1, in_addr_t dns2)
 {
+    struct if_batch b;
+    addr_t addr;
+
     (void)gwaddr;
-    if_link_up(ifname);
-    if_set_addr_v4(ifname, ipaddr, prefix);
-    if_set_default_route_v4(ifname);
+    if (if_batch_init(&b, ifname))
+        return -1;
+    addr.ip = ipaddr;
+    if_batch_addr(&b, 1, AF_INET, &addr, prefix);
+    if_batch_link(&b, 1);
+    if_batch_route(&b, 1, AF_INET, (addr_t *)&in6addr_any, 0, NULL);
+    if_batch_commit(&b);
     if_set_dns(ipaddr_to_string_v4(dns1), ipaddr_to_string_v4(dns2));
     return 0;
 }
@@ -735,10 +763,17 @@ int if_set_network_v4(const char *ifname, in_addr_t ipaddr, uint32_t prefix,
 int if_set_network_v6(const char *ifname, uint8_t *ipaddr, uint32_t prefix,
                       uint8_t *gwaddr, uint8_t *dns1, uint8_t *dns2)
 {
+    struct if_batch b;
+    addr_t addr;
+
     (void)gwaddr;
-    if_link_up(ifname);
-    if_set_addr_v6(ifname, ipaddr, prefix);
-    if_set_default_route_v6(ifname);
+    if (if_batch_init(&b, ifname))
+        return -1;
+    memcpy(&addr.ip6, ipaddr, 16);
+    if_batch_addr(&b, 1, AF_INET6, &addr, prefix);
+    if_batch_link(&b, 1);
+    if_batch_route(&b, 1, AF_INET6, (addr_t *)&in6addr_any, 0, NULL);
+    if_batch_commit(&b);
     if_set_dns(ipaddr_to_string_v6(dns1), ipaddr_to_string_v6(dns2));
     return 0;
 }
\ No newline at end of file
@@ -1,6 +1,11 @@
 #ifndef __IFUTILS_H__
 #define __IFUTILS_H__
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
 typedef union {
     in_addr_t ip;
     struct in6_addr ip6;
@@ -34,6 +39,9 @@ int if_set_addr_v6(const char *name, uint8_t *address, uint32_t prefixlen);
 int if_del_addr_v6(const char *name, uint8_t *address, uint32_t prefixlen);
 int if_flush_v4_addr(const char *ifname);
 int if_flush_v6_addr(const char *ifname);
+int if_has_addr(const char *ifname, int proto, addr_t *ipaddr);
+
+int if_act_on_route(bool operate, int proto, const char *ifname, addr_t *dstaddr, uint32_t prefix, addr_t *gwaddr);
 
 int if_set_route_gw_v4(const char *ifname, in_addr_t gwaddr);
 int if_del_route_gw_v4(const char *ifname, in_addr_t gwaddr);
@@ -45,6 +53,34 @@ int if_del_route_gw_v6(const char *ifname, uint8_t *gwaddr);
 int if_set_default_route_v6(const char *ifname);
 int if_del_default_route_v6(const char *ifname);
 
+/*
+ * Batched reconfiguration: queue link/MTU/address/route changes for one
+ * interface, then if_batch_commit() sends them as a single multi-part
+ * message on the shared netlink socket and collects every ACK at once.
+ */
+struct if_batch
+{
+    const char *ifname;
+    int iface;
+    int num;        /* messages queued */
+    int acked;
+    int failed;     /* index of the first NACKed message, -1 if none */
+    int error;      /* errno of that NACK */
+    int overflow;
+    unsigned char addr_flags; /* extra IFA_F_* for added addresses */
+    unsigned int seq;
+    size_t len;
+    char buf[4096];
+};
+
+int if_batch_init(struct if_batch *b, const char *ifname);
+int if_batch_link(struct if_batch *b, int up);
+int if_batch_mtu(struct if_batch *b, uint32_t mtu);
+int if_batch_flush_addr(struct if_batch *b, int proto);
+int if_batch_addr(struct if_batch *b, bool operate, int proto, addr_t *ipaddr, uint32_t prefix);
+int if_batch_route(struct if_batch *b, bool operate, int proto, addr_t *dstaddr, uint32_t prefix, addr_t *gwaddr);
+int if_batch_commit(struct if_batch *b);
+
 int if_set_network_v4(const char *ifname, in_addr_t ipaddr, uint32_t prefix,
                       in_addr_t gwaddr, in_addr_t dns1, in_addr_t dns2);
 int if_set_network_v6(const char *ifname, uint8_t *ipaddr, uint32_t prefix,
@@ -18,6 +18,9 @@
 #include <sys/wait.h>
 #include <sys/utsname.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
 #include <dirent.h>
 #include <libxml/parser.h>
 #include <libxml/tree.h>
@@ -27,7 +30,28 @@
 char *apnConfigfile = NULL;
 int debug_qmi = 0;
 int qmidevice_control_fd[2];
-static int signal_control_fd[2];
+static int main_signalfd = -1;
+
+/* SIG_EVENT_* queued by the main thread for itself, drained before each epoll_wait,
+ * pdn NULL means every PDN of this process. Equal events are coalesced, so the
+ * queue holds at most one START and one CHECK per target. SIG_EVENT_STOP is
+ * kept apart in s_main_event_stop and is never dropped */
+#define MAIN_EVENT_QUEUE_SIZE 16
+static struct {
+    int signo;
+    PROFILE_T *pdn;
+} s_main_events[MAIN_EVENT_QUEUE_SIZE];
+static unsigned s_main_event_head, s_main_event_tail;
+static int s_main_event_stop;
+
+/* fds of other main-thread modules (the in-process DHCP client), serviced by the main loop */
+#define MAIN_WATCH_SIZE 16
+static struct {
+    int fd;
+    main_fd_handler handler;
+    void *arg;
+} s_main_watch[MAIN_WATCH_SIZE];
+static int s_main_epoll_fd = -1;
 
 extern int ql_ifconfig(int argc, char *argv[]);
 extern int ql_get_netcard_driver_info(const char*);
@@ -96,16 +120,15 @@ void parseXml(const char *filename, const char *searchMcc, const char *searchMnc
 }
 
 //UINT ifc_get_addr(const char *ifname);
-static int s_link = -1;
-static void usbnet_link_state(int state)
+static void usbnet_link_state(PROFILE_T *profile, int state)
 {
-    s_link = state ? 1 : 0;
+    profile->usbnet_link = state ? 1 : 0;
 }
 static void usbnet_link_change(int link, PROFILE_T *profile) {
-    if (s_link == link)
+    if (profile->usbnet_link == link)
         return;
 
-    s_link = link;
+    profile->usbnet_link = link;
 
     if (!(link & (1<<IpFamilyV4)))
         memset(&profile->ipv4, 0, sizeof(IPV4_T));
@@ -118,6 +141,9 @@ static void usbnet_link_change(int link, PROFILE_T *profile) {
     } else {
         udhcpc_stop(profile);
     }
+    ql_status_set_link(profile);
+    metric_set(METRIC_PDN_CONNECTED, !!(link & (1<<IpFamilyV4)), "pdn=\"%d\",family=\"ipv4\"", profile->pdp);
+    metric_set(METRIC_PDN_CONNECTED, !!(link & (1<<IpFamilyV6)), "pdn=\"%d\",family=\"ipv6\"", profile->pdp);
 }
 
 static int check_ipv4_address(PROFILE_T *profile) {
@@ -145,8 +171,113 @@ static void main_send_event_to_qmidevice(int triger_event) {
      if (write(qmidevice_control_fd[0], &triger_event, sizeof(triger_event)) == -1) {};
 }
 
+static void send_signo_to_pdn(int signo, PROFILE_T *pdn) {
+    unsigned i;
+
+    if (signo == SIG_EVENT_STOP) {
+        s_main_event_stop = 1;
+        return;
+    }
+
+    //START and CHECK only ask for work, one queued copy is as good as two
+    for (i = s_main_event_head; i != s_main_event_tail; i++) {
+        unsigned j = i % MAIN_EVENT_QUEUE_SIZE;
+
+        if (s_main_events[j].signo == signo && s_main_events[j].pdn == pdn)
+            return;
+    }
+
+    if (s_main_event_tail - s_main_event_head >= MAIN_EVENT_QUEUE_SIZE) {
+        dbg_time("%s queue overflow, drop signo %d of pdn-%d", __func__, signo, pdn ? pdn->pdp : -1);
+        return;
+    }
+    i = s_main_event_tail++ % MAIN_EVENT_QUEUE_SIZE;
+    s_main_events[i].signo = signo;
+    s_main_events[i].pdn = pdn;
+}
+
 static void send_signo_to_main(int signo) {
-     if (write(signal_control_fd[0], &signo, sizeof(signo)) == -1) {};
+    send_signo_to_pdn(signo, NULL);
+}
+
+static int main_event_pending(void) {
+    return s_main_event_stop || s_main_event_tail != s_main_event_head;
+}
+
+static int main_event_pop(int *signo, PROFILE_T **pdn) {
+    unsigned i;
+
+    //nothing else matters once a stop is pending
+    if (s_main_event_stop) {
+        s_main_event_stop = 0;
+        *signo = SIG_EVENT_STOP;
+        *pdn = NULL;
+        return 1;
+    }
+    if (!main_event_pending())
+        return 0;
+    i = s_main_event_head++ % MAIN_EVENT_QUEUE_SIZE;
+    *signo = s_main_events[i].signo;
+    *pdn = s_main_events[i].pdn;
+    return 1;
+}
+
+int main_watch_fd(int fd, main_fd_handler handler, void *arg) {
+    int i;
+
+    if (s_main_epoll_fd < 0 || fd < 0)
+        return -EINVAL;
+
+    for (i = 0; i < MAIN_WATCH_SIZE; i++) {
+        if (s_main_watch[i].handler == NULL) {
+            if (epoll_register(s_main_epoll_fd, fd, EPOLLIN) < 0)
+                return -errno;
+            s_main_watch[i].fd = fd;
+            s_main_watch[i].handler = handler;
+            s_main_watch[i].arg = arg;
+            return 0;
+        }
+    }
+
+    return -ENOSPC;
+}
+
+/* switch a watched fd between EPOLLIN and EPOLLOUT, its handler is called for either */
+int main_watch_fd_events(int fd, unsigned int events) {
+    int i;
+
+    for (i = 0; i < MAIN_WATCH_SIZE; i++) {
+        if (s_main_watch[i].handler && s_main_watch[i].fd == fd)
+            return epoll_modify(s_main_epoll_fd, fd, events) < 0 ? -errno : 0;
+    }
+
+    return -ENOENT;
+}
+
+void main_unwatch_fd(int fd) {
+    int i;
+
+    for (i = 0; i < MAIN_WATCH_SIZE; i++) {
+        if (s_main_watch[i].handler && s_main_watch[i].fd == fd) {
+            if (s_main_epoll_fd >= 0)
+                epoll_deregister(s_main_epoll_fd, fd);
+            s_main_watch[i].handler = NULL;
+            return;
+        }
+    }
+}
+
+static int main_watch_dispatch(int fd) {
+    int i;
+
+    for (i = 0; i < MAIN_WATCH_SIZE; i++) {
+        if (s_main_watch[i].handler && s_main_watch[i].fd == fd) {
+            s_main_watch[i].handler(fd, s_main_watch[i].arg);
+            return 1;
+        }
+    }
+
+    return 0;
 }
 
 void qmidevice_send_event_to_main(int triger_event) {
@@ -289,18 +420,242 @@ static int kill_data_call_pdp(int pdp, char *self) {
     return -1;
 }
 
-static void ql_sigaction(int signo) {
-     if (SIGALRM == signo)
-         send_signo_to_main(SIG_EVENT_START);
-     else
-     {
-        send_signo_to_main(SIG_EVENT_STOP);
-        main_send_event_to_qmidevice(SIG_EVENT_STOP); //main may be wating qmi response
-    }
+/* arm timerfd to expire after msecs, then every interval msecs (0 for one-shot),
+ * msecs = 0 disarms it */
+static void main_timer_set(int timerfd, unsigned long msecs, unsigned long interval) {
+    struct itimerspec its;
+
+    memset(&its, 0x00, sizeof(its));
+    its.it_value.tv_sec = msecs / 1000;
+    its.it_value.tv_nsec = (msecs % 1000) * 1000000;
+    its.it_interval.tv_sec = interval / 1000;
+    its.it_interval.tv_nsec = (interval % 1000) * 1000000;
+    if (timerfd_settime(timerfd, 0, &its, NULL) < 0)
+        dbg_time("%s timerfd_settime errno: %d (%s)", __func__, errno, strerror(errno));
+}
+
+/* exponential backoff between redial_min_msec and redial_max_msec,
+ * with the lower half randomized so many routers do not redial in lockstep */
+static unsigned long redial_backoff(PROFILE_T *profile, unsigned fails) {
+    unsigned long msecs = profile->redial_min_msec;
+
+    while (fails-- && msecs < profile->redial_max_msec)
+        msecs *= 2;
+    if (msecs > profile->redial_max_msec)
+        msecs = profile->redial_max_msec;
+
+    return msecs / 2 + random() % (msecs / 2 + 1);
 }
 
 static pthread_t gQmiThreadID = 0;
 
+/*
+ * startup queries run as a dependency graph on the request_async workers.
+ * SetEthMode decides s_9x07 for the UIM/NAS requests, so SIM and
+ * registration wait for it; IMEI and baseband version do not depend on anything.
+ */
+enum {
+    STARTUP_IMEI,
+    STARTUP_BASEBAND,
+    STARTUP_ETHMODE,
+    STARTUP_LOOPBACK,
+    STARTUP_SIM,
+    STARTUP_ICCID,
+    STARTUP_IMSI,
+    STARTUP_SETPROFILE,
+    STARTUP_GETPROFILE,
+    STARTUP_REGISTRATION,
+    STARTUP_MAX
+};
+#define STARTUP_BIT(_step) (1U << (_step))
+
+typedef struct {
+    SIM_Status SIMStatus;
+    UCHAR PSAttachedState;
+} STARTUP_STATE_T;
+
+typedef struct {
+    REQUEST_FUTURE future;
+    unsigned deps;
+} STARTUP_STEP_T;
+
+static int startup_imei(PROFILE_T *profile, void *arg) {
+    (void)arg;
+    if (profile->request_ops->requestGetIMEI)
+        return profile->request_ops->requestGetIMEI();
+    return 0;
+}
+
+static int startup_baseband(PROFILE_T *profile, void *arg) {
+    (void)arg;
+    if (profile->request_ops->requestBaseBandVersion)
+        return profile->request_ops->requestBaseBandVersion(profile);
+    return 0;
+}
+
+static int startup_ethmode(PROFILE_T *profile, void *arg) {
+    (void)arg;
+    if (profile->request_ops->requestSetEthMode)
+        return profile->request_ops->requestSetEthMode(profile);
+    return 0;
+}
+
+static int startup_loopback(PROFILE_T *profile, void *arg) {
+    (void)arg;
+    if (profile->request_ops->requestSetLoopBackState && profile->loopback_state) {
+        profile->request_ops->requestSetLoopBackState(profile->loopback_state, profile->replication_factor);
+        profile->loopback_state = 0;
+    }
+    return 0;
+}
+
+static int startup_sim(PROFILE_T *profile, void *arg) {
+    const struct request_ops *request_ops = profile->request_ops;
+    STARTUP_STATE_T *state = (STARTUP_STATE_T *)arg;
+    int qmierr;
+
+    if (!request_ops->requestGetSIMStatus)
+        return 0;
+
+    qmierr = request_ops->requestGetSIMStatus(&state->SIMStatus);
+    while (qmierr == QMI_ERR_OP_DEVICE_UNSUPPORTED /*|| (SIMStatus != SIM_READY)*/) {
+        sleep(1);
+        qmierr = request_ops->requestGetSIMStatus(&state->SIMStatus);
+        dbg_time("[%s] SIMStatus %d", __func__, state->SIMStatus);
+    }
+
+    if ((state->SIMStatus == SIM_PIN) && profile->pincode && request_ops->requestEnterSimPin) {
+        request_ops->requestEnterSimPin(profile->pincode);
+    }
+
+    return qmierr;
+}
+
+static int startup_iccid(PROFILE_T *profile, void *arg) {
+    STARTUP_STATE_T *state = (STARTUP_STATE_T *)arg;
+
+    if (state->SIMStatus == SIM_READY && profile->request_ops->requestGetICCID)
+        return profile->request_ops->requestGetICCID();
+    return 0;
+}
+
+static int startup_imsi(PROFILE_T *profile, void *arg) {
+    STARTUP_STATE_T *state = (STARTUP_STATE_T *)arg;
+    char *pp_imsi = NULL;
+    char mcc_tmp[4] = {'\0'};
+    char mnc_tmp[3] = {'\0'};
+
+    if (state->SIMStatus != SIM_READY)
+        return 0;
+
+    if (profile->request_ops->requestGetIMSI)
+        profile->request_ops->requestGetIMSI((const char **)&pp_imsi);
+    dbg_time("[%s] IMSI %s", __func__, pp_imsi);
+    if (pp_imsi && !(profile->apn || profile->user || profile->password) && apnConfigfile) {
+      strncpy(mcc_tmp, pp_imsi, 3);
+      strncpy(mnc_tmp, pp_imsi + 3, 2);
+      parseXml(apnConfigfile, mcc_tmp, mnc_tmp, profile);
+      dbg_time("[%s] APN is %s", __func__, profile->apn);
+    }
+    if (pp_imsi) {
+      free(pp_imsi);
+    }
+
+    return 0;
+}
+
+//the APN settings of every PDN of this process
+static int startup_setprofile(PROFILE_T *profile, void *arg) {
+    PROFILE_T *pdn;
+    int err = 0;
+
+    (void)arg;
+    for (pdn = profile; pdn && !err; pdn = pdn->next_pdn) {
+        if (profile->request_ops->requestSetProfile && (pdn->apn || pdn->user || pdn->password))
+            err = profile->request_ops->requestSetProfile(pdn);
+    }
+    return err;
+}
+
+static int startup_getprofile(PROFILE_T *profile, void *arg) {
+    PROFILE_T *pdn;
+    int err = 0;
+
+    (void)arg;
+    for (pdn = profile; pdn && !err; pdn = pdn->next_pdn) {
+        if (profile->request_ops->requestGetProfile)
+            err = profile->request_ops->requestGetProfile(pdn);
+    }
+    return err;
+}
+
+static int startup_registration(PROFILE_T *profile, void *arg) {
+    STARTUP_STATE_T *state = (STARTUP_STATE_T *)arg;
+
+    if (profile->request_ops->requestRegistrationState)
+        return profile->request_ops->requestRegistrationState(&state->PSAttachedState);
+    return 0;
+}
+
+static STARTUP_STEP_T s_startup_steps[STARTUP_MAX] = {
+    [STARTUP_IMEI] = {REQUEST_FUTURE_INIT("imei", startup_imei, NULL, NULL), 0},
+    [STARTUP_BASEBAND] = {REQUEST_FUTURE_INIT("baseband", startup_baseband, NULL, NULL), 0},
+    [STARTUP_ETHMODE] = {REQUEST_FUTURE_INIT("ethmode", startup_ethmode, NULL, NULL), 0},
+    [STARTUP_LOOPBACK] = {REQUEST_FUTURE_INIT("loopback", startup_loopback, NULL, NULL), STARTUP_BIT(STARTUP_ETHMODE)},
+    [STARTUP_SIM] = {REQUEST_FUTURE_INIT("sim", startup_sim, NULL, NULL), STARTUP_BIT(STARTUP_ETHMODE)},
+    [STARTUP_ICCID] = {REQUEST_FUTURE_INIT("iccid", startup_iccid, NULL, NULL), STARTUP_BIT(STARTUP_SIM)},
+    [STARTUP_IMSI] = {REQUEST_FUTURE_INIT("imsi", startup_imsi, NULL, NULL), STARTUP_BIT(STARTUP_SIM)},
+    [STARTUP_SETPROFILE] = {REQUEST_FUTURE_INIT("setprofile", startup_setprofile, NULL, NULL), STARTUP_BIT(STARTUP_IMSI)},
+    [STARTUP_GETPROFILE] = {REQUEST_FUTURE_INIT("getprofile", startup_getprofile, NULL, NULL), STARTUP_BIT(STARTUP_SETPROFILE)},
+    [STARTUP_REGISTRATION] = {REQUEST_FUTURE_INIT("registration", startup_registration, NULL, NULL), STARTUP_BIT(STARTUP_ETHMODE)},
+};
+
+static void qmi_startup(STARTUP_STATE_T *state) {
+    REQUEST_FUTURE *running[STARTUP_MAX];
+    unsigned submitted = 0, finished = 0, all = STARTUP_BIT(STARTUP_MAX) - 1;
+    unsigned long start_msec = clock_msec(), serial_msec = 0;
+    int i, nrunning = 0;
+
+    while (finished != all) {
+        STARTUP_STEP_T *step;
+
+        for (i = 0; i < STARTUP_MAX; i++) {
+            step = &s_startup_steps[i];
+            if ((submitted & STARTUP_BIT(i)) || (step->deps & finished) != step->deps)
+                continue;
+            step->future.arg = state;
+            submitted |= STARTUP_BIT(i);
+            if (request_async_submit(&step->future) == 0)
+                running[nrunning++] = &step->future;
+            else
+                finished |= STARTUP_BIT(i);
+        }
+
+        if (nrunning == 0)
+            break;
+
+        i = request_async_wait_any(running, nrunning, 0);
+        if (i < 0)
+            break;
+
+        step = node_to_item(running[i], STARTUP_STEP_T, future);
+        finished |= STARTUP_BIT(step - s_startup_steps);
+        running[i] = running[--nrunning];
+    }
+
+    for (i = 0; i < STARTUP_MAX; i++) {
+        REQUEST_FUTURE *future = &s_startup_steps[i].future;
+
+        if (!(finished & STARTUP_BIT(i)) || !future->done)
+            continue;
+        serial_msec += future->done_msec - future->start_msec;
+        dbg_time("startup %-12s at %4lu ms, wait %4lu ms, run %4lu ms, err=%d", future->name,
+            future->submit_msec - start_msec, future->start_msec - future->submit_msec,
+            future->done_msec - future->start_msec, future->err);
+    }
+    dbg_time("startup done in %lu ms (%lu ms if run one by one)", clock_msec() - start_msec, serial_msec);
+}
+
 static int usage(const char *progname) {
     dbg_time("Usage: %s [options]", progname);
     dbg_time("-s [apn [user password auth]]          Set apn/user/password/auth get from your network provider. auth: 1~pap, 2~chap");
@@ -314,9 +669,14 @@ static int usage(const char *progname) {
     dbg_time("-6                                     Setup IPv6 data call");
     dbg_time("-n pdn                                 Specify which pdn to setup data call (default 1 for QMI, 0 for MBIM)");
     dbg_time("-k pdn                                 Specify which pdn to hangup data call (by send SIGINT to 'quectel-CM -n pdn')");
+    dbg_time("-r min_ms [max_ms]                     Redial backoff after a failed data call, doubles from min_ms up to max_ms (default 5000 60000)");
     dbg_time("-m iface-idx                           Bind QMI data call to wwan0_<iface idx> when QMAP used. E.g '-n 7 -m 1' bind pdn-7 data call to wwan0_1");
+    dbg_time("-N pdn [apn [user password auth]]      Also setup data call on this pdn in the same process, QMAP qmi_wwan only. Can be repeated");
     dbg_time("-b                                     Enable network interface bridge function (default 0)");
+    dbg_time("-S                                     Set IP/gateway/DNS/MTU got from the modem directly, no DHCP (raw IP mode modems)");
     dbg_time("-v                                     Verbose log mode, for debug purpose.");
+    dbg_time("kill -USR1 <pid>                       Log QMI request latency, timeouts and retries per message type");
+    dbg_time("kill -USR2 <pid>                       Write the last QMI/MBIM/AT frames to /tmp/quectel-CM.<pdn>.pcap");
     dbg_time("[Examples]");
     dbg_time("Example 1: %s ", progname);
     dbg_time("Example 2: %s -s 3gnet ", progname);
@@ -324,30 +684,349 @@ static int usage(const char *progname) {
     return 0;
 }
 
+/* without indications SIG_EVENT_CHECK polls every KEEPALIVE_MIN_MSEC,
+ * with them the poll only backs up lost indications, so it slows down to
+ * KEEPALIVE_MAX_MSEC while the data call stays up */
+#define KEEPALIVE_MIN_MSEC (15*1000)
+#define KEEPALIVE_MAX_MSEC (120*1000)
+
+static int pdn_data_call_up(PROFILE_T *pdn) {
+    return (!pdn->enable_ipv4 || pdn->IPv4ConnectionStatus == QWDS_PKT_DATA_CONNECTED)
+        && (!pdn->enable_ipv6 || pdn->IPv6ConnectionStatus == QWDS_PKT_DATA_CONNECTED);
+}
+
+static int pdn_data_call_down(PROFILE_T *pdn) {
+    return (pdn->enable_ipv4 && pdn->IPv4ConnectionStatus == QWDS_PKT_DATA_DISCONNECTED)
+        || (pdn->enable_ipv6 && pdn->IPv6ConnectionStatus == QWDS_PKT_DATA_DISCONNECTED);
+}
+
+typedef struct pdn_setup PDN_SETUP_T;
+
+typedef struct {
+    REQUEST_FUTURE future;
+    PDN_SETUP_T *setup;
+    int curIpFamily;
+    int auth; //the worker's own copy of pdn->auth, pdn_setup_finish() keeps the one that worked
+} BEARER_SETUP_T;
+
+/* one SIG_EVENT_START of a PDN, from the submit of its bearers until the
+ * main loop collects them after s_setup_eventfd says they are all done */
+struct pdn_setup {
+    PROFILE_T *pdn;
+    int nbearers;
+    int ncompleted; //bumped by the workers
+    int check_deferred; //a SIG_EVENT_CHECK came in meanwhile
+    BEARER_SETUP_T bearers[2];
+};
+
+static int s_setup_eventfd = -1;
+
+//one bearer of a PDN, runs on a request_async worker
+static int pdn_setup_bearer(PROFILE_T *profile, void *arg) {
+    BEARER_SETUP_T *bearer = (BEARER_SETUP_T *)arg;
+    PROFILE_T *pdn = bearer->setup->pdn;
+    const struct request_ops *request_ops = pdn->request_ops;
+    int qmierr;
+
+    (void)profile;
+    qmierr = request_ops->requestSetupDataCall(pdn, bearer->curIpFamily, bearer->auth);
+
+    if (bearer->curIpFamily == IpFamilyV4
+        && (qmierr > 0) && pdn->user && pdn->user[0] && pdn->password && pdn->password[0]) {
+        //may be fail because wrong auth mode, try pap->chap, or chap->pap
+        int other_auth = (bearer->auth == 1) ? 2 : 1;
+
+        qmierr = request_ops->requestSetupDataCall(pdn, IpFamilyV4, other_auth);
+        if (!qmierr)
+            bearer->auth = other_auth;
+    }
+
+    if (!qmierr)
+        qmierr = request_ops->requestGetIPAddress(pdn, bearer->curIpFamily);
+
+    return qmierr;
+}
+
+//worker side, the results are left for pdn_setup_finish() on the main loop
+static void pdn_setup_bearer_done(REQUEST_FUTURE *future) {
+    BEARER_SETUP_T *bearer = node_to_item(future, BEARER_SETUP_T, future);
+    uint64_t one = 1;
+
+    __sync_fetch_and_add(&bearer->setup->ncompleted, 1);
+    if (write(s_setup_eventfd, &one, sizeof(one)) == -1) {};
+}
+
+static void pdn_setup_finish(PDN_SETUP_T *setup) {
+    PROFILE_T *pdn = setup->pdn;
+    int i;
+
+    for (i = 0; i < setup->nbearers; i++) {
+        BEARER_SETUP_T *bearer = &setup->bearers[i];
+        //the callback ran, this only waits for the worker to let go of the future
+        int ok = (request_async_wait(&bearer->future, 0) == 0);
+
+        if (ok) {
+            if (bearer->curIpFamily == IpFamilyV4) {
+                pdn->IPv4ConnectionStatus = QWDS_PKT_DATA_CONNECTED;
+                pdn->auth = bearer->auth;
+            }
+            else
+                pdn->IPv6ConnectionStatus = QWDS_PKT_DATA_CONNECTED;
+        }
+        metric_inc(METRIC_SETUP_CALL, "pdn=\"%d\",family=\"%s\",result=\"%s\"", pdn->pdp,
+            bearer->curIpFamily == IpFamilyV4 ? "ipv4" : "ipv6", ok ? "ok" : "fail");
+    }
+
+    if (pdn->enable_ipv6 && pdn->IPv6ConnectionStatus !=  QWDS_PKT_DATA_CONNECTED
+        && pdn->enable_ipv4 && pdn->request_ops != &qmi_request_ops) {
+        pdn->IPv6ConnectionStatus = pdn->IPv4ConnectionStatus;
+    }
+
+    if (pdn_data_call_down(pdn)) {
+        unsigned long backoff = redial_backoff(pdn, pdn->SetupCallFail);
+
+        pdn->SetupCallFail++;
+        dbg_time("pdn-%d try to requestSetupDataCall %lu ms later", pdn->pdp, backoff);
+        main_timer_set(pdn->redial_timerfd, backoff, 0);
+        pdn->SetupCallAllowTime = backoff + clock_msec();
+    }
+    else if (pdn->IPv4ConnectionStatus ==  QWDS_PKT_DATA_CONNECTED || pdn->IPv6ConnectionStatus ==  QWDS_PKT_DATA_CONNECTED) {
+        pdn->SetupCallFail = 0;
+        pdn->SetupCallAllowTime = clock_msec();
+        if (pdn->OutageStartTime) {
+            pdn->outage_msec = clock_msec() - pdn->OutageStartTime;
+            pdn->OutageStartTime = 0;
+            dbg_time("pdn-%d data call restored, outage %lu ms", pdn->pdp, pdn->outage_msec);
+            metric_observe(METRIC_OUTAGE_SECONDS, pdn->outage_msec / 1000.0, "pdn=\"%d\"", pdn->pdp);
+        }
+    }
+
+    pdn->setup_call = NULL;
+    if (setup->check_deferred)
+        send_signo_to_pdn(SIG_EVENT_CHECK, pdn);
+    free(setup);
+}
+
+/* SIG_EVENT_START of one PDN, does not wait for the modem: the bearers run on the
+ * request_async workers and pdn_setup_finish() picks up their results.
+ * With QMI the IPv4 and IPv6 bearers use different WDS clients, so they are
+ * brought up at the same time and dual stack costs max(v4, v6), not v4 + v6. */
+static void pdn_setup_data_call(PROFILE_T *pdn, UCHAR PSAttachedState) {
+    PDN_SETUP_T *setup;
+    int i;
+
+    if (pdn->setup_call)
+        return; //the one in flight answers this START too
+
+    if (PSAttachedState != 1 && pdn->loopback_state == 0)
+        return;
+
+    if (pdn->SetupCallAllowTime > clock_msec()) {
+        main_timer_set(pdn->redial_timerfd, pdn->SetupCallAllowTime - clock_msec(), 0);
+        return;
+    }
+
+    setup = (PDN_SETUP_T *)calloc(1, sizeof(*setup));
+    if (!setup)
+        return;
+    setup->pdn = pdn;
+
+    if (pdn->enable_ipv4 && pdn->IPv4ConnectionStatus !=  QWDS_PKT_DATA_CONNECTED) {
+        BEARER_SETUP_T bearer = {REQUEST_FUTURE_INIT("setup_ipv4", pdn_setup_bearer, NULL, pdn_setup_bearer_done), setup, IpFamilyV4, pdn->auth};
+        setup->bearers[setup->nbearers++] = bearer;
+    }
+
+    //MBIM and AT have one call for both families, IPv6 just follows IPv4
+    if (pdn->enable_ipv6 && pdn->IPv6ConnectionStatus !=  QWDS_PKT_DATA_CONNECTED
+        && !(pdn->enable_ipv4 && pdn->request_ops != &qmi_request_ops)) {
+        BEARER_SETUP_T bearer = {REQUEST_FUTURE_INIT("setup_ipv6", pdn_setup_bearer, NULL, pdn_setup_bearer_done), setup, IpFamilyV6, pdn->auth};
+        setup->bearers[setup->nbearers++] = bearer;
+    }
+
+    pdn->setup_call = setup;
+    if (setup->nbearers == 0) {
+        pdn_setup_finish(setup);
+        return;
+    }
+
+    for (i = 0; i < setup->nbearers; i++) {
+        setup->bearers[i].future.arg = &setup->bearers[i];
+        request_async_submit(&setup->bearers[i].future);
+    }
+}
+
+//s_setup_eventfd, finish every SIG_EVENT_START whose bearers are all done
+static void pdn_setup_collect(PROFILE_T *profile) {
+    PROFILE_T *pdn;
+
+    for (pdn = profile; pdn; pdn = pdn->next_pdn) {
+        PDN_SETUP_T *setup = pdn->setup_call;
+
+        if (setup && __sync_fetch_and_add(&setup->ncompleted, 0) == setup->nbearers)
+            pdn_setup_finish(setup);
+    }
+}
+
+//request_async_deinit() has completed every future, the device is gone, just forget the results
+static void pdn_setup_drop(PROFILE_T *profile) {
+    PROFILE_T *pdn;
+
+    for (pdn = profile; pdn; pdn = pdn->next_pdn) {
+        free(pdn->setup_call);
+        pdn->setup_call = NULL;
+    }
+}
+
+//SIG_EVENT_CHECK of one PDN
+static void pdn_check_data_call(PROFILE_T *pdn) {
+    const struct request_ops *request_ops = pdn->request_ops;
+    UCHAR OldIPv4ConnectionStatus = pdn->IPv4ConnectionStatus;
+    UCHAR OldIPv6ConnectionStatus = pdn->IPv6ConnectionStatus;
+    int qmierr;
+
+    if (pdn->enable_ipv4 && pdn->IPv4ConnectionStatus != QWDS_PKT_DATA_DISCONNECTED
+        && !request_ops->requestQueryDataCall(pdn, &pdn->IPv4ConnectionStatus, IpFamilyV4))
+    {
+        if (QWDS_PKT_DATA_CONNECTED == pdn->IPv4ConnectionStatus && pdn->ipv4.Address == 0) {
+            //killall -9 quectel-CM for MBIM and ATC call
+            qmierr = request_ops->requestGetIPAddress(pdn, IpFamilyV4);
+            if (qmierr)
+                pdn->IPv4ConnectionStatus = QWDS_PKT_DATA_DISCONNECTED;
+        }
+
+        //local ip is different with remote ip
+        if (QWDS_PKT_DATA_CONNECTED == pdn->IPv4ConnectionStatus && check_ipv4_address(pdn) == 0) {
+            request_ops->requestDeactivateDefaultPDP(pdn, IpFamilyV4);
+            pdn->IPv4ConnectionStatus = QWDS_PKT_DATA_DISCONNECTED;
+        }
+    }
+    else {
+        pdn->IPv4ConnectionStatus = QWDS_PKT_DATA_DISCONNECTED;
+    }
+
+    if (pdn->enable_ipv6 && pdn->IPv6ConnectionStatus != QWDS_PKT_DATA_DISCONNECTED) {
+        if (pdn->enable_ipv4 && pdn->request_ops != &qmi_request_ops) {
+            pdn->IPv6ConnectionStatus = pdn->IPv4ConnectionStatus;
+        }
+        else {
+            request_ops->requestQueryDataCall(pdn, &pdn->IPv6ConnectionStatus, IpFamilyV6);
+        }
+    }
+    else {
+        pdn->IPv6ConnectionStatus = QWDS_PKT_DATA_DISCONNECTED;
+    }
+
+    if (pdn->IPv4ConnectionStatus ==  QWDS_PKT_DATA_DISCONNECTED && pdn->IPv6ConnectionStatus ==  QWDS_PKT_DATA_DISCONNECTED) {
+        usbnet_link_change(0, pdn);
+    }
+    else if (pdn->IPv4ConnectionStatus ==  QWDS_PKT_DATA_CONNECTED || pdn->IPv6ConnectionStatus ==  QWDS_PKT_DATA_CONNECTED) {
+        int link = 0;
+        if (pdn->IPv4ConnectionStatus == QWDS_PKT_DATA_CONNECTED)
+            link |= (1<<IpFamilyV4);
+        if (pdn->IPv6ConnectionStatus == QWDS_PKT_DATA_CONNECTED)
+            link |= (1<<IpFamilyV6);
+        usbnet_link_change(link, pdn);
+    }
+
+    if (!pdn->OutageStartTime
+        && ((OldIPv4ConnectionStatus == QWDS_PKT_DATA_CONNECTED && pdn->IPv4ConnectionStatus != QWDS_PKT_DATA_CONNECTED)
+        || (OldIPv6ConnectionStatus == QWDS_PKT_DATA_CONNECTED && pdn->IPv6ConnectionStatus != QWDS_PKT_DATA_CONNECTED))) {
+        pdn->OutageStartTime = clock_msec();
+        dbg_time("pdn-%d data call lost, redial now", pdn->pdp);
+    }
+
+    if (pdn_data_call_down(pdn)) {
+        send_signo_to_pdn(SIG_EVENT_START, pdn);
+    }
+}
+
+//SIG_EVENT_STOP of one PDN
+static void pdn_deactivate_data_call(PROFILE_T *pdn) {
+    const struct request_ops *request_ops = pdn->request_ops;
+
+    if (pdn->enable_ipv4 && pdn->IPv4ConnectionStatus ==  QWDS_PKT_DATA_CONNECTED) {
+        request_ops->requestDeactivateDefaultPDP(pdn, IpFamilyV4);
+    }
+    if (pdn->enable_ipv6 && pdn->IPv6ConnectionStatus ==  QWDS_PKT_DATA_CONNECTED) {
+        if (pdn->enable_ipv4 && pdn->request_ops != &qmi_request_ops) {
+
+        }
+        else {
+            request_ops->requestDeactivateDefaultPDP(pdn, IpFamilyV6);
+        }
+    }
+    usbnet_link_change(0, pdn);
+}
+
 int qmi_main(PROFILE_T *profile)
 {
     int triger_event = 0;
     int signo;
-#ifdef CONFIG_SIM
-    SIM_Status SIMStatus = SIM_NOT_READY;
-#endif
+    STARTUP_STATE_T startup = {SIM_NOT_READY, 0};
     UCHAR PSAttachedState = 0;
-    UCHAR  IPv4ConnectionStatus = QWDS_PKT_DATA_UNKNOW;
-    UCHAR  IPv6ConnectionStatus = QWDS_PKT_DATA_UNKNOW; 
-    unsigned SetupCallFail = 0;
-    unsigned long SetupCallAllowTime = clock_msec();
-    int qmierr = 0;
     const struct request_ops *request_ops = profile ->request_ops;
-    
-    char *pp_imsi = NULL;
-    char mcc_tmp[4] = {'\0'};
-    char mnc_tmp[3] = {'\0'};
+    int indication_mode = 0;
+    unsigned keepalive_msec = KEEPALIVE_MIN_MSEC;
+    PROFILE_T *pdn, *target;
+
+    int keepalive_timerfd;
+    int epoll_fd;
+    sigset_t sigmask;
+
+    /* signal trigger quit event, SIGUSR1 dumps the QMI statistics, SIGUSR2 the frame trace.
+     * block them before any thread is created so they are only delivered through main_signalfd,
+     * which only the main loop reads; the QMI thread learns about a quit from qmidevice_control_fd */
+    sigemptyset(&sigmask);
+    sigaddset(&sigmask, SIGINT);
+    sigaddset(&sigmask, SIGTERM);
+    sigaddset(&sigmask, SIGUSR1);
+    sigaddset(&sigmask, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &sigmask, NULL);
+    main_signalfd = signalfd(-1, &sigmask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (main_signalfd < 0) {
+        dbg_time("%s Failed to create signalfd: %d (%s)", __func__, errno, strerror(errno));
+        return -1;
+    }
 
-    /* signal trigger quit event */
-    signal(SIGINT, ql_sigaction);
-    signal(SIGTERM, ql_sigaction);
-    /* timer routine */
-    signal(SIGALRM, ql_sigaction);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        dbg_time("%s Failed to create epoll: %d (%s)", __func__, errno, strerror(errno));
+        return -1;
+    }
+    s_main_epoll_fd = epoll_fd;
+
+    /* SIG_EVENT_START of each PDN is re-sent from its redial_timerfd, SIG_EVENT_CHECK from keepalive_timerfd */
+    keepalive_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (keepalive_timerfd < 0) {
+        dbg_time("%s Failed to create timer: %d (%s)", __func__, errno, strerror(errno));
+        return -1;
+    }
+    s_setup_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (s_setup_eventfd < 0) {
+        dbg_time("%s Failed to create eventfd: %d (%s)", __func__, errno, strerror(errno));
+        return -1;
+    }
+    epoll_register(epoll_fd, main_signalfd, EPOLLIN);
+    epoll_register(epoll_fd, keepalive_timerfd, EPOLLIN);
+    epoll_register(epoll_fd, s_setup_eventfd, EPOLLIN);
+    metrics_start(profile->pdp);
+
+    for (pdn = profile; pdn; pdn = pdn->next_pdn) {
+        pdn->IPv4ConnectionStatus = QWDS_PKT_DATA_UNKNOW;
+        pdn->IPv6ConnectionStatus = QWDS_PKT_DATA_UNKNOW;
+        pdn->SetupCallFail = 0;
+        pdn->SetupCallAllowTime = clock_msec();
+        pdn->OutageStartTime = 0;
+        pdn->setup_call = NULL;
+        pdn->usbnet_link = -1;
+        pdn->redial_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (pdn->redial_timerfd < 0) {
+            dbg_time("%s Failed to create timer: %d (%s)", __func__, errno, strerror(errno));
+            return -1;
+        }
+        epoll_register(epoll_fd, pdn->redial_timerfd, EPOLLIN);
+    }
+    srandom(getpid() ^ clock_msec());
 
 //sudo apt-get install udhcpc
 //sudo apt-get remove ModemManager
@@ -358,15 +1037,14 @@ __main_loop:
     }
 
     /* try to recreate FDs*/
-    if (socketpair( AF_LOCAL, SOCK_STREAM, 0, signal_control_fd) < 0 ) {
-        dbg_time("%s Faild to create main_control_fd: %d (%s)", __func__, errno, strerror(errno));
-        return -1;
-    }
+    s_main_event_head = s_main_event_tail = 0;
+    s_main_event_stop = 0;
 
     if ( socketpair( AF_LOCAL, SOCK_STREAM, 0, qmidevice_control_fd ) < 0 ) {
         dbg_time("%s Failed to create thread control socket pair: %d (%s)", __func__, errno, strerror(errno));
         return 0;
     }
+    epoll_register(epoll_fd, qmidevice_control_fd[0], EPOLLIN);
 
     if ((profile->qmap_mode == 0 || profile->qmap_mode == 1) && (!profile->proxy[0])) {
         kill_brothers(profile->qmichannel);
@@ -388,276 +1066,206 @@ __main_loop:
         return 0;
     }
 
-    if (request_ops->requestGetIMEI)
-        request_ops->requestGetIMEI();
-
-    if (request_ops->requestBaseBandVersion)
-        request_ops->requestBaseBandVersion(profile);
-
-    if (request_ops->requestSetEthMode)
-        request_ops->requestSetEthMode(profile);
-
-    if (request_ops->requestSetLoopBackState && profile->loopback_state) {
-    	request_ops->requestSetLoopBackState(profile->loopback_state, profile->replication_factor);
-    	profile->loopback_state = 0;
-    }
-
-    if (request_ops->requestGetSIMStatus) {
-        qmierr = request_ops->requestGetSIMStatus(&SIMStatus);
-
-        while (qmierr == QMI_ERR_OP_DEVICE_UNSUPPORTED /*|| (SIMStatus != SIM_READY)*/) {
-            sleep(1);
-            qmierr = request_ops->requestGetSIMStatus(&SIMStatus);
-            dbg_time("[%s] SIMStatus %d", __func__, SIMStatus);
-        }
-
-        if ((SIMStatus == SIM_PIN) && profile->pincode && request_ops->requestEnterSimPin) {
-            request_ops->requestEnterSimPin(profile->pincode);
-        }
-    }
-
-    if (SIMStatus == SIM_READY) {
-        if (request_ops->requestGetICCID)
-            request_ops->requestGetICCID();
+    request_async_init(profile);
 
-        if (request_ops->requestGetIMSI)
-            request_ops->requestGetIMSI(&pp_imsi);
-        dbg_time("[%s] IMSI %s", __func__, pp_imsi);
-        if (pp_imsi && !(profile->apn || profile->user || profile->password) && apnConfigfile) {
-          strncpy(mcc_tmp, pp_imsi, 3);
-          strncpy(mnc_tmp, pp_imsi + 3, 2);
-          parseXml(apnConfigfile, mcc_tmp, mnc_tmp, profile);
-          dbg_time("[%s] APN is %s", __func__, profile->apn);
-        }
-        if (pp_imsi) {
-          free(pp_imsi);
-        }
-    }
+    qmi_startup(&startup);
+    PSAttachedState = startup.PSAttachedState;
 
-    if (request_ops->requestSetProfile && (profile->apn || profile->user || profile->password)) {
-        request_ops->requestSetProfile(profile);
+    indication_mode = 0;
+    keepalive_msec = KEEPALIVE_MIN_MSEC;
+    if (request_ops->requestRegisterIndications && !request_ops->requestRegisterIndications(profile)) {
+        indication_mode = 1;
+        dbg_time("%s driven by indications, keepalive %d~%d seconds", __func__, KEEPALIVE_MIN_MSEC/1000, KEEPALIVE_MAX_MSEC/1000);
+        if (request_ops->requestGetSignalInfo)
+            request_ops->requestGetSignalInfo();
     }
 
-    if (request_ops->requestGetProfile)
-        request_ops->requestGetProfile(profile);
-
-    request_ops->requestRegistrationState(&PSAttachedState);
-
     send_signo_to_main(SIG_EVENT_CHECK);
+    main_timer_set(keepalive_timerfd, keepalive_msec, keepalive_msec);
 
     while (1)
     {
-        struct pollfd pollfds[] = {{signal_control_fd[1], POLLIN, 0}, {qmidevice_control_fd[0], POLLIN, 0}};
-        int ne, ret, nevents = sizeof(pollfds)/sizeof(pollfds[0]);
+        struct epoll_event events[8];
+        int ne, nevents;
 
-        do {
-            ret = poll(pollfds, nevents,  15*1000);
-        } while ((ret < 0) && (errno == EINTR));
-
-        if (ret == 0)
+        while (main_event_pop(&signo, &target))
         {
-            send_signo_to_main(SIG_EVENT_CHECK);
-            continue;
+            switch (signo)
+            {
+                case SIG_EVENT_START:
+                case SIG_EVENT_CHECK:
+                    if (signo == SIG_EVENT_CHECK && request_ops->requestGetSignalInfo && !indication_mode)
+                        request_ops->requestGetSignalInfo();
+
+                    for (pdn = profile; pdn; pdn = pdn->next_pdn) {
+                        if (target && target != pdn)
+                            continue;
+                        main_timer_set(pdn->redial_timerfd, 0, 0);
+                        if (signo == SIG_EVENT_START)
+                            pdn_setup_data_call(pdn, PSAttachedState);
+                        else if (pdn->setup_call)
+                            pdn->setup_call->check_deferred = 1; //the state is still being set up
+                        else
+                            pdn_check_data_call(pdn);
+                    }
+                break;
+
+                case SIG_EVENT_STOP:
+                    //a bearer still coming up must be known to be torn down
+                    for (pdn = profile; pdn; pdn = pdn->next_pdn) {
+                        if (pdn->setup_call)
+                            pdn_setup_finish(pdn->setup_call);
+                    }
+                    for (pdn = profile; pdn; pdn = pdn->next_pdn)
+                        pdn_deactivate_data_call(pdn);
+                    if (profile->qmi_ops->deinit)
+                        profile->qmi_ops->deinit();
+                    main_send_event_to_qmidevice(RIL_REQUEST_QUIT);
+                    goto __main_quit;
+                break;
+
+                default:
+                break;
+            }
         }
 
-        if (ret <= 0) {
-            dbg_time("%s poll=%d, errno: %d (%s)", __func__, ret, errno, strerror(errno));
+        do {
+            nevents = epoll_wait(epoll_fd, events, sizeof(events)/sizeof(events[0]), main_event_pending() ? 0 : -1);
+        } while ((nevents < 0) && (errno == EINTR));
+
+        if (nevents < 0) {
+            dbg_time("%s epoll_wait=%d, errno: %d (%s)", __func__, nevents, errno, strerror(errno));
             goto __main_quit;
         }
 
         for (ne = 0; ne < nevents; ne++) {
-            int fd = pollfds[ne].fd;
-            short revents = pollfds[ne].revents;
+            int fd = events[ne].data.fd;
+            uint32_t revents = events[ne].events;
 
-            if (revents & (POLLERR | POLLHUP | POLLNVAL)) {
-                dbg_time("%s poll err/hup", __func__);
+            //their owners read the error, it must not take the QMI thread down
+            if (main_watch_dispatch(fd))
+                continue;
+
+            if (revents & (EPOLLERR | EPOLLHUP)) {
+                dbg_time("%s epoll err/hup", __func__);
                 dbg_time("epoll fd = %d, events = 0x%04x", fd, revents);
                 main_send_event_to_qmidevice(RIL_REQUEST_QUIT);
-                if (revents & POLLHUP)
+                if (revents & EPOLLHUP)
                     goto __main_quit;
             }
 
-            if ((revents & POLLIN) == 0)
+            if ((revents & EPOLLIN) == 0)
                 continue;
 
-            if (fd == signal_control_fd[1])
-            {
-                if (read(fd, &signo, sizeof(signo)) == sizeof(signo))
-                {
-                    alarm(0);
-                    switch (signo)
-                    {
-                        case SIG_EVENT_START:
-                            if (PSAttachedState != 1 && profile->loopback_state == 0)
-                                break;
-                            
-                            if (SetupCallAllowTime > clock_msec()) {
-                                alarm((SetupCallAllowTime - clock_msec()+999)/1000);
-                                break;
-                            }
-
-                            if (profile->enable_ipv4 && IPv4ConnectionStatus !=  QWDS_PKT_DATA_CONNECTED) {
-                                qmierr = request_ops->requestSetupDataCall(profile, IpFamilyV4);
-
-                                if ((qmierr > 0) && profile->user && profile->user[0] && profile->password && profile->password[0]) {
-                                    int old_auto =  profile->auth;
-
-                                    //may be fail because wrong auth mode, try pap->chap, or chap->pap
-                                    profile->auth = (profile->auth == 1) ? 2 : 1;
-                                	qmierr = request_ops->requestSetupDataCall(profile, IpFamilyV4);
-
-                                    if (qmierr)
-                                        profile->auth = old_auto; //still fail, restore old auth moe
-                                }
-
-                                if (!qmierr) {
-                                    qmierr = request_ops->requestGetIPAddress(profile, IpFamilyV4);
-                                    if (!qmierr)
-                                        IPv4ConnectionStatus = QWDS_PKT_DATA_CONNECTED;
-                                }
-                                        
-                            }
+            if (fd == main_signalfd) {
+                struct signalfd_siginfo si;
+
+                if (read(fd, &si, sizeof(si)) != sizeof(si))
+                    continue;
+
+                switch (si.ssi_signo) {
+                    case SIGUSR1:
+                        qmi_stats_dump();
+                    break;
+                    case SIGUSR2:
+                        ql_trace_dump();
+                    break;
+                    case SIGINT:
+                    case SIGTERM:
+                        dbg_time("%s recv signal %u", __func__, si.ssi_signo);
+                        send_signo_to_main(SIG_EVENT_STOP);
+                        main_send_event_to_qmidevice(SIG_EVENT_STOP); //main may be wating qmi response
+                    break;
+                    default:
+                    break;
+                }
+                continue;
+            }
 
-                            if (profile->enable_ipv6 && IPv6ConnectionStatus !=  QWDS_PKT_DATA_CONNECTED) {
-                                if (profile->enable_ipv4 && profile->request_ops != &qmi_request_ops) {
-                                    IPv6ConnectionStatus = IPv4ConnectionStatus;
-                                }
-                                else {
-                                    qmierr = request_ops->requestSetupDataCall(profile, IpFamilyV6);
-
-                                    if (!qmierr) {
-                                        qmierr = request_ops->requestGetIPAddress(profile, IpFamilyV6);
-                                        if (!qmierr)
-                                            IPv6ConnectionStatus = QWDS_PKT_DATA_CONNECTED;
-                                    }
-                                }
-                            }
-                                
-                            if ((profile->enable_ipv4 && IPv4ConnectionStatus ==  QWDS_PKT_DATA_DISCONNECTED)
-                                    || (profile->enable_ipv6 && IPv6ConnectionStatus ==  QWDS_PKT_DATA_DISCONNECTED)) {
-                                const unsigned allow_time[] = {5, 10, 20, 40, 60};
-
-                                if (SetupCallFail < (sizeof(allow_time)/sizeof(unsigned)))
-                                    SetupCallAllowTime = allow_time[SetupCallFail];
-                                else
-                                    SetupCallAllowTime = 60;
-                                SetupCallFail++;
-                                dbg_time("try to requestSetupDataCall %ld second later", SetupCallAllowTime);
-                                alarm(SetupCallAllowTime);
-                                SetupCallAllowTime = SetupCallAllowTime*1000 + clock_msec();
-                            }
-                            else if (IPv4ConnectionStatus ==  QWDS_PKT_DATA_CONNECTED || IPv6ConnectionStatus ==  QWDS_PKT_DATA_CONNECTED) {
-                                SetupCallFail = 0;
-                                SetupCallAllowTime = clock_msec();
-                            }
-                        break;
+            if (fd == s_setup_eventfd) {
+                uint64_t ncompleted;
 
-                        case SIG_EVENT_CHECK:
-                            if (request_ops->requestGetSignalInfo)
-                                request_ops->requestGetSignalInfo();
+                if (read(fd, &ncompleted, sizeof(ncompleted)) == sizeof(ncompleted))
+                    pdn_setup_collect(profile);
+                continue;
+            }
 
-                            if (profile->enable_ipv4 && IPv4ConnectionStatus != QWDS_PKT_DATA_DISCONNECTED
-                                && !request_ops->requestQueryDataCall(&IPv4ConnectionStatus, IpFamilyV4))
-                            {
-                                if (QWDS_PKT_DATA_CONNECTED == IPv4ConnectionStatus && profile->ipv4.Address == 0) {
-                                    //killall -9 quectel-CM for MBIM and ATC call
-                                    qmierr = request_ops->requestGetIPAddress(profile, IpFamilyV4);
-                                    if (qmierr)
-                                        IPv4ConnectionStatus = QWDS_PKT_DATA_DISCONNECTED;
-                                }
+            if (fd == keepalive_timerfd) {
+                uint64_t expirations;
+                unsigned last_keepalive_msec = keepalive_msec;
+                int all_up = 1;
 
-                                //local ip is different with remote ip
-                                if (QWDS_PKT_DATA_CONNECTED == IPv4ConnectionStatus && check_ipv4_address(profile) == 0) {
-                                    request_ops->requestDeactivateDefaultPDP(profile, IpFamilyV4);
-                                    IPv4ConnectionStatus = QWDS_PKT_DATA_DISCONNECTED;
-                                }
-                            }
-                            else {
-                                IPv4ConnectionStatus = QWDS_PKT_DATA_DISCONNECTED;
-                            }
+                if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+                    continue;
 
-                            if (profile->enable_ipv6 && IPv6ConnectionStatus != QWDS_PKT_DATA_DISCONNECTED) {
-                                if (profile->enable_ipv4 && profile->request_ops != &qmi_request_ops) {
-                                    IPv6ConnectionStatus = IPv4ConnectionStatus;
-                                }
-                                else {
-                                    request_ops->requestQueryDataCall(&IPv6ConnectionStatus, IpFamilyV6);
-                                }
-                            }
-                            else {
-                                IPv6ConnectionStatus = QWDS_PKT_DATA_DISCONNECTED;
-                            }
+                for (pdn = profile; pdn; pdn = pdn->next_pdn)
+                    all_up = all_up && pdn_data_call_up(pdn);
 
-                            if (IPv4ConnectionStatus ==  QWDS_PKT_DATA_DISCONNECTED && IPv6ConnectionStatus ==  QWDS_PKT_DATA_DISCONNECTED) {
-                                usbnet_link_change(0, profile);
-                            }
-                            else if (IPv4ConnectionStatus ==  QWDS_PKT_DATA_CONNECTED || IPv6ConnectionStatus ==  QWDS_PKT_DATA_CONNECTED) {
-                                int link = 0;
-                                if (IPv4ConnectionStatus == QWDS_PKT_DATA_CONNECTED)
-                                    link |= (1<<IpFamilyV4);
-                                if (IPv6ConnectionStatus == QWDS_PKT_DATA_CONNECTED)
-                                    link |= (1<<IpFamilyV6);
-                                usbnet_link_change(link, profile);
-                            }
-                            
-                            if ((profile->enable_ipv4 && IPv4ConnectionStatus ==  QWDS_PKT_DATA_DISCONNECTED)
-                                || (profile->enable_ipv6 && IPv6ConnectionStatus ==  QWDS_PKT_DATA_DISCONNECTED)) {
-                                send_signo_to_main(SIG_EVENT_START);
-                            }
-                        break;
+                if (indication_mode && all_up) {
+                    if (keepalive_msec < KEEPALIVE_MAX_MSEC)
+                        keepalive_msec *= 2;
+                    if (keepalive_msec > KEEPALIVE_MAX_MSEC)
+                        keepalive_msec = KEEPALIVE_MAX_MSEC;
+                } else {
+                    keepalive_msec = KEEPALIVE_MIN_MSEC;
+                }
+                if (keepalive_msec != last_keepalive_msec)
+                    main_timer_set(keepalive_timerfd, keepalive_msec, keepalive_msec);
+                send_signo_to_main(SIG_EVENT_CHECK);
+                continue;
+            }
 
-                        case SIG_EVENT_STOP:
-                            if (profile->enable_ipv4 && IPv4ConnectionStatus ==  QWDS_PKT_DATA_CONNECTED) {
-                                request_ops->requestDeactivateDefaultPDP(profile, IpFamilyV4);
-                            }
-                            if (profile->enable_ipv6 && IPv6ConnectionStatus ==  QWDS_PKT_DATA_CONNECTED) {
-                                if (profile->enable_ipv4 && profile->request_ops != &qmi_request_ops) {
-                                    
-                                }
-                                else {
-                                    request_ops->requestDeactivateDefaultPDP(profile, IpFamilyV6);
-                                }
-                            }
-                            usbnet_link_change(0, profile);
-                            if (profile->qmi_ops->deinit)
-                                profile->qmi_ops->deinit();
-                            main_send_event_to_qmidevice(RIL_REQUEST_QUIT);
-                            goto __main_quit;
-                        break;
+            for (pdn = profile; pdn; pdn = pdn->next_pdn) {
+                if (fd == pdn->redial_timerfd) {
+                    uint64_t expirations;
 
-                        default:
-                        break;
-                    }
+                    if (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+                        send_signo_to_pdn(SIG_EVENT_START, pdn);
+                    break;
                 }
             }
+            if (pdn)
+                continue;
 
             if (fd == qmidevice_control_fd[0]) {
                 if (read(fd, &triger_event, sizeof(triger_event)) == sizeof(triger_event)) {
                     switch (triger_event) {
                         case RIL_INDICATE_DEVICE_DISCONNECTED:
-                            usbnet_link_change(0, profile);                            
+                            for (pdn = profile; pdn; pdn = pdn->next_pdn)
+                                usbnet_link_change(0, pdn);
                             goto __main_quit;
                         break;
 
                         case RIL_UNSOL_RESPONSE_VOICE_NETWORK_STATE_CHANGED:
                             request_ops->requestRegistrationState(&PSAttachedState);
-                            if (PSAttachedState == 1) {
-                                if ((profile->enable_ipv4 && IPv4ConnectionStatus ==  QWDS_PKT_DATA_DISCONNECTED)
-                                    || (profile->enable_ipv6 && IPv6ConnectionStatus ==  QWDS_PKT_DATA_DISCONNECTED)) {
-                                    send_signo_to_main(SIG_EVENT_START);
+                            for (pdn = profile; pdn; pdn = pdn->next_pdn) {
+                                if (PSAttachedState == 1) {
+                                    if (pdn_data_call_down(pdn))
+                                        send_signo_to_pdn(SIG_EVENT_START, pdn);
+                                } else {
+                                    pdn->SetupCallAllowTime = clock_msec();
                                 }
-                             } else {
-                                SetupCallAllowTime = clock_msec();
-                             }
+                            }
                         break;
 
                         case RIL_UNSOL_DATA_CALL_LIST_CHANGED:
-                            if (IPv4ConnectionStatus ==  QWDS_PKT_DATA_CONNECTED || IPv6ConnectionStatus ==  QWDS_PKT_DATA_CONNECTED) {
-                                SetupCallAllowTime = clock_msec() + 1000; //from connect -> disconnect, do not re-dail immediately, wait network stable
+                            for (pdn = profile; pdn; pdn = pdn->next_pdn) {
+                                if (pdn->IPv4ConnectionStatus ==  QWDS_PKT_DATA_CONNECTED || pdn->IPv6ConnectionStatus ==  QWDS_PKT_DATA_CONNECTED) {
+                                    //from connect -> disconnect, re-query and redial at once, failures then back off
+                                    pdn->SetupCallFail = 0;
+                                    pdn->SetupCallAllowTime = clock_msec();
+                                }
                             }
+                            keepalive_msec = KEEPALIVE_MIN_MSEC;
+                            main_timer_set(keepalive_timerfd, keepalive_msec, keepalive_msec);
                             send_signo_to_main(SIG_EVENT_CHECK);
                         break;
 
+                        case RIL_UNSOL_SIGNAL_STRENGTH:
+                            if (request_ops->requestGetSignalInfo)
+                                request_ops->requestGetSignalInfo();
+                        break;
+
                         case MODEM_REPORT_RESET_EVENT:
                         {
                             unsigned int time_to_wait = 20;
@@ -669,10 +1277,12 @@ __main_loop:
                              * DO NOT CALL usbnet_link_change(0, profile) DIRECTLLY
                              * for, the modem may go into wrong state(only ttyUSB0 left) and wont go back
                              */
-                            usbnet_link_state(0);
+                            for (pdn = profile; pdn; pdn = pdn->next_pdn) {
+                                usbnet_link_state(pdn, 0);
+                                main_timer_set(pdn->redial_timerfd, 0, 0);
+                            }
                             /* close FDs, for we want restart. */
-                            close(signal_control_fd[0]);
-                            close(signal_control_fd[1]);
+                            main_timer_set(keepalive_timerfd, 0, 0);
                             close(qmidevice_control_fd[0]);
                             close(qmidevice_control_fd[1]);
                             while (time_expired++ < time_to_wait) {
@@ -684,6 +1294,8 @@ __main_loop:
                                     goto __main_quit;
                                 }
                             }
+                            request_async_deinit();
+                            pdn_setup_drop(profile);
                             dbg_time("main try do restart");
                             goto __main_loop;
                         }
@@ -696,7 +1308,7 @@ __main_loop:
                             	dbg_time("SetLoopBackInd: loopback_state=%d, replication_factor=%u",
                                 	profile->loopback_state, profile->replication_factor);
                             	if (profile->loopback_state)
-                                	send_signo_to_main(SIG_EVENT_START);
+                                	send_signo_to_pdn(SIG_EVENT_START, profile);
                             }
                         }
                     	break;
@@ -709,25 +1321,107 @@ __main_loop:
     }
 
 __main_quit:
-    usbnet_link_change(0, profile);
+    for (pdn = profile; pdn; pdn = pdn->next_pdn)
+        usbnet_link_change(0, pdn);
     if (gQmiThreadID && pthread_join(gQmiThreadID, NULL)) {
         dbg_time("%s Error joining to listener thread (%s)", __func__, strerror(errno));
     }
-    close(signal_control_fd[0]);
-    close(signal_control_fd[1]);
+    request_async_deinit();
+    pdn_setup_drop(profile);
     close(qmidevice_control_fd[0]);
     close(qmidevice_control_fd[1]);
+    metrics_stop();
+    close(epoll_fd);
+    s_main_epoll_fd = -1;
+    for (pdn = profile; pdn; pdn = pdn->next_pdn)
+        close(pdn->redial_timerfd);
+    close(keepalive_timerfd);
+    close(s_setup_eventfd);
+    s_setup_eventfd = -1;
+    close(main_signalfd);
+    main_signalfd = -1;
     dbg_time("%s exit", __func__);
 
     return 0;
 }
 
 #define has_more_argv() ((opt < argc) && (argv[opt][0] != '-'))
+//[apn [user password auth]] of -s and -N, returns the next opt, or -1 for a bad auth
+static int parse_apn_argv(PROFILE_T *profile, int argc, char *argv[], int opt) {
+    profile->apn = profile->user = profile->password = "";
+    if (has_more_argv())
+        profile->apn = argv[opt++];
+    if (has_more_argv())
+        profile->user = argv[opt++];
+    if (has_more_argv())
+    {
+        profile->password = argv[opt++];
+        if (profile->password && profile->password[0])
+            profile->auth = 2; //default chap, customers may miss auth
+    }
+    if (has_more_argv()) {
+        const char *auth = argv[opt++];
+
+        if (!strcmp(auth, "0") || !strcasecmp(auth, "none")) {
+            profile->auth = 0;
+        } else if (!strcmp(auth, "1") || !strcasecmp(auth, "pap")) {
+            profile->auth = 1;
+        } else if (!strcmp(auth, "2") || !strcasecmp(auth, "chap")) {
+            profile->auth = 2;
+        } else {
+            dbg_time("unknow auth '%s'", auth);
+            return -1;
+        }
+    }
+
+    return opt;
+}
+
+/*
+ * -N turns a PROFILE_T holding only pdp/apn/user/password/auth into one more
+ * PDN of this process: a copy of the first profile with its own mux id,
+ * qmap netcard, WDS clients and redial state, over the same cdc-wdm.
+ */
+static int pdn_attach(PROFILE_T *profile, PROFILE_T *pdn) {
+    PROFILE_T args = *pdn;
+    PROFILE_T *other;
+
+    if (args.pdp < 1 || args.pdp > profile->qmap_mode) {
+        dbg_time("pdn-%d out of range, qmap_mode = %d", args.pdp, profile->qmap_mode);
+        return -1;
+    }
+    for (other = profile; other != pdn; other = other->next_pdn) {
+        if (other->pdp == args.pdp) {
+            dbg_time("pdn-%d is given more than once", args.pdp);
+            return -1;
+        }
+    }
+
+    *pdn = *profile;
+    pdn->pdp = args.pdp;
+    pdn->apn = args.apn;
+    pdn->user = args.user;
+    pdn->password = args.password;
+    pdn->auth = args.auth;
+    pdn->muxid = 0;
+    pdn->qmapnet_adapter[0] = '\0';
+    pdn->loopback_state = 0;
+    memset(&pdn->ipv4, 0x00, sizeof(pdn->ipv4));
+    memset(&pdn->ipv6, 0x00, sizeof(pdn->ipv6));
+    memset(pdn->wds_client, 0x00, sizeof(pdn->wds_client));
+    pdn->next_pdn = args.next_pdn;
+
+    ql_qmap_mode_detect(pdn);
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     int opt = 1;
     const char *usbmon_logfile = NULL;
     PROFILE_T profile;
+    PROFILE_T **next_pdn = &profile.next_pdn;
+    PROFILE_T *pdn;
     int ret = -1;
 
     dbg_time("Quectel_QConnectManager_Linux_V1.6.0.24");
@@ -745,31 +1439,25 @@ int main(int argc, char *argv[])
         switch (argv[opt++][1])
         {
             case 's':
-                profile.apn = profile.user = profile.password = "";
-                if (has_more_argv())
-                    profile.apn = argv[opt++];
-                if (has_more_argv())
-                    profile.user = argv[opt++];
-                if (has_more_argv())
-                {
-                    profile.password = argv[opt++];
-                    if (profile.password && profile.password[0])
-                        profile.auth = 2; //default chap, customers may miss auth
-                }
+                opt = parse_apn_argv(&profile, argc, argv, opt);
+                if (opt < 0)
+                    return usage(argv[0]);
+            break;
+
+            case 'N':
+                if (!has_more_argv())
+                    return usage(argv[0]);
+                pdn = (PROFILE_T *)calloc(1, sizeof(PROFILE_T));
+                if (!pdn)
+                    return -1;
+                pdn->pdp = argv[opt++][0] - '0';
                 if (has_more_argv()) {
-                    const char *auth = argv[opt++];
-
-                    if (!strcmp(auth, "0") || !strcasecmp(auth, "none")) {
-                        profile.auth = 0;
-                    } else if (!strcmp(auth, "1") || !strcasecmp(auth, "pap")) {
-                        profile.auth = 1;
-                    } else if (!strcmp(auth, "2") || !strcasecmp(auth, "chap")) {
-                        profile.auth = 2;
-                    } else {
-                        dbg_time("unknow auth '%s'", auth);
+                    opt = parse_apn_argv(pdn, argc, argv, opt);
+                    if (opt < 0)
                         return usage(argv[0]);
-                    }
                 }
+                *next_pdn = pdn;
+                next_pdn = &pdn->next_pdn;
             break;
 
             case 'p':
@@ -852,6 +1540,17 @@ int main(int argc, char *argv[])
             case 'b':
                 profile.enable_bridge = 1;
             break;
+
+            case 'S':
+                profile.static_ip = 1;
+            break;
+
+            case 'r':
+                if (has_more_argv())
+                    profile.redial_min_msec = strtoul(argv[opt++], NULL, 10);
+                if (has_more_argv())
+                    profile.redial_max_msec = strtoul(argv[opt++], NULL, 10);
+            break;
 			
             case 'k':
                 if (has_more_argv()) {
@@ -869,6 +1568,11 @@ int main(int argc, char *argv[])
         profile.enable_ipv4 = 1;
     }
 
+    if (profile.redial_min_msec == 0)
+        profile.redial_min_msec = 5000;
+    if (profile.redial_max_msec < profile.redial_min_msec)
+        profile.redial_max_msec = (profile.redial_min_msec > 60000) ? profile.redial_min_msec : 60000;
+
     if (!(profile.qmichannel[0]) || !(profile.usbnet_adapter[0])) {
         char qmichannel[32+1] = {'\0'};
         char usbnet_adapter[32+1] = {'\0'};
@@ -901,11 +1605,11 @@ int main(int argc, char *argv[])
   
     ql_qmap_mode_detect(&profile);
 
+    //before pdn_attach(), every -N PDN copies the ops of the first one
     if (profile.software_interface == SOFTWARE_MBIM) {
         dbg_time("Modem works in MBIM mode");
         profile.request_ops = &mbim_request_ops;
         profile.qmi_ops = &mbim_dev_ops;
-        ret = qmi_main(&profile);
     }
     else if (profile.software_interface == SOFTWARE_QMI) {
         dbg_time("Modem works in QMI mode");
@@ -915,23 +1619,44 @@ int main(int argc, char *argv[])
         else
             profile.qmi_ops = &qmiwwan_qmidev_ops;
         qmidev_send = profile.qmi_ops->send;
-        ret = qmi_main(&profile);
     }
     else if (profile.software_interface == SOFTWARE_ECM_RNDIS_NCM) {
         dbg_time("Modem works in ECM_RNDIS_NCM mode");
         profile.request_ops = &atc_request_ops;
         profile.qmi_ops = &atc_dev_ops;
-        ret = qmi_main(&profile);
     }
     else {
         dbg_time("unsupport software_interface %d", profile.software_interface);
+        goto error;
+    }
+
+    if (profile.next_pdn) {
+        if (profile.software_interface != SOFTWARE_QMI || qmidev_is_gobinet(profile.qmichannel) || profile.qmap_mode <= 1) {
+            dbg_time("-N needs qmi_wwan in QMAP mode (qmap_mode > 1), qmap_mode = %d", profile.qmap_mode);
+            goto error;
+        }
+        for (pdn = profile.next_pdn; pdn; pdn = pdn->next_pdn) {
+            if (pdn_attach(&profile, pdn))
+                goto error;
+        }
     }
 
+    ql_status_open(profile.pdp);
+    ql_trace_init(profile.pdp);
+
+    ret = qmi_main(&profile);
+
+    ql_status_close();
     ql_stop_usbmon_log(&profile);
     if (logfilefp)
     fclose(logfilefp);
 
 error:
+    while (profile.next_pdn) {
+        pdn = profile.next_pdn;
+        profile.next_pdn = pdn->next_pdn;
+        free(pdn);
+    }
 
     return ret;
 }
@@ -33,6 +33,7 @@
 #include <limits.h>
 #include <inttypes.h>
 #include "QMIThread.h"
+#include "trace.h"
 
 #ifndef htole32
 #if __BYTE_ORDER == __LITTLE_ENDIAN
@@ -807,6 +808,7 @@ static int mbim_sessionID = 0;
 static int mbim_fd = -1;
 static MBIM_MESSAGE_HEADER *mbim_pRequest;
 static MBIM_MESSAGE_HEADER *mbim_pResponse;
+static pthread_mutex_t mbim_command_mutex = PTHREAD_MUTEX_INITIALIZER; //one command in flight
 
 static const UUID_T * str2uuid(const char *str) {
     static UUID_T uuid;
@@ -1307,11 +1309,15 @@ static void mbim_dump(MBIM_MESSAGE_HEADER *pMsg, int mbim_verbose) {
 
 static void mbim_recv_command(MBIM_MESSAGE_HEADER *pResponse, unsigned size)
 {
-    (void)size;
     pthread_mutex_lock(&cm_command_mutex);
 
-    if (pResponse)
+    if (pResponse) {
+        //MessageLength comes from the device, never trace past what was read
+        if (size > le32toh(pResponse->MessageLength))
+            size = le32toh(pResponse->MessageLength);
+        ql_trace(QL_TRACE_MBIM, QL_TRACE_RX, pResponse, size);
         mbim_dump(pResponse, mbim_verbose);
+    }
 
     if (pResponse == NULL) {
         pthread_cond_signal(&cm_command_cond);
@@ -1384,6 +1390,7 @@ static int mbim_send_command(MBIM_MESSAGE_HEADER *pRequest, MBIM_COMMAND_DONE_T
     if (!pRequest)
         return -ENOMEM;
 
+    pthread_mutex_lock(&mbim_command_mutex);
     pthread_mutex_lock(&cm_command_mutex);
 
     if (pRequest) {
@@ -1391,6 +1398,7 @@ static int mbim_send_command(MBIM_MESSAGE_HEADER *pRequest, MBIM_COMMAND_DONE_T
             TransactionId = 1;
             pRequest->TransactionId = htole32(TransactionId++);
         }
+        ql_trace(QL_TRACE_MBIM, QL_TRACE_TX, pRequest, le32toh(pRequest->MessageLength));
         mbim_dump(pRequest, mbim_verbose);
     }
 
@@ -1413,21 +1421,50 @@ static int mbim_send_command(MBIM_MESSAGE_HEADER *pRequest, MBIM_COMMAND_DONE_T
     mbim_pRequest = mbim_pResponse = NULL;
 
     pthread_mutex_unlock(&cm_command_mutex);
+    pthread_mutex_unlock(&mbim_command_mutex);
 
     return ret;
 }
 
+/*
+ * The proxy socket is a stream: a read() may end inside a message or carry several.
+ * The bytes wait in cm_recv_buf until they make a message, which is always at the front.
+ */
+static size_t s_proxy_len = 0;
+
 static ssize_t mbim_proxy_read (int fd, MBIM_MESSAGE_HEADER *pResponse, size_t size) {
     ssize_t nreads;
 
-    nreads = read(fd, pResponse, sizeof(MBIM_MESSAGE_HEADER));
-    if (nreads == sizeof(MBIM_MESSAGE_HEADER) && le32toh(pResponse->MessageLength) <= size) {
-        nreads += read(fd, pResponse+1, le32toh(pResponse->MessageLength) - sizeof(MBIM_MESSAGE_HEADER));
-    }
+    nreads = read(fd, (uint8_t *)pResponse + s_proxy_len, size - s_proxy_len);
+    if (nreads > 0)
+        s_proxy_len += nreads;
 
     return nreads;
 }
 
+/* size of the message at the front, 0 until it is complete */
+static size_t mbim_proxy_next (MBIM_MESSAGE_HEADER *pResponse, size_t size) {
+    size_t len;
+
+    if (s_proxy_len < sizeof(MBIM_MESSAGE_HEADER))
+        return 0;
+
+    len = le32toh(pResponse->MessageLength);
+    if (len < sizeof(MBIM_MESSAGE_HEADER) || len > size) {
+        //lost the framing, nothing to resync on
+        mbim_debug("%s bad MessageLength %u, drop %u bytes", __func__, (unsigned)len, (unsigned)s_proxy_len);
+        s_proxy_len = 0;
+        return 0;
+    }
+
+    return s_proxy_len >= len ? len : 0;
+}
+
+static void mbim_proxy_consume (MBIM_MESSAGE_HEADER *pResponse, size_t len) {
+    s_proxy_len -= len;
+    memmove(pResponse, (uint8_t *)pResponse + len, s_proxy_len);
+}
+
 static void * mbim_read_thread(void *param) {
     PROFILE_T *profile = (PROFILE_T *)param;
     const char *cdc_wdm = (const char *)profile->qmichannel;
@@ -1456,11 +1493,12 @@ static void * mbim_read_thread(void *param) {
 
     dbg_time("cdc_wdm_fd = %d", mbim_fd);
 
+    s_proxy_len = 0;
     qmidevice_send_event_to_main(RIL_INDICATE_DEVICE_CONNECTED);
 
     while (mbim_fd > 0) {
         struct pollfd pollfds[] = {{mbim_fd, POLLIN, 0}, {qmidevice_control_fd[1], POLLIN, 0}};
-        int ne, ret, nevents = 2;
+        int ne, ret, nevents = sizeof(pollfds)/sizeof(pollfds[0]);
 
         ret = poll(pollfds, nevents, wait_for_request_quit ? 1000 : -1);
 
@@ -1501,6 +1539,16 @@ static void * mbim_read_thread(void *param) {
                     break;
                 }
 
+                if (profile->proxy[0]) {
+                    size_t len;
+
+                    while ((len = mbim_proxy_next(pResponse, sizeof(cm_recv_buf))) > 0) {
+                        mbim_recv_command(pResponse, len);
+                        mbim_proxy_consume(pResponse, len);
+                    }
+                    continue;
+                }
+
                 mbim_recv_command(pResponse, nreads);
             }
             else if (fd == qmidevice_control_fd[1]) {
@@ -2113,10 +2161,15 @@ static int mbim_deinit(void) {
     return 0;
 }
 
+static void mbim_wakeup(void) {
+    mbim_recv_command(NULL, 0);
+}
+
 const struct qmi_device_ops mbim_dev_ops = {
     .init = mbim_init,
     .deinit = mbim_deinit,
     .read = mbim_read_thread,
+    .wakeup = mbim_wakeup,
 };
 
 static int requestBaseBandVersion(PROFILE_T *profile) {
@@ -2192,7 +2245,7 @@ exit:
     return retval;
 }
 
-static int requestSetupDataCall(PROFILE_T *profile, int curIpFamily) {
+static int requestSetupDataCall(PROFILE_T *profile, int curIpFamily, int auth) {
     int retval;
 
     (void)curIpFamily;
@@ -2203,8 +2256,8 @@ static int requestSetupDataCall(PROFILE_T *profile, int curIpFamily) {
         mbim_user = profile->user;
     if (profile->password)
         mbim_passwd = profile->password;
-    if (profile->auth)
-        mbim_auth = profile->auth;
+    if (auth)
+        mbim_auth = auth;
     if (profile->enable_ipv4)
         mbim_iptype = MBIMContextIPTypeIPv4;
     if (profile->enable_ipv6)
@@ -2220,9 +2273,10 @@ exit:
     return retval;
 }
 
-static int requestQueryDataCall(UCHAR  *pConnectionStatus, int curIpFamily) {
+static int requestQueryDataCall(PROFILE_T *profile, UCHAR  *pConnectionStatus, int curIpFamily) {
     int retval;
 
+    (void)profile;
     (void)curIpFamily;
 
     *pConnectionStatus = QWDS_PKT_DATA_DISCONNECTED;
@@ -2278,5 +2332,6 @@ const struct request_ops mbim_request_ops = {
     .requestQueryDataCall = requestQueryDataCall,
     .requestDeactivateDefaultPDP = requestDeactivateDefaultPDP,
     .requestGetIPAddress = requestGetIPAddress,
+    .async_workers = 1,
 };
 
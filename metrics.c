@@ -0,0 +1,469 @@
+/******************************************************************************
+  @file    metrics.c
+  @brief   in-process metrics registry and its Unix socket exporter.
+
+  DESCRIPTION
+  Connectivity Management Tool for USB network adapter of Quectel wireless cellular modules.
+
+  Gauges, counters and histograms are kept as series of (metric, labels).
+  /tmp/quectel-CM.<pdn>.metrics serves them from the main loop:
+    curl --unix-socket /tmp/quectel-CM.1.metrics http://localhost/metrics
+    curl --unix-socket /tmp/quectel-CM.1.metrics http://localhost/json
+    socat - UNIX-CONNECT:/tmp/quectel-CM.1.metrics < /dev/null
+  An HTTP GET gets an HTTP reply, anything else (or nothing) gets the plain
+  Prometheus text, or JSON when the request mentions "json".
+
+  INITIALIZATION AND SEQUENCING REQUIREMENTS
+  The setters can be called from any thread at any time.
+  metrics_start() once the main loop's epoll exists, metrics_stop() on exit.
+******************************************************************************/
+#include <sys/un.h>
+#include <sys/timerfd.h>
+#include <stdarg.h>
+#include "QMIThread.h"
+
+#define METRICS_MAX_SERIES 192
+#define METRICS_MAX_CLIENTS 4
+#define METRICS_CLIENT_TIMEOUT_MSEC 5000
+
+typedef enum {
+    METRIC_COUNTER,
+    METRIC_GAUGE,
+    METRIC_HISTOGRAM,
+} METRIC_TYPE;
+
+static const struct {
+    const char *name;
+    METRIC_TYPE type;
+    const char *help;
+} s_metric_desc[METRIC_ID_MAX] = {
+    [METRIC_SIGNAL_RSSI] = {"qcm_signal_rssi_dbm", METRIC_GAUGE, "Received signal strength per RAT"},
+    [METRIC_SIGNAL_RSRQ] = {"qcm_signal_rsrq_db", METRIC_GAUGE, "LTE reference signal received quality"},
+    [METRIC_SIGNAL_RSRP] = {"qcm_signal_rsrp_dbm", METRIC_GAUGE, "Reference signal received power per RAT"},
+    [METRIC_SIGNAL_SNR] = {"qcm_signal_snr_db", METRIC_GAUGE, "Signal to noise ratio per RAT"},
+    [METRIC_SIGNAL_ECIO] = {"qcm_signal_ecio_db", METRIC_GAUGE, "Ec/Io per RAT"},
+    [METRIC_REGISTERED] = {"qcm_registered", METRIC_GAUGE, "1 when registered with a network"},
+    [METRIC_PS_ATTACHED] = {"qcm_ps_attached", METRIC_GAUGE, "1 when packet service is attached"},
+    [METRIC_DATA_CLASS] = {"qcm_data_class", METRIC_GAUGE, "Current data class, the value is always 1"},
+    [METRIC_PDN_CONNECTED] = {"qcm_pdn_connected", METRIC_GAUGE, "1 when the bearer of the PDN is up"},
+    [METRIC_SETUP_CALL] = {"qcm_setup_data_call_total", METRIC_COUNTER, "Data call setup attempts by result"},
+    [METRIC_CALL_END] = {"qcm_call_end_total", METRIC_COUNTER, "Data call setups refused by the network, by reason"},
+    [METRIC_CALL_END_REASON] = {"qcm_call_end_reason", METRIC_GAUGE, "Verbose reason of the last refused data call setup"},
+    [METRIC_OUTAGE_SECONDS] = {"qcm_pdn_outage_seconds", METRIC_HISTOGRAM, "Time from data call loss to restore"},
+    [METRIC_QMI_REQUEST_SECONDS] = {"qcm_qmi_request_seconds", METRIC_HISTOGRAM, "QMI request to response latency per message type"},
+    [METRIC_QMI_TIMEOUTS] = {"qcm_qmi_timeouts_total", METRIC_COUNTER, "QMI requests that got no response in time"},
+};
+
+static const double s_metric_buckets[] = {0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60, 120};
+#define METRICS_NUM_BUCKETS (sizeof(s_metric_buckets)/sizeof(s_metric_buckets[0]))
+
+typedef struct {
+    int used;
+    enum metric_id id;
+    char labels[96];
+    double value;
+    unsigned long long count;
+    unsigned long long buckets[METRICS_NUM_BUCKETS];
+} METRIC_SERIES;
+
+static pthread_mutex_t s_metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+static METRIC_SERIES s_series[METRICS_MAX_SERIES];
+static int s_series_dropped = 0;
+
+static int s_metrics_fd = -1;
+static int s_metrics_timerfd = -1;
+static char s_metrics_path[64];
+static struct {
+    int fd;
+    unsigned long accept_msec;
+    char *reply; //NULL until the request is read, then flushed on EPOLLOUT
+    size_t reply_len;
+    size_t reply_off;
+} s_metrics_clients[METRICS_MAX_CLIENTS];
+
+/* callers hold s_metrics_mutex */
+static METRIC_SERIES *metric_series(enum metric_id id, const char *fmt, va_list args) {
+    char labels[sizeof(s_series[0].labels)];
+    METRIC_SERIES *free_slot = NULL;
+    int i;
+
+    labels[0] = '\0';
+    if (fmt)
+        vsnprintf(labels, sizeof(labels), fmt, args);
+
+    for (i = 0; i < METRICS_MAX_SERIES; i++) {
+        if (!s_series[i].used) {
+            if (!free_slot)
+                free_slot = &s_series[i];
+        }
+        else if (s_series[i].id == id && !strcmp(s_series[i].labels, labels)) {
+            return &s_series[i];
+        }
+    }
+
+    if (!free_slot) {
+        if (!s_series_dropped++)
+            dbg_time("%s too many series, %s{%s} dropped", __func__, s_metric_desc[id].name, labels);
+        return NULL;
+    }
+
+    memset(free_slot, 0, sizeof(*free_slot));
+    free_slot->used = 1;
+    free_slot->id = id;
+    strcpy(free_slot->labels, labels);
+    return free_slot;
+}
+
+void metric_set(enum metric_id id, double value, const char *labels, ...) {
+    METRIC_SERIES *s;
+    va_list args;
+
+    pthread_mutex_lock(&s_metrics_mutex);
+    va_start(args, labels);
+    s = metric_series(id, labels, args);
+    va_end(args);
+    if (s)
+        s->value = value;
+    pthread_mutex_unlock(&s_metrics_mutex);
+}
+
+void metric_inc(enum metric_id id, const char *labels, ...) {
+    METRIC_SERIES *s;
+    va_list args;
+
+    pthread_mutex_lock(&s_metrics_mutex);
+    va_start(args, labels);
+    s = metric_series(id, labels, args);
+    va_end(args);
+    if (s)
+        s->value += 1;
+    pthread_mutex_unlock(&s_metrics_mutex);
+}
+
+void metric_observe(enum metric_id id, double value, const char *labels, ...) {
+    METRIC_SERIES *s;
+    va_list args;
+    unsigned i;
+
+    pthread_mutex_lock(&s_metrics_mutex);
+    va_start(args, labels);
+    s = metric_series(id, labels, args);
+    va_end(args);
+    if (s) {
+        s->value += value;
+        s->count++;
+        for (i = 0; i < METRICS_NUM_BUCKETS; i++) {
+            if (value <= s_metric_buckets[i])
+                s->buckets[i]++;
+        }
+    }
+    pthread_mutex_unlock(&s_metrics_mutex);
+}
+
+/* drop every series of a metric, for the ones whose labels carry the value (data class) */
+void metric_clear(enum metric_id id) {
+    int i;
+
+    pthread_mutex_lock(&s_metrics_mutex);
+    for (i = 0; i < METRICS_MAX_SERIES; i++) {
+        if (s_series[i].used && s_series[i].id == id)
+            s_series[i].used = 0;
+    }
+    pthread_mutex_unlock(&s_metrics_mutex);
+}
+
+static void metrics_render_prometheus(FILE *fp) {
+    int id, i;
+    unsigned b;
+
+    for (id = 0; id < METRIC_ID_MAX; id++) {
+        const char *name = s_metric_desc[id].name;
+        int header = 0;
+
+        for (i = 0; i < METRICS_MAX_SERIES; i++) {
+            METRIC_SERIES *s = &s_series[i];
+            const char *sep = s->labels[0] ? "," : "";
+
+            if (!s->used || (int)s->id != id)
+                continue;
+
+            if (!header) {
+                static const char *types[] = {"counter", "gauge", "histogram"};
+
+                fprintf(fp, "# HELP %s %s\n", name, s_metric_desc[id].help);
+                fprintf(fp, "# TYPE %s %s\n", name, types[s_metric_desc[id].type]);
+                header = 1;
+            }
+
+            if (s_metric_desc[id].type != METRIC_HISTOGRAM) {
+                fprintf(fp, s->labels[0] ? "%s{%s} %g\n" : "%s%s %g\n", name, s->labels, s->value);
+                continue;
+            }
+
+            for (b = 0; b < METRICS_NUM_BUCKETS; b++)
+                fprintf(fp, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, s->labels, sep, s_metric_buckets[b], s->buckets[b]);
+            fprintf(fp, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, s->labels, sep, s->count);
+            fprintf(fp, s->labels[0] ? "%s_sum{%s} %g\n" : "%s_sum%s %g\n", name, s->labels, s->value);
+            fprintf(fp, s->labels[0] ? "%s_count{%s} %llu\n" : "%s_count%s %llu\n", name, s->labels, s->count);
+        }
+    }
+
+    fprintf(fp, "# TYPE qcm_process_spawn_total counter\n");
+    fprintf(fp, "qcm_process_spawn_total %u\n", ql_status_spawn_count());
+}
+
+/* a="b",c="d" -> "a":"b","c":"d", label values never contain quotes */
+static void metrics_json_labels(FILE *fp, const char *labels) {
+    const char *p;
+
+    fputc('"', fp);
+    for (p = labels; *p; p++) {
+        if (*p == '=')
+            fputs("\":", fp);
+        else if (*p == ',')
+            fputs(",\"", fp);
+        else
+            fputc(*p, fp);
+    }
+}
+
+static void metrics_render_json(FILE *fp) {
+    int i, first = 1;
+    unsigned b;
+
+    fprintf(fp, "{\"metrics\":[");
+    for (i = 0; i < METRICS_MAX_SERIES; i++) {
+        METRIC_SERIES *s = &s_series[i];
+
+        if (!s->used)
+            continue;
+
+        fprintf(fp, "%s\n{\"name\":\"%s\",\"labels\":{", first ? "" : ",", s_metric_desc[s->id].name);
+        if (s->labels[0])
+            metrics_json_labels(fp, s->labels);
+        fprintf(fp, "},");
+        first = 0;
+
+        if (s_metric_desc[s->id].type != METRIC_HISTOGRAM) {
+            fprintf(fp, "\"value\":%g}", s->value);
+            continue;
+        }
+
+        fprintf(fp, "\"buckets\":[");
+        for (b = 0; b < METRICS_NUM_BUCKETS; b++)
+            fprintf(fp, "%s[%g,%llu]", b ? "," : "", s_metric_buckets[b], s->buckets[b]);
+        fprintf(fp, "],\"sum\":%g,\"count\":%llu}", s->value, s->count);
+    }
+    fprintf(fp, "%s\n{\"name\":\"qcm_process_spawn_total\",\"labels\":{},\"value\":%u}\n]}\n",
+        first ? "" : ",", ql_status_spawn_count());
+}
+
+int metrics_render(FILE *fp, int json) {
+    pthread_mutex_lock(&s_metrics_mutex);
+    if (json)
+        metrics_render_json(fp);
+    else
+        metrics_render_prometheus(fp);
+    pthread_mutex_unlock(&s_metrics_mutex);
+
+    return ferror(fp) ? -EIO : 0;
+}
+
+static char *metrics_reply(const char *request, size_t *reply_len) {
+    int http = !strncmp(request, "GET ", 4);
+    int json = strstr(request, "json") != NULL;
+    char *reply = NULL;
+    FILE *fp;
+
+    fp = open_memstream(&reply, reply_len);
+    if (!fp)
+        return NULL;
+    if (http) {
+        char *body = NULL;
+        size_t body_len = 0;
+        FILE *body_fp = open_memstream(&body, &body_len);
+
+        if (body_fp) {
+            metrics_render(body_fp, json);
+            fclose(body_fp);
+            fprintf(fp, "HTTP/1.0 200 OK\r\nContent-Type: %s\r\nContent-Length: %zu\r\n\r\n",
+                json ? "application/json" : "text/plain; version=0.0.4", body_len);
+            fwrite(body, 1, body_len, fp);
+            free(body);
+        }
+    } else {
+        metrics_render(fp, json);
+    }
+    fclose(fp);
+
+    return reply;
+}
+
+static void metrics_client_close(int i) {
+    main_unwatch_fd(s_metrics_clients[i].fd);
+    close(s_metrics_clients[i].fd);
+    s_metrics_clients[i].fd = -1;
+    free(s_metrics_clients[i].reply);
+    s_metrics_clients[i].reply = NULL;
+}
+
+/* 1 once the whole reply is out (or the client is gone), 0 to wait for EPOLLOUT */
+static int metrics_client_flush(int i) {
+    while (s_metrics_clients[i].reply_off < s_metrics_clients[i].reply_len) {
+        ssize_t nwrites = send(s_metrics_clients[i].fd, s_metrics_clients[i].reply + s_metrics_clients[i].reply_off,
+            s_metrics_clients[i].reply_len - s_metrics_clients[i].reply_off, MSG_NOSIGNAL);
+
+        if (nwrites < 0 && errno == EINTR)
+            continue;
+        if (nwrites < 0 && errno == EAGAIN)
+            return 0;
+        if (nwrites <= 0)
+            return 1;
+        s_metrics_clients[i].reply_off += nwrites;
+    }
+
+    return 1;
+}
+
+static void metrics_client_handler(int fd, void *arg) {
+    int i = (int)(long)arg;
+    char request[256];
+    ssize_t nreads;
+
+    if (s_metrics_clients[i].reply == NULL) {
+        nreads = recv(fd, request, sizeof(request) - 1, MSG_DONTWAIT);
+        if (nreads < 0 && (errno == EAGAIN || errno == EINTR))
+            return;
+
+        request[nreads > 0 ? nreads : 0] = '\0';
+        s_metrics_clients[i].reply = metrics_reply(request, &s_metrics_clients[i].reply_len);
+        s_metrics_clients[i].reply_off = 0;
+        if (s_metrics_clients[i].reply == NULL) {
+            metrics_client_close(i);
+            return;
+        }
+    }
+
+    if (metrics_client_flush(i) || main_watch_fd_events(fd, EPOLLOUT))
+        metrics_client_close(i);
+}
+
+/* close the clients that did not send a request or read the reply in time */
+static void metrics_timer_handler(int fd, void *arg) {
+    struct itimerspec its;
+    uint64_t expirations;
+    int i, clients = 0;
+
+    (void)arg;
+    if (read(fd, &expirations, sizeof(expirations)) == -1) {};
+
+    for (i = 0; i < METRICS_MAX_CLIENTS; i++) {
+        if (s_metrics_clients[i].fd >= 0 && clock_msec() - s_metrics_clients[i].accept_msec > METRICS_CLIENT_TIMEOUT_MSEC)
+            metrics_client_close(i);
+        if (s_metrics_clients[i].fd >= 0)
+            clients++;
+    }
+
+    if (!clients) {
+        memset(&its, 0, sizeof(its));
+        timerfd_settime(fd, 0, &its, NULL);
+    }
+}
+
+static void metrics_accept_handler(int fd, void *arg) {
+    struct itimerspec its;
+    int client, i, slot = -1;
+
+    (void)arg;
+    client = accept(fd, NULL, NULL);
+    if (client < 0)
+        return;
+    fcntl(client, F_SETFD, FD_CLOEXEC);
+    fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK);
+
+    for (i = 0; i < METRICS_MAX_CLIENTS; i++) {
+        if (s_metrics_clients[i].fd < 0) {
+            slot = i;
+            break;
+        }
+    }
+
+    //all slots busy, the reaper frees them within METRICS_CLIENT_TIMEOUT_MSEC
+    if (slot < 0 || main_watch_fd(client, metrics_client_handler, (void *)(long)slot)) {
+        close(client);
+        return;
+    }
+
+    s_metrics_clients[slot].fd = client;
+    s_metrics_clients[slot].accept_msec = clock_msec();
+
+    //reap idle clients once a second while there are any
+    memset(&its, 0, sizeof(its));
+    timerfd_gettime(s_metrics_timerfd, &its);
+    if (!its.it_value.tv_sec && !its.it_value.tv_nsec) {
+        its.it_value.tv_sec = its.it_interval.tv_sec = 1;
+        timerfd_settime(s_metrics_timerfd, 0, &its, NULL);
+    }
+}
+
+int metrics_start(int pdp) {
+    struct sockaddr_un addr;
+    int i;
+
+    for (i = 0; i < METRICS_MAX_CLIENTS; i++)
+        s_metrics_clients[i].fd = -1;
+
+    s_metrics_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (s_metrics_timerfd < 0)
+        return -errno;
+    if (main_watch_fd(s_metrics_timerfd, metrics_timer_handler, NULL)) {
+        close(s_metrics_timerfd);
+        s_metrics_timerfd = -1;
+        return -1;
+    }
+
+    snprintf(s_metrics_path, sizeof(s_metrics_path), "/tmp/quectel-CM.%d.metrics", pdp);
+    s_metrics_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (s_metrics_fd < 0) {
+        metrics_stop();
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, s_metrics_path, sizeof(addr.sun_path) - 1);
+    unlink(s_metrics_path);
+    if (bind(s_metrics_fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(s_metrics_fd, METRICS_MAX_CLIENTS)
+        || main_watch_fd(s_metrics_fd, metrics_accept_handler, NULL)) {
+        dbg_time("%s %s fail, errno: %d (%s)", __func__, s_metrics_path, errno, strerror(errno));
+        close(s_metrics_fd);
+        s_metrics_fd = -1;
+        unlink(s_metrics_path);
+        metrics_stop();
+        return -1;
+    }
+
+    return 0;
+}
+
+void metrics_stop(void) {
+    int i;
+
+    if (s_metrics_timerfd >= 0) {
+        main_unwatch_fd(s_metrics_timerfd);
+        close(s_metrics_timerfd);
+        s_metrics_timerfd = -1;
+    }
+
+    if (s_metrics_fd < 0)
+        return;
+
+    for (i = 0; i < METRICS_MAX_CLIENTS; i++) {
+        if (s_metrics_clients[i].fd >= 0)
+            metrics_client_close(i);
+    }
+    main_unwatch_fd(s_metrics_fd);
+    close(s_metrics_fd);
+    s_metrics_fd = -1;
+    unlink(s_metrics_path);
+}
@@ -53,11 +53,20 @@ typedef struct {
 typedef struct {
     int client_fd;
     int client_idx;
+    unsigned char *out_buf; /* what the client has not read yet, at most out_max bytes */
+    size_t out_len;
+    size_t out_size;
+    unsigned out_drops;
+    int stalled;            /* shut down for not reading, disconnected on its POLLHUP */
+    size_t in_len;
+    unsigned char in_buf[4096]; /* the client stream until it makes a message */
 } CM_CLIENT_T;
 
 static unsigned char cm_recv_buffer[4096];
 static CM_CLIENT_T cm_clients[CM_MAX_CLIENT];
 static int verbose = 0;
+static size_t out_max = 64*1024;
+static int out_drop = 0; /* drop messages to a full client instead of disconnecting it */
 
 const char * get_time(void) {
     static char time_buf[128];
@@ -100,6 +109,104 @@ static int non_block_write(int fd, void *data, int len)
     return len;
 }
 
+/*
+ * a client that does not read must not stop the others, so nothing here waits for it:
+ * what the socket does not take now is queued and written on POLLOUT
+ */
+static int client_write(CM_CLIENT_T *client, void *data, size_t len)
+{
+    ssize_t ret = 0;
+
+    if (client->stalled)
+        return -EPIPE;
+
+    if (client->out_len == 0) {
+        ret = write(client->client_fd, data, len);
+        if (ret < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                return -errno; /* POLLERR/POLLHUP disconnects it */
+            ret = 0;
+        }
+        if ((size_t)ret == len)
+            return len;
+        data = (unsigned char *)data + ret;
+        len -= ret;
+    }
+
+    /* a partly written message always fits, the limit is never below one message */
+    if (client->out_len + len > out_max) {
+        if (out_drop) {
+            if (client->out_drops++ % 100 == 0)
+                mbim_debug("client_fd=%d is not reading, %u messages dropped\n", client->client_fd, client->out_drops);
+            return -ENOBUFS;
+        }
+
+        mbim_debug("client_fd=%d is not reading, %zu bytes queued, disconnect it\n", client->client_fd, client->out_len);
+        client->stalled = 1;
+        free(client->out_buf);
+        client->out_buf = NULL;
+        client->out_len = client->out_size = 0;
+        shutdown(client->client_fd, SHUT_RDWR);
+        return -ENOBUFS;
+    }
+
+    if (client->out_len + len > client->out_size) {
+        size_t out_size = client->out_size ? client->out_size * 2 : 4096;
+        unsigned char *out_buf;
+
+        while (out_size < client->out_len + len)
+            out_size *= 2;
+        if (out_size > out_max)
+            out_size = out_max;
+        out_buf = realloc(client->out_buf, out_size);
+        if (!out_buf)
+            return -ENOMEM;
+        client->out_buf = out_buf;
+        client->out_size = out_size;
+    }
+
+    memcpy(client->out_buf + client->out_len, data, len);
+    client->out_len += len;
+
+    return ret;
+}
+
+static void client_flush(int client_fd)
+{
+    int i;
+    ssize_t ret;
+
+    for (i = 0; i < CM_MAX_CLIENT; i++) {
+        CM_CLIENT_T *client = &cm_clients[i];
+
+        if (client->client_fd != client_fd || client->out_len == 0)
+            continue;
+
+        ret = write(client_fd, client->out_buf, client->out_len);
+        if (ret <= 0)
+            return;
+
+        client->out_len -= ret;
+        memmove(client->out_buf, client->out_buf + ret, client->out_len);
+        if (client->out_len == 0 && client->out_drops) {
+            mbim_debug("client_fd=%d is reading again, %u messages were dropped\n", client_fd, client->out_drops);
+            client->out_drops = 0;
+        }
+        return;
+    }
+}
+
+static void client_free(CM_CLIENT_T *client)
+{
+    safe_close(client->client_fd);
+    free(client->out_buf);
+    client->out_buf = NULL;
+    client->out_len = client->out_size = 0;
+    client->out_drops = 0;
+    client->stalled = 0;
+    client->in_len = 0;
+}
+
 static int mbim_send_open_msg(int mbim_dev_fd, uint32_t MaxControlTransfer) {
     MBIM_OPEN_MSG_T open_msg;
     MBIM_OPEN_MSG_T *pRequest = &open_msg;
@@ -188,39 +295,73 @@ static void handle_client_disconnect(int client_fd)
     for (i = 0; i < CM_MAX_CLIENT; i++) {
         if (cm_clients[i].client_fd == client_fd) {
             mbim_debug("%s client_fd=%d, client_idx=%d\n", __func__, cm_clients[i].client_fd, cm_clients[i].client_idx);
-            safe_close(cm_clients[i].client_fd);
+            client_free(&cm_clients[i]);
             return;
         }
     }
 }
 
-static int handle_client_request(int mbim_dev_fd, int client_fd, void *pdata, int len)
+static int handle_client_request(int mbim_dev_fd, CM_CLIENT_T *client, void *pdata, int len)
 {
-    int i;
-    int client_idx = -1;
     int ret;
     MBIM_MESSAGE_HEADER *pRequest = (MBIM_MESSAGE_HEADER *)pdata;
 
+    /* transfer TransicationID to proxy transicationID and record in sender list */
+    pRequest->TransactionId = (pRequest->TransactionId & TID_MASK) + (client->client_idx << TID_SHIFT);
+    if (verbose) mbim_debug("REQ client_fd=%d, client_idx=%d, tid=%u\n", client->client_fd, client->client_idx, (pRequest->TransactionId & TID_MASK));
+    ret = non_block_write (mbim_dev_fd, pRequest, len);
+    if (ret == len)
+        return 0;
+
+    return -1;
+}
+
+/*
+ * the client socket is a stream: a read() may end inside a message or carry several
+ * return: -1 when the client is to be disconnected
+ */
+static int handle_client_read(int mbim_dev_fd, int client_fd)
+{
+    int i, len;
+    CM_CLIENT_T *client = NULL;
+
     for (i = 0; i < CM_MAX_CLIENT; i++) {
         if (cm_clients[i].client_fd == client_fd) {
-            client_idx = cm_clients[i].client_idx;
+            client = &cm_clients[i];
             break;
         }
     }
 
-    if (client_idx == -1) {
-        goto error;
+    if (!client)
+        return -1;
+
+    len = read(client_fd, client->in_buf + client->in_len, sizeof(client->in_buf) - client->in_len);
+    if (len <= 0) {
+        mbim_debug("%s read fd=%d, len=%d, errno: %d(%s)\n", __func__, client_fd, len, errno, strerror(errno));
+        return -1;
     }
+    client->in_len += len;
 
-    /* transfer TransicationID to proxy transicationID and record in sender list */
-    pRequest->TransactionId = (pRequest->TransactionId & TID_MASK) + (client_idx << TID_SHIFT);
-    if (verbose) mbim_debug("REQ client_fd=%d, client_idx=%d, tid=%u\n", cm_clients[i].client_fd, cm_clients[i].client_idx, (pRequest->TransactionId & TID_MASK));
-    ret = non_block_write (mbim_dev_fd, pRequest, len);
-    if (ret == len)
-        return 0;
+    while (client->in_len >= sizeof(MBIM_MESSAGE_HEADER)) {
+        MBIM_MESSAGE_HEADER *pRequest = (MBIM_MESSAGE_HEADER *)client->in_buf;
+        unsigned int size = pRequest->MessageLength;
 
-error:
-    return -1;
+        if (size < sizeof(MBIM_MESSAGE_HEADER) || size > sizeof(client->in_buf)) {
+            /* lost the framing, nothing to resync on */
+            mbim_debug("%s client_fd=%d, MessageLength=%u\n", __func__, client_fd, size);
+            return -1;
+        }
+        if (client->in_len < size)
+            break;
+
+        memcpy(cm_recv_buffer, client->in_buf, size);
+        client->in_len -= size;
+        memmove(client->in_buf, client->in_buf + size, client->in_len);
+
+        handle_client_request(mbim_dev_fd, client, cm_recv_buffer, size);
+    }
+
+    return 0;
 }
 
 /*
@@ -237,7 +378,7 @@ static int handle_device_response(void *pdata, int len)
     if (pResponse->TransactionId == 0) {
         for (i = 0; i < CM_MAX_CLIENT; i++) {
             if (cm_clients[i].client_fd > 0) {
-                non_block_write(cm_clients[i].client_fd, pResponse, len);
+                client_write(&cm_clients[i], pResponse, len);
             }
         }
     }
@@ -249,7 +390,7 @@ static int handle_device_response(void *pdata, int len)
             if (cm_clients[i].client_idx == client_idx && cm_clients[i].client_fd > 0) {
                 pResponse->TransactionId &= TID_MASK;
                 if (verbose) mbim_debug("RSP client_fd=%d, client_idx=%d, tid=%u\n", cm_clients[i].client_fd, cm_clients[i].client_idx, (pResponse->TransactionId & TID_MASK));
-                non_block_write(cm_clients[i].client_fd, pResponse, len);
+                client_write(&cm_clients[i], pResponse, len);
                 break;
             }
         }
@@ -285,7 +426,7 @@ static int proxy_loop(int mbim_dev_fd)
             for (i = 0; i < CM_MAX_CLIENT; i++) {
                 if (cm_clients[i].client_fd > 0) {
                     pollfds[nevents].fd = cm_clients[i].client_fd;
-                    pollfds[nevents].events = POLLIN;
+                    pollfds[nevents].events = cm_clients[i].out_len ? (POLLIN | POLLOUT) : POLLIN;
                     pollfds[nevents].revents= 0;
                     nevents++;
                 }
@@ -313,6 +454,10 @@ static int proxy_loop(int mbim_dev_fd)
                 continue;
             }
 
+            if ((revents & POLLOUT) && fd != mbim_dev_fd && fd != mbim_server_fd) {
+                client_flush(fd);
+            }
+
             if (!(pollfds[ne].revents & POLLIN)) {
                 continue;
             }
@@ -320,38 +465,32 @@ static int proxy_loop(int mbim_dev_fd)
             if (fd == mbim_server_fd) {
                 handle_client_connect(fd);
             }
+            else if (fd != mbim_dev_fd) {
+                if (handle_client_read(mbim_dev_fd, fd) < 0)
+                    handle_client_disconnect(fd);
+            }
             else {
-                    int len = read(fd, cm_recv_buffer, sizeof(cm_recv_buffer));
+                int len = read(fd, cm_recv_buffer, sizeof(cm_recv_buffer));
 
-                    if (len <= 0) {
-                        mbim_debug("%s read fd=%d, len=%d, errno: %d(%s)\n", __func__, fd, len, errno, strerror(errno));
-                        if (fd == mbim_dev_fd)
-                            goto error;
-                        else
-                            handle_client_disconnect(fd);
+                if (len <= 0) {
+                    mbim_debug("%s read fd=%d, len=%d, errno: %d(%s)\n", __func__, fd, len, errno, strerror(errno));
+                    goto error;
+                }
 
-                        return len;
-                    }
+                if (mbim_server_fd == -1) {
+                    MBIM_OPEN_DONE_T *pOpenDone = (MBIM_OPEN_DONE_T *)cm_recv_buffer;
 
-                    if (fd == mbim_dev_fd) {
-                        if (mbim_server_fd == -1) {
-                            MBIM_OPEN_DONE_T *pOpenDone = (MBIM_OPEN_DONE_T *)cm_recv_buffer;
-
-                            if (pOpenDone->MessageHeader.MessageType == MBIM_OPEN_DONE) {
-                                mbim_debug("receive MBIM_OPEN_DONE, status=%d\n", pOpenDone->Status);
-                                if (pOpenDone->Status)
-                                    goto error;
-                                mbim_server_fd = proxy_make_server(QUECTEL_MBIM_PROXY);
-                                mbim_debug("mbim_server_fd=%d\n", mbim_server_fd);
-                            }
-                        }
-                        else {
-                            handle_device_response(cm_recv_buffer, len);
-                        }
-                    }
-                    else {
-                        handle_client_request(mbim_dev_fd, fd, cm_recv_buffer, len);
+                    if (pOpenDone->MessageHeader.MessageType == MBIM_OPEN_DONE) {
+                        mbim_debug("receive MBIM_OPEN_DONE, status=%d\n", pOpenDone->Status);
+                        if (pOpenDone->Status)
+                            goto error;
+                        mbim_server_fd = proxy_make_server(QUECTEL_MBIM_PROXY);
+                        mbim_debug("mbim_server_fd=%d\n", mbim_server_fd);
                     }
+                }
+                else {
+                    handle_device_response(cm_recv_buffer, len);
+                }
             }
         }
     }
@@ -359,7 +498,7 @@ static int proxy_loop(int mbim_dev_fd)
 error:
     safe_close(mbim_server_fd);
     for (i = 0; i < CM_MAX_CLIENT; i++) {
-        safe_close(cm_clients[i].client_fd);
+        client_free(&cm_clients[i]);
     }
 
     mbim_debug("%s exit\n", __func__);
@@ -386,12 +525,14 @@ int main(int argc, char **argv)
 {
     int optidx = 0;
     int opt;
-    char *optstr = "d:vh";
+    char *optstr = "d:q:s:vh";
     const char *device = "/dev/cdc-wdm0";
 
     struct option options[] = {
         {"verbose", no_argument,        NULL, 'v'},
         {"device", required_argument,   NULL, 'd'},
+        {"queue", required_argument,    NULL, 'q'},
+        {"slow", required_argument,     NULL, 's'},
         {0, 0, 0, 0},
     };
     while ((opt = getopt_long(argc, argv, optstr, options, &optidx)) != -1) {
@@ -402,10 +543,27 @@ int main(int argc, char **argv)
         case 'd':
             device = optarg;
             break;
+        case 'q':
+            out_max = strtoul(optarg, NULL, 10) * 1024;
+            if (out_max < sizeof(cm_recv_buffer))
+                out_max = sizeof(cm_recv_buffer);
+            break;
+        case 's':
+            if (!strcmp(optarg, "drop"))
+                out_drop = 1;
+            else if (!strcmp(optarg, "disconnect"))
+                out_drop = 0;
+            else {
+                mbim_debug("illegal argument\n");
+                return -1;
+            }
+            break;
         case 'h':
             mbim_debug("-h              Show this message\n");
             mbim_debug("-v              Verbose\n");
             mbim_debug("-d [device]     MBIM device\n");
+            mbim_debug("-q [kbytes]     Queued for a client that does not read, default 64\n");
+            mbim_debug("-s [drop|disconnect]  What to do when that queue is full, default disconnect\n");
             return 0;
         default:
             mbim_debug("illegal argument\n");
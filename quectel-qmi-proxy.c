@@ -30,6 +30,7 @@
 #include <linux/if.h>
 #include <dirent.h>
 #include <signal.h>
+#include <sys/epoll.h>
 #include <endian.h>
 #include <inttypes.h>
 
@@ -336,6 +337,9 @@ typedef struct _QCQMIMSG {
 #define QMICTL_SYNC_REQ               0x0027
 #define QMICTL_SYNC_RESP              0x0027
 #define QMICTL_SYNC_IND               0x0027
+/* answered by the proxy itself, see set_ind_filter() */
+#define QMICTL_PROXY_IND_FILTER_REQ   0xFF10
+#define QMICTL_PROXY_IND_FILTER_RESP  0xFF10
     
 #define QCTLV_TYPE_REQUIRED_PARAMETER 0x01
 
@@ -375,12 +379,6 @@ struct qlistnode
 #define qlist_head(list) ((list)->next)
 #define qlist_tail(list) ((list)->prev)
 
-typedef struct {
-    struct qlistnode qnode;
-    int ClientFd;
-    QCQMIMSG qmi[0];
-} QMI_PROXY_MSG;
-
 typedef struct {
     struct qlistnode qnode;
     uint8_t QMIType;
@@ -388,13 +386,47 @@ typedef struct {
     unsigned AccessTime;
 } QMI_PROXY_CLINET;
 
+typedef struct {
+    struct qlistnode qnode;
+    uint8_t QMIType;
+    uint8_t NumIds;
+    uint16_t MsgId[0];
+} QMI_PROXY_IND_FILTER;
+
 typedef struct {
     struct qlistnode qnode;
     struct qlistnode client_qnode;
+    struct qlistnode filter_qnode; //no filter for a service: all its broadcasts
+    unsigned IndSeq;    //last broadcast sent, a connection with several clients of a service gets it once
     int ClientFd;
     unsigned AccessTime;
+    uint8_t *OutBuf;    //what the client has not read yet, at most qmi_out_max bytes
+    size_t OutLen;
+    size_t OutSize;
+    unsigned OutDrops;
+    int Stalled;        //shut down for not reading, cleaned up on its EPOLLHUP
+    size_t InLen;
+    uint8_t InBuf[4096]; //the client stream until it makes a message
 } QMI_PROXY_CONNECTION;
 
+typedef struct {
+    struct qlistnode qnode;
+    QMI_PROXY_CONNECTION *qmi_con;
+    QCQMIMSG qmi[0];
+} QMI_PROXY_MSG;
+
+/* CTL requests of all clients are in flight together, each under a TransactionId of the proxy.
+ * CTL TransactionId is only 8 bits, so a table maps it back instead of mbim-proxy's TID_SHIFT. */
+#define QMI_CTL_MAX_INFLIGHT 16
+#define QMI_CTL_TIMEOUT_SEC 30
+
+typedef struct {
+    QMI_PROXY_CONNECTION *qmi_con; //NULL once the connection is gone
+    uint8_t TransactionId;         //the one of the client
+    uint8_t used;
+    time_t SendTime;
+} QMI_PROXY_CTL_TXN;
+
 #ifdef QUECTEL_QMI_MERGE
 #define MERGE_PACKET_IDENTITY 0x2c7c
 #define MERGE_PACKET_VERSION 0x0001
@@ -437,8 +469,17 @@ static int qmi_proxy_quit = 0;
 static pthread_t thread_id = 0;
 static int cdc_wdm_fd = -1;
 static int qmi_proxy_server_fd = -1;
+static int qmi_proxy_epoll_fd = -1;
 static struct qlistnode qmi_proxy_connection;
+/* owner of every (QMIType, ClientId), a row of 256 is allocated on the first client of a QMIType */
+static QMI_PROXY_CONNECTION **qmi_client_route[256];
+static QMI_PROXY_CTL_TXN qmi_ctl_txn[256];
+static unsigned qmi_ctl_inflight = 0;
+static uint8_t qmi_ctl_tid = 0;
 static struct qlistnode qmi_proxy_ctl_msg;
+static size_t qmi_out_max = 64*1024;
+static int qmi_out_drop = 0; //drop messages to a full client instead of disconnecting it
+static unsigned qmi_ind_seq = 0;
 static int verbose_debug = 0;
 static int modem_reset_flag = 0;
 static int qmi_sync_done = 0;
@@ -502,71 +543,121 @@ static int create_local_server(const char *name) {
 
     dprintf("local server: %s sockfd = %d\n", name, sockfd);
     cfmakenoblock(sockfd);
-    listen(sockfd, 1);    
+    listen(sockfd, 16);
 
     return sockfd;
 }
 
+static QMI_PROXY_CONNECTION *qmi_route_get(uint8_t QMIType, uint8_t ClientId) {
+    return qmi_client_route[QMIType] ? qmi_client_route[QMIType][ClientId] : NULL;
+}
+
+static void qmi_route_set(uint8_t QMIType, uint8_t ClientId, QMI_PROXY_CONNECTION *qmi_con) {
+    if (!qmi_client_route[QMIType]) {
+        if (!qmi_con)
+            return;
+        qmi_client_route[QMIType] = (QMI_PROXY_CONNECTION **)calloc(256, sizeof(QMI_PROXY_CONNECTION *));
+        if (!qmi_client_route[QMIType])
+            return;
+    }
+    qmi_client_route[QMIType][ClientId] = qmi_con;
+}
+
 static void accept_qmi_connection(int serverfd) {
     int clientfd = -1;
     unsigned char addr[128];
     socklen_t alen = sizeof(addr);
     QMI_PROXY_CONNECTION *qmi_con;
+    struct epoll_event ev;
 
     clientfd = accept(serverfd, (struct sockaddr *)addr, &alen);
+    if (clientfd < 0)
+        return;
 
     qmi_con = (QMI_PROXY_CONNECTION *)malloc(sizeof(QMI_PROXY_CONNECTION));
-    if (qmi_con) {
-        qlist_init(&qmi_con->qnode);
-        qlist_init(&qmi_con->client_qnode);
-        qmi_con->ClientFd= clientfd;
-        qmi_con->AccessTime = 0;
-        dprintf("+++ ClientFd=%d\n", qmi_con->ClientFd);
-        qlist_add_tail(&qmi_proxy_connection, &qmi_con->qnode);
+    if (!qmi_con) {
+        close(clientfd);
+        return;
+    }
+
+    qlist_init(&qmi_con->qnode);
+    qlist_init(&qmi_con->client_qnode);
+    qlist_init(&qmi_con->filter_qnode);
+    qmi_con->IndSeq = 0;
+    qmi_con->ClientFd= clientfd;
+    qmi_con->AccessTime = 0;
+    qmi_con->OutBuf = NULL;
+    qmi_con->OutLen = qmi_con->OutSize = 0;
+    qmi_con->OutDrops = 0;
+    qmi_con->Stalled = 0;
+    qmi_con->InLen = 0;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = qmi_con;
+    if (epoll_ctl(qmi_proxy_epoll_fd, EPOLL_CTL_ADD, clientfd, &ev) < 0) {
+        dprintf("%s epoll_ctl errno: %d (%s)\n", __func__, errno, strerror(errno));
+        close(clientfd);
+        free(qmi_con);
+        return;
     }
 
+    dprintf("+++ ClientFd=%d\n", qmi_con->ClientFd);
+    qlist_add_tail(&qmi_proxy_connection, &qmi_con->qnode);
     cfmakenoblock(clientfd);
 }
 
-static void cleanup_qmi_connection(int clientfd) {
-    struct qlistnode *con_node, *qmi_node;
-    
-    qlist_for_each(con_node, &qmi_proxy_connection) {
-        QMI_PROXY_CONNECTION *qmi_con = qnode_to_item(con_node, QMI_PROXY_CONNECTION, qnode);
+static void cleanup_qmi_connection(QMI_PROXY_CONNECTION *qmi_con) {
+    struct qlistnode *qmi_node, *next_node;
+    unsigned i;
 
-        if (qmi_con->ClientFd == clientfd) {
-            while (!qlist_empty(&qmi_con->client_qnode)) {
-                QMI_PROXY_CLINET *qmi_client = qnode_to_item(qlist_head(&qmi_con->client_qnode), QMI_PROXY_CLINET, qnode);
+    while (!qlist_empty(&qmi_con->client_qnode)) {
+        QMI_PROXY_CLINET *qmi_client = qnode_to_item(qlist_head(&qmi_con->client_qnode), QMI_PROXY_CLINET, qnode);
 
-                dprintf("xxx ClientFd=%d QMIType=%d ClientId=%d\n", qmi_con->ClientFd, qmi_client->QMIType, qmi_client->ClientId);
+        dprintf("xxx ClientFd=%d QMIType=%d ClientId=%d\n", qmi_con->ClientFd, qmi_client->QMIType, qmi_client->ClientId);
 
-                qlist_remove(&qmi_client->qnode);
-                free(qmi_client);
-            }
-           
-            qlist_for_each(qmi_node, &qmi_proxy_ctl_msg) {
-                QMI_PROXY_MSG *qmi_msg = qnode_to_item(qmi_node, QMI_PROXY_MSG, qnode);
+        qmi_route_set(qmi_client->QMIType, qmi_client->ClientId, NULL);
+        qlist_remove(&qmi_client->qnode);
+        free(qmi_client);
+    }
 
-                if (qmi_msg->ClientFd == qmi_con->ClientFd) {
-                    qlist_remove(&qmi_msg->qnode);
-                    free(qmi_msg);
-                    break;
-                 }
-            }
+    while (!qlist_empty(&qmi_con->filter_qnode)) {
+        QMI_PROXY_IND_FILTER *filter = qnode_to_item(qlist_head(&qmi_con->filter_qnode), QMI_PROXY_IND_FILTER, qnode);
 
-            dprintf("--- ClientFd=%d\n", qmi_con->ClientFd);    
-            close(qmi_con->ClientFd);
-            qlist_remove(&qmi_con->qnode);
-            free(qmi_con);
-            break;
+        qlist_remove(&filter->qnode);
+        free(filter);
+    }
+
+    for (qmi_node = qlist_head(&qmi_proxy_ctl_msg); qmi_node != &qmi_proxy_ctl_msg; qmi_node = next_node) {
+        QMI_PROXY_MSG *qmi_msg = qnode_to_item(qmi_node, QMI_PROXY_MSG, qnode);
+
+        next_node = qmi_node->next;
+        if (qmi_msg->qmi_con == qmi_con) {
+            qlist_remove(&qmi_msg->qnode);
+            free(qmi_msg);
         }
     }
+
+    //requests already with the modem keep their TransactionId until the response, which is dropped
+    for (i = 0; i < sizeof(qmi_ctl_txn)/sizeof(qmi_ctl_txn[0]); i++) {
+        if (qmi_ctl_txn[i].used && qmi_ctl_txn[i].qmi_con == qmi_con)
+            qmi_ctl_txn[i].qmi_con = NULL;
+    }
+
+    dprintf("--- ClientFd=%d\n", qmi_con->ClientFd);
+    epoll_ctl(qmi_proxy_epoll_fd, EPOLL_CTL_DEL, qmi_con->ClientFd, NULL);
+    close(qmi_con->ClientFd);
+    qlist_remove(&qmi_con->qnode);
+    free(qmi_con->OutBuf);
+    free(qmi_con);
 }
 
 static void get_client_id(QMI_PROXY_CONNECTION *qmi_con, PQMICTL_GET_CLIENT_ID_RESP_MSG pClient) {
     if (pClient->QMIResult == 0 && pClient->QMIError == 0) {
         QMI_PROXY_CLINET *qmi_client = (QMI_PROXY_CLINET *)malloc(sizeof(QMI_PROXY_CLINET));
 
+        if (!qmi_client)
+            return;
+
         qlist_init(&qmi_client->qnode);
         qmi_client->QMIType = pClient->QMIType;
         qmi_client->ClientId = pClient->ClientId;
@@ -574,6 +665,7 @@ static void get_client_id(QMI_PROXY_CONNECTION *qmi_con, PQMICTL_GET_CLIENT_ID_R
 
         dprintf("+++ ClientFd=%d QMIType=%d ClientId=%d\n", qmi_con->ClientFd, qmi_client->QMIType, qmi_client->ClientId);
         qlist_add_tail(&qmi_con->client_qnode, &qmi_client->qnode);
+        qmi_route_set(qmi_client->QMIType, qmi_client->ClientId, qmi_con);
     }
 }
 
@@ -586,6 +678,7 @@ static void release_client_id(QMI_PROXY_CONNECTION *qmi_con, PQMICTL_RELEASE_CLI
             
             if (pClient->QMIType == qmi_client->QMIType && pClient->ClientId == qmi_client->ClientId) {
                 dprintf("--- ClientFd=%d QMIType=%d ClientId=%d\n", qmi_con->ClientFd, qmi_client->QMIType, qmi_client->ClientId);
+                qmi_route_set(qmi_client->QMIType, qmi_client->ClientId, NULL);
                 qlist_remove(&qmi_client->qnode);
                 free(qmi_client);
                 break;
@@ -594,6 +687,26 @@ static void release_client_id(QMI_PROXY_CONNECTION *qmi_con, PQMICTL_RELEASE_CLI
     }
 }
 
+static int ind_filter_match(QMI_PROXY_CONNECTION *qmi_con, uint8_t QMIType, uint16_t MsgId) {
+    struct qlistnode *filter_node;
+
+    qlist_for_each (filter_node, &qmi_con->filter_qnode) {
+        QMI_PROXY_IND_FILTER *filter = qnode_to_item(filter_node, QMI_PROXY_IND_FILTER, qnode);
+        unsigned i;
+
+        if (filter->QMIType != QMIType)
+            continue;
+
+        for (i = 0; i < filter->NumIds; i++) {
+            if (filter->MsgId[i] == MsgId)
+                return 1;
+        }
+        return 0;
+    }
+
+    return 1;
+}
+
 static void dump_qmi(PQCQMIMSG pQMI, int fd, const char flag)
 {
     if (verbose_debug)
@@ -626,87 +739,280 @@ static int send_qmi_to_cdc_wdm(PQCQMIMSG pQMI) {
     return ret;
 }
 
-static int send_qmi_to_client(PQCQMIMSG pQMI, int clientFd) {
-    struct pollfd pollfds[]= {{clientFd, POLLOUT, 0}};
-    ssize_t ret = 0;
+static void qmi_con_want_write(QMI_PROXY_CONNECTION *qmi_con, int on) {
+    struct epoll_event ev;
 
-    do {
-        ret = poll(pollfds, sizeof(pollfds)/sizeof(pollfds[0]), 5000);
-    } while (ret == -1 && errno == EINTR && qmi_proxy_quit == 0);
+    ev.events = on ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+    ev.data.ptr = qmi_con;
+    epoll_ctl(qmi_proxy_epoll_fd, EPOLL_CTL_MOD, qmi_con->ClientFd, &ev);
+}
 
-    if (pollfds[0].revents & POLLOUT) {
-        ssize_t size = le16toh(pQMI->QMIHdr.Length) + 1;
-        ret = write(clientFd, pQMI, size);
-        dump_qmi(pQMI, clientFd, 'w');
+/* a client that does not read must not stop the others, so nothing here waits for it:
+ * what the socket does not take now is queued and written on EPOLLOUT */
+static int send_qmi_to_client(PQCQMIMSG pQMI, QMI_PROXY_CONNECTION *qmi_con) {
+    const uint8_t *data = (const uint8_t *)pQMI;
+    size_t size = le16toh(pQMI->QMIHdr.Length) + 1;
+    ssize_t nwrites = 0;
+
+    if (qmi_con->Stalled)
+        return -EPIPE;
+
+    dump_qmi(pQMI, qmi_con->ClientFd, 'w');
+    if (qmi_con->OutLen == 0) {
+        nwrites = write(qmi_con->ClientFd, data, size);
+        if (nwrites < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                return -errno; //EPOLLERR/EPOLLHUP cleans up
+            nwrites = 0;
+        }
+        if ((size_t)nwrites == size)
+            return size;
+        data += nwrites;
+        size -= nwrites;
     }
 
-    return ret;
+    //a partly written message always fits, the limit is never below one message
+    if (qmi_con->OutLen + size > qmi_out_max) {
+        if (qmi_out_drop) {
+            if (qmi_con->OutDrops++ % 100 == 0)
+                dprintf("ClientFd=%d is not reading, %u messages dropped\n", qmi_con->ClientFd, qmi_con->OutDrops);
+            return -ENOBUFS;
+        }
+
+        dprintf("ClientFd=%d is not reading, %zu bytes queued, disconnect it\n", qmi_con->ClientFd, qmi_con->OutLen);
+        qmi_con->Stalled = 1;
+        free(qmi_con->OutBuf);
+        qmi_con->OutBuf = NULL;
+        qmi_con->OutLen = qmi_con->OutSize = 0;
+        shutdown(qmi_con->ClientFd, SHUT_RDWR);
+        qmi_con_want_write(qmi_con, 0);
+        return -ENOBUFS;
+    }
+
+    if (qmi_con->OutLen + size > qmi_con->OutSize) {
+        size_t OutSize = qmi_con->OutSize ? qmi_con->OutSize * 2 : 4096;
+        uint8_t *OutBuf;
+
+        while (OutSize < qmi_con->OutLen + size)
+            OutSize *= 2;
+        if (OutSize > qmi_out_max)
+            OutSize = qmi_out_max;
+        OutBuf = (uint8_t *)realloc(qmi_con->OutBuf, OutSize);
+        if (!OutBuf)
+            return -ENOMEM;
+        qmi_con->OutBuf = OutBuf;
+        qmi_con->OutSize = OutSize;
+    }
+
+    if (qmi_con->OutLen == 0)
+        qmi_con_want_write(qmi_con, 1);
+    memcpy(qmi_con->OutBuf + qmi_con->OutLen, data, size);
+    qmi_con->OutLen += size;
+
+    return nwrites;
 }
 
-static void recv_qmi_from_dev(PQCQMIMSG pQMI) {
-    struct qlistnode *con_node, *client_node;
+static void flush_qmi_connection(QMI_PROXY_CONNECTION *qmi_con) {
+    ssize_t nwrites;
 
-    if (qmi_proxy_server_fd == -1) {
-        qmi_sync_done = 1;
+    if (qmi_con->OutLen == 0)
+        return;
+
+    nwrites = write(qmi_con->ClientFd, qmi_con->OutBuf, qmi_con->OutLen);
+    if (nwrites <= 0)
+        return;
+
+    qmi_con->OutLen -= nwrites;
+    memmove(qmi_con->OutBuf, qmi_con->OutBuf + nwrites, qmi_con->OutLen);
+    if (qmi_con->OutLen == 0) {
+        if (qmi_con->OutDrops)
+            dprintf("ClientFd=%d is reading again, %u messages were dropped\n", qmi_con->ClientFd, qmi_con->OutDrops);
+        qmi_con->OutDrops = 0;
+        qmi_con_want_write(qmi_con, 0);
     }
-    else if (pQMI->QMIHdr.QMIType == QMUX_TYPE_CTL) {
-        if (pQMI->CTLMsg.QMICTLMsgHdr.CtlFlags == QMICTL_CTL_FLAG_RSP) {            
-            if (!qlist_empty(&qmi_proxy_ctl_msg)) {
-                QMI_PROXY_MSG *qmi_msg = qnode_to_item(qlist_head(&qmi_proxy_ctl_msg), QMI_PROXY_MSG, qnode);
-
-                qlist_for_each(con_node, &qmi_proxy_connection) {
-                    QMI_PROXY_CONNECTION *qmi_con = qnode_to_item(con_node, QMI_PROXY_CONNECTION, qnode);
-
-                    if (qmi_con->ClientFd == qmi_msg->ClientFd) {
-                        send_qmi_to_client(pQMI, qmi_msg->ClientFd);
-
-                        if (le16toh(pQMI->CTLMsg.QMICTLMsgHdrRsp.QMICTLType) == QMICTL_GET_CLIENT_ID_RESP)
-                            get_client_id(qmi_con, &pQMI->CTLMsg.GetClientIdRsp);                                                        
-                        else if ((le16toh(pQMI->CTLMsg.QMICTLMsgHdrRsp.QMICTLType) == QMICTL_RELEASE_CLIENT_ID_RESP) ||
-                                (le16toh(pQMI->CTLMsg.QMICTLMsgHdrRsp.QMICTLType) == QMICTL_REVOKE_CLIENT_ID_IND)) {
-                            release_client_id(qmi_con, &pQMI->CTLMsg.ReleaseClientIdRsp);
-                            if (le16toh(pQMI->CTLMsg.QMICTLMsgHdrRsp.QMICTLType) == QMICTL_REVOKE_CLIENT_ID_IND)
-                                modem_reset_flag = 1;
-                        }
-                        else {
-                        }
-                    }
-                }
+}
+
+/*
+ * QMICTL_PROXY_IND_FILTER_REQ, one TLV 0x01 per service: uint8_t QMIType, uint8_t NumIds, uint16_t MsgId[NumIds]
+ * the broadcast indications of QMIType the connection wants, it replaces the last filter of QMIType
+ */
+static void set_ind_filter(QMI_PROXY_CONNECTION *qmi_con, PQCQMIMSG pQMI) {
+    PQCQMUX_TLV pFirst = (PQCQMUX_TLV)(&pQMI->CTLMsg.QMICTLMsgHdr + 1);
+    PQCQMUX_TLV pTLV;
+    unsigned Length = le16toh(pQMI->CTLMsg.QMICTLMsgHdr.Length);
+    unsigned Offset;
+    uint16_t QMIError = 0;
+    QCQMIMSG _QMI;
+    PQCQMIMSG pRsp = &_QMI;
+
+    //check every TLV before applying any, a malformed request changes nothing
+    for (Offset = 0; Offset < Length; Offset += sizeof(QCQMUX_TLV) + le16toh(pTLV->Length)) {
+        pTLV = (PQCQMUX_TLV)((uint8_t *)pFirst + Offset);
+        if (Length - Offset < sizeof(QCQMUX_TLV) + 2 || pTLV->Type != 0x01
+            || le16toh(pTLV->Length) + sizeof(QCQMUX_TLV) > Length - Offset
+            || le16toh(pTLV->Length) != 2 + 2 * pTLV->Value[1]) {
+            QMIError = 0x0001; //QMI_ERR_MALFORMED_MSG
+            break;
+        }
+    }
+    if (!Length)
+        QMIError = 0x0001;
+
+    for (Offset = 0; !QMIError && Offset < Length; Offset += sizeof(QCQMUX_TLV) + le16toh(pTLV->Length)) {
+        QMI_PROXY_IND_FILTER *filter;
+        struct qlistnode *filter_node;
+        unsigned i;
+
+        pTLV = (PQCQMUX_TLV)((uint8_t *)pFirst + Offset);
+        filter = malloc(sizeof(QMI_PROXY_IND_FILTER) + 2 * pTLV->Value[1]);
+        if (!filter) {
+            QMIError = 0x0002; //QMI_ERR_NO_MEMORY
+            break;
+        }
+
+        qlist_init(&filter->qnode);
+        filter->QMIType = pTLV->Value[0];
+        filter->NumIds = pTLV->Value[1];
+        for (i = 0; i < filter->NumIds; i++)
+            filter->MsgId[i] = pTLV->Value[2 + 2*i] | (pTLV->Value[3 + 2*i] << 8);
 
-                qlist_remove(&qmi_msg->qnode);
-                free(qmi_msg);
+        qlist_for_each (filter_node, &qmi_con->filter_qnode) {
+            QMI_PROXY_IND_FILTER *old = qnode_to_item(filter_node, QMI_PROXY_IND_FILTER, qnode);
+
+            if (old->QMIType == filter->QMIType) {
+                qlist_remove(&old->qnode);
+                free(old);
+                break;
             }
         }
+        qlist_add_tail(&qmi_con->filter_qnode, &filter->qnode);
+        dprintf("ClientFd=%d QMIType=%d wants %d indications\n", qmi_con->ClientFd, filter->QMIType, filter->NumIds);
+    }
 
-        if (!qlist_empty(&qmi_proxy_ctl_msg)) {
-            QMI_PROXY_MSG *qmi_msg = qnode_to_item(qlist_head(&qmi_proxy_ctl_msg), QMI_PROXY_MSG, qnode);
+    pRsp->QMIHdr.IFType = USB_CTL_MSG_TYPE_QMI;
+    pRsp->QMIHdr.CtlFlags = 0x80;
+    pRsp->QMIHdr.QMIType = QMUX_TYPE_CTL;
+    pRsp->QMIHdr.ClientId = 0x00;
+    pRsp->CTLMsg.QMICTLMsgHdrRsp.CtlFlags = QMICTL_FLAG_RESPONSE;
+    pRsp->CTLMsg.QMICTLMsgHdrRsp.TransactionId = pQMI->CTLMsg.QMICTLMsgHdr.TransactionId;
+    pRsp->CTLMsg.QMICTLMsgHdrRsp.QMICTLType = htole16(QMICTL_PROXY_IND_FILTER_RESP);
+    pRsp->CTLMsg.QMICTLMsgHdrRsp.Length = htole16(sizeof(QCQMICTL_MSG_HDR_RESP) - sizeof(QCQMICTL_MSG_HDR));
+    pRsp->CTLMsg.QMICTLMsgHdrRsp.TLVType = 0x02;
+    pRsp->CTLMsg.QMICTLMsgHdrRsp.TLVLength = htole16(4);
+    pRsp->CTLMsg.QMICTLMsgHdrRsp.QMUXResult = htole16(QMIError ? 1 : 0);
+    pRsp->CTLMsg.QMICTLMsgHdrRsp.QMUXError = htole16(QMIError);
+    pRsp->QMIHdr.Length = htole16(sizeof(QCQMI_HDR) + sizeof(QCQMICTL_MSG_HDR_RESP) - 1);
+
+    send_qmi_to_client(pRsp, qmi_con);
+}
 
-            qlist_for_each(con_node, &qmi_proxy_connection) {
-                QMI_PROXY_CONNECTION *qmi_con = qnode_to_item(con_node, QMI_PROXY_CONNECTION, qnode);
+static time_t qmi_ctl_now(void) {
+    struct timespec ts;
 
-                if (qmi_con->ClientFd == qmi_msg->ClientFd) {
-                    send_qmi_to_cdc_wdm(qmi_msg->qmi);
-                }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/* send the waiting CTL requests while there is room */
+static void qmi_ctl_flush(void) {
+    unsigned i;
+
+    if (qmi_ctl_inflight >= QMI_CTL_MAX_INFLIGHT) {
+        //a modem that never answers must not stop CTL for good
+        for (i = 1; i < sizeof(qmi_ctl_txn)/sizeof(qmi_ctl_txn[0]); i++) {
+            if (qmi_ctl_txn[i].used && qmi_ctl_now() - qmi_ctl_txn[i].SendTime > QMI_CTL_TIMEOUT_SEC) {
+                dprintf("%s drop CTL TransactionId %u, no response\n", __func__, i);
+                qmi_ctl_txn[i].used = 0;
+                qmi_ctl_inflight--;
             }
         }
     }
-    else  {
-        qlist_for_each(con_node, &qmi_proxy_connection) {
-            QMI_PROXY_CONNECTION *qmi_con = qnode_to_item(con_node, QMI_PROXY_CONNECTION, qnode);
-            
-            qlist_for_each(client_node, &qmi_con->client_qnode) {
-                QMI_PROXY_CLINET *qmi_client = qnode_to_item(client_node, QMI_PROXY_CLINET, qnode);
-                if (pQMI->QMIHdr.QMIType == qmi_client->QMIType) {
-                    if (pQMI->QMIHdr.ClientId == 0 || pQMI->QMIHdr.ClientId == qmi_client->ClientId) {
-                        send_qmi_to_client(pQMI, qmi_con->ClientFd);
+
+    while (qmi_ctl_inflight < QMI_CTL_MAX_INFLIGHT && !qlist_empty(&qmi_proxy_ctl_msg)) {
+        QMI_PROXY_MSG *qmi_msg = qnode_to_item(qlist_head(&qmi_proxy_ctl_msg), QMI_PROXY_MSG, qnode);
+        QMI_PROXY_CTL_TXN *txn;
+
+        //0 is never used, fewer in flight than slots so a free one is always found
+        do {
+            qmi_ctl_tid++;
+        } while (qmi_ctl_tid == 0 || qmi_ctl_txn[qmi_ctl_tid].used);
+
+        txn = &qmi_ctl_txn[qmi_ctl_tid];
+        txn->qmi_con = qmi_msg->qmi_con;
+        txn->TransactionId = qmi_msg->qmi->CTLMsg.QMICTLMsgHdr.TransactionId;
+        txn->used = 1;
+        txn->SendTime = qmi_ctl_now();
+        qmi_ctl_inflight++;
+
+        qmi_msg->qmi->CTLMsg.QMICTLMsgHdr.TransactionId = qmi_ctl_tid;
+        send_qmi_to_cdc_wdm(qmi_msg->qmi);
+
+        qlist_remove(&qmi_msg->qnode);
+        free(qmi_msg);
+    }
+}
+
+static void recv_qmi_from_dev(PQCQMIMSG pQMI) {
+    if (qmi_proxy_server_fd == -1) {
+        qmi_sync_done = 1;
+    }
+    else if (pQMI->QMIHdr.QMIType == QMUX_TYPE_CTL) {
+        if (pQMI->CTLMsg.QMICTLMsgHdr.CtlFlags == QMICTL_CTL_FLAG_RSP) {            
+            QMI_PROXY_CTL_TXN *txn = &qmi_ctl_txn[pQMI->CTLMsg.QMICTLMsgHdr.TransactionId];
+
+            if (txn->used) {
+                QMI_PROXY_CONNECTION *qmi_con = txn->qmi_con;
+
+                txn->used = 0;
+                qmi_ctl_inflight--;
+
+                if (qmi_con) {
+                    pQMI->CTLMsg.QMICTLMsgHdr.TransactionId = txn->TransactionId;
+                    send_qmi_to_client(pQMI, qmi_con);
+
+                    if (le16toh(pQMI->CTLMsg.QMICTLMsgHdrRsp.QMICTLType) == QMICTL_GET_CLIENT_ID_RESP)
+                        get_client_id(qmi_con, &pQMI->CTLMsg.GetClientIdRsp);                                                        
+                    else if ((le16toh(pQMI->CTLMsg.QMICTLMsgHdrRsp.QMICTLType) == QMICTL_RELEASE_CLIENT_ID_RESP) ||
+                            (le16toh(pQMI->CTLMsg.QMICTLMsgHdrRsp.QMICTLType) == QMICTL_REVOKE_CLIENT_ID_IND)) {
+                        release_client_id(qmi_con, &pQMI->CTLMsg.ReleaseClientIdRsp);
+                        if (le16toh(pQMI->CTLMsg.QMICTLMsgHdrRsp.QMICTLType) == QMICTL_REVOKE_CLIENT_ID_IND)
+                            modem_reset_flag = 1;
+                    }
+                    else {
                     }
                 }
             }
         }
+
+        qmi_ctl_flush();
+    }
+    else if (pQMI->QMIHdr.ClientId == 0) {
+        //broadcast to every connection with a client of the service which wants it
+        QMI_PROXY_CONNECTION **route = qmi_client_route[pQMI->QMIHdr.QMIType];
+        uint16_t MsgId = le16toh(pQMI->MUXMsg.QMUXMsgHdr.Type);
+        unsigned ClientId;
+
+        qmi_ind_seq++;
+        for (ClientId = 1; route && ClientId < 256; ClientId++) {
+            QMI_PROXY_CONNECTION *qmi_con = route[ClientId];
+
+            if (!qmi_con || qmi_con->IndSeq == qmi_ind_seq)
+                continue;
+            qmi_con->IndSeq = qmi_ind_seq;
+
+            if (ind_filter_match(qmi_con, pQMI->QMIHdr.QMIType, MsgId))
+                send_qmi_to_client(pQMI, qmi_con);
+        }
+    }
+    else {
+        QMI_PROXY_CONNECTION *qmi_con = qmi_route_get(pQMI->QMIHdr.QMIType, pQMI->QMIHdr.ClientId);
+
+        if (qmi_con)
+            send_qmi_to_client(pQMI, qmi_con);
     }
 }
 
-static int recv_qmi_from_client(PQCQMIMSG pQMI, unsigned size, int clientfd) {
+static int recv_qmi_from_client(PQCQMIMSG pQMI, unsigned size, QMI_PROXY_CONNECTION *qmi_con) {
     if (qmi_proxy_server_fd <= 0) {
         send_qmi_to_cdc_wdm(pQMI);
     }
@@ -718,14 +1024,20 @@ static int recv_qmi_from_client(PQCQMIMSG pQMI, unsigned size, int clientfd) {
             return 0;
         }
 
-        if (qlist_empty(&qmi_proxy_ctl_msg))
-            send_qmi_to_cdc_wdm(pQMI);
+        if (le16toh(pQMI->CTLMsg.QMICTLMsgHdr.QMICTLType) == QMICTL_PROXY_IND_FILTER_REQ) {
+            set_ind_filter(qmi_con, pQMI);
+            return 0;
+        }
 
         qmi_msg = malloc(sizeof(QMI_PROXY_MSG) + size);
+        if (!qmi_msg)
+            return -1;
+
         qlist_init(&qmi_msg->qnode);
-        qmi_msg->ClientFd = clientfd;
+        qmi_msg->qmi_con = qmi_con;
         memcpy(qmi_msg->qmi, pQMI, size);
         qlist_add_tail(&qmi_proxy_ctl_msg, &qmi_msg->qnode);
+        qmi_ctl_flush();
     }
     else {
         send_qmi_to_cdc_wdm(pQMI);
@@ -734,6 +1046,39 @@ static int recv_qmi_from_client(PQCQMIMSG pQMI, unsigned size, int clientfd) {
     return 0;
 }
 
+/* the client socket is a stream: a read() may end inside a message or carry several */
+static int recv_qmi_from_connection(QMI_PROXY_CONNECTION *qmi_con, PQCQMIMSG pQMI) {
+    ssize_t nreads;
+
+    nreads = read(qmi_con->ClientFd, qmi_con->InBuf + qmi_con->InLen, sizeof(qmi_con->InBuf) - qmi_con->InLen);
+    if (nreads <= 0) {
+        dprintf("%s read=%d errno: %d (%s)\n",  __func__, (int)nreads, errno, strerror(errno));
+        return -1;
+    }
+    qmi_con->InLen += nreads;
+
+    while (qmi_con->InLen >= sizeof(QCQMI_HDR)) {
+        size_t size = le16toh(((PQCQMI_HDR)qmi_con->InBuf)->Length) + 1;
+
+        if (size < sizeof(QCQMI_HDR) || size > sizeof(qmi_con->InBuf)) {
+            //lost the framing, nothing to resync on
+            dprintf("%s ClientFd=%d QMIHdr.Length = %d\n",  __func__, qmi_con->ClientFd, (int)size - 1);
+            return -1;
+        }
+        if (qmi_con->InLen < size)
+            break;
+
+        memcpy(pQMI, qmi_con->InBuf, size);
+        qmi_con->InLen -= size;
+        memmove(qmi_con->InBuf, qmi_con->InBuf + size, qmi_con->InLen);
+
+        dump_qmi(pQMI, qmi_con->ClientFd, 'r');
+        recv_qmi_from_client(pQMI, size, qmi_con);
+    }
+
+    return 0;
+}
+
 static int qmi_proxy_init(void) {
     unsigned i;
     QCQMIMSG _QMI;
@@ -788,8 +1133,9 @@ static void qmi_close_server(const char* servername) {
 static void *qmi_proxy_loop(void *param)
 {
     PQCQMIMSG pQMI = (PQCQMIMSG)qmi_buf;
-    struct qlistnode *con_node;
-    QMI_PROXY_CONNECTION *qmi_con;
+    struct epoll_event ev;
+    int server_fd = -1;
+    unsigned i;
 
     (void)param;
     dprintf("%s enter thread_id %p\n", __func__, (void *)pthread_self());
@@ -797,79 +1143,71 @@ static void *qmi_proxy_loop(void *param)
     qlist_init(&qmi_proxy_connection);
     qlist_init(&qmi_proxy_ctl_msg);
 
-    while (cdc_wdm_fd > 0 && qmi_proxy_quit == 0) {
-        struct pollfd pollfds[2+64];
-        int ne, ret, nevents = 0;
-        ssize_t nreads;
-
-        pollfds[nevents].fd = cdc_wdm_fd;
-        pollfds[nevents].events = POLLIN;
-        pollfds[nevents].revents= 0;
-        nevents++;
-        
-        if (qmi_proxy_server_fd > 0) {
-            pollfds[nevents].fd = qmi_proxy_server_fd;
-            pollfds[nevents].events = POLLIN;
-            pollfds[nevents].revents= 0;
-            nevents++;
-        }
+    qmi_proxy_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (qmi_proxy_epoll_fd < 0) {
+        dprintf("%s epoll_create1 errno: %d (%s)\n", __func__, errno, strerror(errno));
+        return NULL;
+    }
 
-        qlist_for_each(con_node, &qmi_proxy_connection) {
-            qmi_con = qnode_to_item(con_node, QMI_PROXY_CONNECTION, qnode);
-            
-            pollfds[nevents].fd = qmi_con->ClientFd;
-            pollfds[nevents].events = POLLIN;
-            pollfds[nevents].revents= 0;
-            nevents++;
+    //data.ptr: NULL for cdc-wdm, &qmi_proxy_server_fd for the server, else the connection
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(qmi_proxy_epoll_fd, EPOLL_CTL_ADD, cdc_wdm_fd, &ev);
 
-            if (nevents == (sizeof(pollfds)/sizeof(pollfds[0])))
-                break;
-        }
+    while (cdc_wdm_fd > 0 && qmi_proxy_quit == 0) {
+        struct epoll_event events[32];
+        int ne, ret;
+        ssize_t nreads;
 
-#if 0
-        dprintf("poll ");
-        for (ne = 0; ne < nevents; ne++) {
-            dprintf("%d ", pollfds[ne].fd);
+        //the server is started once qmi_proxy_init() is done
+        if (server_fd == -1 && qmi_proxy_server_fd > 0) {
+            server_fd = qmi_proxy_server_fd;
+            ev.events = EPOLLIN;
+            ev.data.ptr = &qmi_proxy_server_fd;
+            epoll_ctl(qmi_proxy_epoll_fd, EPOLL_CTL_ADD, server_fd, &ev);
         }
-        dprintf("\n");
-#endif
 
         do {
-            //ret = poll(pollfds, nevents, -1);
-            ret = poll(pollfds, nevents, (qmi_proxy_server_fd > 0) ? -1 : 200);
+            ret = epoll_wait(qmi_proxy_epoll_fd, events, sizeof(events)/sizeof(events[0]), (server_fd > 0) ? -1 : 200);
          } while (ret == -1 && errno == EINTR && qmi_proxy_quit == 0);
          
         if (ret < 0) {
-            dprintf("%s poll=%d, errno: %d (%s)\n", __func__, ret, errno, strerror(errno));
+            dprintf("%s epoll_wait=%d, errno: %d (%s)\n", __func__, ret, errno, strerror(errno));
             goto qmi_proxy_loop_exit;
         }
 
-        for (ne = 0; ne < nevents; ne++) {
-            int fd = pollfds[ne].fd;
-            short revents = pollfds[ne].revents;
+        for (ne = 0; ne < ret; ne++) {
+            void *ptr = events[ne].data.ptr;
+            uint32_t revents = events[ne].events;
 
-            if (revents & (POLLERR | POLLHUP | POLLNVAL)) {
-                dprintf("%s poll fd = %d, revents = %04x\n", __func__, fd, revents);
-                if (fd == cdc_wdm_fd) {
+            if (revents & (EPOLLERR | EPOLLHUP)) {
+                dprintf("%s epoll %p, revents = %04x\n", __func__, ptr, revents);
+                if (ptr == NULL) {
                     goto qmi_proxy_loop_exit;
-                } else if(fd == qmi_proxy_server_fd) {
+                } else if (ptr == &qmi_proxy_server_fd) {
                 
                 } else {
-                    cleanup_qmi_connection(fd);
+                    cleanup_qmi_connection((QMI_PROXY_CONNECTION *)ptr);
+                    //later events may point to the freed connection
+                    break;
                 }
 
                 continue;
             }
 
-            if (!(pollfds[ne].revents & POLLIN)) {
+            if ((revents & EPOLLOUT) && ptr != NULL && ptr != &qmi_proxy_server_fd) {
+                flush_qmi_connection((QMI_PROXY_CONNECTION *)ptr);
+            }
+
+            if (!(revents & EPOLLIN)) {
                 continue;
             }
 
-            if (fd == qmi_proxy_server_fd) {
-                accept_qmi_connection(fd);
+            if (ptr == &qmi_proxy_server_fd) {
+                accept_qmi_connection(server_fd);
             }
-            else if (fd == cdc_wdm_fd) {
-                nreads = read(fd, pQMI, sizeof(qmi_buf));
+            else if (ptr == NULL) {
+                nreads = read(cdc_wdm_fd, pQMI, sizeof(qmi_buf));
                 if (nreads <= 0) {
                     dprintf("%s read=%d errno: %d (%s)\n",  __func__, (int)nreads, errno, strerror(errno));
                     goto qmi_proxy_loop_exit;
@@ -883,27 +1221,19 @@ static void *qmi_proxy_loop(void *param)
                     continue;
                 }
 
-                dump_qmi(pQMI, fd, 'r');
+                dump_qmi(pQMI, cdc_wdm_fd, 'r');
                 recv_qmi_from_dev(pQMI);
                 if (modem_reset_flag)
                     goto qmi_proxy_loop_exit;
             }
             else {
-                nreads = read(fd, pQMI, sizeof(qmi_buf));
-  
-                if (nreads <= 0) {
-                    dprintf("%s read=%d errno: %d (%s)",  __func__, (int)nreads, errno, strerror(errno));
-                    cleanup_qmi_connection(fd);
-                    break;
-                }
+                QMI_PROXY_CONNECTION *qmi_con = (QMI_PROXY_CONNECTION *)ptr;
 
-                if (nreads != (le16toh(pQMI->QMIHdr.Length) + 1)) {
-                    dprintf("%s nreads=%d,  pQCQMI->QMIHdr.Length = %d\n",  __func__, (int)nreads, le16toh(pQMI->QMIHdr.Length));
-                    continue;
+                if (recv_qmi_from_connection(qmi_con, pQMI) < 0) {
+                    cleanup_qmi_connection(qmi_con);
+                    //later events may point to the freed connection
+                    break;
                 }
-
-                dump_qmi(pQMI, fd, 'r');
-                recv_qmi_from_client(pQMI, nreads, fd);
             }
         }
     }
@@ -912,8 +1242,22 @@ qmi_proxy_loop_exit:
     while (!qlist_empty(&qmi_proxy_connection)) {
         QMI_PROXY_CONNECTION *qmi_con = qnode_to_item(qlist_head(&qmi_proxy_connection), QMI_PROXY_CONNECTION, qnode);
 
-        cleanup_qmi_connection(qmi_con->ClientFd);
+        cleanup_qmi_connection(qmi_con);
     }
+    while (!qlist_empty(&qmi_proxy_ctl_msg)) {
+        QMI_PROXY_MSG *qmi_msg = qnode_to_item(qlist_head(&qmi_proxy_ctl_msg), QMI_PROXY_MSG, qnode);
+
+        qlist_remove(&qmi_msg->qnode);
+        free(qmi_msg);
+    }
+    for (i = 0; i < sizeof(qmi_client_route)/sizeof(qmi_client_route[0]); i++) {
+        free(qmi_client_route[i]);
+        qmi_client_route[i] = NULL;
+    }
+    memset(qmi_ctl_txn, 0, sizeof(qmi_ctl_txn));
+    qmi_ctl_inflight = 0;
+    close(qmi_proxy_epoll_fd);
+    qmi_proxy_epoll_fd = -1;
     
     dprintf("%s exit, thread_id %p\n", __func__, (void *)pthread_self());
 
@@ -924,6 +1268,8 @@ static void usage(void) {
     dprintf(" -d <device_name>                      A valid qmi device\n"
             "                                       default /dev/cdc-wdm0, but cdc-wdm0 may be invalid\n"
             " -i <netcard_name>                     netcard name\n"
+            " -q <kbytes>                           queued for a client that does not read, default 64\n"
+            " -s <drop|disconnect>                  what to do when that queue is full, default disconnect\n"
             " -v                                    Will show all details\n");
 }
 
@@ -945,7 +1291,7 @@ int main(int argc, char *argv[]) {
 
     signal(SIGINT, sig_action);
 
-    while ( -1 != (opt = getopt(argc, argv, "d:i:vh"))) {
+    while ( -1 != (opt = getopt(argc, argv, "d:i:q:s:vh"))) {
         switch (opt) {
             case 'd':
                 strcpy(cdc_wdm, optarg);
@@ -953,6 +1299,21 @@ int main(int argc, char *argv[]) {
             case 'v':
                 verbose_debug = 1;
                 break;
+            case 'q':
+                qmi_out_max = strtoul(optarg, NULL, 10) * 1024;
+                if (qmi_out_max < sizeof(qmi_buf))
+                    qmi_out_max = sizeof(qmi_buf);
+                break;
+            case 's':
+                if (!strcmp(optarg, "drop"))
+                    qmi_out_drop = 1;
+                else if (!strcmp(optarg, "disconnect"))
+                    qmi_out_drop = 0;
+                else {
+                    usage();
+                    return 0;
+                }
+                break;
             default:
                 usage();
                 return 0;
@@ -0,0 +1,217 @@
+/******************************************************************************
+  @file    quectel-trace-decode.c
+  @brief   print the frame trace quectel-CM dumps on SIGUSR2 or on a crash.
+
+  DESCRIPTION
+  Connectivity Management Tool for USB network adapter of Quectel wireless cellular modules.
+
+  QMI frames are decoded by dump_qmi() from MPQMUX.c, with the same message
+  names quectel-CM -v prints, so the decoding costs nothing at capture time.
+  MBIM frames get their header, AT frames their text.
+
+  usage: quectel-trace-decode /tmp/quectel-CM.1.pcap
+
+  INITIALIZATION AND SEQUENCING REQUIREMENTS
+  None.
+******************************************************************************/
+#include <endian.h>
+#include "QMIThread.h"
+#include "trace.h"
+
+int debug_qmi = 1; //dump_qmi() prints nothing without it
+FILE *logfilefp = NULL;
+static char s_frame_time[32];
+
+/* dbg_time() in MPQMUX.c prints the capture time of the frame */
+const char * get_time(void) {
+    return s_frame_time;
+}
+
+USHORT le16_to_cpu(USHORT v16) {
+    return le16toh(v16);
+}
+
+PQMI_TLV_HDR GetTLVLimit (PQCQMUX_MSG_HDR pQMUXMsgHdr, int Length, int TLVType) {
+    int TLVFind = 0;
+    PQMI_TLV_HDR pTLVHdr = (PQMI_TLV_HDR)(pQMUXMsgHdr + 1);
+
+    if (Length > le16_to_cpu(pQMUXMsgHdr->Length))
+        Length = le16_to_cpu(pQMUXMsgHdr->Length);
+
+    while (Length >= (int)sizeof(QMI_TLV_HDR)) {
+        int TLVSize = le16_to_cpu(pTLVHdr->TLVLength) + sizeof(QMI_TLV_HDR);
+
+        if (TLVSize > Length)
+            break;
+
+        TLVFind++;
+        if (TLVType > 0x1000) {
+            if ((TLVFind + 0x1000) == TLVType)
+                return pTLVHdr;
+        } else if (pTLVHdr->TLVType == TLVType) {
+            return pTLVHdr;
+        }
+
+        Length -= TLVSize;
+        pTLVHdr = (PQMI_TLV_HDR)(((UCHAR *)pTLVHdr) + TLVSize);
+    }
+
+    return NULL;
+}
+
+struct pcap_file_hdr {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+};
+
+struct pcap_rec_hdr {
+    uint32_t ts_sec;
+    uint32_t ts_usec;
+    uint32_t incl_len;
+    uint32_t orig_len;
+};
+
+static const char *mbim_msg_name(uint32_t type) {
+    switch (type) {
+        case 1: return "MBIM_OPEN_MSG";
+        case 2: return "MBIM_CLOSE_MSG";
+        case 3: return "MBIM_COMMAND_MSG";
+        case 4: return "MBIM_HOST_ERROR_MSG";
+        case 0x80000001: return "MBIM_OPEN_DONE";
+        case 0x80000002: return "MBIM_CLOSE_DONE";
+        case 0x80000003: return "MBIM_COMMAND_DONE";
+        case 0x80000004: return "MBIM_FUNCTION_ERROR_MSG";
+        case 0x80000007: return "MBIM_INDICATE_STATUS_MSG";
+        default: return "unknown";
+    }
+}
+
+static void decode_mbim(const uint8_t *data, unsigned len) {
+    const uint32_t *hdr = (const uint32_t *)data;
+    uint32_t type;
+
+    if (len < 12) {
+        dbg_time("short MBIM frame");
+        return;
+    }
+
+    type = le32toh(hdr[0]);
+    dbg_time("%s MessageLength = %u, TransactionId = %u", mbim_msg_name(type), le32toh(hdr[1]), le32toh(hdr[2]));
+
+    //command, command done and indication carry the service uuid and cid after the fragment header
+    if ((type == 3 || type == 0x80000003 || type == 0x80000007) && len >= 40) {
+        const uint8_t *uuid = data + 20;
+
+        dbg_time("  service %02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x, cid %u",
+            uuid[0], uuid[1], uuid[2], uuid[3], uuid[4], uuid[5], uuid[6], uuid[7],
+            uuid[8], uuid[9], uuid[10], uuid[11], uuid[12], uuid[13], uuid[14], uuid[15],
+            le32toh(hdr[9]));
+    }
+}
+
+static void decode_at(const uint8_t *data, unsigned len) {
+    char text[2048];
+    unsigned i, n = 0;
+
+    for (i = 0; i < len && n + 5 < sizeof(text); i++) {
+        if (data[i] == '\r')
+            n += sprintf(text + n, "\\r");
+        else if (data[i] == '\n')
+            n += sprintf(text + n, "\\n");
+        else if (data[i] < 0x20 || data[i] >= 0x7f)
+            n += sprintf(text + n, "\\x%02x", data[i]);
+        else
+            text[n++] = data[i];
+    }
+    text[n] = '\0';
+    dbg_time("%s", text);
+}
+
+static uint32_t swap32(uint32_t v, int swapped) {
+    return swapped ? __builtin_bswap32(v) : v;
+}
+
+int main(int argc, char *argv[]) {
+    static uint8_t frame[64 * 1024 + 64];
+    struct pcap_file_hdr file_hdr;
+    struct pcap_rec_hdr rec;
+    FILE *fp;
+    int swapped;
+    unsigned frames = 0;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s /tmp/quectel-CM.<pdn>.pcap\n", argv[0]);
+        return 1;
+    }
+
+    fp = fopen(argv[1], "rb");
+    if (!fp) {
+        fprintf(stderr, "open %s: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+
+    if (fread(&file_hdr, sizeof(file_hdr), 1, fp) != 1
+        || (file_hdr.magic != 0xa1b2c3d4 && file_hdr.magic != 0xd4c3b2a1)) {
+        fprintf(stderr, "%s is not a pcap file\n", argv[1]);
+        fclose(fp);
+        return 1;
+    }
+    swapped = (file_hdr.magic == 0xd4c3b2a1);
+    if (swap32(file_hdr.linktype, swapped) != QL_TRACE_LINKTYPE) {
+        fprintf(stderr, "%s is not a quectel-CM trace, linktype %u\n", argv[1], swap32(file_hdr.linktype, swapped));
+        fclose(fp);
+        return 1;
+    }
+
+    while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+        unsigned incl_len = swap32(rec.incl_len, swapped);
+        time_t sec = swap32(rec.ts_sec, swapped);
+        const struct ql_trace_hdr *hdr = (const struct ql_trace_hdr *)frame;
+        const uint8_t *data = frame + sizeof(*hdr);
+        unsigned caplen, len;
+        struct tm *ti;
+
+        if (incl_len < sizeof(*hdr) || incl_len > sizeof(frame)) {
+            fprintf(stderr, "bad record length %u\n", incl_len);
+            break;
+        }
+        //zeros past the captured bytes, for the headers of a truncated frame
+        memset(frame, 0, sizeof(frame));
+        if (fread(frame, incl_len, 1, fp) != 1)
+            break;
+
+        ti = localtime(&sec);
+        snprintf(s_frame_time, sizeof(s_frame_time), "%02d-%02d_%02d:%02d:%02d.%06u",
+            ti->tm_mon+1, ti->tm_mday, ti->tm_hour, ti->tm_min, ti->tm_sec, swap32(rec.ts_usec, swapped));
+
+        caplen = incl_len - sizeof(*hdr);
+        len = le32toh(hdr->len);
+        dbg_time("%s %s %u bytes%s", hdr->proto == QL_TRACE_QMI ? "QMI" : hdr->proto == QL_TRACE_MBIM ? "MBIM" : "AT",
+            hdr->dir == QL_TRACE_TX ? "->" : "<-", len, caplen < len ? " (truncated)" : "");
+
+        switch (hdr->proto) {
+            case QL_TRACE_QMI:
+                if (caplen >= sizeof(QCQMI_HDR))
+                    dump_qmi((void *)data, caplen);
+            break;
+            case QL_TRACE_MBIM:
+                decode_mbim(data, caplen);
+            break;
+            case QL_TRACE_AT:
+                decode_at(data, caplen);
+            break;
+            default:
+            break;
+        }
+        frames++;
+    }
+
+    fclose(fp);
+    fprintf(stderr, "%u frames\n", frames);
+    return 0;
+}
@@ -0,0 +1,269 @@
+/******************************************************************************
+  @file    request_async.c
+  @brief   asynchronous execution of request_ops.
+
+  DESCRIPTION
+  Connectivity Management Tool for USB network adapter of Quectel wireless cellular modules.
+
+  The request_ops are blocking calls. A REQUEST_FUTURE wraps one of them so it
+  runs on a worker thread, the submitter gets the result through a completion
+  callback and/or request_async_wait(). The number of workers comes from
+  request_ops->async_workers: QMI can keep several transactions outstanding,
+  MBIM and AT have a single command channel and get one worker.
+
+  A future belongs to the workers from request_async_submit() until it is
+  done or request_async_cancel() took it back, only then may its owner
+  release it. A timed out request_async_wait() cancels a queued future, but
+  a running one cannot be stopped: it is detached and left to the worker,
+  which still calls its cb when func returns and never touches it after.
+  Do not release a timed out future before its cb has run, a future that
+  may time out without a cb must outlive the workers (static).
+
+  INITIALIZATION AND SEQUENCING REQUIREMENTS
+  request_async_init() after qmi_ops->init(). request_async_deinit() fails
+  the requests the workers are blocked in through qmi_ops->wakeup, so it
+  does not have to wait out their timeouts.
+******************************************************************************/
+#include "QMIThread.h"
+
+#define REQUEST_ASYNC_MAX_WORKERS 4
+
+static pthread_mutex_t s_async_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_async_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t s_async_done_cond = PTHREAD_COND_INITIALIZER;
+static struct listnode s_async_queue = {&s_async_queue, &s_async_queue};
+static pthread_t s_async_tid[REQUEST_ASYNC_MAX_WORKERS];
+static unsigned s_async_workers = 0;
+static unsigned s_async_busy = 0; //workers inside future->func
+static int s_async_quit = 0;
+static PROFILE_T *s_async_profile = NULL;
+
+static void request_async_complete(REQUEST_FUTURE *future, int err, int detached) {
+    future->err = err;
+    future->done_msec = clock_msec();
+
+    //callback runs before 'done' is set, so the owner cannot release the future under it
+    if (future->cb)
+        future->cb(future);
+    if (detached)
+        return; //nobody waits for it, and the cb may have released it
+
+    pthread_mutex_lock(&s_async_mutex);
+    future->done = 1;
+    pthread_cond_broadcast(&s_async_done_cond);
+    pthread_mutex_unlock(&s_async_mutex);
+}
+
+static void * request_async_thread(void *param) {
+    (void)param;
+
+    pthread_mutex_lock(&s_async_mutex);
+    while (!s_async_quit) {
+        REQUEST_FUTURE *future;
+        int err, detached;
+
+        if (list_empty(&s_async_queue)) {
+            pthread_cond_wait(&s_async_cond, &s_async_mutex);
+            continue;
+        }
+
+        future = node_to_item(list_head(&s_async_queue), REQUEST_FUTURE, node);
+        list_remove(&future->node);
+        future->queued = 0;
+        future->running = 1;
+        s_async_busy++;
+        pthread_mutex_unlock(&s_async_mutex);
+
+        future->start_msec = clock_msec();
+        err = future->func(s_async_profile, future->arg);
+        if (debug_qmi)
+            dbg_time("%s %s err=%d, queued %lu ms, run %lu ms", __func__, future->name, err,
+                future->start_msec - future->submit_msec, clock_msec() - future->start_msec);
+
+        //from here on a waiter cannot detach it any more, it waits for the cb instead
+        pthread_mutex_lock(&s_async_mutex);
+        future->running = 0;
+        detached = future->detached;
+        pthread_mutex_unlock(&s_async_mutex);
+        request_async_complete(future, err, detached);
+
+        pthread_mutex_lock(&s_async_mutex);
+        s_async_busy--;
+        pthread_cond_broadcast(&s_async_done_cond);
+    }
+    pthread_mutex_unlock(&s_async_mutex);
+
+    return NULL;
+}
+
+int request_async_init(PROFILE_T *profile) {
+    unsigned i, workers = profile->request_ops->async_workers;
+
+    if (workers > REQUEST_ASYNC_MAX_WORKERS)
+        workers = REQUEST_ASYNC_MAX_WORKERS;
+
+    s_async_profile = profile;
+    s_async_quit = 0;
+    s_async_workers = 0;
+
+    for (i = 0; i < workers; i++) {
+        if (pthread_create(&s_async_tid[i], NULL, request_async_thread, NULL) != 0) {
+            dbg_time("%s Failed to create worker %u: %d (%s)", __func__, i, errno, strerror(errno));
+            break;
+        }
+        s_async_workers++;
+    }
+
+    return s_async_workers ? 0 : -1;
+}
+
+void request_async_deinit(void) {
+    unsigned i;
+
+    pthread_mutex_lock(&s_async_mutex);
+    s_async_quit = 1;
+    pthread_cond_broadcast(&s_async_cond);
+    //a func may run several requests in a row, keep failing them until every worker is out
+    while (s_async_busy) {
+        pthread_mutex_unlock(&s_async_mutex);
+        if (s_async_profile && s_async_profile->qmi_ops->wakeup)
+            s_async_profile->qmi_ops->wakeup();
+        pthread_mutex_lock(&s_async_mutex);
+        if (s_async_busy)
+            pthread_cond_timeout_np(&s_async_done_cond, &s_async_mutex, 100);
+    }
+    pthread_mutex_unlock(&s_async_mutex);
+
+    for (i = 0; i < s_async_workers; i++)
+        pthread_join(s_async_tid[i], NULL);
+    s_async_workers = 0;
+
+    //cancel everything nobody picked up
+    pthread_mutex_lock(&s_async_mutex);
+    while (!list_empty(&s_async_queue)) {
+        REQUEST_FUTURE *future = node_to_item(list_head(&s_async_queue), REQUEST_FUTURE, node);
+
+        list_remove(&future->node);
+        future->queued = 0;
+        pthread_mutex_unlock(&s_async_mutex);
+        request_async_complete(future, -ECANCELED, 0);
+        pthread_mutex_lock(&s_async_mutex);
+    }
+    pthread_mutex_unlock(&s_async_mutex);
+}
+
+int request_async_submit(REQUEST_FUTURE *future) {
+    if (!future || !future->func)
+        return -EINVAL;
+
+    future->err = 0;
+    future->done = 0;
+    future->queued = 0;
+    future->running = 0;
+    future->detached = 0;
+    future->submit_msec = clock_msec();
+    future->start_msec = future->done_msec = 0;
+
+    pthread_mutex_lock(&s_async_mutex);
+    if (s_async_workers == 0 || s_async_quit) {
+        pthread_mutex_unlock(&s_async_mutex);
+        //no workers, degrade to a synchronous call
+        future->start_msec = future->submit_msec;
+        request_async_complete(future, future->func(s_async_profile, future->arg), 0);
+        return 0;
+    }
+    list_add_tail(&s_async_queue, &future->node);
+    future->queued = 1;
+    pthread_cond_signal(&s_async_cond);
+    pthread_mutex_unlock(&s_async_mutex);
+
+    return 0;
+}
+
+/* take a future back from the workers. A queued one completes with -ECANCELED,
+ * a running one cannot be stopped: it is detached and -EINPROGRESS returned
+ * at once, the worker still calls its cb when func returns */
+int request_async_cancel(REQUEST_FUTURE *future) {
+    pthread_mutex_lock(&s_async_mutex);
+    if (future->queued) {
+        list_remove(&future->node);
+        future->queued = 0;
+        pthread_mutex_unlock(&s_async_mutex);
+        request_async_complete(future, -ECANCELED, 0);
+        return -ECANCELED;
+    }
+    if (future->running) {
+        future->detached = 1;
+        pthread_mutex_unlock(&s_async_mutex);
+        return -EINPROGRESS;
+    }
+    //func has returned, only its cb is left to run
+    while (!future->done)
+        pthread_cond_wait(&s_async_done_cond, &s_async_mutex);
+    pthread_mutex_unlock(&s_async_mutex);
+
+    return future->err;
+}
+
+/* wait up to msecs (0 for ever) for the future. On -ETIMEDOUT a queued future
+ * was cancelled, a running one detached, see request_async_cancel() */
+int request_async_wait(REQUEST_FUTURE *future, unsigned msecs) {
+    unsigned long deadline = clock_msec() + msecs;
+    int ret = 0;
+
+    pthread_mutex_lock(&s_async_mutex);
+    while (!future->done) {
+        unsigned long now = clock_msec();
+
+        if (msecs && now >= deadline) {
+            ret = ETIMEDOUT;
+            break;
+        }
+        ret = pthread_cond_timeout_np(&s_async_done_cond, &s_async_mutex, msecs ? (deadline - now) : 0);
+        if (ret && ret != ETIMEDOUT)
+            break;
+    }
+    pthread_mutex_unlock(&s_async_mutex);
+
+    if (!future->done) {
+        dbg_time("%s %s timeout", __func__, future->name);
+        //the caller may release a cancelled future once we return, a detached one is left to its cb
+        ret = request_async_cancel(future);
+        if (ret == -ECANCELED || ret == -EINPROGRESS)
+            return -ETIMEDOUT;
+        return ret; //func returned meanwhile
+    }
+
+    return future->err;
+}
+
+/* return the index of the first completed future in futures[], or -ETIMEDOUT.
+ * On timeout all of them are still submitted, wait for or cancel each before releasing it */
+int request_async_wait_any(REQUEST_FUTURE **futures, int count, unsigned msecs) {
+    unsigned long deadline = clock_msec() + msecs;
+    int i, ret = 0;
+
+    if (count <= 0)
+        return -EINVAL;
+
+    pthread_mutex_lock(&s_async_mutex);
+    while (1) {
+        unsigned long now = clock_msec();
+
+        for (i = 0; i < count; i++) {
+            if (futures[i]->done) {
+                pthread_mutex_unlock(&s_async_mutex);
+                return i;
+            }
+        }
+
+        if (msecs && now >= deadline)
+            break;
+        ret = pthread_cond_timeout_np(&s_async_done_cond, &s_async_mutex, msecs ? (deadline - now) : 0);
+        if (ret && ret != ETIMEDOUT)
+            break;
+    }
+    pthread_mutex_unlock(&s_async_mutex);
+
+    return -ETIMEDOUT;
+}
@@ -0,0 +1,266 @@
+/******************************************************************************
+  @file    status.c
+  @brief   publish modem and data call state without forking a shell.
+
+  DESCRIPTION
+  Connectivity Management Tool for USB network adapter of Quectel wireless cellular modules.
+
+  State goes to a versioned page (see status.h) in a file other programs can
+  mmap(), updated in place under a sequence counter. The old /tmp/lte* files
+  are still written for existing scripts, with open()/write(), unless built
+  with -DQL_STATUS_LEGACY=0.
+
+  INITIALIZATION AND SEQUENCING REQUIREMENTS
+  ql_status_open() once the pdn is known, ql_status_close() on exit.
+  The setters may be called before ql_status_open() or after it failed,
+  then only the legacy files are written.
+******************************************************************************/
+#include <sys/mman.h>
+#include <stdarg.h>
+#include <arpa/inet.h>
+#include "QMIThread.h"
+#include "status.h"
+
+#ifndef QL_STATUS_LEGACY
+#define QL_STATUS_LEGACY 1
+#endif
+
+static pthread_mutex_t s_status_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct ql_status_page *s_status_page = NULL;
+static char s_status_file[64];
+static unsigned s_spawn_count = 0;
+
+static const struct {
+    const char *legacy;
+    size_t offset;
+    size_t size;
+} s_status_fields[QL_STATUS_FIELD_MAX] = {
+    [QL_STATUS_SIM] = {"/tmp/lteSim", offsetof(struct ql_status_page, sim), sizeof(((struct ql_status_page *)0)->sim)},
+    [QL_STATUS_MODE] = {"/tmp/lteMode", offsetof(struct ql_status_page, mode), sizeof(((struct ql_status_page *)0)->mode)},
+    [QL_STATUS_IMEI] = {"/tmp/lteIMEI", offsetof(struct ql_status_page, imei), sizeof(((struct ql_status_page *)0)->imei)},
+    [QL_STATUS_MODEL] = {"/tmp/lteDevModel", offsetof(struct ql_status_page, model), sizeof(((struct ql_status_page *)0)->model)},
+    [QL_STATUS_REVISION] = {"/tmp/lteVersion", offsetof(struct ql_status_page, revision), sizeof(((struct ql_status_page *)0)->revision)},
+};
+
+static void ql_status_legacy_write(const char *file, const char *value) {
+#if QL_STATUS_LEGACY
+    int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd < 0)
+        return;
+    if (value && value[0]) {
+        size_t len = strlen(value);
+
+        //same as 'echo value > file'
+        if (write(fd, value, len) != (ssize_t)len || write(fd, "\n", 1) != 1) {};
+    }
+    close(fd);
+#else
+    (void)file; (void)value;
+#endif
+}
+
+static void ql_status_legacy_unlink(const char *file) {
+#if QL_STATUS_LEGACY
+    unlink(file);
+#else
+    (void)file;
+#endif
+}
+
+/* callers hold s_status_mutex */
+static struct ql_status_page *ql_status_begin(void) {
+    struct ql_status_page *page = s_status_page;
+
+    if (page) {
+        page->seq++;
+        __sync_synchronize();
+    }
+    return page;
+}
+
+static void ql_status_end(struct ql_status_page *page) {
+    if (page) {
+        page->update_msec = clock_msec();
+        __sync_synchronize();
+        page->seq++;
+    }
+}
+
+int ql_status_open(int pdp) {
+    struct ql_status_page *page;
+    int fd;
+
+    snprintf(s_status_file, sizeof(s_status_file), "/tmp/quectel-CM.%d.status", pdp);
+    fd = open(s_status_file, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        dbg_time("%s open %s fail, errno: %d (%s)", __func__, s_status_file, errno, strerror(errno));
+        return -errno;
+    }
+
+    if (ftruncate(fd, sizeof(*page))) {
+        dbg_time("%s ftruncate fail, errno: %d (%s)", __func__, errno, strerror(errno));
+        close(fd);
+        unlink(s_status_file);
+        return -errno;
+    }
+
+    page = mmap(NULL, sizeof(*page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED) {
+        dbg_time("%s mmap fail, errno: %d (%s)", __func__, errno, strerror(errno));
+        unlink(s_status_file);
+        return -errno;
+    }
+
+    page->size = sizeof(*page);
+    page->version = QL_STATUS_VERSION;
+    page->pid = getpid();
+    page->spawn_count = s_spawn_count;
+    page->update_msec = clock_msec();
+    __sync_synchronize();
+    page->magic = QL_STATUS_MAGIC;
+
+    pthread_mutex_lock(&s_status_mutex);
+    s_status_page = page;
+    pthread_mutex_unlock(&s_status_mutex);
+
+    return 0;
+}
+
+void ql_status_close(void) {
+    pthread_mutex_lock(&s_status_mutex);
+    dbg_time("%u external programs were started", s_spawn_count);
+    if (s_status_page) {
+        munmap(s_status_page, sizeof(*s_status_page));
+        s_status_page = NULL;
+        unlink(s_status_file);
+    }
+    pthread_mutex_unlock(&s_status_mutex);
+}
+
+void ql_status_set(enum ql_status_field field, const char *fmt, ...) {
+    struct ql_status_page *page;
+    char value[128];
+    va_list args;
+
+    if (field >= QL_STATUS_FIELD_MAX)
+        return;
+
+    va_start(args, fmt);
+    vsnprintf(value, sizeof(value), fmt, args);
+    va_end(args);
+
+    pthread_mutex_lock(&s_status_mutex);
+    page = ql_status_begin();
+    if (page) {
+        char *dst = (char *)page + s_status_fields[field].offset;
+
+        strncpy(dst, value, s_status_fields[field].size - 1);
+        dst[s_status_fields[field].size - 1] = '\0';
+        page->modem_present = 1;
+    }
+    ql_status_end(page);
+    pthread_mutex_unlock(&s_status_mutex);
+
+    ql_status_legacy_write(s_status_fields[field].legacy, value);
+}
+
+void ql_status_set_rssi(int rssi) {
+    struct ql_status_page *page;
+    char value[16];
+
+    pthread_mutex_lock(&s_status_mutex);
+    page = ql_status_begin();
+    if (page) {
+        page->rssi = rssi;
+        page->modem_present = 1;
+    }
+    ql_status_end(page);
+    pthread_mutex_unlock(&s_status_mutex);
+
+    snprintf(value, sizeof(value), "%d", rssi);
+    ql_status_legacy_write("/tmp/lteRssi", value);
+}
+
+void ql_status_set_link(const PROFILE_T *profile) {
+    struct ql_status_page *page;
+    struct ql_status_pdn *pdn = NULL;
+    const char *ifname = profile->qmapnet_adapter[0] ? profile->qmapnet_adapter : profile->usbnet_adapter;
+    unsigned i;
+
+    pthread_mutex_lock(&s_status_mutex);
+    page = ql_status_begin();
+    if (page) {
+        for (i = 0; i < page->num_pdn; i++) {
+            if (page->pdn[i].pdp == profile->pdp)
+                pdn = &page->pdn[i];
+        }
+        if (!pdn && page->num_pdn < QL_STATUS_MAX_PDN)
+            pdn = &page->pdn[page->num_pdn++];
+    }
+    if (pdn) {
+        memset(pdn, 0, sizeof(*pdn));
+        pdn->pdp = profile->pdp;
+        if (profile->usbnet_link & (1<<IpFamilyV4))
+            pdn->link |= 1;
+        if (profile->usbnet_link & (1<<IpFamilyV6))
+            pdn->link |= 2;
+        pdn->ipv4 = htonl(profile->ipv4.Address);
+        memcpy(pdn->ipv6, profile->ipv6.Address, sizeof(pdn->ipv6));
+        strncpy(pdn->ifname, ifname, sizeof(pdn->ifname) - 1);
+    }
+    ql_status_end(page);
+    pthread_mutex_unlock(&s_status_mutex);
+}
+
+void ql_status_count_spawn(void) {
+    struct ql_status_page *page;
+
+    pthread_mutex_lock(&s_status_mutex);
+    s_spawn_count++;
+    page = ql_status_begin();
+    if (page)
+        page->spawn_count = s_spawn_count;
+    ql_status_end(page);
+    pthread_mutex_unlock(&s_status_mutex);
+}
+
+unsigned ql_status_spawn_count(void) {
+    unsigned count;
+
+    pthread_mutex_lock(&s_status_mutex);
+    count = s_spawn_count;
+    pthread_mutex_unlock(&s_status_mutex);
+    return count;
+}
+
+/* the data call is usable, what udhcpc's 'touch /tmp/lteconnected' used to say */
+void ql_status_set_connected(void) {
+    ql_status_legacy_write("/tmp/lteconnected", NULL);
+}
+
+/* the modem is gone: forget everything, like 'rm -rf /tmp/lte*; touch /tmp/lteDisconnected' */
+void ql_status_reset(void) {
+    static const char *legacy[] = {
+        "/tmp/lteSim", "/tmp/lteMode", "/tmp/lteRssi", "/tmp/lteIMEI", "/tmp/lteDevModel",
+        "/tmp/lteVersion", "/tmp/lteconnected", "/tmp/ltePowerOff",
+    };
+    struct ql_status_page *page;
+    unsigned i;
+
+    pthread_mutex_lock(&s_status_mutex);
+    page = ql_status_begin();
+    if (page) {
+        size_t head = offsetof(struct ql_status_page, modem_present);
+
+        memset((char *)page + head, 0, sizeof(*page) - head);
+        page->spawn_count = s_spawn_count;
+    }
+    ql_status_end(page);
+    pthread_mutex_unlock(&s_status_mutex);
+
+    for (i = 0; i < sizeof(legacy)/sizeof(legacy[0]); i++)
+        ql_status_legacy_unlink(legacy[i]);
+    ql_status_legacy_write("/tmp/lteDisconnected", NULL);
+}
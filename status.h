@@ -0,0 +1,58 @@
+/**
+  @file
+  status.h
+
+  @brief
+  Layout of the status page quectel-CM publishes in /tmp/quectel-CM.<pdn>.status.
+
+  Other programs mmap() the file read-only and copy the page out:
+
+    do {
+        seq = page->seq;
+        __sync_synchronize();
+        memcpy(&copy, page, sizeof(copy));
+        __sync_synchronize();
+    } while ((seq & 1) || seq != page->seq);
+
+  magic/version tell the layout, fields are only ever appended.
+  The file is removed when quectel-CM exits.
+ */
+
+#ifndef __QL_STATUS_H__
+#define __QL_STATUS_H__
+
+#include <stdint.h>
+
+#define QL_STATUS_MAGIC 0x534d4351 /* "QCMS" */
+#define QL_STATUS_VERSION 1
+#define QL_STATUS_MAX_PDN 8
+
+struct ql_status_pdn {
+    uint8_t pdp;
+    uint8_t link;           /* bit 0 IPv4 up, bit 1 IPv6 up, same as usbnet_link */
+    uint8_t reserved[2];
+    uint32_t ipv4;          /* network order */
+    uint8_t ipv6[16];
+    char ifname[16];
+};
+
+struct ql_status_page {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;          /* sizeof(struct ql_status_page) of the writer */
+    volatile uint32_t seq;  /* odd while an update is in progress */
+    uint32_t pid;
+    uint32_t modem_present;
+    uint64_t update_msec;   /* CLOCK_MONOTONIC of the last update */
+    int32_t rssi;           /* LTE RSSI in dBm, 0 if unknown */
+    uint32_t num_pdn;
+    char sim[32];
+    char mode[64];
+    char imei[32];
+    char model[64];
+    char revision[128];
+    struct ql_status_pdn pdn[QL_STATUS_MAX_PDN];
+    uint32_t spawn_count;   /* external programs started since launch, stays put once connected */
+};
+
+#endif //__QL_STATUS_H__
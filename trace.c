@@ -0,0 +1,185 @@
+/******************************************************************************
+  @file    trace.c
+  @brief   always-on ring of the raw QMI/MBIM/AT frames.
+
+  DESCRIPTION
+  Connectivity Management Tool for USB network adapter of Quectel wireless cellular modules.
+
+  ql_trace() copies the head of every frame with a CLOCK_MONOTONIC timestamp
+  into a fixed ring of slots. It takes no lock and formats nothing, so it can
+  stay on in production without changing timing, unlike dump_qmi().
+  The ring is written out as a pcap file (see trace.h) on SIGUSR2 and when
+  quectel-CM crashes; quectel-trace-decode turns it back into text.
+
+  A slot is claimed with an atomic add and carries the number it was claimed
+  with once complete, so a reader skips slots that are being (re)written.
+
+  INITIALIZATION AND SEQUENCING REQUIREMENTS
+  ql_trace() can be called from any thread at any time.
+  ql_trace_init() once the pdn is known, to name the file and catch crashes.
+******************************************************************************/
+#include "QMIThread.h"
+#include "trace.h"
+
+#ifndef QL_TRACE_SLOTS
+#define QL_TRACE_SLOTS 256
+#endif
+#ifndef QL_TRACE_SNAPLEN
+#define QL_TRACE_SNAPLEN 512
+#endif
+
+typedef struct {
+    volatile uint32_t stamp;    /* claim number + 1, 0 while being written */
+    uint8_t proto;
+    uint8_t dir;
+    uint32_t len;
+    uint64_t usec;
+    uint8_t data[QL_TRACE_SNAPLEN];
+} QL_TRACE_SLOT;
+
+struct pcap_file_hdr {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+};
+
+struct pcap_rec_hdr {
+    uint32_t ts_sec;
+    uint32_t ts_usec;
+    uint32_t incl_len;
+    uint32_t orig_len;
+};
+
+static QL_TRACE_SLOT s_trace_ring[QL_TRACE_SLOTS];
+static volatile uint32_t s_trace_head = 0;
+static char s_trace_file[64] = "/tmp/quectel-CM.pcap";
+
+static uint64_t ql_trace_usec(clockid_t clock) {
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void ql_trace(int proto, int dir, const void *data, unsigned len) {
+    uint32_t n = __sync_fetch_and_add(&s_trace_head, 1);
+    QL_TRACE_SLOT *slot = &s_trace_ring[n % QL_TRACE_SLOTS];
+
+    slot->stamp = 0;
+    __sync_synchronize();
+    slot->usec = ql_trace_usec(CLOCK_MONOTONIC);
+    slot->proto = proto;
+    slot->dir = dir;
+    slot->len = len;
+    memcpy(slot->data, data, len < QL_TRACE_SNAPLEN ? len : QL_TRACE_SNAPLEN);
+    __sync_synchronize();
+    slot->stamp = n + 1;
+}
+
+static int ql_trace_write(int fd, const void *buf, size_t size) {
+    const char *p = buf;
+
+    while (size) {
+        ssize_t nwrites = write(fd, p, size);
+
+        if (nwrites < 0 && errno == EINTR)
+            continue;
+        if (nwrites <= 0)
+            return -1;
+        p += nwrites;
+        size -= nwrites;
+    }
+    return 0;
+}
+
+/* only async-signal-safe calls, this runs from the crash handler too */
+static int ql_trace_dump_file(void) {
+    struct pcap_file_hdr file_hdr = {0xa1b2c3d4, 2, 4, 0, 0,
+        sizeof(struct ql_trace_hdr) + QL_TRACE_SNAPLEN, QL_TRACE_LINKTYPE};
+    uint64_t realtime_offset = ql_trace_usec(CLOCK_REALTIME) - ql_trace_usec(CLOCK_MONOTONIC);
+    uint32_t head = s_trace_head;
+    uint32_t n = head > QL_TRACE_SLOTS ? head - QL_TRACE_SLOTS : 0;
+    int fd, frames = 0;
+
+    fd = open(s_trace_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -errno;
+
+    if (ql_trace_write(fd, &file_hdr, sizeof(file_hdr)))
+        goto __err;
+
+    for (; n != head; n++) {
+        const QL_TRACE_SLOT *slot = &s_trace_ring[n % QL_TRACE_SLOTS];
+        struct {
+            struct pcap_rec_hdr rec;
+            struct ql_trace_hdr hdr;
+            uint8_t data[QL_TRACE_SNAPLEN];
+        } __attribute__ ((packed)) pkt;
+        unsigned caplen;
+        uint64_t usec;
+
+        if (slot->stamp != n + 1)
+            continue;
+        __sync_synchronize();
+        caplen = slot->len < QL_TRACE_SNAPLEN ? slot->len : QL_TRACE_SNAPLEN;
+        usec = slot->usec + realtime_offset;
+        pkt.rec.ts_sec = usec / 1000000;
+        pkt.rec.ts_usec = usec % 1000000;
+        pkt.rec.incl_len = sizeof(pkt.hdr) + caplen;
+        pkt.rec.orig_len = sizeof(pkt.hdr) + slot->len;
+        pkt.hdr.proto = slot->proto;
+        pkt.hdr.dir = slot->dir;
+        pkt.hdr.reserved = 0;
+        pkt.hdr.len = htole32(slot->len);
+        memcpy(pkt.data, slot->data, caplen);
+        __sync_synchronize();
+        if (slot->stamp != n + 1)
+            continue; //overwritten while we copied it
+
+        if (ql_trace_write(fd, &pkt, sizeof(pkt.rec) + pkt.rec.incl_len))
+            goto __err;
+        frames++;
+    }
+
+    close(fd);
+    return frames;
+
+__err:
+    close(fd);
+    return -EIO;
+}
+
+int ql_trace_dump(void) {
+    int frames = ql_trace_dump_file();
+
+    if (frames < 0)
+        dbg_time("%s %s fail, errno: %d (%s)", __func__, s_trace_file, -frames, strerror(-frames));
+    else
+        dbg_time("%d frames dumped to %s", frames, s_trace_file);
+    return frames;
+}
+
+static void ql_trace_crash_handler(int signo) {
+    ql_trace_dump_file();
+    //SA_RESETHAND put the default action back
+    raise(signo);
+}
+
+void ql_trace_init(int pdp) {
+    static const int signals[] = {SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT};
+    struct sigaction sa;
+    unsigned i;
+
+    snprintf(s_trace_file, sizeof(s_trace_file), "/tmp/quectel-CM.%d.pcap", pdp);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = ql_trace_crash_handler;
+    sa.sa_flags = SA_RESETHAND;
+    sigemptyset(&sa.sa_mask);
+    for (i = 0; i < sizeof(signals)/sizeof(signals[0]); i++)
+        sigaction(signals[i], &sa, NULL);
+}
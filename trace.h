@@ -0,0 +1,39 @@
+/**
+  @file
+  trace.h
+
+  @brief
+  Layout of the frame trace quectel-CM dumps to /tmp/quectel-CM.<pdn>.pcap.
+
+  The file is a classic pcap file (either byte order, microsecond timestamps)
+  with link type LINKTYPE_USER0. Every packet starts with struct ql_trace_hdr,
+  followed by the first bytes of the raw QMI/MBIM/AT frame.
+  quectel-trace-decode prints it, wireshark shows it as raw data.
+ */
+
+#ifndef __QL_TRACE_H__
+#define __QL_TRACE_H__
+
+#include <stdint.h>
+
+#define QL_TRACE_LINKTYPE 147 /* LINKTYPE_USER0 */
+
+enum ql_trace_proto {
+    QL_TRACE_QMI = 1,
+    QL_TRACE_MBIM = 2,
+    QL_TRACE_AT = 3,
+};
+
+enum ql_trace_dir {
+    QL_TRACE_TX = 0, /* host to modem */
+    QL_TRACE_RX = 1, /* modem to host */
+};
+
+struct ql_trace_hdr {
+    uint8_t proto;
+    uint8_t dir;
+    uint16_t reserved;
+    uint32_t len;           /* little endian, length of the frame before truncation */
+};
+
+#endif //__QL_TRACE_H__
@@ -29,11 +29,6 @@ static __inline in_addr_t qmi2addr(uint32_t __x) {
     return (__x>>24) | (__x>>8&0xff00) | (__x<<8&0xff0000) | (__x<<24);
 }
 
-static int ql_system(const char *shell_cmd) {
-    dbg_time("%s", shell_cmd);
-    return system(shell_cmd);
-}
-
 static void ifc_init_ifr(const char *name, struct ifreq *ifr)
 {
     memset(ifr, 0, sizeof(struct ifreq));
@@ -104,6 +99,46 @@ static short ifc_get_flags(const char *ifname)
     return ret;
 }
 
+//same as 'ifconfig ifname up/down'
+static void ifc_set_up(const char *ifname, int up)
+{
+    int inet_sock;
+    struct ifreq ifr;
+
+    dbg_time("ifconfig %s %s", ifname, up ? "up" : "down");
+    inet_sock = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (inet_sock > 0) {
+        ifc_init_ifr(ifname, &ifr);
+
+        if (!ioctl(inet_sock, SIOCGIFFLAGS, &ifr)) {
+            if (up)
+                ifr.ifr_ifru.ifru_flags |= IFF_UP;
+            else
+                ifr.ifr_ifru.ifru_flags &= ~IFF_UP;
+            ioctl(inet_sock, SIOCSIFFLAGS, &ifr);
+        }
+
+        close(inet_sock);
+    }
+}
+
+//same as 'ifconfig ifname 0.0.0.0'
+static void ifc_clear_addr(const char *ifname)
+{
+    int inet_sock;
+    struct ifreq ifr;
+
+    inet_sock = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (inet_sock > 0) {
+        ifc_init_ifr(ifname, &ifr);
+        ((struct sockaddr_in *)&ifr.ifr_addr)->sin_family = AF_INET;
+        ioctl(inet_sock, SIOCSIFADDR, &ifr);
+        close(inet_sock);
+    }
+}
+
 static int ql_netcard_ipv4_address_check(const char *ifname, in_addr_t ip) {
     in_addr_t addr = 0;
 
@@ -114,7 +149,6 @@ static int ql_netcard_ipv4_address_check(const char *ifname, in_addr_t ip) {
 static int ql_raw_ip_mode_check(const char *ifname, uint32_t ip) {
     int fd;
     char raw_ip[128];
-    char shell_cmd[128];
     char mode[2] = "X";
     int mode_change = 0;
 
@@ -134,14 +168,12 @@ static int ql_raw_ip_mode_check(const char *ifname, uint32_t ip) {
     if (read(fd, mode, 2) == -1) {};
     if (mode[0] == '0' || mode[0] == 'N') {
         dbg_time("File:%s Line:%d udhcpc fail to get ip address, try next:", __func__, __LINE__);
-        snprintf(shell_cmd, sizeof(shell_cmd), "ifconfig %s down", ifname);
-        ql_system(shell_cmd);
+        ifc_set_up(ifname, 0);
         dbg_time("echo Y > /sys/class/net/%s/qmi/raw_ip", ifname);
         mode[0] = 'Y';
         if (write(fd, mode, 2) == -1) {};
         mode_change = 1;
-        snprintf(shell_cmd, sizeof(shell_cmd), "ifconfig %s up", ifname);
-        ql_system(shell_cmd);
+        ifc_set_up(ifname, 1);
     }
 
     close(fd);
@@ -150,12 +182,13 @@ static int ql_raw_ip_mode_check(const char *ifname, uint32_t ip) {
 
 static void* udhcpc_thread_function(void* arg) {
     FILE * udhcpc_fp;
+    pid_t udhcpc_pid;
     char *udhcpc_cmd = (char *)arg;
     if (udhcpc_cmd == NULL)
         return NULL;
 
     dbg_time("1.%s", udhcpc_cmd);
-    udhcpc_fp = popen(udhcpc_cmd, "r");
+    udhcpc_fp = ql_popen(udhcpc_cmd, &udhcpc_pid);
     free(udhcpc_cmd);
     if (udhcpc_fp) {
         char buf[0xff];
@@ -165,10 +198,10 @@ static void* udhcpc_thread_function(void* arg) {
             if ((strlen(buf) > 1) && (buf[strlen(buf) - 1] == '\n'))
                 buf[strlen(buf) - 1] = '\0';
             dbg_time("1.%s", buf);
-            system("touch /tmp/lteconnected");
+            ql_status_set_connected();
         }
 
-        pclose(udhcpc_fp);
+        ql_pclose(udhcpc_fp, udhcpc_pid);
     }
 
     return NULL;
@@ -210,8 +243,7 @@ void ql_set_driver_link_state(PROFILE_T *profile, int link_state) {
         lseek(fd, 0, SEEK_SET);
         rc = read(fd, link_file, sizeof(link_file));
         if (rc > 1 && (!strncasecmp(link_file, "0\n", 2) || !strncasecmp(link_file, "0x0\n", 4))) {
-            snprintf(link_file, sizeof(link_file), "ifconfig %s down", profile->usbnet_adapter);
-            ql_system(link_file);
+            ifc_set_up(profile->usbnet_adapter, 0);
         }
     }
 
@@ -240,63 +272,67 @@ static const char *ipv6Str(const UCHAR Address[16]) {
     return str;
 }
 
+//ip/ifconfig/route are run directly, not through 'sh -c'
 void update_ipv4_address(const char *ifname, const char *ip, const char *gw, unsigned prefix)
 {
-    char shell_cmd[128];
+    char *dev = (char *)ifname;
+    char addr[64];
 
     if (!ifname)
         return;
 
     if (!access("/sbin/ip", X_OK)) {
-        snprintf(shell_cmd, sizeof(shell_cmd), "ip -%d address flush dev %s", 4, ifname);
-        ql_system(shell_cmd);
-
-        snprintf(shell_cmd, sizeof(shell_cmd), "ip -%d address add %s/%u dev %s", 4, ip, prefix, ifname);
-        ql_system(shell_cmd);
+        char *flush[] = {"ip", "-4", "address", "flush", "dev", dev, NULL};
+        char *add[] = {"ip", "-4", "address", "add", addr, "dev", dev, NULL};
+        char *route[] = {"ip", "-4", "route", "add", "default", "via", (char *)gw, "dev", dev, NULL};
 
+        snprintf(addr, sizeof(addr), "%s/%u", ip, prefix);
+        ql_exec(flush);
+        ql_exec(add);
         //ping6 www.qq.com
-        snprintf(shell_cmd, sizeof(shell_cmd), "ip -%d route add default via %s dev %s", 4, gw, ifname);
-        ql_system(shell_cmd);
+        ql_exec(route);
     } else {
+        char *ifconfig[] = {"ifconfig", dev, (char *)ip, "netmask", addr, NULL};
+        char *route_del[] = {"route", "del", "default", "dev", dev, NULL};
+        char *route_add[] = {"route", "add", "default", "gw", (char *)gw, "dev", dev, NULL};
         unsigned n =  (0xFFFFFFFF >> (32 - prefix)) << (32 - prefix);
         n = (n>>24) | (n>>8&0xff00) | (n<<8&0xff0000) | (n<<24);
 
-        snprintf(shell_cmd, sizeof(shell_cmd), "ifconfig %s %s netmask %s", ifname, ip, ipv4Str(n));
-        ql_system(shell_cmd);
+        snprintf(addr, sizeof(addr), "%s", ipv4Str(n));
+        ql_exec(ifconfig);
 
         //Resetting default routes
-        snprintf(shell_cmd, sizeof(shell_cmd), "route del default dev %s", ifname);
-        while(!system(shell_cmd));
+        while(!ql_exec(route_del));
 
-        snprintf(shell_cmd, sizeof(shell_cmd), "route add default gw %s dev %s", gw, ifname);
-        ql_system(shell_cmd);
+        ql_exec(route_add);
     }
 }
 
 void update_ipv6_address(const char *ifname, const char *ip, const char *gw, unsigned prefix) {
-    char shell_cmd[128];
+    char *dev = (char *)ifname;
+    char addr[64];
 
     (void)gw;
+    snprintf(addr, sizeof(addr), "%s/%u", ip, prefix);
     if (!access("/sbin/ip", X_OK)) {
-        snprintf(shell_cmd, sizeof(shell_cmd), "ip -%d address flush dev %s", 6, ifname);
-        ql_system(shell_cmd);
-
-        snprintf(shell_cmd, sizeof(shell_cmd), "ip -%d address add %s/%u dev %s", 6, ip, prefix, ifname);
-        ql_system(shell_cmd);
+        char *flush[] = {"ip", "-6", "address", "flush", "dev", dev, NULL};
+        char *add[] = {"ip", "-6", "address", "add", addr, "dev", dev, NULL};
+        char *route[] = {"ip", "-6", "route", "add", "default", "dev", dev, NULL};
 
+        ql_exec(flush);
+        ql_exec(add);
         //ping6 www.qq.com
-        snprintf(shell_cmd, sizeof(shell_cmd), "ip -%d route add default dev %s", 6, ifname);
-        ql_system(shell_cmd);
+        ql_exec(route);
     } else {
-        snprintf(shell_cmd, sizeof(shell_cmd), "ifconfig %s %s/%d", ifname, ip, prefix);
-        ql_system(shell_cmd);
+        char *ifconfig[] = {"ifconfig", dev, addr, NULL};
+        char *route[] = {"route", "-A", "inet6", "add", "default", "dev", dev, NULL};
 
-        snprintf(shell_cmd, sizeof(shell_cmd), "route -A inet6 add default dev %s", ifname);
-        ql_system(shell_cmd);
+        ql_exec(ifconfig);
+        ql_exec(route);
     }
 }
 
-static void update_ip_address_by_qmi(const char *ifname, const IPV4_T *ipv4, const IPV6_T *ipv6) {
+static void update_ip_address_by_qmi(PROFILE_T *profile, const char *ifname, const IPV4_T *ipv4, const IPV6_T *ipv6) {
     char *d1, *d2;
 
     if (ipv4 && ipv4->Address) {
@@ -318,7 +354,7 @@ static void update_ip_address_by_qmi(const char *ifname, const IPV4_T *ipv4, con
         if (ipv4->DnsPrimary) {
             d1 = strdup(ipv4Str(ipv4->DnsPrimary));
             d2 = strdup(ipv4Str(ipv4->DnsSecondary ? ipv4->DnsSecondary : ipv4->DnsPrimary));
-            update_resolv_conf(4, ifname, d1, d2);
+            update_resolv_conf(4, ifname, profile->pdp, d1, d2);
             free(d1); free(d2);
         }
     }
@@ -334,7 +370,7 @@ static void update_ip_address_by_qmi(const char *ifname, const IPV4_T *ipv4, con
         if (ipv6->DnsPrimary[0]) {
             d1 = strdup(ipv6Str(ipv6->DnsPrimary));
             d2 = strdup(ipv6Str(ipv6->DnsSecondary[0] ? ipv6->DnsSecondary : ipv6->DnsPrimary));
-            update_resolv_conf(6, ifname, d1, d2);
+            update_resolv_conf(6, ifname, profile->pdp, d1, d2);
             free(d1); free(d2);
         }
     }
@@ -350,11 +386,10 @@ static int ql_openwrt_system(const char *cmd) {
     int ret = 1;
     char shell_cmd[128];
 
-    snprintf(shell_cmd, sizeof(shell_cmd), "%s 2>1 > /dev/null", cmd);
+    snprintf(shell_cmd, sizeof(shell_cmd), "%s > /dev/null 2>&1", cmd);
     
     for (i = 0; i < 15; i++) {
-        dbg_time("%s", cmd);
-        ret = system(shell_cmd);
+        ret = ql_system(shell_cmd);
         if (!ret)
             break;
         sleep(1);
@@ -365,7 +400,7 @@ static int ql_openwrt_system(const char *cmd) {
 
 static int ql_openwrt_is_wan(const char *ifname) {
     if (openwrt_lan == NULL) {
-        system("uci show network.wan.ifname");
+        ql_system("uci show network.wan.ifname");
     }
 
     if (strcmp(ifname, openwrt_wan))
@@ -469,7 +504,6 @@ static void ql_openwrt_setup_wan6(const char *ifname, const IPV6_T *ipv6) {
 
 void udhcpc_start(PROFILE_T *profile) {
     char *ifname = profile->usbnet_adapter;
-    char shell_cmd[128];
 
     ql_set_driver_link_state(profile, 1);
 
@@ -482,16 +516,13 @@ void udhcpc_start(PROFILE_T *profile) {
     }
 
     if (strcmp(ifname, profile->usbnet_adapter)) {
-        snprintf(shell_cmd, sizeof(shell_cmd), "ifconfig %s up", profile->usbnet_adapter);
-        ql_system(shell_cmd);
+        ifc_set_up(profile->usbnet_adapter, 1);
         if (ifc_get_flags(ifname)&IFF_UP) {
-            snprintf(shell_cmd, sizeof(shell_cmd), "ifconfig %s down", ifname);
-            ql_system(shell_cmd);
+            ifc_set_up(ifname, 0);
         }
     }
 
-    snprintf(shell_cmd, sizeof(shell_cmd), "ifconfig %s up", ifname);
-    ql_system(shell_cmd);
+    ifc_set_up(ifname, 1);
 	
     if (profile->ipv4.Address) {
         if (profile->PCSCFIpv4Addr1)
@@ -516,19 +547,18 @@ void udhcpc_start(PROFILE_T *profile) {
 //because must use udhcpc to obtain IP when working on ETH mode,
 //so it is better also use udhcpc to obtain IP when working on IP mode.
 //use the same policy for all modules
-#if 0
-    if (profile->rawIP != 0) //mdm9x07/ec25,ec20 R2.0
+//unless asked for with -S
+    if (profile->static_ip)
     {
-        update_ip_address_by_qmi(ifname, &profile->ipv4, &profile->ipv6);
+        update_ip_address_by_qmi(profile, ifname, &profile->ipv4, &profile->ipv6);
         return;
     }
-#endif
 
     if (profile->ipv4.Address == 0)
         goto set_ipv6;
 
     if (profile->request_ops == &mbim_request_ops) { //lots of mbim modem do not support DHCP
-        update_ip_address_by_qmi(ifname, &profile->ipv4, NULL);
+        update_ip_address_by_qmi(profile, ifname, &profile->ipv4, NULL);
     }
     else
 /* Do DHCP using busybox tools */
@@ -587,7 +617,7 @@ void udhcpc_start(PROFILE_T *profile) {
 
             if (!ql_netcard_ipv4_address_check(ifname, qmi2addr(profile->ipv4.Address))) {
                 //no udhcpc's default.script exist, directly set ip and dns
-                update_ip_address_by_qmi(ifname, &profile->ipv4, NULL);
+                update_ip_address_by_qmi(profile, ifname, &profile->ipv4, NULL);
             }
 #endif
     }
@@ -612,7 +642,7 @@ set_ipv6:
             close(forward_fd);
         }
 
-        update_ip_address_by_qmi(ifname, NULL, &profile->ipv6);
+        update_ip_address_by_qmi(profile, ifname, NULL, &profile->ipv6);
 
         if (profile->ipv6.DnsPrimary[0] || profile->ipv6.DnsSecondary[0]) {
             char dns1str[64], dns2str[64];
@@ -625,7 +655,7 @@ set_ipv6:
                 strcpy(dns2str, ipv6Str(profile->ipv6.DnsSecondary));
             }
 
-            update_resolv_conf(6, ifname, profile->ipv6.DnsPrimary[0] ? dns1str : NULL,
+            update_resolv_conf(6, ifname, profile->pdp, profile->ipv6.DnsPrimary[0] ? dns1str : NULL,
                                profile->ipv6.DnsSecondary[0] != '\0' ? dns2str : NULL);
         }
 
@@ -654,8 +684,10 @@ set_ipv6:
              5. run "dibbler-client start" to get ipV6 address
              6. run "route -A inet6 add default dev wwan0" to add default route
         */
-        snprintf(shell_cmd, sizeof(shell_cmd), "route -A inet6 add default %s", ifname);
-        ql_system(shell_cmd);
+        {
+            char *route[] = {"route", "-A", "inet6", "add", "default", ifname, NULL};
+            ql_exec(route);
+        }
         snprintf(udhcpc_cmd, sizeof(udhcpc_cmd), "dibbler-client run");
         dibbler_client_alive++;
 #endif
@@ -667,7 +699,6 @@ set_ipv6:
 
 void udhcpc_stop(PROFILE_T *profile) {
     char *ifname = profile->usbnet_adapter;
-    char shell_cmd[128];
 
     ql_set_driver_link_state(profile, 0);
 
@@ -677,20 +708,20 @@ void udhcpc_stop(PROFILE_T *profile) {
 
 #ifdef USE_DHCLIENT
     if (dhclient_alive) {
-        system("killall dhclient");
+        char *killall[] = {"killall", "dhclient", NULL};
+        ql_exec(killall);
         dhclient_alive = 0;
     }
 #endif
     if (dibbler_client_alive) {
-        if (system("killall dibbler-client")) {};
+        char *killall[] = {"killall", "dibbler-client", NULL};
+        ql_exec(killall);
         dibbler_client_alive = 0;
     }
 
 //it seems when call netif_carrier_on(), and netcard 's IP is "0.0.0.0", will cause netif_queue_stopped()
-    snprintf(shell_cmd, sizeof(shell_cmd), "ifconfig %s 0.0.0.0", ifname);
-    ql_system(shell_cmd);
-    snprintf(shell_cmd, sizeof(shell_cmd), "ifconfig %s down", ifname);
-    ql_system(shell_cmd);
+    ifc_clear_addr(ifname);
+    ifc_set_up(ifname, 0);
 
 #ifdef QL_OPENWER_NETWORK_SETUP
     ql_openwrt_setup_wan(ifname, NULL);
@@ -1,42 +1,102 @@
+/******************************************************************************
+  @file    udhcpc_netlink.c
+  @brief   configure the USB network adapter over RTNETLINK.
+
+  DESCRIPTION
+  Same policy as udhcpc.c, but link state, MTU, addresses and routes are
+  programmed with RTNETLINK messages (libmnl/ifutils.c) instead of forking
+  ifconfig/route/ip for every step.
+
+  INITIALIZATION AND SEQUENCING REQUIREMENTS
+  None.
+
+  ---------------------------------------------------------------------------
+  Copyright (c) 2016 - 2020 Quectel Wireless Solution, Co., Ltd.  All Rights Reserved.
+  Quectel Wireless Solution Proprietary and Confidential.
+  ---------------------------------------------------------------------------
+******************************************************************************/
 #include <sys/socket.h>
 #include <sys/select.h>
 #include <sys/types.h>
 #include <net/if.h>
-#include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <linux/if_addr.h>
 #include <endian.h>
+#include <stdbool.h>
 
 #include "libmnl/ifutils.h"
 #include "libmnl/dhcp/dhcp.h"
 #include "util.h"
 #include "QMIThread.h"
 
-static int ql_raw_ip_mode_check(const char *ifname)
+static __inline in_addr_t qmi2addr(uint32_t __x) {
+    return (__x>>24) | (__x>>8&0xff00) | (__x<<8&0xff0000) | (__x<<24);
+}
+
+static void ifc_init_ifr(const char *name, struct ifreq *ifr)
 {
+    memset(ifr, 0, sizeof(struct ifreq));
+    strncpy(ifr->ifr_name, name, IFNAMSIZ);
+    ifr->ifr_name[IFNAMSIZ - 1] = 0;
+}
+
+static int ifc_get_addr(const char *name, in_addr_t *addr)
+{
+    int inet_sock;
+    struct ifreq ifr;
+    int ret = 0;
+
+    inet_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (inet_sock < 0)
+        return -1;
+
+    ifc_init_ifr(name, &ifr);
+    if (addr != NULL) {
+        ret = ioctl(inet_sock, SIOCGIFADDR, &ifr);
+        if (ret < 0) {
+            *addr = 0;
+        } else {
+            *addr = ((struct sockaddr_in*) &ifr.ifr_addr)->sin_addr.s_addr;
+        }
+    }
+    close(inet_sock);
+    return ret;
+}
+
+static int ql_netcard_ipv4_address_check(const char *ifname, in_addr_t ip) {
+    in_addr_t addr = 0;
+
+    ifc_get_addr(ifname, &addr);
+    return addr == ip;
+}
+
+static int ql_raw_ip_mode_check(const char *ifname, uint32_t ip) {
     int fd;
     char raw_ip[128];
     char mode[2] = "X";
     int mode_change = 0;
 
+    if (ql_netcard_ipv4_address_check(ifname, qmi2addr(ip)))
+        return 0;
+
     snprintf(raw_ip, sizeof(raw_ip), "/sys/class/net/%s/qmi/raw_ip", ifname);
     if (access(raw_ip, F_OK))
         return 0;
 
     fd = open(raw_ip, O_RDWR | O_NONBLOCK | O_NOCTTY);
-    if (fd < 0)
-    {
+    if (fd < 0) {
         dbg_time("%s %d fail to open(%s), errno:%d (%s)", __FILE__, __LINE__, raw_ip, errno, strerror(errno));
         return 0;
     }
 
-    read(fd, mode, 2);
-    if (mode[0] == '0' || mode[0] == 'N')
-    {
+    if (read(fd, mode, 2) == -1) {};
+    if (mode[0] == '0' || mode[0] == 'N') {
+        dbg_time("File:%s Line:%d udhcpc fail to get ip address, try next:", __func__, __LINE__);
         if_link_down(ifname);
         dbg_time("echo Y > /sys/class/net/%s/qmi/raw_ip", ifname);
         mode[0] = 'Y';
-        write(fd, mode, 2);
+        if (write(fd, mode, 2) == -1) {};
         mode_change = 1;
         if_link_up(ifname);
     }
@@ -45,16 +105,14 @@ static int ql_raw_ip_mode_check(const char *ifname)
     return mode_change;
 }
 
-void ql_set_driver_link_state(PROFILE_T *profile, int link_state)
-{
+void ql_set_driver_link_state(PROFILE_T *profile, int link_state) {
     char link_file[128];
     int fd;
     int new_state = 0;
 
     snprintf(link_file, sizeof(link_file), "/sys/class/net/%s/link_state", profile->usbnet_adapter);
     fd = open(link_file, O_RDWR | O_NONBLOCK | O_NOCTTY);
-    if (fd == -1)
-    {
+    if (fd == -1) {
         if (errno != ENOENT)
             dbg_time("Fail to access %s, errno: %d (%s)", link_file, errno, strerror(errno));
         return;
@@ -62,23 +120,21 @@ void ql_set_driver_link_state(PROFILE_T *profile, int link_state)
 
     if (profile->qmap_mode <= 1)
         new_state = !!link_state;
-    else
-    {
+    else {
         //0x80 means link off this pdp
-        new_state = (link_state ? 0x00 : 0x80) + profile->pdp;
+        new_state = (link_state ? 0x00 : 0x80) + (profile->muxid - 0x80);
     }
 
     snprintf(link_file, sizeof(link_file), "%d\n", new_state);
-    write(fd, link_file, sizeof(link_file));
+    if (write(fd, link_file, sizeof(link_file)) == -1) {};
 
-    if (link_state == 0 && profile->qmap_mode > 1)
-    {
+    if (link_state == 0 && profile->qmapnet_adapter[0]
+        && strcmp(profile->qmapnet_adapter, profile->usbnet_adapter)) {
         size_t rc;
 
         lseek(fd, 0, SEEK_SET);
         rc = read(fd, link_file, sizeof(link_file));
-        if (rc > 1 && (!strcasecmp(link_file, "0\n") || !strcasecmp(link_file, "0x0\n")))
-        {
+        if (rc > 1 && (!strncasecmp(link_file, "0\n", 2) || !strncasecmp(link_file, "0x0\n", 4))) {
             if_link_down(profile->usbnet_adapter);
         }
     }
@@ -86,94 +142,487 @@ void ql_set_driver_link_state(PROFILE_T *profile, int link_state)
     close(fd);
 }
 
-void udhcpc_start(PROFILE_T *profile)
-{
+static const char *ipv4Str(const uint32_t Address) {
+    static char str[] = {"255.225.255.255"};
+    uint8_t *ip = (uint8_t *)&Address;
+
+    snprintf(str, sizeof(str), "%d.%d.%d.%d", ip[3], ip[2], ip[1], ip[0]);
+    return str;
+}
+
+static const char *ipv6Str(const UCHAR Address[16]) {
+    static char str[64];
+    uint16_t ip[8];
+    int i;
+    for (i = 0; i < 8; i++) {
+        ip[i] = (Address[i*2]<<8) + Address[i*2+1];
+    }
+
+    snprintf(str, sizeof(str), "%x:%x:%x:%x:%x:%x:%x:%x",
+        ip[0], ip[1], ip[2], ip[3], ip[4], ip[5], ip[6], ip[7]);
+
+    return str;
+}
+
+/*
+ * MTU, flush, address, link up and default route go out as one netlink
+ * batch. If the address is refused the family is flushed again, so the
+ * netcard is either fully configured or carries no address of that family.
+ */
+static int ql_netlink_commit(struct if_batch *b, int proto, int addr_idx) {
+    if (!if_batch_commit(b))
+        return 0;
+
+    dbg_time("%s: netlink msg %d of %d failed, errno: %d (%s)", b->ifname, b->failed, b->num, b->error, strerror(b->error));
+    if (b->failed >= 0 && b->failed <= addr_idx) {
+        struct if_batch undo;
+
+        if (!if_batch_init(&undo, b->ifname) && !if_batch_flush_addr(&undo, proto))
+            if_batch_commit(&undo);
+    }
+
+    return b->failed;
+}
+
+/* addresses in network byte order */
+static void ql_netlink_set_ipv4(const char *ifname, in_addr_t ip, in_addr_t gw, unsigned prefix, unsigned mtu) {
+    struct if_batch b;
+    addr_t addr, gwaddr;
+    int addr_idx, route_idx;
+
+    if (if_batch_init(&b, ifname))
+        return;
+
+    addr.ip = ip;
+    gwaddr.ip = gw;
+    if (mtu)
+        if_batch_mtu(&b, mtu);
+    if_batch_flush_addr(&b, AF_INET);
+    addr_idx = b.num;
+    if_batch_addr(&b, 1, AF_INET, &addr, prefix);
+    if_batch_link(&b, 1);
+    route_idx = b.num;
+    if_batch_route(&b, 1, AF_INET, (addr_t *)&in6addr_any, 0, gw ? &gwaddr : NULL);
+
+    //a gateway outside the subnet still works as an on-link default route
+    if (ql_netlink_commit(&b, AF_INET, addr_idx) == route_idx && gw)
+        if_set_default_route_v4(ifname);
+}
+
+static void ql_netlink_set_ipv6(const char *ifname, const UCHAR ip[16], unsigned prefix, unsigned mtu, int nodad) {
+    struct if_batch b;
+    addr_t addr;
+    int addr_idx;
+
+    if (if_batch_init(&b, ifname))
+        return;
+
+    //the modem is the only neighbour, DAD just keeps the address tentative for a second
+    if (nodad)
+        b.addr_flags = IFA_F_NODAD;
+
+    memcpy(&addr.ip6, ip, 16);
+    if (mtu)
+        if_batch_mtu(&b, mtu);
+    if_batch_flush_addr(&b, AF_INET6);
+    addr_idx = b.num;
+    if_batch_addr(&b, 1, AF_INET6, &addr, prefix);
+    if_batch_link(&b, 1);
+    //ping6 www.qq.com
+    if_batch_route(&b, 1, AF_INET6, (addr_t *)&in6addr_any, 0, NULL);
+
+    ql_netlink_commit(&b, AF_INET6, addr_idx);
+}
+
+void update_ipv4_address(const char *ifname, const char *ip, const char *gw, unsigned prefix) {
+    struct in_addr addr, gwaddr;
+
+    if (!ifname || inet_pton(AF_INET, ip, &addr) != 1)
+        return;
+    if (!gw || inet_pton(AF_INET, gw, &gwaddr) != 1)
+        gwaddr.s_addr = 0;
+
+    ql_netlink_set_ipv4(ifname, addr.s_addr, gwaddr.s_addr, prefix, 0);
+}
+
+void update_ipv6_address(const char *ifname, const char *ip, const char *gw, unsigned prefix) {
+    struct in6_addr addr;
+
+    (void)gw;
+    if (!ifname || inet_pton(AF_INET6, ip, &addr) != 1)
+        return;
+
+    ql_netlink_set_ipv6(ifname, addr.s6_addr, prefix, 0, 0);
+}
+
+static void update_ip_address_by_qmi(PROFILE_T *profile, const char *ifname, const IPV4_T *ipv4, const IPV6_T *ipv6) {
+    int static_ip = profile->static_ip;
+    char *d1, *d2;
+
+    if (ipv4 && ipv4->Address) {
+        dbg_time("ipv4 %s/%d via netlink", ipv4Str(ipv4->Address), mask_to_prefix_v4(ipv4->SubnetMask));
+        ql_netlink_set_ipv4(ifname, qmi2addr(ipv4->Address), qmi2addr(ipv4->Gateway),
+                            mask_to_prefix_v4(ipv4->SubnetMask), static_ip ? ipv4->Mtu : 0);
+
+        //Adding DNS
+        if (ipv4->DnsPrimary) {
+            d1 = strdup(ipv4Str(ipv4->DnsPrimary));
+            d2 = strdup(ipv4Str(ipv4->DnsSecondary ? ipv4->DnsSecondary : ipv4->DnsPrimary));
+            update_resolv_conf(4, ifname, profile->pdp, d1, d2);
+            free(d1); free(d2);
+        }
+    }
+
+    if (ipv6 && ipv6->Address[0] && ipv6->PrefixLengthIPAddr) {
+        dbg_time("ipv6 %s/%d via netlink", ipv6Str(ipv6->Address), ipv6->PrefixLengthIPAddr);
+        ql_netlink_set_ipv6(ifname, ipv6->Address, ipv6->PrefixLengthIPAddr, static_ip ? ipv6->Mtu : 0, static_ip);
+
+        //Adding DNS
+        if (ipv6->DnsPrimary[0]) {
+            d1 = strdup(ipv6Str(ipv6->DnsPrimary));
+            d2 = strdup(ipv6Str(ipv6->DnsSecondary[0] ? ipv6->DnsSecondary : ipv6->DnsPrimary));
+            update_resolv_conf(6, ifname, profile->pdp, d1, d2);
+            free(d1); free(d2);
+        }
+    }
+}
+
+static void ql_dhcp_event(struct dhcp_client *c, int event, const dhcp_info *info, void *arg) {
+    PROFILE_T *profile = (PROFILE_T *)arg;
+    const char *ifname = dhcp_client_ifname(c);
+    char d1[INET_ADDRSTRLEN], d2[INET_ADDRSTRLEN];
+
+    switch (event) {
+    case DHCP_EVENT_BOUND:
+        inet_ntop(AF_INET, &info->ipaddr, d1, sizeof(d1));
+        inet_ntop(AF_INET, &info->gateway, d2, sizeof(d2));
+        dbg_time("%s: dhcp lease %s/%u gw %s, %u seconds", ifname, d1, info->prefixLength, d2, info->lease);
+        ql_netlink_set_ipv4(ifname, info->ipaddr, info->gateway, info->prefixLength, 0);
+
+        //what udhcpc's default.script did
+        if (info->dns1) {
+            inet_ntop(AF_INET, &info->dns1, d1, sizeof(d1));
+            inet_ntop(AF_INET, info->dns2 ? &info->dns2 : &info->dns1, d2, sizeof(d2));
+            update_resolv_conf(4, ifname, profile->pdp, d1, d2);
+        }
+        ql_status_set_connected();
+    break;
+
+    case DHCP_EVENT_RENEWED:
+        dbg_time("%s: dhcp lease renewed, %u seconds", ifname, info->lease);
+    break;
+
+    case DHCP_EVENT_EXPIRED:
+        dbg_time("%s: dhcp lease lost", ifname);
+        if_flush_v4_addr(ifname);
+    break;
+
+    case DHCP_EVENT_FAILED:
+        if (profile->request_ops == &qmi_request_ops //only QMI modem support next fixup!
+            && ql_raw_ip_mode_check(ifname, profile->ipv4.Address)) {
+            dhcp_client_restart(c);
+            break;
+        }
+        //no dhcp server answered, directly set ip and dns
+        update_ip_address_by_qmi(profile, ifname, &profile->ipv4, NULL);
+    break;
+    }
+}
+
+static void ql_dhcp_fd_handler(int fd, void *arg) {
+    dhcp_client_handle((struct dhcp_client *)arg, fd);
+}
+
+static void ql_dhcp_stop(PROFILE_T *profile) {
+    if (!profile->dhcpc)
+        return;
+
+    main_unwatch_fd(dhcp_client_sock(profile->dhcpc));
+    main_unwatch_fd(dhcp_client_timerfd(profile->dhcpc));
+    dhcp_client_stop(profile->dhcpc);
+    profile->dhcpc = NULL;
+}
+
+/* -S: read the address back from the kernel, nothing is sent on the wire (no ARP probe, no DAD) */
+static int ql_static_ip_check(const char *ifname, int proto, const void *ip, unsigned long start) {
+    addr_t addr;
+
+    memset(&addr, 0, sizeof(addr));
+    memcpy(&addr, ip, proto == AF_INET ? 4 : 16);
+    if (!if_has_addr(ifname, proto, &addr)) {
+        dbg_time("%s: static ipv%d address not installed", ifname, proto == AF_INET ? 4 : 6);
+        return -1;
+    }
+
+    dbg_time("%s: static ipv%d ready in %lu ms", ifname, proto == AF_INET ? 4 : 6, clock_msec() - start);
+    return 0;
+}
+
+/* DHCP runs from the main loop, udhcpc_start() returns once DISCOVER is sent */
+static int ql_dhcp_start(PROFILE_T *profile, const char *ifname) {
+    struct dhcp_client *c;
+
+    ql_dhcp_stop(profile);
+
+    c = dhcp_client_start(ifname, ql_dhcp_event, profile);
+    if (!c)
+        return -1;
+
+    if (main_watch_fd(dhcp_client_sock(c), ql_dhcp_fd_handler, c)
+        || main_watch_fd(dhcp_client_timerfd(c), ql_dhcp_fd_handler, c)) {
+        main_unwatch_fd(dhcp_client_sock(c));
+        dhcp_client_stop(c);
+        return -1;
+    }
+
+    profile->dhcpc = c;
+    return 0;
+}
+
+//#define QL_OPENWER_NETWORK_SETUP
+#ifdef QL_OPENWER_NETWORK_SETUP
+static const char *openwrt_lan = "br-lan";
+static const char *openwrt_wan = "wwan0";
+
+static int ql_openwrt_system(const char *cmd) {
+    int i;
+    int ret = 1;
+    char shell_cmd[128];
+
+    snprintf(shell_cmd, sizeof(shell_cmd), "%s > /dev/null 2>&1", cmd);
+
+    for (i = 0; i < 15; i++) {
+        ret = ql_system(shell_cmd);
+        if (!ret)
+            break;
+        sleep(1);
+    }
+
+    return ret;
+}
+
+static int ql_openwrt_is_wan(const char *ifname) {
+    if (openwrt_lan == NULL) {
+        ql_system("uci show network.wan.ifname");
+    }
+
+    if (strcmp(ifname, openwrt_wan))
+        return 0;
+
+    return 1;
+}
+
+static void ql_openwrt_setup_wan(const char *ifname, const IPV4_T *ipv4) {
+    FILE *fp = NULL;
+    char config[64];
+
+    snprintf(config, sizeof(config), "/tmp/rmnet_%s_ipv4config", ifname);
+
+    if (ipv4 == NULL) {
+        if (ql_openwrt_is_wan(ifname))
+            ql_openwrt_system("ifdown wan");
+        return;
+    }
+
+    fp = fopen(config, "w");
+    if (fp == NULL)
+        return;
+
+    fprintf(fp, "IFNAME=\"%s\"\n", ifname);
+    fprintf(fp, "PUBLIC_IP=\"%s\"\n", ipv4Str(ipv4->Address));
+    fprintf(fp, "NETMASK=\"%s\"\n", ipv4Str(ipv4->SubnetMask));
+    fprintf(fp, "GATEWAY=\"%s\"\n", ipv4Str(ipv4->Gateway));
+    fprintf(fp, "DNSSERVERS=\"%s", ipv4Str(ipv4->DnsPrimary));
+    if (ipv4->DnsSecondary != 0)
+        fprintf(fp, " %s", ipv4Str(ipv4->DnsSecondary));
+    fprintf(fp, "\"\n");
+
+    fclose(fp);
+
+    if (!ql_openwrt_is_wan(ifname))
+        return;
+
+    ql_openwrt_system("ifup wan");
+}
+
+static void ql_openwrt_setup_wan6(const char *ifname, const IPV6_T *ipv6) {
+    FILE *fp = NULL;
+    char config[64];
+    int first_ifup;
+
+    snprintf(config, sizeof(config), "/tmp/rmnet_%s_ipv6config", ifname);
+
+    if (ipv6 == NULL) {
+        if (ql_openwrt_is_wan(ifname))
+            ql_openwrt_system("ifdown wan6");
+        return;
+    }
+
+    first_ifup = (access(config, F_OK) != 0);
+
+    fp = fopen(config, "w");
+    if (fp == NULL)
+        return;
+
+    fprintf(fp, "IFNAME=\"%s\"\n", ifname);
+    fprintf(fp, "PUBLIC_IP=\"%s\"\n", ipv6Str(ipv6->Address));
+    fprintf(fp, "NETMASK=\"%s\"\n", ipv6Str(ipv6->SubnetMask));
+    fprintf(fp, "GATEWAY=\"%s\"\n", ipv6Str(ipv6->Gateway));
+    fprintf(fp, "PrefixLength=\"%d\"\n", ipv6->PrefixLengthIPAddr);
+    fprintf(fp, "DNSSERVERS=\"%s", ipv6Str(ipv6->DnsPrimary));
+    if (ipv6->DnsSecondary[0])
+        fprintf(fp, " %s", ipv6Str(ipv6->DnsSecondary));
+    fprintf(fp, "\"\n");
+
+    fclose(fp);
+
+    if (!ql_openwrt_is_wan(ifname))
+        return;
+
+    if (first_ifup)
+        ql_openwrt_system("ifup wan6");
+    else
+        ql_openwrt_system("/etc/init.d/network restart"); //make PC to release old IPV6 address, and RS new IPV6 address
+
+#if 1 //TODO? why need this?
+    if (openwrt_lan) {
+        int i;
+        addr_t prefix;
+
+        ql_openwrt_system(("ifstatus lan"));
+
+        memset(&prefix, 0, sizeof(prefix));
+        for (i = 0; i < (ipv6->PrefixLengthIPAddr/8); i++)
+            prefix.ip6.s6_addr[i] = ipv6->Address[i];
+
+        //move the on-link prefix route from the wan to the lan bridge
+        dbg_time("route %s/%u %s -> %s", ipv6Str(prefix.ip6.s6_addr), ipv6->PrefixLengthIPAddr, ifname, openwrt_lan);
+        if_act_on_route(0, AF_INET6, ifname, &prefix, ipv6->PrefixLengthIPAddr, NULL);
+        if_act_on_route(1, AF_INET6, openwrt_lan, &prefix, ipv6->PrefixLengthIPAddr, NULL);
+    }
+#endif
+}
+#endif
+
+void udhcpc_start(PROFILE_T *profile) {
     char *ifname = profile->usbnet_adapter;
+    struct if_batch b;
+    unsigned long start = clock_msec();
 
     ql_set_driver_link_state(profile, 1);
-    ql_raw_ip_mode_check(ifname);
 
-    if (profile->qmapnet_adapter)
-    {
+    if (profile->qmapnet_adapter[0]) {
         ifname = profile->qmapnet_adapter;
     }
-    if (profile->rawIP && profile->ipv4.Address && profile->ipv4.Mtu)
-    {
-        if_set_mtu(ifname, (profile->ipv4.Mtu));
-    }
 
-    if (strcmp(ifname, profile->usbnet_adapter))
-    {
+    if (strcmp(ifname, profile->usbnet_adapter)) {
         if_link_up(profile->usbnet_adapter);
     }
 
-    if_link_up(ifname);
+    if (!if_batch_init(&b, ifname)) {
+        if (profile->rawIP && profile->ipv4.Address && profile->ipv4.Mtu) {
+            if_batch_mtu(&b, profile->ipv4.Mtu);
+        }
+        //bounce the qmimux netcard, same as udhcpc.c
+        if (strcmp(ifname, profile->usbnet_adapter))
+            if_batch_link(&b, 0);
+        if_batch_link(&b, 1);
+        if_batch_commit(&b);
+    }
+
+    if (profile->ipv4.Address) {
+        if (profile->PCSCFIpv4Addr1)
+            dbg_time("pcscf1: %s", ipv4Str(profile->PCSCFIpv4Addr1));
+        if (profile->PCSCFIpv4Addr2)
+            dbg_time("pcscf2: %s", ipv4Str(profile->PCSCFIpv4Addr2));
+    }
+
+    if (profile->ipv6.Address[0] && profile->ipv6.PrefixLengthIPAddr) {
+        if (profile->PCSCFIpv6Addr1[0])
+            dbg_time("pcscf1: %s", ipv6Str(profile->PCSCFIpv6Addr1));
+        if (profile->PCSCFIpv6Addr2[0])
+            dbg_time("pcscf2: %s", ipv6Str(profile->PCSCFIpv6Addr2));
+    }
 
 #if 1 //for bridge mode, only one public IP, so do udhcpc manually
-    if (ql_bridge_mode_detect(profile))
-    {
+    if (ql_bridge_mode_detect(profile)) {
         return;
     }
 #endif
-    // if use DHCP(should make with ${DHCP} src files)
-    // do_dhcp(ifname);
-    // return 0;
-    /* IPv4 Addr Info */
-    if (profile->ipv4.Address)
-    {
-        dbg_time("IPv4 MTU: %d", profile->ipv4.Mtu);
-        dbg_time("IPv4 Address: %s", ipaddr_to_string_v4(ntohl(profile->ipv4.Address)));
-        dbg_time("IPv4 Netmask: %d", mask_to_prefix_v4(ntohl(profile->ipv4.SubnetMask)));
-        dbg_time("IPv4 Gateway: %s", ipaddr_to_string_v4(ntohl(profile->ipv4.Gateway)));
-        dbg_time("IPv4 DNS1: %s", ipaddr_to_string_v4(ntohl(profile->ipv4.DnsPrimary)));
-        dbg_time("IPv4 DNS2: %s", ipaddr_to_string_v4(ntohl(profile->ipv4.DnsSecondary)));
-        if_set_network_v4(ifname, ntohl(profile->ipv4.Address),
-                       mask_to_prefix_v4(profile->ipv4.SubnetMask),
-                       ntohl(profile->ipv4.Gateway),
-                       ntohl(profile->ipv4.DnsPrimary),
-                       ntohl(profile->ipv4.DnsSecondary));
-    }
-
-    if (profile->ipv6.Address[0] && profile->ipv6.PrefixLengthIPAddr)
+
+    if (profile->ipv4.Address == 0)
+        goto set_ipv6;
+
+    if (profile->static_ip) {
+        in_addr_t ip = qmi2addr(profile->ipv4.Address);
+
+        update_ip_address_by_qmi(profile, ifname, &profile->ipv4, NULL);
+        if (ql_static_ip_check(ifname, AF_INET, &ip, start) && ql_dhcp_start(profile, ifname))
+            dbg_time("%s: cannot start dhcp either", ifname);
+    }
+    else if (profile->request_ops == &mbim_request_ops) { //lots of mbim modem do not support DHCP
+        update_ip_address_by_qmi(profile, ifname, &profile->ipv4, NULL);
+    }
+    else
+/* Do DHCP in process, see libmnl/dhcp/dhcpclient.c */
     {
+#if 1 //for OpenWrt
+        if (!access("/lib/netifd/dhcp.script", X_OK) && !access("/sbin/ifup", X_OK) && !access("/sbin/ifstatus", X_OK)) {
+            dbg_time("you are use OpenWrt?");
+            dbg_time("should not calling udhcpc manually?");
+            dbg_time("should modify /etc/config/network as below?");
+            dbg_time("config interface wan");
+            dbg_time("\toption ifname	%s", ifname);
+            dbg_time("\toption proto	dhcp");
+            dbg_time("should use \"/sbin/ifstaus wan\" to check %s 's status?", ifname);
+        }
+#endif
+
+        if (ql_dhcp_start(profile, ifname)) {
+            dbg_time("%s: cannot start dhcp, use the QMI settings", ifname);
+            update_ip_address_by_qmi(profile, ifname, &profile->ipv4, NULL);
+        }
+    }
+
+#ifdef QL_OPENWER_NETWORK_SETUP
+    ql_openwrt_setup_wan(ifname, &profile->ipv4);
+#endif
+
+set_ipv6:
+    if (profile->ipv6.Address[0] && profile->ipv6.PrefixLengthIPAddr) {
         //module do not support DHCPv6, only support 'Router Solicit'
         //and it seem if enable /proc/sys/net/ipv6/conf/all/forwarding, Kernel do not send RS
-        const char *forward_file = "/proc/sys/net/ipv6/conf/all/forwarding";
-        int forward_fd = open(forward_file, O_RDONLY);
-        if (forward_fd > 0)
-        {
-            char forward_state[2];
-            read(forward_fd, forward_state, 2);
-            if (forward_state[0] == '1')
-            {
-                dbg_time("%s enabled, kernel maybe donot send 'Router Solicit'", forward_file);
-            }
-            close(forward_fd);
-        }
+        update_ip_address_by_qmi(profile, ifname, NULL, &profile->ipv6);
+        if (profile->static_ip)
+            ql_static_ip_check(ifname, AF_INET6, profile->ipv6.Address, start);
 
-        dbg_time("IPv6 MTU: %d", profile->ipv6.Mtu);
-        dbg_time("IPv6 Address: %s", ipaddr_to_string_v6(profile->ipv6.Address));
-        dbg_time("IPv6 Netmask: %d", profile->ipv6.PrefixLengthIPAddr);
-        dbg_time("IPv6 Gateway: %s", ipaddr_to_string_v6(profile->ipv6.Gateway));
-        dbg_time("IPv6 DNS1: %s", ipaddr_to_string_v6(profile->ipv6.DnsPrimary));
-        dbg_time("IPv6 DNS2: %s", ipaddr_to_string_v6(profile->ipv6.DnsSecondary));
-        if_set_network_v6(ifname, profile->ipv6.Address, profile->ipv6.PrefixLengthIPAddr,
-                       profile->ipv6.Gateway, profile->ipv6.DnsPrimary, profile->ipv6.DnsSecondary);
+#ifdef QL_OPENWER_NETWORK_SETUP
+        ql_openwrt_setup_wan6(ifname, &profile->ipv6);
+#endif
     }
 }
 
-void udhcpc_stop(PROFILE_T *profile)
-{
+void udhcpc_stop(PROFILE_T *profile) {
     char *ifname = profile->usbnet_adapter;
+    struct if_batch b;
 
     ql_set_driver_link_state(profile, 0);
+    ql_dhcp_stop(profile);
 
-    if (profile->qmapnet_adapter)
-    {
+    if (profile->qmapnet_adapter[0]) {
         ifname = profile->qmapnet_adapter;
     }
 
-    if_link_down(ifname);
-    if_flush_v4_addr(ifname);
-    if_flush_v6_addr(ifname);
+//it seems when call netif_carrier_on(), and netcard 's IP is "0.0.0.0", will cause netif_queue_stopped()
+    if (!if_batch_init(&b, ifname)) {
+        if_batch_flush_addr(&b, AF_INET);
+        if_batch_flush_addr(&b, AF_INET6);
+        if_batch_link(&b, 0);
+        if_batch_commit(&b);
+    }
+
+#ifdef QL_OPENWER_NETWORK_SETUP
+    ql_openwrt_setup_wan(ifname, NULL);
+    ql_openwrt_setup_wan6(ifname, NULL);
+#endif
 }
@@ -15,7 +15,11 @@
 ******************************************************************************/
 
 #include <sys/time.h>
+#include <sys/wait.h>
 #include <net/if.h>
+#include <spawn.h>
+#include <sys/file.h>
+#include <limits.h>
 typedef unsigned short sa_family_t;
 #include <linux/un.h>
 
@@ -168,6 +172,180 @@ unsigned long clock_msec(void)
 	return (unsigned long)(tm.tv_sec*1000 + (tm.tv_nsec/1000000));
 }
 
+void list_init(struct listnode *node)
+{
+    node->next = node;
+    node->prev = node;
+}
+
+void list_add_tail(struct listnode *head, struct listnode *item)
+{
+    item->next = head;
+    item->prev = head->prev;
+    head->prev->next = item;
+    head->prev = item;
+}
+
+void list_add_head(struct listnode *head, struct listnode *item)
+{
+    item->next = head->next;
+    item->prev = head;
+    head->next->prev = item;
+    head->next = item;
+}
+
+void list_remove(struct listnode *item)
+{
+    item->next->prev = item->prev;
+    item->prev->next = item->next;
+    item->next = item->prev = item;
+}
+
+int epoll_register(int epoll_fd, int fd, unsigned int events)
+{
+    struct epoll_event ev;
+    int ret;
+
+    ev.events = events;
+    ev.data.fd = fd;
+    do {
+        ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret;
+}
+
+int epoll_modify(int epoll_fd, int fd, unsigned int events)
+{
+    struct epoll_event ev;
+    int ret;
+
+    ev.events = events;
+    ev.data.fd = fd;
+    do {
+        ret = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret;
+}
+
+int epoll_deregister(int epoll_fd, int fd)
+{
+    int ret;
+
+    do {
+        ret = epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret;
+}
+
+/* qmi_main() keeps SIGINT/SIGTERM blocked for its signalfd, and a blocked mask
+ * survives exec(). Children are started with an empty mask so that daemons
+ * like dibbler-client can still be stopped by killall. */
+extern char **environ;
+
+/* every external program goes through here, so the status page can count them */
+static pid_t ql_spawn(char *const argv[], int stdout_fd) {
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+    sigset_t empty_mask;
+    pid_t pid;
+    int err;
+
+    sigemptyset(&empty_mask);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &empty_mask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+    posix_spawn_file_actions_init(&actions);
+    if (stdout_fd >= 0)
+        posix_spawn_file_actions_adddup2(&actions, stdout_fd, STDOUT_FILENO);
+
+    err = posix_spawnp(&pid, argv[0], &actions, &attr, argv, environ);
+    if (err) {
+        dbg_time("%s '%s' errno: %d (%s)", __func__, argv[0], err, strerror(err));
+        pid = -1;
+    }
+    else {
+        ql_status_count_spawn();
+    }
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    return pid;
+}
+
+static pid_t ql_spawn_shell(const char *shell_cmd, int stdout_fd) {
+    char *argv[] = {"/bin/sh", "-c", (char *)shell_cmd, NULL};
+
+    return ql_spawn(argv, stdout_fd);
+}
+
+static int ql_spawn_wait(pid_t pid) {
+    int status;
+
+    if (pid < 0)
+        return -1;
+
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR)
+            return -1;
+    }
+
+    return status;
+}
+
+int ql_system(const char *shell_cmd) {
+    dbg_time("%s", shell_cmd);
+    return ql_spawn_wait(ql_spawn_shell(shell_cmd, -1));
+}
+
+/* like ql_system(), but argv[0] is run directly (searched in PATH), no shell in between */
+int ql_exec(char *const argv[]) {
+    char cmd[128];
+    size_t len = 0;
+    int i;
+
+    cmd[0] = '\0';
+    for (i = 0; argv[i] && len < sizeof(cmd); i++)
+        len += snprintf(cmd + len, sizeof(cmd) - len, i ? " %s" : "%s", argv[i]);
+    dbg_time("%s", cmd);
+
+    return ql_spawn_wait(ql_spawn(argv, -1));
+}
+
+FILE *ql_popen(const char *shell_cmd, pid_t *ppid) {
+    int fds[2];
+    FILE *fp;
+
+    if (pipe(fds) < 0)
+        return NULL;
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+    *ppid = ql_spawn_shell(shell_cmd, fds[1]);
+    close(fds[1]);
+    if (*ppid < 0 || (fp = fdopen(fds[0], "r")) == NULL) {
+        close(fds[0]);
+        return NULL;
+    }
+
+    return fp;
+}
+
+int ql_pclose(FILE *fp, pid_t pid) {
+    int status;
+
+    fclose(fp);
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR)
+            return -1;
+    }
+
+    return status;
+}
+
 FILE *logfilefp = NULL;
 
 const int i = 1;
@@ -234,66 +412,207 @@ UINT cpu_to_le32 (UINT v32) {
     return tmp;
 }
 
-void update_resolv_conf(int iptype, const char *ifname, const char *dns1, const char *dns2) {
-    const char *dns_file = "/etc/resolv.conf";
-    FILE *dns_fp;
-    char dns_line[256];
+/*
+ * Every quectel-CM instance (one per PDN, or one serving several PDNs) keeps its
+ * nameservers in one shared file, each line tagged "# IPV<type> <ifname> <prio>".
+ * Writers are serialized with flock(), lines are merged in priority order (lower
+ * first, so the first PDN's servers are the ones the resolver tries), and the file
+ * is replaced by rename() only when its content really changes.
+ * Build with -DQL_RESOLV_CONF=\"/tmp/resolv.conf.d/resolv.conf.auto\" to feed dnsmasq
+ * (it watches its resolv-file) instead of /etc/resolv.conf.
+ */
+#ifndef QL_RESOLV_CONF
+#define QL_RESOLV_CONF "/etc/resolv.conf"
+#endif
+#define QL_RESOLV_LOCK "/tmp/quectel-CM.resolv.lock"
+
+struct resolv_ns {
+    int prio;
+    int iptype;
+    int seq;
+    char ifname[32];
+    char addr[64];
+};
+
+static int resolv_ns_parse(const char *line, struct resolv_ns *ns) {
+    ns->prio = 0;
+    return sscanf(line, "nameserver %63s # IPV%d %31s %d", ns->addr, &ns->iptype, ns->ifname, &ns->prio) >= 3;
+}
+
+static int resolv_ns_cmp(const void *a, const void *b) {
+    const struct resolv_ns *x = (const struct resolv_ns *)a;
+    const struct resolv_ns *y = (const struct resolv_ns *)b;
+
+    if (x->prio != y->prio)
+        return x->prio - y->prio;
+    if (x->iptype != y->iptype)
+        return x->iptype - y->iptype;
+    if (strcmp(x->ifname, y->ifname))
+        return strcmp(x->ifname, y->ifname);
+    return x->seq - y->seq;
+}
+
+static int resolv_conf_replace(const char *dns_file, const char *buf, size_t len) {
+    char tmp_file[PATH_MAX + 8];
+    int fd;
+
+    snprintf(tmp_file, sizeof(tmp_file), "%s.XXXXXX", dns_file);
+    fd = mkstemp(tmp_file);
+    if (fd < 0) {
+        dbg_time("mkstemp %s fail, errno:%d (%s)", tmp_file, errno, strerror(errno));
+        return -errno;
+    }
+
+    if (fchmod(fd, 0644) || write(fd, buf, len) != (ssize_t)len || fsync(fd)) {
+        dbg_time("write %s fail, errno:%d (%s)", tmp_file, errno, strerror(errno));
+        close(fd);
+        unlink(tmp_file);
+        return -EIO;
+    }
+    close(fd);
+
+    if (rename(tmp_file, dns_file)) {
+        dbg_time("rename %s fail, errno:%d (%s)", dns_file, errno, strerror(errno));
+        unlink(tmp_file);
+        return -errno;
+    }
+
+    return 0;
+}
+
+/* the file to read and replace: QL_RESOLV_CONF, or what its symlink chain ends in,
+ * so the symlink itself is never replaced by rename(), even when dangling */
+static int resolv_conf_path(char *dns_file, size_t size) {
+    char target[PATH_MAX];
+    struct stat st;
+    int depth;
+
+    snprintf(dns_file, size, "%s", QL_RESOLV_CONF);
+    for (depth = 0; !lstat(dns_file, &st) && S_ISLNK(st.st_mode); depth++) {
+        ssize_t n;
+        char *slash;
+
+        if (depth == 8)
+            return -ELOOP;
+        n = readlink(dns_file, target, sizeof(target) - 1);
+        if (n < 0)
+            return -errno;
+        target[n] = '\0';
+
+        slash = strrchr(dns_file, '/');
+        if (target[0] != '/' && slash) {
+            slash[1] = '\0';
+            if (strlen(dns_file) + n >= size)
+                return -ENAMETOOLONG;
+            strcat(dns_file, target);
+        }
+        else if (snprintf(dns_file, size, "%s", target) >= (int)size) {
+            return -ENAMETOOLONG;
+        }
+    }
+
+    return 0;
+}
+
+void update_resolv_conf(int iptype, const char *ifname, int prio, const char *dns1, const char *dns2) {
+    char dns_file[PATH_MAX];
     #define MAX_DNS 16
-    char *dns_info[MAX_DNS];
-    char dns_tag[64];
-    int dns_match = 0;
+    struct resolv_ns dns_info[MAX_DNS + 1]; //last one is scratch for parsing
+    int num = 0;
+    FILE *dns_fp, *old_fp, *others_fp, *new_fp;
+    char *old = NULL, *others = NULL, *new = NULL;
+    size_t old_len = 0, others_len = 0, new_len = 0;
+    char *dns_line = NULL;
+    size_t dns_line_size = 0;
+    int lock_fd;
     int i;
 
-    snprintf(dns_tag, sizeof(dns_tag), "# IPV%d %s", iptype, ifname);
+    //keep a symlinked resolv.conf (e.g. -> /tmp/resolv.conf) a symlink
+    i = resolv_conf_path(dns_file, sizeof(dns_file));
+    if (i < 0) {
+        dbg_time("%s %s not updated, errno:%d (%s)", __func__, QL_RESOLV_CONF, -i, strerror(-i));
+        return;
+    }
+
+    lock_fd = open(QL_RESOLV_LOCK, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lock_fd >= 0)
+        flock(lock_fd, LOCK_EX);
+
+    old_fp = open_memstream(&old, &old_len);
+    others_fp = open_memstream(&others, &others_len);
+    new_fp = open_memstream(&new, &new_len);
+    if (!old_fp || !others_fp || !new_fp)
+        goto out;
 
-    for (i = 0; i < MAX_DNS; i++)
-        dns_info[i] = NULL;
-    
     dns_fp = fopen(dns_file, "r");
     if (dns_fp) {
-        i = 0;    
-        dns_line[sizeof(dns_line)-1] = '\0';
-        
-        while((fgets(dns_line, sizeof(dns_line)-1, dns_fp)) != NULL) {
-            if ((strlen(dns_line) > 1) && (dns_line[strlen(dns_line) - 1] == '\n'))
-                dns_line[strlen(dns_line) - 1] = '\0';
-            //dbg_time("%s", dns_line);
-            if (strstr(dns_line, dns_tag)) {
-                dns_match++;
+        while (getline(&dns_line, &dns_line_size, dns_fp) > 0) {
+            struct resolv_ns *ns = &dns_info[num];
+
+            fputs(dns_line, old_fp);
+            if (!resolv_ns_parse(dns_line, ns)) {
+                fputs(dns_line, others_fp);
                 continue;
             }
-            dns_info[i++] = strdup(dns_line);
-            if (i == MAX_DNS)
-                break;
+            if (ns->iptype == iptype && !strcmp(ns->ifname, ifname))
+                continue;
+            if (num < MAX_DNS) {
+                ns->seq = num;
+                num++;
+            }
         }
-
+        free(dns_line);
         fclose(dns_fp);
     }
     else if (errno != ENOENT) {
         dbg_time("fopen %s fail, errno:%d (%s)", dns_file, errno, strerror(errno));
-        return;
+        goto out;
     }
-    
-    if (dns1 == NULL && dns_match == 0)
-        return;
 
-    dns_fp = fopen(dns_file, "w");
-    if (dns_fp) {
-        if (dns1)
-            fprintf(dns_fp, "nameserver %s %s\n", dns1, dns_tag);
-        if (dns2)
-            fprintf(dns_fp, "nameserver %s %s\n", dns2, dns_tag);
-        
-        for (i = 0; i < MAX_DNS && dns_info[i]; i++)
-            fprintf(dns_fp, "%s\n", dns_info[i]);
-        fclose(dns_fp);
-    }
-    else {
-        dbg_time("fopen %s fail, errno:%d (%s)", dns_file, errno, strerror(errno));
+    for (i = 0; i < 2 && num < MAX_DNS; i++) {
+        const char *dns = i ? dns2 : dns1;
+        struct resolv_ns *ns = &dns_info[num];
+
+        if (!dns || (i && dns1 && !strcmp(dns1, dns2)))
+            continue;
+        ns->prio = prio;
+        ns->iptype = iptype;
+        ns->seq = num;
+        snprintf(ns->ifname, sizeof(ns->ifname), "%s", ifname);
+        snprintf(ns->addr, sizeof(ns->addr), "%s", dns);
+        num++;
     }
 
-    for (i = 0; i < MAX_DNS && dns_info[i]; i++)
-        free(dns_info[i]);
+    qsort(dns_info, num, sizeof(dns_info[0]), resolv_ns_cmp);
+    for (i = 0; i < num; i++)
+        fprintf(new_fp, "nameserver %s # IPV%d %s %d\n", dns_info[i].addr, dns_info[i].iptype, dns_info[i].ifname, dns_info[i].prio);
+    fclose(others_fp);
+    others_fp = NULL;
+    if (others_len)
+        fwrite(others, 1, others_len, new_fp);
+
+    fclose(old_fp);
+    old_fp = NULL;
+    fclose(new_fp);
+    new_fp = NULL;
+
+    if (new_len == old_len && !memcmp(new, old, new_len))
+        goto out; //nothing changed, spare the flash
+
+    resolv_conf_replace(dns_file, new, new_len);
+
+out:
+    if (old_fp)
+        fclose(old_fp);
+    if (others_fp)
+        fclose(others_fp);
+    if (new_fp)
+        fclose(new_fp);
+    free(old);
+    free(others);
+    free(new);
+    if (lock_fd >= 0)
+        close(lock_fd);
 }
 
 pid_t getpid_by_pdp(int pdp, const char* program_name)
@@ -44,6 +44,7 @@ void list_remove(struct listnode *item);
 #define list_tail(list) ((list)->prev)
 
 int epoll_register(int  epoll_fd, int  fd, unsigned int events);
+int epoll_modify(int  epoll_fd, int  fd, unsigned int events);
 int epoll_deregister(int  epoll_fd, int  fd);
 const char * get_time(void);
 unsigned long clock_msec(void);